@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2026 by Farsight Security, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "fstrm-private.h"
+
+/* Size of the smallest size class. */
+#define FSTRM__BUFPOOL_MIN_CLASS_SIZE	64
+
+/* Size class index of buffers which are too large for any size class. */
+#define FSTRM__BUFPOOL_NO_CLASS		UINT32_MAX
+
+/*
+ * Every buffer is preceded by a header recording its size class. The header
+ * is padded to preserve the alignment guaranteed by malloc().
+ */
+struct fstrm__bufpool_hdr {
+	uint32_t	size_class;
+	uint8_t		pad[16 - sizeof(uint32_t)];
+};
+
+struct fstrm_bufpool_options {
+	size_t		max_buf_size;
+	unsigned	num_cached_bufs;
+};
+
+static const struct fstrm_bufpool_options default_fstrm_bufpool_options = {
+	.max_buf_size		= FSTRM_BUFPOOL_MAX_BUF_SIZE_DEFAULT,
+	.num_cached_bufs	= FSTRM_BUFPOOL_NUM_CACHED_BUFS_DEFAULT,
+};
+
+struct fstrm_bufpool {
+	/*
+	 * Free lists of buffer pointers, one per size class. Size class 'i'
+	 * holds buffers of FSTRM__BUFPOOL_MIN_CLASS_SIZE << i bytes.
+	 */
+	struct my_queue			**free_lists;
+	unsigned			num_classes;
+	const struct my_queue_ops	*queue_ops;
+};
+
+struct fstrm_bufpool_options *
+fstrm_bufpool_options_init(void)
+{
+	struct fstrm_bufpool_options *bpopt;
+	bpopt = my_malloc(sizeof(*bpopt));
+	memmove(bpopt, &default_fstrm_bufpool_options, sizeof(*bpopt));
+	return bpopt;
+}
+
+void
+fstrm_bufpool_options_destroy(struct fstrm_bufpool_options **bpopt)
+{
+	if (*bpopt != NULL)
+		my_free(*bpopt);
+}
+
+fstrm_res
+fstrm_bufpool_options_set_max_buf_size(struct fstrm_bufpool_options *bpopt,
+				       size_t max_buf_size)
+{
+	if (max_buf_size < FSTRM_BUFPOOL_MAX_BUF_SIZE_MIN ||
+	    max_buf_size > FSTRM_BUFPOOL_MAX_BUF_SIZE_MAX)
+	{
+		return fstrm_res_failure;
+	}
+	bpopt->max_buf_size = max_buf_size;
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm_bufpool_options_set_num_cached_bufs(struct fstrm_bufpool_options *bpopt,
+					  unsigned num_cached_bufs)
+{
+	if (num_cached_bufs < FSTRM_BUFPOOL_NUM_CACHED_BUFS_MIN ||
+	    num_cached_bufs > FSTRM_BUFPOOL_NUM_CACHED_BUFS_MAX ||
+	    (num_cached_bufs & (num_cached_bufs - 1)) != 0)
+	{
+		return fstrm_res_failure;
+	}
+	bpopt->num_cached_bufs = num_cached_bufs;
+	return fstrm_res_success;
+}
+
+struct fstrm_bufpool *
+fstrm_bufpool_init(const struct fstrm_bufpool_options *bpopt)
+{
+	struct fstrm_bufpool *bp;
+
+	if (bpopt == NULL)
+		bpopt = &default_fstrm_bufpool_options;
+
+	bp = my_calloc(1, sizeof(*bp));
+
+	/*
+	 * The free lists are filled by whichever thread disposes of a buffer,
+	 * usually the I/O thread, and drained by the thread allocating from
+	 * the pool, so they need to be safe for concurrent use from both ends.
+	 */
+	bp->queue_ops = &my_queue_mpmc_ops;
+
+	bp->num_classes = 1;
+	while (((size_t) FSTRM__BUFPOOL_MIN_CLASS_SIZE << (bp->num_classes - 1)) <
+	       bpopt->max_buf_size)
+	{
+		bp->num_classes++;
+	}
+
+	bp->free_lists = my_calloc(bp->num_classes, sizeof(struct my_queue *));
+	for (unsigned i = 0; i < bp->num_classes; i++) {
+		bp->free_lists[i] = bp->queue_ops->init(bpopt->num_cached_bufs,
+							sizeof(void *));
+		assert(bp->free_lists[i] != NULL);
+	}
+
+	return bp;
+}
+
+void
+fstrm_bufpool_destroy(struct fstrm_bufpool **bp)
+{
+	if (*bp != NULL) {
+		for (unsigned i = 0; i < (*bp)->num_classes; i++) {
+			void *buf;
+			while ((*bp)->queue_ops->remove((*bp)->free_lists[i], &buf, NULL))
+				free(buf);
+			(*bp)->queue_ops->destroy(&(*bp)->free_lists[i]);
+		}
+		my_free((*bp)->free_lists);
+		my_free(*bp);
+	}
+}
+
+void *
+fstrm_bufpool_alloc(struct fstrm_bufpool *bp, size_t len)
+{
+	struct fstrm__bufpool_hdr *hdr;
+	uint32_t size_class = 0;
+
+	while (size_class < bp->num_classes &&
+	       ((size_t) FSTRM__BUFPOOL_MIN_CLASS_SIZE << size_class) < len)
+	{
+		size_class++;
+	}
+
+	if (unlikely(size_class == bp->num_classes)) {
+		/* Too large for the pool. */
+		hdr = my_malloc(sizeof(*hdr) + len);
+		hdr->size_class = FSTRM__BUFPOOL_NO_CLASS;
+		return hdr + 1;
+	}
+
+	if (!bp->queue_ops->remove(bp->free_lists[size_class], &hdr, NULL)) {
+		hdr = my_malloc(sizeof(*hdr) +
+			((size_t) FSTRM__BUFPOOL_MIN_CLASS_SIZE << size_class));
+		hdr->size_class = size_class;
+	}
+	return hdr + 1;
+}
+
+void
+fstrm_bufpool_free_wrapper(void *buf, void *bp_)
+{
+	struct fstrm_bufpool *bp = bp_;
+	struct fstrm__bufpool_hdr *hdr;
+
+	if (buf == NULL)
+		return;
+
+	hdr = (struct fstrm__bufpool_hdr *) buf - 1;
+	if (hdr->size_class == FSTRM__BUFPOOL_NO_CLASS ||
+	    !bp->queue_ops->insert(bp->free_lists[hdr->size_class], &hdr, NULL))
+	{
+		free(hdr);
+	}
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2026 by Farsight Security, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef FSTRM_BUFPOOL_H
+#define FSTRM_BUFPOOL_H
+
+/**
+ * \defgroup fstrm_bufpool fstrm_bufpool
+ *
+ * The `fstrm_bufpool` interface provides data frame buffers that are recycled
+ * rather than returned to the system allocator when the \ref fstrm_iothr I/O
+ * thread disposes of them.
+ *
+ * Data frames submitted with fstrm_iothr_submit() are usually allocated by a
+ * worker thread and deallocated by the I/O thread, which exercises the
+ * allocator's slow cross-thread paths. An `fstrm_bufpool` instead keeps a
+ * bounded free list of buffers for each of a range of power-of-2 size classes.
+ * fstrm_bufpool_alloc() takes a buffer from the free list for the requested
+ * size, and fstrm_bufpool_free_wrapper(), passed as the `free_func` callback
+ * to fstrm_iothr_submit(), puts it back. The free lists are lock-free, so in
+ * the steady state neither the worker thread nor the I/O thread calls into the
+ * system allocator.
+ *
+ * For best results, dedicate an `fstrm_bufpool` to each input queue, that is,
+ * to each worker thread. A pool may nevertheless be shared by any number of
+ * threads.
+ *
+ * @{
+ */
+
+/**
+ * Initialize an `fstrm_bufpool_options` object, which is needed to configure
+ * an `fstrm_bufpool` object.
+ *
+ * \return
+ *	`fstrm_bufpool_options` object.
+ */
+struct fstrm_bufpool_options *
+fstrm_bufpool_options_init(void);
+
+/**
+ * Destroy an `fstrm_bufpool_options` object.
+ *
+ * \param bpopt
+ *	Pointer to `fstrm_bufpool_options` object.
+ */
+void
+fstrm_bufpool_options_destroy(struct fstrm_bufpool_options **bpopt);
+
+/**
+ * Set the `max_buf_size` parameter. This is the size of the largest size class
+ * of buffers kept by the pool, and is rounded up to a power of 2. Larger
+ * buffers may still be obtained from fstrm_bufpool_alloc(), but they are
+ * allocated from and returned to the system allocator.
+ *
+ * \param bpopt
+ *	`fstrm_bufpool_options` object.
+ * \param max_buf_size
+ *	New `max_buf_size` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_bufpool_options_set_max_buf_size(
+	struct fstrm_bufpool_options *bpopt,
+	size_t max_buf_size);
+
+/** Minimum `max_buf_size` value. */
+#define FSTRM_BUFPOOL_MAX_BUF_SIZE_MIN			64
+
+/** Default `max_buf_size` value. */
+#define FSTRM_BUFPOOL_MAX_BUF_SIZE_DEFAULT		65536
+
+/** Maximum `max_buf_size` value. */
+#define FSTRM_BUFPOOL_MAX_BUF_SIZE_MAX			16777216
+
+/**
+ * Set the `num_cached_bufs` parameter. This is the maximum number of free
+ * buffers kept for each size class, and must be a power of 2. Buffers returned
+ * to a full free list are deallocated.
+ *
+ * \param bpopt
+ *	`fstrm_bufpool_options` object.
+ * \param num_cached_bufs
+ *	New `num_cached_bufs` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_bufpool_options_set_num_cached_bufs(
+	struct fstrm_bufpool_options *bpopt,
+	unsigned num_cached_bufs);
+
+/** Minimum `num_cached_bufs` value. */
+#define FSTRM_BUFPOOL_NUM_CACHED_BUFS_MIN		2
+
+/** Default `num_cached_bufs` value. */
+#define FSTRM_BUFPOOL_NUM_CACHED_BUFS_DEFAULT		512
+
+/** Maximum `num_cached_bufs` value. */
+#define FSTRM_BUFPOOL_NUM_CACHED_BUFS_MAX		65536
+
+/**
+ * Initialize an `fstrm_bufpool` object.
+ *
+ * \param bpopt
+ *	`fstrm_bufpool_options` object. May be NULL, in which case default
+ *	values will be used.
+ *
+ * \return
+ *	`fstrm_bufpool` object.
+ */
+struct fstrm_bufpool *
+fstrm_bufpool_init(const struct fstrm_bufpool_options *bpopt);
+
+/**
+ * Destroy an `fstrm_bufpool` object and deallocate its free buffers.
+ *
+ * All buffers obtained from the pool must have been returned to it before it
+ * is destroyed. In particular, an `fstrm_bufpool` used for data frames
+ * submitted to an `fstrm_iothr` must be destroyed after the `fstrm_iothr`.
+ *
+ * \param bp
+ *	Pointer to `fstrm_bufpool` object.
+ */
+void
+fstrm_bufpool_destroy(struct fstrm_bufpool **bp);
+
+/**
+ * Obtain a buffer of at least `len` bytes from the pool.
+ *
+ * \param bp
+ *	`fstrm_bufpool` object.
+ * \param len
+ *	Number of bytes needed.
+ *
+ * \return
+ *	Buffer of at least `len` bytes.
+ */
+void *
+fstrm_bufpool_alloc(struct fstrm_bufpool *bp, size_t len);
+
+/**
+ * Return a buffer obtained from fstrm_bufpool_alloc() to its pool. This is
+ * suitable for use as the `free_func` callback for fstrm_iothr_submit(), with
+ * the `free_data` parameter set to the `fstrm_bufpool` object.
+ *
+ * \param buf
+ *	Buffer obtained from fstrm_bufpool_alloc().
+ * \param bp
+ *	The `fstrm_bufpool` object `buf` was obtained from.
+ */
+void
+fstrm_bufpool_free_wrapper(void *buf, void *bp);
+
+/**@}*/
+
+#endif /* FSTRM_BUFPOOL_H */
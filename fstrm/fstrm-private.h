@@ -26,12 +26,14 @@
 #define FSTRM_PRIVATE_H
 
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
 #include <limits.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -52,10 +54,20 @@
 # define likely(x)		__builtin_expect(!!(x), 1)
 # define unlikely(x)		__builtin_expect(!!(x), 0)
 # define warn_unused_result	__attribute__ ((warn_unused_result))
+# define cacheline_aligned	__attribute__ ((aligned(64)))
 #else
 # define likely(x)
 # define unlikely(x)
 # define warn_unused_result
+# define cacheline_aligned
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define cpu_relax()		__builtin_ia32_pause()
+#elif defined(__GNUC__) && defined(__aarch64__)
+# define cpu_relax()		__asm__ __volatile__("yield" ::: "memory")
+#else
+# define cpu_relax()		do { } while (0)
 #endif
 
 #ifndef MSG_NOSIGNAL
@@ -133,14 +145,33 @@ fs_store_bytes(uint8_t **buf, size_t *len,
 	return true;
 }
 
+/* iothr */
+
+/*
+ * Like fstrm_iothr_init(), but with 'spool_suffix' appended to the options'
+ * spool_path, if any. Used by fstrm_iothr_pool_init() to give each shard its
+ * own spool file.
+ */
+struct fstrm_iothr *
+fstrm__iothr_init(const struct fstrm_iothr_options *,
+		  struct fstrm_writer **, const char *spool_suffix);
+
 /* rdwr */
 
+/*
+ * Cap the connect and handshake timeouts of a socket-based rdwr at
+ * 'timeout_max' milliseconds. Other rdwr implementations don't have one.
+ */
+typedef void (*fstrm__rdwr_limit_timeouts_func)(void *obj,
+						unsigned timeout_max);
+
 struct fstrm_rdwr_ops {
 	fstrm_rdwr_destroy_func		destroy;
 	fstrm_rdwr_open_func		open;
 	fstrm_rdwr_close_func		close;
 	fstrm_rdwr_read_func		read;
 	fstrm_rdwr_write_func		write;
+	fstrm__rdwr_limit_timeouts_func	limit_timeouts;
 };
 
 struct fstrm_rdwr {
@@ -169,6 +200,70 @@ fstrm__rdwr_write_control(struct fstrm_rdwr *,
 			  fstrm_control_type type,
 			  const fs_buf *content_type);
 
+void
+fstrm__rdwr_set_limit_timeouts(struct fstrm_rdwr *,
+			       fstrm__rdwr_limit_timeouts_func);
+
+/* socket */
+
+/*
+ * Connect a socket-based writer's socket. A non-zero 'connect_timeout' bounds
+ * the connect() call, and a non-zero 'handshake_timeout' bounds each read from
+ * the connected socket, in milliseconds.
+ */
+fstrm_res
+fstrm__socket_connect(int fd, const struct sockaddr *sa, socklen_t sa_len,
+		      unsigned connect_timeout, unsigned handshake_timeout);
+
+/* Cap a socket-based writer's timeout, where 0 means none, at 'timeout_max'. */
+static inline void
+fstrm__socket_limit_timeout(unsigned *timeout, unsigned timeout_max)
+{
+	if (*timeout == 0 || *timeout > timeout_max)
+		*timeout = timeout_max;
+}
+
+/* spool */
+
+/*
+ * Bounded on-disk spool of data frames, see spool.c. The spool file is
+ * created by fstrm__spool_init(), which keeps the data frames left in it by a
+ * previous spool, and at most 'max_size' bytes of data frames are held in it
+ * at a time.
+ */
+struct fstrm__spool;
+
+struct fstrm__spool *
+fstrm__spool_init(const char *path, size_t max_size);
+
+void
+fstrm__spool_destroy(struct fstrm__spool **);
+
+bool
+fstrm__spool_empty(const struct fstrm__spool *);
+
+/*
+ * Append 'nframes' data frames, laid out as for fstrm__writer_writev_frames(),
+ * totalling 'nbytes' bytes including their length prefixes. Returns
+ * fstrm_res_again if the spool does not have room for all of them, and
+ * fstrm_res_failure if writing to the spool file failed. Either way, none of
+ * them are added to the spool.
+ */
+fstrm_res
+fstrm__spool_append(struct fstrm__spool *, const struct iovec *iov,
+		    const unsigned *frame_iovcnt, int nframes, size_t nbytes);
+
+/*
+ * Write a batch of the oldest data frames in the spool to 'w' with a single
+ * fstrm_writer_writev() call. The spool file is read in large chunks, so most
+ * calls don't touch the disk. The number of data frames and payload bytes
+ * written are returned in 'frames' and 'bytes'. The data frames remain in the
+ * spool if writing them fails.
+ */
+fstrm_res
+fstrm__spool_drain(struct fstrm__spool *, struct fstrm_writer *w,
+		   unsigned *frames, size_t *bytes);
+
 /* time */
 
 #if HAVE_CLOCK_GETTIME
@@ -181,12 +276,35 @@ bool fstrm__get_best_monotonic_clocks(clockid_t *clkid_gettime,
 				      char **errstr_out);
 #endif
 
+/* writer */
+
+/*
+ * Write 'nframes' data frames whose payloads are scattered across 'iov'. The
+ * payload of the i'th frame is the next frame_iovcnt[i] elements of 'iov'; each
+ * frame is written with a single length prefix. frame_iovcnt[i] must be less
+ * than FSTRM__WRITER_IOVEC_SIZE (see writer.c).
+ */
+fstrm_res
+fstrm__writer_writev_frames(struct fstrm_writer *w, const struct iovec *iov,
+			    const unsigned *frame_iovcnt, int nframes);
+
+/*
+ * Cap the connect and handshake timeouts of the writer's transport, if it has
+ * any, at 'timeout_max' milliseconds.
+ */
+void
+fstrm__writer_limit_timeouts(struct fstrm_writer *w, unsigned timeout_max);
+
 /* queue */
 
 #ifdef MY_HAVE_MEMORY_BARRIERS
 extern const struct my_queue_ops my_queue_mb_ops;
 #endif
 
+extern const struct my_queue_ops my_queue_mpmc_ops;
+
 extern const struct my_queue_ops my_queue_mutex_ops;
 
+extern const struct my_queue_ops my_queue_spsc_ops;
+
 #endif /* FSTRM_PRIVATE_H */
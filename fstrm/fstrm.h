@@ -282,15 +282,18 @@ struct fstrm_file_options;
 struct fstrm_iothr;
 struct fstrm_iothr_options;
 struct fstrm_iothr_queue;
+struct fstrm_iothr_reactor;
 struct fstrm_rdwr;
 struct fstrm_reader_options;
 struct fstrm_unix_writer_options;
 struct fstrm_writer;
 struct fstrm_writer_options;
 
+#include <fstrm/bufpool.h>
 #include <fstrm/control.h>
 #include <fstrm/file.h>
 #include <fstrm/iothr.h>
+#include <fstrm/iothr_pool.h>
 #include <fstrm/rdwr.h>
 #include <fstrm/reader.h>
 #include <fstrm/tcp_writer.h>
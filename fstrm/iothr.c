@@ -22,51 +22,442 @@
  *
  */
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "fstrm-private.h"
 
+/* Maximum number of entries fstrm_iothr_submit_batch() inserts at once. */
+#define FSTRM__IOTHR_SUBMIT_BATCH_SIZE	64
+
+/*
+ * Size of the header preceding each data frame in an input queue's reserve
+ * buffer. Data frames are padded to a multiple of this size.
+ */
+#define FSTRM__IOTHR_RING_HDR		8
+
+/* Upper bound on the number of entries an input queue grows to. */
+#define FSTRM__IOTHR_QUEUE_SIZE_LIMIT	(1U << 24)
+
+/*
+ * An input queue which has grown is shrunk back to input_queue_size entries
+ * once it has been empty for this many microseconds.
+ */
+#define FSTRM__IOTHR_QUEUE_SHRINK_IDLE	10000000
+
+/* Set in an input queue's 'users' while it is being resized. */
+#define FSTRM__IOTHR_QUEUE_RESIZING	(1U << 31)
+
 static void *fstrm__iothr_thr(void *);
+static void *fstrm__iothr_write_thr(void *);
+static void fstrm__iothr_gettime_cond(struct fstrm_iothr *, struct timespec *);
+static inline uint64_t fstrm__iothr_now_us(struct fstrm_iothr *);
+static void fstrm__iothr_shutdown(struct fstrm_iothr *);
+static void fstrm__iothr_wake_producers(struct fstrm_iothr *);
+static void fstrm__iothr_ring_release(void *, void *);
+static void fstrm__iothr_maybe_open(struct fstrm_iothr *);
 
 struct fstrm_iothr_options {
 	unsigned			buffer_hint;
 	unsigned			flush_timeout;
+	unsigned			flush_max_age;
 	unsigned			input_queue_size;
 	unsigned			num_input_queues;
 	unsigned			output_queue_size;
 	unsigned			queue_notify_threshold;
 	unsigned			reopen_interval;
+	unsigned			reopen_interval_max;
+	unsigned			reserve_buffer_size;
+	unsigned			spin_duration;
+	unsigned			drop_sample_threshold;
+	int				track_latency;
+	int				pipeline_writes;
+	int				external_drive;
+	int				direct_write;
+	char				*spool_path;
+	size_t				spool_size;
+	size_t				input_queue_max_bytes;
+	size_t				queued_bytes_max;
+	struct fstrm_iothr_reactor	*reactor;
+	fstrm_iothr_drop_policy		drop_policy;
 	fstrm_iothr_queue_model		queue_model;
+	fstrm_iothr_wait_strategy	wait_strategy;
 };
 
 static const struct fstrm_iothr_options default_fstrm_iothr_options = {
 	.buffer_hint			= FSTRM_IOTHR_BUFFER_HINT_DEFAULT,
 	.flush_timeout			= FSTRM_IOTHR_FLUSH_TIMEOUT_DEFAULT,
+	.flush_max_age			= FSTRM_IOTHR_FLUSH_MAX_AGE_DEFAULT,
 	.input_queue_size		= FSTRM_IOTHR_INPUT_QUEUE_SIZE_DEFAULT,
+	.input_queue_max_bytes		= FSTRM_IOTHR_INPUT_QUEUE_MAX_BYTES_DEFAULT,
+	.queued_bytes_max		= FSTRM_IOTHR_QUEUED_BYTES_MAX_DEFAULT,
 	.num_input_queues		= FSTRM_IOTHR_NUM_INPUT_QUEUES_DEFAULT,
 	.output_queue_size		= FSTRM_IOTHR_OUTPUT_QUEUE_SIZE_DEFAULT,
 	.queue_model			= FSTRM_IOTHR_QUEUE_MODEL_DEFAULT,
 	.queue_notify_threshold		= FSTRM_IOTHR_QUEUE_NOTIFY_THRESHOLD_DEFAULT,
 	.reopen_interval		= FSTRM_IOTHR_REOPEN_INTERVAL_DEFAULT,
+	.reopen_interval_max		= FSTRM_IOTHR_REOPEN_INTERVAL_MAX_DEFAULT,
+	.reserve_buffer_size		= FSTRM_IOTHR_RESERVE_BUFFER_SIZE_DEFAULT,
+	.spin_duration			= FSTRM_IOTHR_SPIN_DURATION_DEFAULT,
+	.track_latency			= FSTRM_IOTHR_TRACK_LATENCY_DEFAULT,
+	.pipeline_writes		= FSTRM_IOTHR_PIPELINE_WRITES_DEFAULT,
+	.external_drive			= FSTRM_IOTHR_EXTERNAL_DRIVE_DEFAULT,
+	.direct_write			= FSTRM_IOTHR_DIRECT_WRITE_DEFAULT,
+	.drop_policy			= FSTRM_IOTHR_DROP_POLICY_DEFAULT,
+	.drop_sample_threshold		= FSTRM_IOTHR_DROP_SAMPLE_THRESHOLD_DEFAULT,
+	.spool_path			= NULL,
+	.spool_size			= FSTRM_IOTHR_SPOOL_SIZE_DEFAULT,
+	.reactor			= NULL,
+	.wait_strategy			= FSTRM_IOTHR_WAIT_STRATEGY_DEFAULT,
 };
 
-struct fstrm_iothr_queue {
-	struct my_queue			*q;
+/*
+ * Byte ring backing fstrm_iothr_reserve() and fstrm_iothr_commit().
+ *
+ * Each committed data frame occupies a contiguous record of the ring: a
+ * FSTRM__IOTHR_RING_HDR byte header holding the ring position just past the
+ * end of the record, followed by the padded data frame. A record that would
+ * straddle the end of the buffer starts at the beginning of the buffer
+ * instead, and the skipped bytes are released along with it.
+ *
+ * Records are released through the queue entry's free_func, by the I/O thread
+ * or, with pipeline_writes, the writer thread, in the same order they were
+ * inserted into the input queue, so releasing a record simply advances 'tail'
+ * to its end.
+ */
+struct fstrm__iothr_ring {
+	/* Buffer of 'size' bytes, a power of 2. */
+	uint8_t				*buf;
+	unsigned			size;
+
+	/* Position of the next record. Owned by the producer. */
+	unsigned			head;
+
+	/* The outstanding reservation, if 'reserved' is set. */
+	bool				reserved;
+	unsigned			rsv_start;
+	size_t				rsv_len;
+
+	/* Position of the oldest unreleased record. Owned by the consumer. */
+	atomic_uint			tail;
 };
 
-struct fstrm__iothr_queue_entry {
-	/* The deallocation callback. */
+/* A deallocation callback and its argument. */
+struct fstrm__iothr_free {
 	void				(*free_func)(void *, void *);
 	void				*free_data;
+};
 
+/*
+ * Input queue entry. By default, an entry carries the deallocation callback of
+ * its data frame, like the arguments to fstrm_iothr_submit(). Producers nearly
+ * always use the same callback for every data frame, though, and may register
+ * it when obtaining the input queue with fstrm_iothr_get_input_queue_free().
+ * The entries of such an input queue leave the callback out, which keeps them
+ * down to 16 bytes. A data frame submitted to it with a different callback is
+ * stored in a separately allocated box along with the callback. Data frames
+ * committed from the input queue's reserve buffer are released through the
+ * reserve buffer, which is implied by their 'kind'.
+ *
+ * The 'enqueued' timestamp is only carried through the input queues with the
+ * track_latency or flush_max_age option. An input queue holds just the leading
+ * 'entry_size' bytes of each entry, see fstrm__iothr_queue_claim(), and arrays
+ * of entries are laid out with that stride (see fstrm__iothr_entry_at()).
+ */
+struct fstrm__iothr_queue_entry {
 	/* The actual payload bytes, allocated by the caller. */
 	void				*data;
 
 	/* Number of bytes in 'data'. */
 	uint32_t			len_data;
+
+	/* A fstrm__iothr_entry_kind. */
+	uint16_t			kind;
+
+	/*
+	 * Zero if the payload is contiguous. Otherwise, 'data' is an array of
+	 * 'iovcnt' struct iovec, see fstrm_iothr_submitv().
+	 */
+	uint16_t			iovcnt;
+
+	union {
+		/* Input queues with a registered deallocation callback. */
+		struct {
+			/*
+			 * Submission time in microseconds, with
+			 * track_latency or flush_max_age.
+			 */
+			uint64_t			enqueued;
+		} reg;
+
+		/* Other input queues. */
+		struct {
+			struct fstrm__iothr_free	free;
+			uint64_t			enqueued;
+		} cb;
+	} u;
+};
+
+/* Where the deallocation callback of an input queue entry's 'data' is. */
+typedef enum {
+	/* Registered with the input queue, or in the entry itself. */
+	fstrm__iothr_entry_plain,
+
+	/* In the fstrm__iothr_box that 'data' points to. */
+	fstrm__iothr_entry_boxed,
+
+	/* 'data' points into the input queue's reserve buffer. */
+	fstrm__iothr_entry_ring,
+} fstrm__iothr_entry_kind;
+
+struct fstrm__iothr_box {
+	struct fstrm__iothr_free	free;
+	void				*data;
+};
+
+/* Output queue entry, with the deallocation callback looked up. */
+struct fstrm__iothr_outq_entry {
+	struct fstrm__iothr_free	free;
+	void				*data;
+};
+
+/*
+ * Capacity of the output queue's iovec array. Besides output_queue_size
+ * contiguous data frames, this always has room for one scattered data frame.
+ */
+#define FSTRM__IOTHR_OUTQ_IOV_SIZE(iothr) \
+	((iothr)->opt.output_queue_size + FSTRM_IOTHR_SUBMITV_IOVCNT_MAX)
+
+/*
+ * Output queue. 'idx' counts data frames, which each have an element in
+ * 'entries' and 'frame_iovcnt', and 'iovcnt' counts their payload segments in
+ * 'iov'.
+ */
+struct fstrm__iothr_outq {
+	unsigned			idx;
+	unsigned			iovcnt;
+	struct iovec			*iov;
+	unsigned			*frame_iovcnt;
+	struct fstrm__iothr_outq_entry	*entries;
+	unsigned			nbytes;
+
+	/* Submission times of the data frames, with track_latency. */
+	uint64_t			*enqueued;
+
+	/*
+	 * Submission time of the oldest data frame in the output queue, with
+	 * flush_max_age.
+	 */
+	uint64_t			oldest;
+};
+
+/* Where the data frames in an output queue are written to. */
+typedef enum {
+	fstrm__iothr_output_writer,
+	fstrm__iothr_output_spool,
+} fstrm__iothr_output_dest;
+
+/*
+ * Per-input queue statistics. These are written by the queue's producers, and
+ * live on their own cache line so that producers on different queues do not
+ * contend. With FSTRM_IOTHR_QUEUE_MODEL_MPSC, they are updated with atomic
+ * read-modify-write operations.
+ */
+struct fstrm__iothr_queue_stats {
+	_Atomic uint64_t		frames_submitted;
+	_Atomic uint64_t		bytes_submitted;
+	_Atomic uint64_t		frames_rejected_full;
+	_Atomic uint64_t		bytes_rejected_full;
+	_Atomic uint64_t		frames_rejected_budget;
+	_Atomic uint64_t		bytes_rejected_budget;
+	_Atomic uint64_t		frames_dropped_oldest;
+	_Atomic uint64_t		bytes_dropped_oldest;
+	_Atomic uint64_t		frames_dropped_sampled;
+	_Atomic uint64_t		bytes_dropped_sampled;
+	_Atomic uint64_t		queue_depth_hwm;
+
+	/* Sequence number for FSTRM_IOTHR_DROP_POLICY_SAMPLE decisions. */
+	_Atomic uint64_t		sample_seq;
+};
+
+/*
+ * Submit-to-write latency histogram, see struct fstrm_iothr_latency. Only
+ * written by the thread writing the output queues.
+ */
+struct fstrm__iothr_latency {
+	_Atomic uint64_t		count;
+	_Atomic uint64_t		sum_us;
+	_Atomic uint64_t		max_us;
+	_Atomic uint64_t		buckets[FSTRM_IOTHR_LATENCY_BUCKETS];
+};
+
+/*
+ * I/O thread statistics. Each of these is only written by one thread at a time:
+ * the I/O thread or, with pipeline_writes, the writer thread while it writes an
+ * output queue, or, with direct_write, a producer holding 'direct_lock'.
+ */
+struct fstrm__iothr_stats {
+	_Atomic uint64_t		frames_written;
+	_Atomic uint64_t		bytes_written;
+	_Atomic uint64_t		frames_written_direct;
+	_Atomic uint64_t		frames_dropped_closed;
+	_Atomic uint64_t		bytes_dropped_closed;
+	_Atomic uint64_t		frames_dropped_write_error;
+	_Atomic uint64_t		bytes_dropped_write_error;
+	_Atomic uint64_t		frames_spooled;
+	_Atomic uint64_t		bytes_spooled;
+	_Atomic uint64_t		frames_dropped_spool_full;
+	_Atomic uint64_t		bytes_dropped_spool_full;
+	_Atomic uint64_t		frames_dropped_spool_error;
+	_Atomic uint64_t		bytes_dropped_spool_error;
+	_Atomic uint64_t		writev_calls;
+	_Atomic uint64_t		flushes_queue_full;
+	_Atomic uint64_t		flushes_buffer_hint;
+	_Atomic uint64_t		flushes_timeout;
+	_Atomic uint64_t		flushes_idle;
+	_Atomic uint64_t		open_attempts;
+	_Atomic uint64_t		open_failures;
+};
+
+struct fstrm_iothr_queue {
+	struct fstrm__iothr_queue_stats	stats cacheline_aligned;
+
+	struct my_queue			*q cacheline_aligned;
+
+	/*
+	 * Number of entries 'q' was created with, and the thresholds derived
+	 * from it, see fstrm__iothr_queue_set_size().
+	 */
+	unsigned			size;
+	unsigned			notify_space;
+	unsigned			sample_depth;
+
+	/*
+	 * With input_queue_max_bytes, the number of threads using 'q', plus
+	 * FSTRM__IOTHR_QUEUE_RESIZING while a thread which is its only user
+	 * replaces it with a larger or smaller queue. Under
+	 * FSTRM_IOTHR_QUEUE_MODEL_SPSC, the producer is not counted, see
+	 * fstrm__iothr_queue_enter().
+	 */
+	atomic_uint			users;
+
+	/* Set by a producer which found 'q' full but could not grow it. */
+	atomic_bool			grow;
+
+	/*
+	 * Set by the I/O thread under FSTRM_IOTHR_QUEUE_MODEL_SPSC for the
+	 * producer to shrink 'q' back to input_queue_size entries.
+	 */
+	atomic_bool			shrink;
+
+	/* When the I/O thread first found 'q' empty, or 0 if it was not. */
+	uint64_t			idle_since;
+
+	/*
+	 * Set once 'q' has been allocated, when the input queue is first
+	 * returned by fstrm_iothr_get_input_queue() or
+	 * fstrm_iothr_get_input_queue_idx(). The I/O thread skips input queues
+	 * which have not been.
+	 */
+	atomic_bool			claimed;
+
+	/*
+	 * Deallocation callback registered by fstrm_iothr_get_input_queue_free(),
+	 * if 'free_registered' is set, and the resulting size of the entries
+	 * of 'q'. Set before 'claimed'.
+	 */
+	struct fstrm__iothr_free	free;
+	bool				free_registered;
+	size_t				entry_size;
+
+	/* Reserve buffer, allocated by the first fstrm_iothr_reserve(). */
+	struct fstrm__iothr_ring	*ring;
+
+	/*
+	 * Serializes reservations between producers sharing the queue. Only
+	 * used with FSTRM_IOTHR_QUEUE_MODEL_MPSC.
+	 */
+	pthread_mutex_t			ring_lock;
+};
+
+/*
+ * Condition variable and lock used to wake a parked I/O thread, or a reactor
+ * thread. With external_drive, the pipe 'fds' is used instead: waking writes a
+ * byte to fds[1], which makes fds[0] readable for the application's event
+ * loop.
+ */
+struct fstrm__iothr_waker {
+	pthread_cond_t			cv;
+	pthread_mutex_t			lock;
+	int				fds[2];
+
+	/*
+	 * Set by the sleeping thread before it sleeps on 'cv'. Producers only
+	 * wake it if they observe this flag set, and clear it when they do so.
+	 */
+	atomic_bool			parked;
+
+#if HAVE_CLOCK_GETTIME
+	/* Clock used by 'cv'. */
+	clockid_t			clkid;
+#endif
+};
+
+struct fstrm_iothr_reactor {
+	/* The reactor thread. */
+	pthread_t			thr;
+
+	/*
+	 * Wakes the reactor thread. 'waker.lock' also protects 'iothrs' and
+	 * the attached I/O thread objects' 'detached' flags.
+	 */
+	struct fstrm__iothr_waker	waker;
+
+	/*
+	 * Attached I/O thread objects, linked through their 'reactor_next'.
+	 * New ones are pushed onto the head, and only the reactor thread
+	 * removes them, so it can walk the list without holding the lock.
+	 */
+	struct fstrm_iothr		*iothrs;
+
+	/* Signalled when an I/O thread object has been detached. */
+	pthread_cond_t			detach_cv;
+
+	/* Whether the reactor thread is shutting down. */
+	volatile bool			shutting_down;
 };
 
 struct fstrm_iothr {
 	/* The I/O thread. */
 	pthread_t			thr;
+	bool				thr_started;
+
+	/*
+	 * Reactor thread doing the I/O work instead, with the reactor option.
+	 * Set once attached; 'detached' is set by the reactor thread when it
+	 * has shut down the I/O work, in fstrm_iothr_destroy().
+	 */
+	struct fstrm_iothr_reactor	*reactor;
+	struct fstrm_iothr		*reactor_next;
+	bool				detached;
+
+	/*
+	 * With a reactor and the timed wait strategy, the time at which to
+	 * flush the output queue if the input queues are still idle.
+	 */
+	uint64_t			flush_deadline;
+
+	/*
+	 * With queued_bytes_max, the payload bytes of the data frames in the
+	 * input and output queues, which producers add to and the I/O thread
+	 * subtracts from once it releases them, and the highest value reached.
+	 */
+	_Atomic uint64_t		queued_bytes cacheline_aligned;
+	_Atomic uint64_t		queued_bytes_hwm;
+
+	/* Statistics maintained by the I/O thread. */
+	struct fstrm__iothr_stats	stats cacheline_aligned;
+	struct fstrm__iothr_latency	latency;
 
 	/* Copy of options. supplied by caller. */
 	struct fstrm_iothr_options	opt;
@@ -74,14 +465,54 @@ struct fstrm_iothr {
 	/* Queue implementation. */
 	const struct my_queue_ops	*queue_ops;
 
+	/* Size of an input queue element, see fstrm__iothr_queue_entry. */
+	size_t				entry_size;
+
+	/* Whether input queue entries carry their submission time. */
+	bool				timestamps;
+
 	/* Writer. */
 	struct fstrm_writer		*writer;
 
 	/* Whether the writer is opened or not. */
 	bool				opened;
 
-	/* Last time the writer's 'open' method was called. */
-	time_t				last_open_attempt;
+	/*
+	 * The writer is opened asynchronously, by a short-lived thread. While
+	 * 'opening' is set, 'open_thr' is running fstrm_writer_open(), and the
+	 * I/O thread does not touch the writer. The open thread stores the
+	 * result in 'open_res', then sets 'open_done' and wakes the I/O thread.
+	 */
+	bool				opening;
+	pthread_t			open_thr;
+	fstrm_res			open_res;
+	atomic_bool			open_done;
+
+	/* Whether no attempt to open the writer has finished yet. */
+	bool				first_open;
+
+	/*
+	 * Time of the next attempt to open the writer, and the current reopen
+	 * interval, in microseconds. The interval doubles after each failed
+	 * attempt, up to opt.reopen_interval_max.
+	 */
+	uint64_t			next_open;
+	uint64_t			reopen_delay;
+
+	/* Sequence number for the reopen jitter. */
+	uint64_t			reopen_seq;
+
+	/*
+	 * Spool for data frames while the writer is closed, with spool_path.
+	 * While the spool holds data frames, all data frames are appended to
+	 * it, so that they are written in order.
+	 *
+	 * 'spool_pending' is set by the I/O thread when it sends data frames
+	 * to the spool, and cleared once it finds the spool empty, so that it
+	 * only has to look at the spool while it may hold data frames.
+	 */
+	struct fstrm__spool		*spool;
+	bool				spool_pending;
 
 	/* Allocated array of input queues, size opt.num_input_queues. */
 	struct fstrm_iothr_queue	*queues;
@@ -96,22 +527,97 @@ struct fstrm_iothr {
 #endif
 
 	/*
-	 * Conditional variable and lock, used by producer thread
-	 * (fstrm_iothr_submit) to signal sleeping I/O thread that the low
-	 * watermark (opt.queue_notify_threshold) has been reached.
+	 * Used by producer threads (fstrm_iothr_submit) to wake the parked I/O
+	 * thread. With the timed wait strategy, this only happens once the low
+	 * watermark (opt.queue_notify_threshold) has been reached. 'wake' is
+	 * the I/O thread's own 'waker', or the reactor's.
 	 */
-	pthread_cond_t			cv;
-	pthread_mutex_t			cv_lock;
+	struct fstrm__iothr_waker	waker;
+	struct fstrm__iothr_waker	*wake;
+
+	/*
+	 * With the timed wait strategy and flush_max_age, set while the I/O
+	 * thread is parked without a timer, having found nothing to do for a
+	 * whole flush_max_age period. Producers then wake it with their next
+	 * data frame rather than at the low watermark. 'busy' is set by the
+	 * I/O thread when it finds data frames, and cleared when it sleeps.
+	 */
+	atomic_bool			idle;
+	bool				busy;
+
+	/*
+	 * Number of entries the input queues may grow to, and whether that is
+	 * more than input_queue_size. 'num_grown' is the number of input
+	 * queues which are currently larger than input_queue_size.
+	 */
+	unsigned			queue_size_max;
+	bool				elastic;
+	atomic_uint			num_grown;
+
+	/*
+	 * Producers sleeping in fstrm_iothr_submit_wait() for space in an input
+	 * queue. They register in 'space_waiters', and sleep on 'space_cv'
+	 * until the I/O thread has advanced 'space_gen' by draining entries.
+	 * fstrm_iothr_destroy() also sleeps on 'space_cv', until the last of
+	 * them has deregistered.
+	 */
+	atomic_uint			space_waiters;
+	atomic_uint			space_gen;
+	pthread_cond_t			space_cv;
+	pthread_mutex_t			space_lock;
 
 	/* Used to return unique queues from fstrm_iothr_get_queue(). */
 	pthread_mutex_t			get_queue_lock;
 	unsigned			get_queue_idx;
 
-	/* Output queue. */
-	unsigned			outq_idx;
-	struct iovec			*outq_iov;
-	struct fstrm__iothr_queue_entry	*outq_entries;
-	unsigned			outq_nbytes;
+	/*
+	 * Scratch array of opt.output_queue_size entries, used to drain an
+	 * input queue in a single batch.
+	 */
+	struct fstrm__iothr_queue_entry	*batch_entries;
+
+	/*
+	 * Output queues. The I/O thread fills 'outq'. With pipeline_writes,
+	 * it hands a full output queue to the writer thread and carries on
+	 * filling the other one; otherwise, only outqs[0] is used.
+	 */
+	struct fstrm__iothr_outq	outqs[2];
+	struct fstrm__iothr_outq	*outq;
+
+	/*
+	 * Writer thread, with pipeline_writes. The I/O thread sets
+	 * 'write_pending' to the output queue to write, and its destination
+	 * in 'write_dest'. The writer thread writes it, clears
+	 * 'write_pending', and stores the result in 'write_res', which the I/O
+	 * thread collects before handing over the next output queue. The I/O
+	 * thread does not touch the writer or the spool while a write is
+	 * pending. All of these are protected by 'write_lock'.
+	 */
+	pthread_t			write_thr;
+	bool				write_thr_started;
+	pthread_cond_t			write_cv;
+	pthread_mutex_t			write_lock;
+	struct fstrm__iothr_outq	*write_pending;
+	fstrm__iothr_output_dest	write_dest;
+	fstrm_res			write_res;
+	bool				write_stop;
+
+	/*
+	 * With direct_write, the I/O thread sets 'direct_ok' while it is idle
+	 * with nothing buffered, and producers holding 'direct_lock' may then
+	 * write to the writer themselves. It only does so as the last thing
+	 * before it sleeps, once its final check found the input queues empty,
+	 * and never drains them while 'direct_ok' is set, so that a data frame
+	 * written directly cannot overtake one queued earlier. The I/O thread
+	 * clears it under 'direct_lock' before it touches the writer again. A
+	 * producer whose write fails clears it and sets 'direct_failed', so
+	 * that the I/O thread closes the writer. 'direct_enabled' is the I/O
+	 * thread's own record of having set 'direct_ok'.
+	 */
+	pthread_mutex_t			direct_lock;
+	atomic_bool			direct_ok;
+	bool				direct_failed;
+	bool				direct_enabled;
 };
 
 struct fstrm_iothr_options *
@@ -126,8 +632,10 @@ fstrm_iothr_options_init(void)
 void
 fstrm_iothr_options_destroy(struct fstrm_iothr_options **opt)
 {
-	if (*opt != NULL)
+	if (*opt != NULL) {
+		my_free((*opt)->spool_path);
 		my_free(*opt);
+	}
 }
 
 fstrm_res
@@ -156,13 +664,23 @@ fstrm_iothr_options_set_flush_timeout(struct fstrm_iothr_options *opt,
 	return fstrm_res_success;
 }
 
+fstrm_res
+fstrm_iothr_options_set_flush_max_age(struct fstrm_iothr_options *opt,
+				      unsigned flush_max_age)
+{
+	if (flush_max_age > FSTRM_IOTHR_FLUSH_MAX_AGE_MAX)
+		return fstrm_res_failure;
+	opt->flush_max_age = flush_max_age;
+	return fstrm_res_success;
+}
+
 fstrm_res
 fstrm_iothr_options_set_input_queue_size(struct fstrm_iothr_options *opt,
 					 unsigned input_queue_size)
 {
 	if (input_queue_size < FSTRM_IOTHR_INPUT_QUEUE_SIZE_MIN ||
 	    input_queue_size > FSTRM_IOTHR_INPUT_QUEUE_SIZE_MAX ||
-	    input_queue_size & 1)
+	    (input_queue_size & (input_queue_size - 1)) != 0)
 	{
 		return fstrm_res_failure;
 	}
@@ -170,6 +688,24 @@ fstrm_iothr_options_set_input_queue_size(struct fstrm_iothr_options *opt,
 	return fstrm_res_success;
 }
 
+fstrm_res
+fstrm_iothr_options_set_input_queue_max_bytes(struct fstrm_iothr_options *opt,
+					      size_t input_queue_max_bytes)
+{
+	if (input_queue_max_bytes > FSTRM_IOTHR_INPUT_QUEUE_MAX_BYTES_MAX)
+		return fstrm_res_failure;
+	opt->input_queue_max_bytes = input_queue_max_bytes;
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm_iothr_options_set_queued_bytes_max(struct fstrm_iothr_options *opt,
+					 size_t queued_bytes_max)
+{
+	opt->queued_bytes_max = queued_bytes_max;
+	return fstrm_res_success;
+}
+
 fstrm_res
 fstrm_iothr_options_set_num_input_queues(struct fstrm_iothr_options *opt,
 					 unsigned num_input_queues)
@@ -229,415 +765,3334 @@ fstrm_iothr_options_set_reopen_interval(struct fstrm_iothr_options *opt,
 	return fstrm_res_success;
 }
 
-struct fstrm_iothr *
-fstrm_iothr_init(const struct fstrm_iothr_options *opt,
-		 struct fstrm_writer **writer)
+fstrm_res
+fstrm_iothr_options_set_spool_path(struct fstrm_iothr_options *opt,
+				   const char *spool_path)
 {
-	struct fstrm_iothr *iothr = NULL;
-
-	int res;
-	pthread_condattr_t ca;
-
-	/* Initialize fstrm_iothr and copy options. */
-	iothr = my_calloc(1, sizeof(*iothr));
-	if (opt == NULL)
-		opt = &default_fstrm_iothr_options;
-	memmove(&iothr->opt, opt, sizeof(iothr->opt));
+	my_free(opt->spool_path);
+	if (spool_path != NULL)
+		opt->spool_path = my_strdup(spool_path);
+	return fstrm_res_success;
+}
 
-	/*
-	 * Some platforms have a ridiculously low IOV_MAX, literally the lowest
-	 * value even allowed by POSIX, which is lower than our conservative
-	 * FSTRM_IOTHR_OUTPUT_QUEUE_SIZE_DEFAULT. Accommodate these platforms by
-	 * silently clamping output_queue_size to IOV_MAX.
-	 */
-	if (iothr->opt.output_queue_size > IOV_MAX)
-		iothr->opt.output_queue_size = IOV_MAX;
+fstrm_res
+fstrm_iothr_options_set_spool_size(struct fstrm_iothr_options *opt,
+				   size_t spool_size)
+{
+	if (spool_size < FSTRM_IOTHR_SPOOL_SIZE_MIN)
+		return fstrm_res_failure;
+	opt->spool_size = spool_size;
+	return fstrm_res_success;
+}
 
-	/*
-	 * Set the queue implementation.
-	 *
-	 * The memory barrier based queue implementation is the only one of our
-	 * queue implementations that supports SPSC, so if it is not available,
-	 * use the mutex based queue implementation instead. The mutex
-	 * implementation is technically MPSC, but MPSC is strictly stronger
-	 * than SPSC.
-	 */
-	if (iothr->opt.queue_model == FSTRM_IOTHR_QUEUE_MODEL_SPSC) {
-#ifdef MY_HAVE_MEMORY_BARRIERS
-		iothr->queue_ops = &my_queue_mb_ops;
-#else
-		iothr->queue_ops = &my_queue_mutex_ops;
-#endif
-	} else {
-		iothr->queue_ops = &my_queue_mutex_ops;
+fstrm_res
+fstrm_iothr_options_set_reopen_interval_max(struct fstrm_iothr_options *opt,
+					    unsigned reopen_interval_max)
+{
+	if (reopen_interval_max < FSTRM_IOTHR_REOPEN_INTERVAL_MAX_MIN ||
+	    reopen_interval_max > FSTRM_IOTHR_REOPEN_INTERVAL_MAX_MAX)
+	{
+		return fstrm_res_failure;
 	}
+	opt->reopen_interval_max = reopen_interval_max;
+	return fstrm_res_success;
+}
 
-#if HAVE_CLOCK_GETTIME
-	/* Detect best clocks. */
-	if (!fstrm__get_best_monotonic_clocks(&iothr->clkid_gettime,
-					      &iothr->clkid_pthread,
-					      NULL))
+fstrm_res
+fstrm_iothr_options_set_wait_strategy(struct fstrm_iothr_options *opt,
+				      fstrm_iothr_wait_strategy wait_strategy)
+{
+	if (wait_strategy != FSTRM_IOTHR_WAIT_STRATEGY_TIMED &&
+	    wait_strategy != FSTRM_IOTHR_WAIT_STRATEGY_SPIN_PARK)
 	{
-		goto fail;
+		return fstrm_res_failure;
 	}
-#endif
+	opt->wait_strategy = wait_strategy;
+	return fstrm_res_success;
+}
 
-	/* Initialize the input queues. */
-	iothr->queues = my_calloc(iothr->opt.num_input_queues,
-				  sizeof(struct fstrm_iothr_queue));
-	for (size_t i = 0; i < iothr->opt.num_input_queues; i++) {
-		iothr->queues[i].q = iothr->queue_ops->init(iothr->opt.input_queue_size,
-			sizeof(struct fstrm__iothr_queue_entry));
-		if (iothr->queues[i].q == NULL)
-			goto fail;
+fstrm_res
+fstrm_iothr_options_set_reserve_buffer_size(struct fstrm_iothr_options *opt,
+					    unsigned reserve_buffer_size)
+{
+	if (reserve_buffer_size < FSTRM_IOTHR_RESERVE_BUFFER_SIZE_MIN ||
+	    reserve_buffer_size > FSTRM_IOTHR_RESERVE_BUFFER_SIZE_MAX ||
+	    (reserve_buffer_size & (reserve_buffer_size - 1)) != 0)
+	{
+		return fstrm_res_failure;
 	}
+	opt->reserve_buffer_size = reserve_buffer_size;
+	return fstrm_res_success;
+}
 
-	/* Initialize the output queue. */
-	iothr->outq_iov = my_calloc(iothr->opt.output_queue_size,
-				    sizeof(struct iovec));
-	iothr->outq_entries = my_calloc(iothr->opt.output_queue_size,
-					sizeof(struct fstrm__iothr_queue_entry));
-
-	/* Initialize the condition variable. */
-	res = pthread_condattr_init(&ca);
-	assert(res == 0);
+fstrm_res
+fstrm_iothr_options_set_spin_duration(struct fstrm_iothr_options *opt,
+				      unsigned spin_duration)
+{
+	if (spin_duration > FSTRM_IOTHR_SPIN_DURATION_MAX)
+		return fstrm_res_failure;
+	opt->spin_duration = spin_duration;
+	return fstrm_res_success;
+}
 
-#if HAVE_CLOCK_GETTIME && HAVE_PTHREAD_CONDATTR_SETCLOCK
-	res = pthread_condattr_setclock(&ca, iothr->clkid_pthread);
-	assert(res == 0);
-#endif
+fstrm_res
+fstrm_iothr_options_set_drop_policy(struct fstrm_iothr_options *opt,
+				    fstrm_iothr_drop_policy drop_policy)
+{
+	if (drop_policy != FSTRM_IOTHR_DROP_POLICY_NEWEST &&
+	    drop_policy != FSTRM_IOTHR_DROP_POLICY_OLDEST &&
+	    drop_policy != FSTRM_IOTHR_DROP_POLICY_SAMPLE)
+	{
+		return fstrm_res_failure;
+	}
+	opt->drop_policy = drop_policy;
+	return fstrm_res_success;
+}
 
-	res = pthread_cond_init(&iothr->cv, &ca);
-	assert(res == 0);
+fstrm_res
+fstrm_iothr_options_set_drop_sample_threshold(struct fstrm_iothr_options *opt,
+					      unsigned drop_sample_threshold)
+{
+	if (drop_sample_threshold > FSTRM_IOTHR_DROP_SAMPLE_THRESHOLD_MAX)
+		return fstrm_res_failure;
+	opt->drop_sample_threshold = drop_sample_threshold;
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm_iothr_options_set_track_latency(struct fstrm_iothr_options *opt,
+				      int track_latency)
+{
+	opt->track_latency = track_latency ? 1 : 0;
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm_iothr_options_set_pipeline_writes(struct fstrm_iothr_options *opt,
+					int pipeline_writes)
+{
+	opt->pipeline_writes = pipeline_writes ? 1 : 0;
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm_iothr_options_set_external_drive(struct fstrm_iothr_options *opt,
+				       int external_drive)
+{
+	opt->external_drive = external_drive ? 1 : 0;
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm_iothr_options_set_direct_write(struct fstrm_iothr_options *opt,
+				     int direct_write)
+{
+	opt->direct_write = direct_write ? 1 : 0;
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm_iothr_options_set_reactor(struct fstrm_iothr_options *opt,
+				struct fstrm_iothr_reactor *reactor)
+{
+	opt->reactor = reactor;
+	return fstrm_res_success;
+}
+
+static void
+#if HAVE_CLOCK_GETTIME
+fstrm__iothr_waker_init(struct fstrm__iothr_waker *waker, clockid_t clkid)
+#else
+fstrm__iothr_waker_init(struct fstrm__iothr_waker *waker)
+#endif
+{
+	pthread_condattr_t ca;
+	int res;
+
+	res = pthread_condattr_init(&ca);
+	assert(res == 0);
+
+#if HAVE_CLOCK_GETTIME
+	waker->clkid = clkid;
+#if HAVE_PTHREAD_CONDATTR_SETCLOCK
+	res = pthread_condattr_setclock(&ca, clkid);
+	assert(res == 0);
+#endif
+#endif
+
+	res = pthread_cond_init(&waker->cv, &ca);
+	assert(res == 0);
+
+	res = pthread_condattr_destroy(&ca);
+	assert(res == 0);
+
+	res = pthread_mutex_init(&waker->lock, NULL);
+	assert(res == 0);
+
+	waker->fds[0] = waker->fds[1] = -1;
+}
+
+/* Switch 'waker' over to a non-blocking pipe, for external_drive. */
+static bool
+fstrm__iothr_waker_init_pipe(struct fstrm__iothr_waker *waker)
+{
+	if (pipe(waker->fds) != 0) {
+		waker->fds[0] = waker->fds[1] = -1;
+		return false;
+	}
+	for (unsigned i = 0; i < 2; i++) {
+		int flags = fcntl(waker->fds[i], F_GETFL, 0);
+		if (flags == -1 ||
+		    fcntl(waker->fds[i], F_SETFL, flags | O_NONBLOCK) == -1 ||
+		    fcntl(waker->fds[i], F_SETFD, FD_CLOEXEC) == -1)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static void
+fstrm__iothr_waker_destroy(struct fstrm__iothr_waker *waker)
+{
+	pthread_cond_destroy(&waker->cv);
+	pthread_mutex_destroy(&waker->lock);
+	if (waker->fds[0] != -1)
+		close(waker->fds[0]);
+	if (waker->fds[1] != -1)
+		close(waker->fds[1]);
+}
+
+/* Wake the thread sleeping on 'waker'. */
+static void
+fstrm__iothr_waker_signal(struct fstrm__iothr_waker *waker)
+{
+	if (waker->fds[1] != -1) {
+		/* If the pipe is full, it is readable anyway. */
+		const uint8_t b = 0;
+		if (write(waker->fds[1], &b, sizeof(b)) < 0)
+			return;
+	} else {
+		pthread_mutex_lock(&waker->lock);
+		pthread_cond_signal(&waker->cv);
+		pthread_mutex_unlock(&waker->lock);
+	}
+}
+
+/*
+ * Return the current time of the clock used by 'waker->cv', for computing
+ * pthread_cond_timedwait() deadlines.
+ */
+static void
+fstrm__iothr_waker_gettime(const struct fstrm__iothr_waker *waker,
+			   struct timespec *ts)
+{
+#if HAVE_CLOCK_GETTIME
+#if HAVE_PTHREAD_CONDATTR_SETCLOCK
+	int rv = clock_gettime(waker->clkid, ts);
+#else
+	int rv = clock_gettime(CLOCK_REALTIME, ts);
+#endif
+	assert(rv == 0);
+#else
+	(void)waker;
+	my_gettime(-1, ts);
+#endif
+}
+
+/*
+ * Unconditionally wake the thread doing the I/O work for 'iothr', whether it
+ * is parked or sleeping.
+ */
+static void
+fstrm__iothr_wake(struct fstrm_iothr *iothr)
+{
+	atomic_store(&iothr->wake->parked, false);
+	fstrm__iothr_waker_signal(iothr->wake);
+}
+
+static void
+fstrm__iothr_outq_init(struct fstrm_iothr *iothr, struct fstrm__iothr_outq *outq)
+{
+	outq->iov = my_calloc(FSTRM__IOTHR_OUTQ_IOV_SIZE(iothr),
+			      sizeof(struct iovec));
+	outq->frame_iovcnt = my_calloc(iothr->opt.output_queue_size,
+				       sizeof(unsigned));
+	outq->entries = my_calloc(iothr->opt.output_queue_size,
+				  sizeof(struct fstrm__iothr_outq_entry));
+	if (iothr->opt.track_latency)
+		outq->enqueued = my_calloc(iothr->opt.output_queue_size,
+					   sizeof(uint64_t));
+}
+
+static void
+fstrm__iothr_outq_destroy(struct fstrm__iothr_outq *outq)
+{
+	my_free(outq->iov);
+	my_free(outq->frame_iovcnt);
+	my_free(outq->entries);
+	my_free(outq->enqueued);
+}
+
+/*
+ * Record the number of entries an input queue's 'q' was created with. Producers
+ * on the timed wait strategy only wake the I/O thread once the free space in
+ * their input queue has dropped to 'notify_space'. With
+ * FSTRM_IOTHR_DROP_POLICY_SAMPLE, data frames are sampled above a depth of
+ * 'sample_depth'.
+ */
+static void
+fstrm__iothr_queue_set_size(struct fstrm_iothr *iothr,
+			    struct fstrm_iothr_queue *ioq, unsigned size)
+{
+	ioq->size = size;
+
+	/*
+	 * A queue of 'size' entries holds at most size - 1 of them, so a
+	 * queue_notify_threshold at or above that only wakes the I/O thread
+	 * once the queue is full.
+	 */
+	if (iothr->opt.queue_notify_threshold < size - 1)
+		ioq->notify_space = size - 1 - iothr->opt.queue_notify_threshold;
+	else
+		ioq->notify_space = 0;
+
+	ioq->sample_depth = (unsigned) ((uint64_t) size *
+		iothr->opt.drop_sample_threshold / 100);
+}
+
+/*
+ * Allocate the storage of an input queue being handed out, unless that has
+ * already been done, with entries laid out for the deallocation callback
+ * 'free', if not NULL. Called with 'get_queue_lock' held. Fails if the input
+ * queue has already been handed out with a different callback registration.
+ */
+static bool
+fstrm__iothr_queue_claim(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+			 const struct fstrm__iothr_free *free)
+{
+	if (atomic_load_explicit(&ioq->claimed, memory_order_relaxed)) {
+		if (free == NULL)
+			return !ioq->free_registered;
+		return ioq->free_registered &&
+			ioq->free.free_func == free->free_func &&
+			ioq->free.free_data == free->free_data;
+	}
+
+	if (free != NULL) {
+		ioq->free = *free;
+		ioq->free_registered = true;
+		if (iothr->timestamps)
+			ioq->entry_size = offsetof(struct fstrm__iothr_queue_entry,
+						   u.reg.enqueued) + sizeof(uint64_t);
+		else
+			ioq->entry_size = offsetof(struct fstrm__iothr_queue_entry,
+						   u.reg.enqueued);
+	} else {
+		ioq->entry_size = iothr->entry_size;
+	}
+
+	ioq->q = iothr->queue_ops->init(iothr->opt.input_queue_size,
+					ioq->entry_size);
+	if (ioq->q == NULL)
+		return false;
+	fstrm__iothr_queue_set_size(iothr, ioq, iothr->opt.input_queue_size);
+
+	/* Publish the input queue to the I/O thread. */
+	atomic_store_explicit(&ioq->claimed, true, memory_order_release);
+	return true;
+}
+
+/*
+ * With input_queue_max_bytes, an input queue's 'q' may be replaced while no
+ * other thread is using it. The I/O thread and
+ * fstrm_iothr_get_queue_occupancy() bracket their use of it with
+ * fstrm__iothr_queue_try_enter() and fstrm__iothr_queue_leave(), skipping or
+ * retrying the input queue while it is being resized.
+ *
+ * Under FSTRM_IOTHR_QUEUE_MODEL_MPSC, producers bracket their use of it with
+ * fstrm__iothr_queue_enter() and fstrm__iothr_queue_exit(), waiting for a
+ * resize in progress to finish. Under FSTRM_IOTHR_QUEUE_MODEL_SPSC, the
+ * producer is the only thread which resizes its input queue, so it does not
+ * need to announce itself: entering only checks whether the I/O thread has
+ * asked for the input queue to be shrunk.
+ */
+static inline bool
+fstrm__iothr_queue_try_enter(struct fstrm_iothr *iothr,
+			     struct fstrm_iothr_queue *ioq)
+{
+	if (likely(!iothr->elastic))
+		return true;
+	if (atomic_fetch_add(&ioq->users, 1) & FSTRM__IOTHR_QUEUE_RESIZING) {
+		atomic_fetch_sub(&ioq->users, 1);
+		return false;
+	}
+	return true;
+}
+
+static inline void
+fstrm__iothr_queue_leave(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq)
+{
+	if (likely(!iothr->elastic))
+		return;
+	atomic_fetch_sub_explicit(&ioq->users, 1, memory_order_release);
+}
+
+/*
+ * Replace an input queue's 'q' with a queue of 'size' entries, moving the
+ * entries over in order. Called between fstrm__iothr_queue_enter() and
+ * fstrm__iothr_queue_exit(), or their I/O thread equivalents. Returns false,
+ * leaving the input queue as is, if another thread is using it, or if its
+ * entries would not fit.
+ *
+ * Under FSTRM_IOTHR_QUEUE_MODEL_SPSC, only the producer calls this, and waits
+ * for the other threads using the input queue instead, which only hold on to
+ * it to remove a batch of entries or to count them.
+ */
+static bool
+fstrm__iothr_queue_resize(struct fstrm_iothr *iothr,
+			  struct fstrm_iothr_queue *ioq, unsigned size)
+{
+	struct fstrm__iothr_queue_entry entry;
+	struct my_queue *q = NULL;
+	unsigned users = 1;
+
+	if (iothr->opt.queue_model == FSTRM_IOTHR_QUEUE_MODEL_SPSC) {
+		users = 0;
+		while (!atomic_compare_exchange_weak(&ioq->users, &users,
+				FSTRM__IOTHR_QUEUE_RESIZING))
+		{
+			users = 0;
+			cpu_relax();
+		}
+	} else if (!atomic_compare_exchange_strong(&ioq->users, &users,
+			1 | FSTRM__IOTHR_QUEUE_RESIZING))
+	{
+		return false;
+	}
+
+	if (iothr->queue_ops->count(ioq->q) < size - 1)
+		q = iothr->queue_ops->init(size, ioq->entry_size);
+	if (q != NULL) {
+		/* The new queue has room for all of the entries. */
+		while (iothr->queue_ops->remove(ioq->q, &entry, NULL))
+			(void)iothr->queue_ops->insert(q, &entry, NULL);
+		iothr->queue_ops->destroy(&ioq->q);
+		ioq->q = q;
+
+		if (ioq->size == iothr->opt.input_queue_size)
+			atomic_fetch_add(&iothr->num_grown, 1);
+		else if (size == iothr->opt.input_queue_size)
+			atomic_fetch_sub(&iothr->num_grown, 1);
+		fstrm__iothr_queue_set_size(iothr, ioq, size);
+	}
+
+	atomic_fetch_sub_explicit(&ioq->users, FSTRM__IOTHR_QUEUE_RESIZING,
+				  memory_order_release);
+	return q != NULL;
+}
+
+static inline void
+fstrm__iothr_queue_enter(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq)
+{
+	if (likely(!iothr->elastic))
+		return;
+	if (iothr->opt.queue_model == FSTRM_IOTHR_QUEUE_MODEL_SPSC) {
+		if (unlikely(atomic_load_explicit(&ioq->shrink,
+						  memory_order_relaxed)))
+		{
+			atomic_store_explicit(&ioq->shrink, false,
+					      memory_order_relaxed);
+			(void)fstrm__iothr_queue_resize(iothr, ioq,
+					iothr->opt.input_queue_size);
+		}
+		return;
+	}
+	while (atomic_fetch_add(&ioq->users, 1) & FSTRM__IOTHR_QUEUE_RESIZING) {
+		atomic_fetch_sub(&ioq->users, 1);
+		while (atomic_load_explicit(&ioq->users, memory_order_relaxed) &
+		       FSTRM__IOTHR_QUEUE_RESIZING)
+		{
+			cpu_relax();
+		}
+	}
+}
+
+static inline void
+fstrm__iothr_queue_exit(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq)
+{
+	if (likely(!iothr->elastic) ||
+	    iothr->opt.queue_model == FSTRM_IOTHR_QUEUE_MODEL_SPSC)
+	{
+		return;
+	}
+	atomic_fetch_sub_explicit(&ioq->users, 1, memory_order_release);
+}
+
+struct fstrm_iothr *
+fstrm_iothr_init(const struct fstrm_iothr_options *opt,
+		 struct fstrm_writer **writer)
+{
+	return fstrm__iothr_init(opt, writer, NULL);
+}
+
+struct fstrm_iothr *
+fstrm__iothr_init(const struct fstrm_iothr_options *opt,
+		  struct fstrm_writer **writer, const char *spool_suffix)
+{
+	struct fstrm_iothr *iothr = NULL;
+
+	int res;
+	pthread_condattr_t ca;
+
+	/* Initialize fstrm_iothr and copy options. */
+	iothr = my_calloc_aligned(64, 1, sizeof(*iothr));
+	if (opt == NULL)
+		opt = &default_fstrm_iothr_options;
+	memmove(&iothr->opt, opt, sizeof(iothr->opt));
+
+	/* The application drives the I/O work, so it can't share a reactor. */
+	if (iothr->opt.external_drive && iothr->opt.reactor != NULL)
+		goto fail;
+
+	if (iothr->opt.reopen_interval_max < iothr->opt.reopen_interval)
+		iothr->opt.reopen_interval_max = iothr->opt.reopen_interval;
+	iothr->reopen_delay = (uint64_t) iothr->opt.reopen_interval * 1000000;
+
+	/*
+	 * Set the queue implementation.
+	 *
+	 * SPSC queues use the C11 atomics ring buffer, which keeps the producer
+	 * and consumer indices on separate cache lines and is available on
+	 * every platform. MPSC queues use the lock-free MPMC queue, which
+	 * avoids serializing the producers on a mutex. So do SPSC queues with
+	 * FSTRM_IOTHR_DROP_POLICY_OLDEST, where the producer is also a
+	 * consumer.
+	 */
+	if (iothr->opt.queue_model == FSTRM_IOTHR_QUEUE_MODEL_SPSC &&
+	    iothr->opt.drop_policy != FSTRM_IOTHR_DROP_POLICY_OLDEST)
+		iothr->queue_ops = &my_queue_spsc_ops;
+	else
+		iothr->queue_ops = &my_queue_mpmc_ops;
+
+	/* Input queues without a registered callback have the largest entries. */
+	iothr->timestamps = iothr->opt.track_latency ||
+			    iothr->opt.flush_max_age != 0;
+	if (iothr->timestamps)
+		iothr->entry_size = sizeof(struct fstrm__iothr_queue_entry);
+	else
+		iothr->entry_size = offsetof(struct fstrm__iothr_queue_entry,
+					     u.cb.enqueued);
+
+	/*
+	 * With input_queue_max_bytes, the input queues may double in size up
+	 * to the largest power of 2 number of entries which fits in it.
+	 */
+	iothr->queue_size_max = iothr->opt.input_queue_size;
+	while (iothr->queue_size_max < FSTRM__IOTHR_QUEUE_SIZE_LIMIT &&
+	       (size_t) iothr->queue_size_max * 2 * iothr->entry_size <=
+	       iothr->opt.input_queue_max_bytes)
+	{
+		iothr->queue_size_max *= 2;
+	}
+	iothr->elastic = iothr->queue_size_max > iothr->opt.input_queue_size;
+	atomic_init(&iothr->num_grown, 0);
+
+#if HAVE_CLOCK_GETTIME
+	/* Detect best clocks. */
+	if (!fstrm__get_best_monotonic_clocks(&iothr->clkid_gettime,
+					      &iothr->clkid_pthread,
+					      NULL))
+	{
+		goto fail;
+	}
+#endif
+
+	/* Initialize the condition variables. */
+#if HAVE_CLOCK_GETTIME
+	fstrm__iothr_waker_init(&iothr->waker, iothr->clkid_pthread);
+#else
+	fstrm__iothr_waker_init(&iothr->waker);
+#endif
+	iothr->wake = &iothr->waker;
+	if (iothr->opt.external_drive &&
+	    !fstrm__iothr_waker_init_pipe(&iothr->waker))
+	{
+		goto fail_waker;
+	}
+
+	/*
+	 * Open the spool file. The copied options do not own the spool path,
+	 * so don't keep it around.
+	 */
+	if (iothr->opt.spool_path != NULL) {
+		if (spool_suffix != NULL) {
+			size_t len = strlen(iothr->opt.spool_path) +
+				strlen(spool_suffix) + 1;
+			char *path = my_malloc(len);
+
+			snprintf(path, len, "%s%s", iothr->opt.spool_path,
+				 spool_suffix);
+			iothr->spool = fstrm__spool_init(path,
+							 iothr->opt.spool_size);
+			my_free(path);
+		} else {
+			iothr->spool = fstrm__spool_init(iothr->opt.spool_path,
+							 iothr->opt.spool_size);
+		}
+		iothr->opt.spool_path = NULL;
+		if (iothr->spool == NULL)
+			goto fail_waker;
+		iothr->spool_pending = !fstrm__spool_empty(iothr->spool);
+	}
+
+	/*
+	 * Initialize the input queues. Their storage is allocated by
+	 * fstrm__iothr_queue_claim().
+	 */
+	iothr->queues = my_calloc_aligned(64, iothr->opt.num_input_queues,
+					  sizeof(struct fstrm_iothr_queue));
+	for (size_t i = 0; i < iothr->opt.num_input_queues; i++) {
+		res = pthread_mutex_init(&iothr->queues[i].ring_lock, NULL);
+		assert(res == 0);
+		atomic_init(&iothr->queues[i].users, 0);
+		atomic_init(&iothr->queues[i].grow, false);
+		atomic_init(&iothr->queues[i].shrink, false);
+		atomic_init(&iothr->queues[i].claimed, false);
+	}
+
+	/* Initialize the output queues. */
+	fstrm__iothr_outq_init(iothr, &iothr->outqs[0]);
+	if (iothr->opt.pipeline_writes)
+		fstrm__iothr_outq_init(iothr, &iothr->outqs[1]);
+	iothr->outq = &iothr->outqs[0];
+	iothr->batch_entries = my_calloc(iothr->opt.output_queue_size,
+					 sizeof(struct fstrm__iothr_queue_entry));
+
+	res = pthread_condattr_init(&ca);
+	assert(res == 0);
+
+#if HAVE_CLOCK_GETTIME && HAVE_PTHREAD_CONDATTR_SETCLOCK
+	res = pthread_condattr_setclock(&ca, iothr->clkid_pthread);
+	assert(res == 0);
+#endif
+
+	res = pthread_cond_init(&iothr->space_cv, &ca);
+	assert(res == 0);
 
 	res = pthread_condattr_destroy(&ca);
 	assert(res == 0);
 
-	/* Initialize the mutex protecting the condition variable. */
-	res = pthread_mutex_init(&iothr->cv_lock, NULL);
+	/* Initialize the mutex protecting the producers' condition variable. */
+	res = pthread_mutex_init(&iothr->space_lock, NULL);
 	assert(res == 0);
 
 	/* Initialize the mutex protecting fstrm_iothr_get_queue(). */
 	res = pthread_mutex_init(&iothr->get_queue_lock, NULL);
 	assert(res == 0);
 
+	/* Initialize the writer thread's condition variable and mutex. */
+	res = pthread_cond_init(&iothr->write_cv, NULL);
+	assert(res == 0);
+	res = pthread_mutex_init(&iothr->write_lock, NULL);
+	assert(res == 0);
+
+	/* Initialize the mutex protecting direct writes by producers. */
+	res = pthread_mutex_init(&iothr->direct_lock, NULL);
+	assert(res == 0);
+
 	/* Take the caller's writer. */
 	iothr->writer = *writer;
 	*writer = NULL;
 
-	/* Start the I/O thread. */
-	res = pthread_create(&iothr->thr, NULL, fstrm__iothr_thr, iothr);
-	assert(res == 0);
+	/*
+	 * With external_drive, the writer is opened on the application's
+	 * thread, see fstrm_iothr_run_once(), so keep that short.
+	 */
+	if (iothr->opt.external_drive) {
+		fstrm__writer_limit_timeouts(iothr->writer,
+			FSTRM_IOTHR_EXTERNAL_DRIVE_TIMEOUT_MAX);
+	}
 
-	return iothr;
-fail:
-	fstrm_iothr_destroy(&iothr);
-	return NULL;
-}
+	/* Start the writer thread. */
+	if (iothr->opt.pipeline_writes) {
+		res = pthread_create(&iothr->write_thr, NULL,
+				     fstrm__iothr_write_thr, iothr);
+		assert(res == 0);
+		iothr->write_thr_started = true;
+	}
 
-static inline void
-fstrm__iothr_queue_entry_free_bytes(struct fstrm__iothr_queue_entry *entry)
+	iothr->reopen_seq = fstrm__iothr_now_us(iothr) ^ (uintptr_t) iothr;
+	iothr->first_open = true;
+
+	/*
+	 * Start the I/O thread, or attach to the reactor thread. With
+	 * external_drive, the application drives the I/O work with
+	 * fstrm_iothr_run_once() instead.
+	 */
+	if (iothr->opt.reactor != NULL) {
+		struct fstrm_iothr_reactor *reactor = iothr->opt.reactor;
+
+		/*
+		 * Start opening the writer before the reactor thread can see
+		 * the object, so that it never drains the input queues of one
+		 * whose writer has not been tried yet.
+		 */
+		iothr->wake = &reactor->waker;
+		fstrm__iothr_maybe_open(iothr);
+		pthread_mutex_lock(&reactor->waker.lock);
+		iothr->reactor_next = reactor->iothrs;
+		reactor->iothrs = iothr;
+		iothr->reactor = reactor;
+		pthread_mutex_unlock(&reactor->waker.lock);
+		fstrm__iothr_wake(iothr);
+	} else if (!iothr->opt.external_drive) {
+		res = pthread_create(&iothr->thr, NULL, fstrm__iothr_thr, iothr);
+		assert(res == 0);
+		iothr->thr_started = true;
+	}
+
+	return iothr;
+fail_waker:
+	fstrm__iothr_waker_destroy(&iothr->waker);
+fail:
+	my_free(iothr);
+	return NULL;
+}
+
+/*
+ * Look up the deallocation callback of an entry removed from 'ioq', and
+ * dispose of its box, if any.
+ */
+static inline void
+fstrm__iothr_queue_entry_resolve(struct fstrm_iothr_queue *ioq,
+				 const struct fstrm__iothr_queue_entry *entry,
+				 struct fstrm__iothr_outq_entry *out)
+{
+	if (likely(entry->kind == fstrm__iothr_entry_plain)) {
+		if (ioq->free_registered)
+			out->free = ioq->free;
+		else
+			out->free = entry->u.cb.free;
+		out->data = entry->data;
+	} else if (entry->kind == fstrm__iothr_entry_ring) {
+		out->free.free_func = fstrm__iothr_ring_release;
+		out->free.free_data = ioq->ring;
+		out->data = entry->data;
+	} else {
+		struct fstrm__iothr_box *box = entry->data;
+		out->free = box->free;
+		out->data = box->data;
+		my_free(box);
+	}
+}
+
+static inline void
+fstrm__iothr_queue_entry_free_bytes(struct fstrm__iothr_outq_entry *entry)
+{
+	if (entry->free.free_func != NULL)
+		entry->free.free_func(entry->data, entry->free.free_data);
+}
+
+static void
+fstrm__iothr_free_queues(struct fstrm_iothr *iothr)
+{
+	size_t i;
+	for (i = 0; i < iothr->opt.num_input_queues; i++) {
+		struct my_queue *queue;
+		struct fstrm__iothr_queue_entry entry;
+		struct fstrm__iothr_outq_entry out;
+
+		queue = iothr->queues[i].q;
+		while (queue != NULL &&
+		       iothr->queue_ops->remove(queue, &entry, NULL))
+		{
+			fstrm__iothr_queue_entry_resolve(&iothr->queues[i],
+							 &entry, &out);
+			fstrm__iothr_queue_entry_free_bytes(&out);
+		}
+		if (queue != NULL)
+			iothr->queue_ops->destroy(&queue);
+
+		if (iothr->queues[i].ring != NULL) {
+			my_free(iothr->queues[i].ring->buf);
+			my_free(iothr->queues[i].ring);
+		}
+		pthread_mutex_destroy(&iothr->queues[i].ring_lock);
+	}
+	my_free(iothr->queues);
+}
+
+void
+fstrm_iothr_destroy(struct fstrm_iothr **iothr)
+{
+	if (*iothr != NULL) {
+		/*
+		 * Signal the I/O thread that a shutdown is in progress.
+		 * This waits for the I/O thread to finish.
+		 */
+		(*iothr)->shutting_down = true;
+		if ((*iothr)->wake != NULL)
+			fstrm__iothr_wake(*iothr);
+
+		/*
+		 * Producers sleeping in fstrm_iothr_submit_wait() give up once
+		 * they see 'shutting_down'. Wait for them to leave, as they
+		 * still use the object.
+		 */
+		pthread_mutex_lock(&(*iothr)->space_lock);
+		pthread_cond_broadcast(&(*iothr)->space_cv);
+		while (atomic_load(&(*iothr)->space_waiters) != 0)
+			pthread_cond_wait(&(*iothr)->space_cv,
+					  &(*iothr)->space_lock);
+		pthread_mutex_unlock(&(*iothr)->space_lock);
+
+		if ((*iothr)->thr_started)
+			pthread_join((*iothr)->thr, NULL);
+
+		/*
+		 * With external_drive, the caller is the thread doing the I/O
+		 * work.
+		 */
+		if ((*iothr)->opt.external_drive && (*iothr)->writer != NULL)
+			fstrm__iothr_shutdown(*iothr);
+
+		/* Likewise, wait for the reactor thread to detach us. */
+		if ((*iothr)->reactor != NULL) {
+			struct fstrm_iothr_reactor *reactor = (*iothr)->reactor;
+
+			pthread_mutex_lock(&reactor->waker.lock);
+			while (!(*iothr)->detached)
+				pthread_cond_wait(&reactor->detach_cv,
+						  &reactor->waker.lock);
+			pthread_mutex_unlock(&reactor->waker.lock);
+		}
+
+		/*
+		 * The I/O thread has waited for the writer thread to finish
+		 * its last write. Stop it.
+		 */
+		if ((*iothr)->write_thr_started) {
+			pthread_mutex_lock(&(*iothr)->write_lock);
+			(*iothr)->write_stop = true;
+			pthread_cond_broadcast(&(*iothr)->write_cv);
+			pthread_mutex_unlock(&(*iothr)->write_lock);
+			pthread_join((*iothr)->write_thr, NULL);
+		}
+		fstrm__iothr_waker_destroy(&(*iothr)->waker);
+		pthread_cond_destroy(&(*iothr)->space_cv);
+		pthread_mutex_destroy(&(*iothr)->space_lock);
+		pthread_mutex_destroy(&(*iothr)->get_queue_lock);
+		pthread_cond_destroy(&(*iothr)->write_cv);
+		pthread_mutex_destroy(&(*iothr)->write_lock);
+		pthread_mutex_destroy(&(*iothr)->direct_lock);
+
+		/* Destroy the writer by calling its 'destroy' method. */
+		(void)fstrm_writer_destroy(&(*iothr)->writer);
+
+		/* Remove the spool file, unless it still holds data frames. */
+		fstrm__spool_destroy(&(*iothr)->spool);
+
+		/* Cleanup our allocations. */
+		fstrm__iothr_free_queues(*iothr);
+		fstrm__iothr_outq_destroy(&(*iothr)->outqs[0]);
+		fstrm__iothr_outq_destroy(&(*iothr)->outqs[1]);
+		my_free((*iothr)->batch_entries);
+		my_free(*iothr);
+	}
+}
+
+static struct fstrm_iothr_queue *
+fstrm__iothr_get_input_queue(struct fstrm_iothr *iothr,
+			     const struct fstrm__iothr_free *free)
+{
+	struct fstrm_iothr_queue *q = NULL;
+
+	pthread_mutex_lock(&iothr->get_queue_lock);
+	if (iothr->get_queue_idx < iothr->opt.num_input_queues &&
+	    fstrm__iothr_queue_claim(iothr, &iothr->queues[iothr->get_queue_idx],
+				     free))
+	{
+		q = &iothr->queues[iothr->get_queue_idx];
+		iothr->get_queue_idx++;
+	}
+	pthread_mutex_unlock(&iothr->get_queue_lock);
+
+	return q;
+}
+
+struct fstrm_iothr_queue *
+fstrm_iothr_get_input_queue(struct fstrm_iothr *iothr)
+{
+	return fstrm__iothr_get_input_queue(iothr, NULL);
+}
+
+struct fstrm_iothr_queue *
+fstrm_iothr_get_input_queue_free(struct fstrm_iothr *iothr,
+				 void (*free_func)(void *, void *),
+				 void *free_data)
+{
+	const struct fstrm__iothr_free free = {
+		.free_func = free_func,
+		.free_data = free_data,
+	};
+
+	return fstrm__iothr_get_input_queue(iothr, &free);
+}
+
+struct fstrm_iothr_queue *
+fstrm_iothr_get_input_queue_idx(struct fstrm_iothr *iothr, size_t idx)
+{
+	struct fstrm_iothr_queue *q = NULL;
+
+	pthread_mutex_lock(&iothr->get_queue_lock);
+	if (idx < iothr->opt.num_input_queues &&
+	    fstrm__iothr_queue_claim(iothr, &iothr->queues[idx], NULL))
+	{
+		q = &iothr->queues[idx];
+	}
+	pthread_mutex_unlock(&iothr->get_queue_lock);
+
+	return q;
+}
+
+void
+fstrm_free_wrapper(void *data,
+		   void *free_data __attribute__((__unused__)))
+{
+	free(data);
+}
+
+#define FSTRM__IOTHR_STAT(s, field) \
+	atomic_load_explicit(&(s)->field, memory_order_relaxed)
+
+/*
+ * Copy the statistics in 'src', of the size known to the library, to the
+ * caller's 'dst' of 'size' bytes, see fstrm_iothr_get_stats(). Returns the
+ * number of bytes filled in.
+ */
+static size_t
+fstrm__iothr_copy_stats(void *dst, size_t size, const void *src, size_t len)
+{
+	if (len > size)
+		len = size;
+	memcpy(dst, src, len);
+	memset((uint8_t *) dst + len, 0, size - len);
+	return len;
+}
+
+static void
+fstrm__iothr_get_queue_stats(struct fstrm_iothr_queue *ioq,
+			     struct fstrm_iothr_queue_stats *stats)
+{
+	stats->frames_submitted = FSTRM__IOTHR_STAT(&ioq->stats, frames_submitted);
+	stats->bytes_submitted = FSTRM__IOTHR_STAT(&ioq->stats, bytes_submitted);
+	stats->frames_rejected_full = FSTRM__IOTHR_STAT(&ioq->stats, frames_rejected_full);
+	stats->bytes_rejected_full = FSTRM__IOTHR_STAT(&ioq->stats, bytes_rejected_full);
+	stats->frames_rejected_budget = FSTRM__IOTHR_STAT(&ioq->stats, frames_rejected_budget);
+	stats->bytes_rejected_budget = FSTRM__IOTHR_STAT(&ioq->stats, bytes_rejected_budget);
+	stats->frames_dropped_oldest = FSTRM__IOTHR_STAT(&ioq->stats, frames_dropped_oldest);
+	stats->bytes_dropped_oldest = FSTRM__IOTHR_STAT(&ioq->stats, bytes_dropped_oldest);
+	stats->frames_dropped_sampled = FSTRM__IOTHR_STAT(&ioq->stats, frames_dropped_sampled);
+	stats->bytes_dropped_sampled = FSTRM__IOTHR_STAT(&ioq->stats, bytes_dropped_sampled);
+	stats->queue_depth_hwm = FSTRM__IOTHR_STAT(&ioq->stats, queue_depth_hwm);
+}
+
+size_t
+fstrm_iothr_get_queue_stats(struct fstrm_iothr *iothr __attribute__((__unused__)),
+			    struct fstrm_iothr_queue *ioq,
+			    struct fstrm_iothr_queue_stats *stats, size_t size)
+{
+	struct fstrm_iothr_queue_stats qs;
+
+	fstrm__iothr_get_queue_stats(ioq, &qs);
+	return fstrm__iothr_copy_stats(stats, size, &qs, sizeof(qs));
+}
+
+void
+fstrm_iothr_get_queue_occupancy(struct fstrm_iothr *iothr,
+				struct fstrm_iothr_queue *ioq,
+				unsigned *depth, unsigned *capacity)
+{
+	while (!fstrm__iothr_queue_try_enter(iothr, ioq))
+		cpu_relax();
+	*depth = iothr->queue_ops->count(ioq->q);
+	if (capacity != NULL)
+		*capacity = ioq->size;
+	fstrm__iothr_queue_leave(iothr, ioq);
+}
+
+static void
+fstrm__iothr_get_stats(struct fstrm_iothr *iothr, struct fstrm_iothr_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	for (unsigned i = 0; i < iothr->opt.num_input_queues; i++) {
+		struct fstrm_iothr_queue_stats qs;
+
+		fstrm__iothr_get_queue_stats(&iothr->queues[i], &qs);
+		stats->frames_submitted += qs.frames_submitted;
+		stats->bytes_submitted += qs.bytes_submitted;
+		stats->frames_rejected_full += qs.frames_rejected_full;
+		stats->bytes_rejected_full += qs.bytes_rejected_full;
+		stats->frames_rejected_budget += qs.frames_rejected_budget;
+		stats->bytes_rejected_budget += qs.bytes_rejected_budget;
+		stats->frames_dropped_oldest += qs.frames_dropped_oldest;
+		stats->bytes_dropped_oldest += qs.bytes_dropped_oldest;
+		stats->frames_dropped_sampled += qs.frames_dropped_sampled;
+		stats->bytes_dropped_sampled += qs.bytes_dropped_sampled;
+		if (qs.queue_depth_hwm > stats->queue_depth_hwm)
+			stats->queue_depth_hwm = qs.queue_depth_hwm;
+	}
+
+	stats->frames_written = FSTRM__IOTHR_STAT(&iothr->stats, frames_written);
+	stats->bytes_written = FSTRM__IOTHR_STAT(&iothr->stats, bytes_written);
+	stats->frames_written_direct = FSTRM__IOTHR_STAT(&iothr->stats, frames_written_direct);
+	stats->frames_dropped_closed = FSTRM__IOTHR_STAT(&iothr->stats, frames_dropped_closed);
+	stats->bytes_dropped_closed = FSTRM__IOTHR_STAT(&iothr->stats, bytes_dropped_closed);
+	stats->frames_dropped_write_error = FSTRM__IOTHR_STAT(&iothr->stats, frames_dropped_write_error);
+	stats->bytes_dropped_write_error = FSTRM__IOTHR_STAT(&iothr->stats, bytes_dropped_write_error);
+	stats->frames_spooled = FSTRM__IOTHR_STAT(&iothr->stats, frames_spooled);
+	stats->bytes_spooled = FSTRM__IOTHR_STAT(&iothr->stats, bytes_spooled);
+	stats->frames_dropped_spool_full = FSTRM__IOTHR_STAT(&iothr->stats, frames_dropped_spool_full);
+	stats->bytes_dropped_spool_full = FSTRM__IOTHR_STAT(&iothr->stats, bytes_dropped_spool_full);
+	stats->writev_calls = FSTRM__IOTHR_STAT(&iothr->stats, writev_calls);
+	stats->flushes_queue_full = FSTRM__IOTHR_STAT(&iothr->stats, flushes_queue_full);
+	stats->flushes_buffer_hint = FSTRM__IOTHR_STAT(&iothr->stats, flushes_buffer_hint);
+	stats->flushes_timeout = FSTRM__IOTHR_STAT(&iothr->stats, flushes_timeout);
+	stats->flushes_idle = FSTRM__IOTHR_STAT(&iothr->stats, flushes_idle);
+	stats->open_attempts = FSTRM__IOTHR_STAT(&iothr->stats, open_attempts);
+	stats->open_failures = FSTRM__IOTHR_STAT(&iothr->stats, open_failures);
+	stats->bytes_queued = FSTRM__IOTHR_STAT(iothr, queued_bytes);
+	stats->bytes_queued_hwm = FSTRM__IOTHR_STAT(iothr, queued_bytes_hwm);
+	stats->frames_dropped_spool_error = FSTRM__IOTHR_STAT(&iothr->stats, frames_dropped_spool_error);
+	stats->bytes_dropped_spool_error = FSTRM__IOTHR_STAT(&iothr->stats, bytes_dropped_spool_error);
+}
+
+size_t
+fstrm_iothr_get_stats(struct fstrm_iothr *iothr, struct fstrm_iothr_stats *stats,
+		      size_t size)
+{
+	struct fstrm_iothr_stats st;
+
+	fstrm__iothr_get_stats(iothr, &st);
+	return fstrm__iothr_copy_stats(stats, size, &st, sizeof(st));
+}
+
+fstrm_res
+fstrm_iothr_get_latency(struct fstrm_iothr *iothr,
+			struct fstrm_iothr_latency *latency)
+{
+	if (!iothr->opt.track_latency)
+		return fstrm_res_failure;
+
+	latency->count = FSTRM__IOTHR_STAT(&iothr->latency, count);
+	latency->sum_us = FSTRM__IOTHR_STAT(&iothr->latency, sum_us);
+	latency->max_us = FSTRM__IOTHR_STAT(&iothr->latency, max_us);
+	for (unsigned i = 0; i < FSTRM_IOTHR_LATENCY_BUCKETS; i++)
+		latency->buckets[i] = FSTRM__IOTHR_STAT(&iothr->latency, buckets[i]);
+	return fstrm_res_success;
+}
+
+/*
+ * Wake the I/O thread if it is parked, after inserting into input queue 'ioq',
+ * leaving 'space' free entries. If 'ioq' is NULL, the I/O thread is woken
+ * regardless of the wait strategy.
+ */
+static inline void
+fstrm__iothr_maybe_wake(struct fstrm_iothr *iothr,
+			const struct fstrm_iothr_queue *ioq, unsigned space)
+{
+	/*
+	 * On the timed wait strategy, the I/O thread wakes up on its own every
+	 * flush_timeout seconds, so don't bother it until the queue is filling
+	 * up.
+	 */
+	if (iothr->opt.wait_strategy == FSTRM_IOTHR_WAIT_STRATEGY_TIMED &&
+	    ioq != NULL && space > ioq->notify_space)
+	{
+		if (likely(iothr->opt.flush_max_age == 0))
+			return;
+
+		/* Unless it has stopped doing so, see 'idle'. */
+		atomic_thread_fence(memory_order_seq_cst);
+		if (likely(!atomic_load_explicit(&iothr->idle, memory_order_relaxed)))
+			return;
+	}
+
+	/*
+	 * Order the preceding queue insert before the load of 'parked'. This
+	 * pairs with the fence in fstrm__iothr_park(): either the I/O thread
+	 * sees our entry when it re-checks the input queues, or we see that it
+	 * has parked.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (likely(!atomic_load_explicit(&iothr->wake->parked, memory_order_relaxed)))
+		return;
+	if (!atomic_exchange(&iothr->wake->parked, false))
+		return;
+
+	fstrm__iothr_waker_signal(iothr->wake);
+}
+
+/* Add to a counter which only the calling thread writes. */
+static inline void
+fstrm__iothr_stat_add(_Atomic uint64_t *ctr, uint64_t n)
+{
+	atomic_store_explicit(ctr,
+		atomic_load_explicit(ctr, memory_order_relaxed) + n,
+		memory_order_relaxed);
+}
+
+/* Add to an input queue counter, which several producers may share. */
+static inline void
+fstrm__iothr_queue_stat_add(struct fstrm_iothr *iothr, _Atomic uint64_t *ctr,
+			    uint64_t n)
+{
+	if (iothr->opt.queue_model == FSTRM_IOTHR_QUEUE_MODEL_MPSC)
+		atomic_fetch_add_explicit(ctr, n, memory_order_relaxed);
+	else
+		fstrm__iothr_stat_add(ctr, n);
+}
+
+static inline void
+fstrm__iothr_queue_stat_submitted(struct fstrm_iothr *iothr,
+				  struct fstrm_iothr_queue *ioq,
+				  uint64_t frames, uint64_t bytes)
+{
+	fstrm__iothr_queue_stat_add(iothr, &ioq->stats.frames_submitted, frames);
+	fstrm__iothr_queue_stat_add(iothr, &ioq->stats.bytes_submitted, bytes);
+}
+
+/*
+ * The 'space' argument to pass to the input queue insert functions. Only the
+ * timed wait strategy needs to know how full input queue 'ioq' is, see
+ * fstrm__iothr_maybe_wake(), and then only whether the free space has dropped
+ * to 'notify_space'. Pass that as the threshold, so that the producer only
+ * reloads the consumer's index of the queue when it may have.
+ */
+static inline unsigned *
+fstrm__iothr_space(const struct fstrm_iothr *iothr,
+		   const struct fstrm_iothr_queue *ioq, unsigned *space)
+{
+	if (iothr->opt.wait_strategy != FSTRM_IOTHR_WAIT_STRATEGY_TIMED)
+		return NULL;
+	*space = ioq->notify_space;
+	return space;
+}
+
+static inline void
+fstrm__iothr_queue_stat_rejected(struct fstrm_iothr *iothr,
+				 struct fstrm_iothr_queue *ioq,
+				 uint64_t frames, uint64_t bytes)
+{
+	fstrm__iothr_queue_stat_add(iothr, &ioq->stats.frames_rejected_full, frames);
+	fstrm__iothr_queue_stat_add(iothr, &ioq->stats.bytes_rejected_full, bytes);
+}
+
+static inline void
+fstrm__iothr_queue_stat_rejected_budget(struct fstrm_iothr *iothr,
+					struct fstrm_iothr_queue *ioq,
+					uint64_t frames, uint64_t bytes)
+{
+	fstrm__iothr_queue_stat_add(iothr, &ioq->stats.frames_rejected_budget, frames);
+	fstrm__iothr_queue_stat_add(iothr, &ioq->stats.bytes_rejected_budget, bytes);
+}
+
+/*
+ * With queued_bytes_max, account for 'len' more queued payload bytes. Returns
+ * false, leaving the count unchanged, if that would exceed queued_bytes_max,
+ * unless no other payload bytes are queued.
+ */
+static inline bool
+fstrm__iothr_charge(struct fstrm_iothr *iothr, uint64_t len)
+{
+	uint64_t queued, hwm;
+
+	queued = atomic_fetch_add_explicit(&iothr->queued_bytes, len,
+					   memory_order_relaxed) + len;
+	if (unlikely(queued > iothr->opt.queued_bytes_max) && queued != len) {
+		atomic_fetch_sub_explicit(&iothr->queued_bytes, len,
+					  memory_order_relaxed);
+		return false;
+	}
+
+	hwm = atomic_load_explicit(&iothr->queued_bytes_hwm, memory_order_relaxed);
+	while (unlikely(queued > hwm)) {
+		if (atomic_compare_exchange_weak_explicit(&iothr->queued_bytes_hwm,
+							  &hwm, queued,
+							  memory_order_relaxed,
+							  memory_order_relaxed))
+		{
+			break;
+		}
+	}
+	return true;
+}
+
+/* With queued_bytes_max, account for 'len' queued payload bytes released. */
+static inline void
+fstrm__iothr_uncharge(struct fstrm_iothr *iothr, uint64_t len)
+{
+	if (unlikely(iothr->opt.queued_bytes_max != 0))
+		atomic_fetch_sub_explicit(&iothr->queued_bytes, len,
+					  memory_order_relaxed);
+}
+
+/* Current time on the monotonic clock, in microseconds. */
+static inline uint64_t
+fstrm__iothr_now_us(struct fstrm_iothr *iothr)
+{
+	struct timespec ts;
+
+#if HAVE_CLOCK_GETTIME
+	int rv = clock_gettime(iothr->clkid_gettime, &ts);
+	assert(rv == 0);
+#else
+	(void)iothr;
+	my_gettime(-1, &ts);
+#endif
+	return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/* Entry 'i' of an array of entries laid out with the stride of input queue 'ioq'. */
+static inline struct fstrm__iothr_queue_entry *
+fstrm__iothr_entry_at(const struct fstrm_iothr_queue *ioq,
+		      struct fstrm__iothr_queue_entry *entries, unsigned i)
+{
+	return (struct fstrm__iothr_queue_entry *)
+		((uint8_t *) entries + i * ioq->entry_size);
+}
+
+/* The submission time of an entry of input queue 'ioq', see 'timestamps'. */
+static inline uint64_t *
+fstrm__iothr_entry_enqueued(const struct fstrm_iothr_queue *ioq,
+			    struct fstrm__iothr_queue_entry *entry)
+{
+	if (ioq->free_registered)
+		return &entry->u.reg.enqueued;
+	return &entry->u.cb.enqueued;
+}
+
+static inline void
+fstrm__iothr_queue_entry_init(struct fstrm_iothr_queue *ioq,
+			      struct fstrm__iothr_queue_entry *entry,
+			      void *data, size_t len,
+			      void (*free_func)(void *, void *), void *free_data)
+{
+	const struct fstrm__iothr_free free = {
+		.free_func = free_func,
+		.free_data = free_data,
+	};
+
+	entry->data = data;
+	entry->len_data = (uint32_t) len;
+	entry->kind = fstrm__iothr_entry_plain;
+	entry->iovcnt = 0;
+	if (!ioq->free_registered) {
+		entry->u.cb.free = free;
+	} else if (unlikely(free_func != ioq->free.free_func ||
+			    free_data != ioq->free.free_data))
+	{
+		struct fstrm__iothr_box *box = my_malloc(sizeof(*box));
+		box->free = free;
+		box->data = data;
+		entry->data = box;
+		entry->kind = fstrm__iothr_entry_boxed;
+	}
+}
+
+/* Undo fstrm__iothr_queue_entry_init() for an entry that was not inserted. */
+static inline void
+fstrm__iothr_queue_entry_discard(struct fstrm__iothr_queue_entry *entry)
+{
+	if (unlikely(entry->kind == fstrm__iothr_entry_boxed))
+		my_free(entry->data);
+}
+
+/*
+ * Discard the entry at the head of an input queue under
+ * FSTRM_IOTHR_DROP_POLICY_OLDEST. Returns false if the input queue is empty.
+ */
+static bool
+fstrm__iothr_drop_oldest(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq)
+{
+	struct fstrm__iothr_queue_entry old;
+	struct fstrm__iothr_outq_entry out;
+
+	if (!iothr->queue_ops->remove(ioq->q, &old, NULL))
+		return false;
+	fstrm__iothr_queue_stat_add(iothr, &ioq->stats.frames_dropped_oldest, 1);
+	fstrm__iothr_queue_stat_add(iothr, &ioq->stats.bytes_dropped_oldest,
+				    old.len_data);
+	fstrm__iothr_uncharge(iothr, old.len_data);
+	fstrm__iothr_queue_entry_resolve(ioq, &old, &out);
+	fstrm__iothr_queue_entry_free_bytes(&out);
+	return true;
+}
+
+/*
+ * Insert an entry into a full input queue under FSTRM_IOTHR_DROP_POLICY_OLDEST,
+ * discarding entries from the head of the queue until it fits.
+ */
+static bool
+fstrm__iothr_insert_drop_oldest(struct fstrm_iothr *iothr,
+				struct fstrm_iothr_queue *ioq,
+				struct fstrm__iothr_queue_entry *entry,
+				unsigned *space)
+{
+	do {
+		(void)fstrm__iothr_drop_oldest(iothr, ioq);
+	} while (!iothr->queue_ops->insert(ioq->q, entry, space));
+	return true;
+}
+
+/*
+ * With queued_bytes_max, account for a data frame of 'len' bytes about to be
+ * inserted into an input queue. Under FSTRM_IOTHR_DROP_POLICY_OLDEST, entries
+ * are discarded from the head of the input queue to make room for it. Returns
+ * false, after waking the I/O thread, if the data frame must be rejected.
+ */
+static bool
+fstrm__iothr_queue_charge(struct fstrm_iothr *iothr,
+			  struct fstrm_iothr_queue *ioq, uint64_t len)
+{
+	while (!fstrm__iothr_charge(iothr, len)) {
+		if (iothr->opt.drop_policy != FSTRM_IOTHR_DROP_POLICY_OLDEST ||
+		    !fstrm__iothr_drop_oldest(iothr, ioq))
+		{
+			/*
+			 * The input queues may have plenty of room, so make
+			 * sure the I/O thread is not parked on the timed wait
+			 * strategy while it holds the queued payload bytes.
+			 */
+			fstrm__iothr_maybe_wake(iothr, NULL, 0);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Called by a producer which found its input queue full, or filling up under
+ * FSTRM_IOTHR_DROP_POLICY_SAMPLE. Double the size of the input queue, up to
+ * input_queue_max_bytes. Under FSTRM_IOTHR_QUEUE_MODEL_MPSC, if another thread
+ * is using the input queue, leave that to the I/O thread instead. Returns true
+ * if the input queue has grown.
+ */
+static bool
+fstrm__iothr_queue_grow(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq)
+{
+	if (ioq->size >= iothr->queue_size_max)
+		return false;
+	if (fstrm__iothr_queue_resize(iothr, ioq, ioq->size * 2))
+		return true;
+	if (iothr->opt.queue_model == FSTRM_IOTHR_QUEUE_MODEL_MPSC) {
+		atomic_store_explicit(&ioq->grow, true, memory_order_relaxed);
+		fstrm__iothr_maybe_wake(iothr, NULL, 0);
+	}
+	return false;
+}
+
+/*
+ * Insert an entry into an input queue, growing it or applying the drop policy
+ * if it is full.
+ */
+static inline bool
+fstrm__iothr_insert(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+		    struct fstrm__iothr_queue_entry *entry, unsigned *space)
+{
+	if (likely(iothr->queue_ops->insert(ioq->q, entry, space)))
+		return true;
+	if (unlikely(iothr->elastic) && fstrm__iothr_queue_grow(iothr, ioq) &&
+	    iothr->queue_ops->insert(ioq->q, entry,
+				     fstrm__iothr_space(iothr, ioq, space)))
+	{
+		return true;
+	}
+	if (iothr->opt.drop_policy == FSTRM_IOTHR_DROP_POLICY_OLDEST)
+		return fstrm__iothr_insert_drop_oldest(iothr, ioq, entry, space);
+	return false;
+}
+
+/* splitmix64 finalizer, used to derive pseudo-random numbers. */
+static inline uint64_t
+fstrm__iothr_splitmix64(uint64_t x)
+{
+	x = (x + 1) * UINT64_C(0x9e3779b97f4a7c15);
+	x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return x ^ (x >> 31);
+}
+
+/*
+ * Decide whether to discard a data frame under FSTRM_IOTHR_DROP_POLICY_SAMPLE.
+ * Above 'sample_depth', the drop probability rises linearly with the depth of
+ * the input queue, reaching 1 when it is full. With input_queue_max_bytes, the
+ * input queue is grown instead, as long as it can be.
+ */
+static bool
+fstrm__iothr_sample_drop(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq)
+{
+	unsigned depth = iothr->queue_ops->count(ioq->q);
+	unsigned size = ioq->size;
+	uint64_t x;
+
+	if (likely(depth <= ioq->sample_depth))
+		return false;
+	if (unlikely(iothr->elastic) && fstrm__iothr_queue_grow(iothr, ioq))
+		return false;
+	if (depth >= size)
+		return true;
+
+	/* Hash of a per-queue sequence number. */
+	if (iothr->opt.queue_model == FSTRM_IOTHR_QUEUE_MODEL_MPSC) {
+		x = atomic_fetch_add_explicit(&ioq->stats.sample_seq, 1,
+					      memory_order_relaxed);
+	} else {
+		x = atomic_load_explicit(&ioq->stats.sample_seq, memory_order_relaxed);
+		atomic_store_explicit(&ioq->stats.sample_seq, x + 1,
+				      memory_order_relaxed);
+	}
+	x = fstrm__iothr_splitmix64(x);
+
+	return x % (size - ioq->sample_depth) >= size - depth;
+}
+
+/* Account for and dispose of a data frame discarded by the sampling policy. */
+static void
+fstrm__iothr_sample_discard(struct fstrm_iothr *iothr,
+			    struct fstrm_iothr_queue *ioq,
+			    void *data, size_t len,
+			    void (*free_func)(void *, void *), void *free_data)
+{
+	fstrm__iothr_queue_stat_add(iothr, &ioq->stats.frames_dropped_sampled, 1);
+	fstrm__iothr_queue_stat_add(iothr, &ioq->stats.bytes_dropped_sampled, len);
+	if (free_func != NULL)
+		free_func(data, free_data);
+}
+
+/*
+ * With direct_write, try to write a data frame to the writer from the calling
+ * producer thread, while the I/O thread is idle. This is only done if the
+ * producer's input queue is empty, so that its data frames stay in order, and
+ * never waits for another thread to finish writing. Returns false if the data
+ * frame must be queued instead.
+ */
+static bool
+fstrm__iothr_direct_write(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+			  const struct iovec *iov, unsigned iovcnt, size_t len,
+			  void *data,
+			  void (*free_func)(void *, void *), void *free_data)
+{
+	fstrm_res res;
+
+	if (!atomic_load_explicit(&iothr->direct_ok, memory_order_relaxed))
+		return false;
+	if (pthread_mutex_trylock(&iothr->direct_lock) != 0)
+		return false;
+	if (!atomic_load_explicit(&iothr->direct_ok, memory_order_relaxed) ||
+	    iothr->queue_ops->count(ioq->q) != 0)
+	{
+		pthread_mutex_unlock(&iothr->direct_lock);
+		return false;
+	}
+
+	fstrm__iothr_stat_add(&iothr->stats.writev_calls, 1);
+	res = fstrm__writer_writev_frames(iothr->writer, iov, &iovcnt, 1);
+	if (likely(res == fstrm_res_success)) {
+		fstrm__iothr_stat_add(&iothr->stats.frames_written, 1);
+		fstrm__iothr_stat_add(&iothr->stats.bytes_written, len);
+		fstrm__iothr_stat_add(&iothr->stats.frames_written_direct, 1);
+	} else {
+		fstrm__iothr_stat_add(&iothr->stats.frames_dropped_write_error, 1);
+		fstrm__iothr_stat_add(&iothr->stats.bytes_dropped_write_error, len);
+		atomic_store_explicit(&iothr->direct_ok, false, memory_order_relaxed);
+		iothr->direct_failed = true;
+	}
+	pthread_mutex_unlock(&iothr->direct_lock);
+
+	fstrm__iothr_queue_stat_add(iothr, &ioq->stats.frames_submitted, 1);
+	fstrm__iothr_queue_stat_add(iothr, &ioq->stats.bytes_submitted, len);
+	if (free_func != NULL)
+		free_func(data, free_data);
+
+	/* Have the I/O thread close the writer and reopen it. */
+	if (unlikely(res != fstrm_res_success))
+		fstrm__iothr_wake(iothr);
+	return true;
+}
+
+static fstrm_res
+fstrm__iothr_submit(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+		    void *data, size_t len,
+		    void (*free_func)(void *, void *), void *free_data)
+{
+	unsigned space = 0, *pspace = fstrm__iothr_space(iothr, ioq, &space);
+	struct fstrm__iothr_queue_entry entry;
+
+	if (unlikely(iothr->shutting_down))
+		return fstrm_res_failure;
+
+	if (unlikely(len < 1 || len >= UINT32_MAX || data == NULL))
+		return fstrm_res_invalid;
+
+	if (unlikely(iothr->opt.drop_policy == FSTRM_IOTHR_DROP_POLICY_SAMPLE) &&
+	    fstrm__iothr_sample_drop(iothr, ioq))
+	{
+		fstrm__iothr_sample_discard(iothr, ioq, data, len,
+					    free_func, free_data);
+		return fstrm_res_success;
+	}
+
+	if (unlikely(iothr->opt.direct_write)) {
+		const struct iovec iov = { .iov_base = data, .iov_len = len };
+
+		if (fstrm__iothr_direct_write(iothr, ioq, &iov, 1, len, data,
+					      free_func, free_data))
+		{
+			return fstrm_res_success;
+		}
+	}
+
+	if (unlikely(iothr->opt.queued_bytes_max != 0) &&
+	    !fstrm__iothr_queue_charge(iothr, ioq, len))
+	{
+		fstrm__iothr_queue_stat_rejected_budget(iothr, ioq, 1, len);
+		return fstrm_res_again;
+	}
+
+	fstrm__iothr_queue_entry_init(ioq, &entry, data, len,
+				      free_func, free_data);
+	if (unlikely(iothr->timestamps))
+		*fstrm__iothr_entry_enqueued(ioq, &entry) =
+			fstrm__iothr_now_us(iothr);
+
+	if (fstrm__iothr_insert(iothr, ioq, &entry, pspace)) {
+		fstrm__iothr_queue_stat_submitted(iothr, ioq, 1, len);
+		fstrm__iothr_maybe_wake(iothr, ioq, space);
+		return fstrm_res_success;
+	} else {
+		fstrm__iothr_queue_entry_discard(&entry);
+		fstrm__iothr_uncharge(iothr, len);
+		fstrm__iothr_queue_stat_rejected(iothr, ioq, 1, len);
+		return fstrm_res_again;
+	}
+}
+
+fstrm_res
+fstrm_iothr_submit(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+		   void *data, size_t len,
+		   void (*free_func)(void *, void *), void *free_data)
+{
+	fstrm_res res;
+
+	fstrm__iothr_queue_enter(iothr, ioq);
+	res = fstrm__iothr_submit(iothr, ioq, data, len, free_func, free_data);
+	fstrm__iothr_queue_exit(iothr, ioq);
+	return res;
+}
+
+fstrm_res
+fstrm_iothr_submit_wait(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+			void *data, size_t len,
+			void (*free_func)(void *, void *), void *free_data,
+			int timeout)
+{
+	struct timespec deadline;
+	fstrm_res res;
+
+	res = fstrm_iothr_submit(iothr, ioq, data, len, free_func, free_data);
+	if (likely(res != fstrm_res_again) || timeout == 0)
+		return res;
+
+	if (timeout > 0) {
+		const struct timespec delta = {
+			.tv_sec = timeout / 1000,
+			.tv_nsec = (timeout % 1000) * 1000000,
+		};
+		fstrm__iothr_gettime_cond(iothr, &deadline);
+		my_timespec_add(&delta, &deadline);
+	}
+
+	atomic_fetch_add(&iothr->space_waiters, 1);
+	for (;;) {
+		unsigned gen = atomic_load(&iothr->space_gen);
+		int rc = 0;
+
+		/*
+		 * Retry after registering in 'space_waiters' and sampling
+		 * 'space_gen'. This pairs with the fence in
+		 * fstrm__iothr_wake_producers(): either this attempt sees the
+		 * space freed by the I/O thread, or the I/O thread sees us
+		 * waiting and advances 'space_gen'.
+		 */
+		atomic_thread_fence(memory_order_seq_cst);
+		res = fstrm_iothr_submit(iothr, ioq, data, len, free_func, free_data);
+		if (res != fstrm_res_again)
+			break;
+
+		/* Make sure the I/O thread is not parked on a full queue. */
+		fstrm__iothr_maybe_wake(iothr, NULL, 0);
+
+		pthread_mutex_lock(&iothr->space_lock);
+		while (atomic_load(&iothr->space_gen) == gen &&
+		       !iothr->shutting_down && rc != ETIMEDOUT)
+		{
+			if (timeout > 0) {
+				rc = pthread_cond_timedwait(&iothr->space_cv,
+							    &iothr->space_lock,
+							    &deadline);
+			} else {
+				pthread_cond_wait(&iothr->space_cv,
+						  &iothr->space_lock);
+			}
+		}
+		pthread_mutex_unlock(&iothr->space_lock);
+
+		if (rc == ETIMEDOUT) {
+			res = fstrm_iothr_submit(iothr, ioq, data, len,
+						 free_func, free_data);
+			break;
+		}
+	}
+
+	/* Let fstrm_iothr_destroy() know once the last waiter has left. */
+	pthread_mutex_lock(&iothr->space_lock);
+	if (atomic_fetch_sub(&iothr->space_waiters, 1) == 1 &&
+	    iothr->shutting_down)
+	{
+		pthread_cond_broadcast(&iothr->space_cv);
+	}
+	pthread_mutex_unlock(&iothr->space_lock);
+	return res;
+}
+
+static fstrm_res
+fstrm__iothr_submitv(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+		     const struct iovec *iov, int iovcnt,
+		     void (*free_func)(void *, void *), void *free_data)
+{
+	unsigned space = 0, *pspace = fstrm__iothr_space(iothr, ioq, &space);
+	size_t len = 0;
+	struct fstrm__iothr_queue_entry entry;
+
+	if (unlikely(iothr->shutting_down))
+		return fstrm_res_failure;
+
+	if (unlikely(iov == NULL || iovcnt < 1 ||
+		     iovcnt > FSTRM_IOTHR_SUBMITV_IOVCNT_MAX))
+	{
+		return fstrm_res_invalid;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (unlikely(iov[i].iov_base == NULL && iov[i].iov_len > 0))
+			return fstrm_res_invalid;
+		len += iov[i].iov_len;
+	}
+	if (unlikely(len < 1 || len >= UINT32_MAX))
+		return fstrm_res_invalid;
+
+	if (unlikely(iothr->opt.drop_policy == FSTRM_IOTHR_DROP_POLICY_SAMPLE) &&
+	    fstrm__iothr_sample_drop(iothr, ioq))
+	{
+		fstrm__iothr_sample_discard(iothr, ioq, (void *) iov, len,
+					    free_func, free_data);
+		return fstrm_res_success;
+	}
+
+	if (unlikely(iothr->opt.direct_write) &&
+	    fstrm__iothr_direct_write(iothr, ioq, iov, (unsigned) iovcnt, len,
+				      (void *) iov, free_func, free_data))
+	{
+		return fstrm_res_success;
+	}
+
+	if (unlikely(iothr->opt.queued_bytes_max != 0) &&
+	    !fstrm__iothr_queue_charge(iothr, ioq, len))
+	{
+		fstrm__iothr_queue_stat_rejected_budget(iothr, ioq, 1, len);
+		return fstrm_res_again;
+	}
+
+	fstrm__iothr_queue_entry_init(ioq, &entry, (void *) iov, len,
+				      free_func, free_data);
+	entry.iovcnt = (uint16_t) iovcnt;
+	if (unlikely(iothr->timestamps))
+		*fstrm__iothr_entry_enqueued(ioq, &entry) =
+			fstrm__iothr_now_us(iothr);
+
+	if (fstrm__iothr_insert(iothr, ioq, &entry, pspace)) {
+		fstrm__iothr_queue_stat_submitted(iothr, ioq, 1, len);
+		fstrm__iothr_maybe_wake(iothr, ioq, space);
+		return fstrm_res_success;
+	} else {
+		fstrm__iothr_queue_entry_discard(&entry);
+		fstrm__iothr_uncharge(iothr, len);
+		fstrm__iothr_queue_stat_rejected(iothr, ioq, 1, len);
+		return fstrm_res_again;
+	}
+}
+
+fstrm_res
+fstrm_iothr_submitv(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+		    const struct iovec *iov, int iovcnt,
+		    void (*free_func)(void *, void *), void *free_data)
+{
+	fstrm_res res;
+
+	fstrm__iothr_queue_enter(iothr, ioq);
+	res = fstrm__iothr_submitv(iothr, ioq, iov, iovcnt,
+				   free_func, free_data);
+	fstrm__iothr_queue_exit(iothr, ioq);
+	return res;
+}
+
+static fstrm_res
+fstrm__iothr_submit_batch(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+			  const struct fstrm_iothr_frame *frames, size_t n_frames,
+			  size_t *n_submitted)
+{
+	struct fstrm__iothr_queue_entry entries[FSTRM__IOTHR_SUBMIT_BATCH_SIZE];
+	unsigned space = 0, *pspace = fstrm__iothr_space(iothr, ioq, &space);
+	size_t total = 0, n_single = 0;
+	bool single_rejected = false;
+	bool over_budget = false;
+	uint64_t bytes = 0;
+	uint64_t now = 0;
+
+	if (n_submitted != NULL)
+		*n_submitted = 0;
+
+	if (unlikely(iothr->shutting_down))
+		return fstrm_res_failure;
+
+	for (size_t i = 0; i < n_frames; i++) {
+		if (unlikely(frames[i].len < 1 || frames[i].len >= UINT32_MAX ||
+			     frames[i].data == NULL))
+		{
+			return fstrm_res_invalid;
+		}
+	}
+
+	if (unlikely(iothr->timestamps))
+		now = fstrm__iothr_now_us(iothr);
+
+	/*
+	 * Insert the frames in chunks of FSTRM__IOTHR_SUBMIT_BATCH_SIZE
+	 * entries, each of which is published to the I/O thread at once.
+	 */
+	while (total < n_frames) {
+		unsigned n = FSTRM__IOTHR_SUBMIT_BATCH_SIZE;
+		unsigned n_inserted;
+
+		if (n > n_frames - total)
+			n = n_frames - total;
+
+		/*
+		 * Above the sampling threshold, each data frame needs its own
+		 * decision, so submit them one at a time.
+		 */
+		if (unlikely(iothr->opt.drop_policy == FSTRM_IOTHR_DROP_POLICY_SAMPLE) &&
+		    iothr->queue_ops->count(ioq->q) > ioq->sample_depth)
+		{
+			const struct fstrm_iothr_frame *f = &frames[total];
+			fstrm_res res = fstrm__iothr_submit(iothr, ioq,
+				f->data, f->len, f->free_func, f->free_data);
+			if (res != fstrm_res_success) {
+				single_rejected = true;
+				break;
+			}
+			n_single++;
+			total++;
+			continue;
+		}
+
+		for (unsigned i = 0; i < n; i++) {
+			const struct fstrm_iothr_frame *f = &frames[total + i];
+			struct fstrm__iothr_queue_entry *e =
+				fstrm__iothr_entry_at(ioq, entries, i);
+			if (unlikely(iothr->opt.queued_bytes_max != 0) &&
+			    !fstrm__iothr_queue_charge(iothr, ioq, f->len))
+			{
+				over_budget = true;
+				n = i;
+				break;
+			}
+			fstrm__iothr_queue_entry_init(ioq, e,
+						      f->data, f->len,
+						      f->free_func, f->free_data);
+			if (unlikely(iothr->timestamps))
+				*fstrm__iothr_entry_enqueued(ioq, e) = now;
+		}
+
+		n_inserted = iothr->queue_ops->insert_batch(ioq->q, entries, n,
+				fstrm__iothr_space(iothr, ioq, pspace));
+		while (unlikely(n_inserted < n) && unlikely(iothr->elastic) &&
+		       fstrm__iothr_queue_grow(iothr, ioq))
+		{
+			n_inserted += iothr->queue_ops->insert_batch(ioq->q,
+				fstrm__iothr_entry_at(ioq, entries, n_inserted),
+				n - n_inserted,
+				fstrm__iothr_space(iothr, ioq, pspace));
+		}
+		if (unlikely(n_inserted < n) &&
+		    iothr->opt.drop_policy == FSTRM_IOTHR_DROP_POLICY_OLDEST)
+		{
+			for (; n_inserted < n; n_inserted++) {
+				fstrm__iothr_insert_drop_oldest(iothr, ioq,
+					fstrm__iothr_entry_at(ioq, entries, n_inserted),
+					pspace);
+			}
+		}
+		for (unsigned i = 0; i < n_inserted; i++)
+			bytes += frames[total + i].len;
+		total += n_inserted;
+		if (n_inserted < n) {
+			for (unsigned i = n_inserted; i < n; i++) {
+				struct fstrm__iothr_queue_entry *e =
+					fstrm__iothr_entry_at(ioq, entries, i);
+				fstrm__iothr_uncharge(iothr, e->len_data);
+				fstrm__iothr_queue_entry_discard(e);
+			}
+			over_budget = false;
+			break;
+		}
+		if (unlikely(over_budget))
+			break;
+	}
+
+	/* Data frames submitted one at a time have already been accounted for. */
+	if (total > n_single) {
+		fstrm__iothr_queue_stat_submitted(iothr, ioq, total - n_single,
+						  bytes);
+		fstrm__iothr_maybe_wake(iothr, ioq, space);
+	}
+
+	if (n_submitted != NULL)
+		*n_submitted = total;
+
+	if (total < n_frames) {
+		size_t first = total;
+		if (single_rejected)
+			first++;
+		bytes = 0;
+		for (size_t i = first; i < n_frames; i++)
+			bytes += frames[i].len;
+		if (over_budget) {
+			fstrm__iothr_queue_stat_rejected_budget(iothr, ioq,
+				n_frames - first, bytes);
+		} else {
+			fstrm__iothr_queue_stat_rejected(iothr, ioq,
+				n_frames - first, bytes);
+		}
+		return fstrm_res_again;
+	}
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm_iothr_submit_batch(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+			 const struct fstrm_iothr_frame *frames, size_t n_frames,
+			 size_t *n_submitted)
+{
+	fstrm_res res;
+
+	fstrm__iothr_queue_enter(iothr, ioq);
+	res = fstrm__iothr_submit_batch(iothr, ioq, frames, n_frames,
+					n_submitted);
+	fstrm__iothr_queue_exit(iothr, ioq);
+	return res;
+}
+
+static inline size_t
+fstrm__iothr_ring_record_size(size_t len)
+{
+	return FSTRM__IOTHR_RING_HDR +
+		((len + FSTRM__IOTHR_RING_HDR - 1) & ~(size_t) (FSTRM__IOTHR_RING_HDR - 1));
+}
+
+static inline uint8_t *
+fstrm__iothr_ring_ptr(struct fstrm__iothr_ring *ring, unsigned pos)
+{
+	return &ring->buf[pos & (ring->size - 1)];
+}
+
+/* free_func for queue entries which point into a reserve buffer. */
+static void
+fstrm__iothr_ring_release(void *data, void *free_data)
+{
+	struct fstrm__iothr_ring *ring = free_data;
+	unsigned end;
+
+	memcpy(&end, (uint8_t *) data - FSTRM__IOTHR_RING_HDR, sizeof(end));
+	atomic_store_explicit(&ring->tail, end, memory_order_release);
+}
+
+static void
+fstrm__iothr_reserve_unlock(struct fstrm_iothr *iothr,
+			    struct fstrm_iothr_queue *ioq)
+{
+	if (iothr->opt.queue_model == FSTRM_IOTHR_QUEUE_MODEL_MPSC)
+		pthread_mutex_unlock(&ioq->ring_lock);
+}
+
+fstrm_res
+fstrm_iothr_reserve(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+		    size_t len, void **data)
+{
+	struct fstrm__iothr_ring *ring;
+	unsigned start, end, tail;
+
+	if (unlikely(iothr->shutting_down))
+		return fstrm_res_failure;
+
+	/*
+	 * Producers discarding the oldest entries would release records out
+	 * of order, while the I/O thread may still be writing older ones.
+	 */
+	if (unlikely(iothr->opt.drop_policy == FSTRM_IOTHR_DROP_POLICY_OLDEST))
+		return fstrm_res_failure;
+
+	if (unlikely(len < 1 ||
+		     len > iothr->opt.reserve_buffer_size - FSTRM__IOTHR_RING_HDR))
+	{
+		return fstrm_res_invalid;
+	}
+
+	if (iothr->opt.queue_model == FSTRM_IOTHR_QUEUE_MODEL_MPSC)
+		pthread_mutex_lock(&ioq->ring_lock);
+
+	ring = ioq->ring;
+	if (unlikely(ring == NULL)) {
+		ring = my_calloc(1, sizeof(*ring));
+		ring->size = iothr->opt.reserve_buffer_size;
+		ring->buf = my_malloc(ring->size);
+		atomic_init(&ring->tail, 0);
+		ioq->ring = ring;
+	}
+
+	if (unlikely(ring->reserved)) {
+		fstrm__iothr_reserve_unlock(iothr, ioq);
+		return fstrm_res_invalid;
+	}
+
+	/* Skip to the start of the buffer if the record would straddle its end. */
+	start = ring->head;
+	if ((start & (ring->size - 1)) + fstrm__iothr_ring_record_size(len) > ring->size)
+		start += ring->size - (start & (ring->size - 1));
+	end = start + (unsigned) fstrm__iothr_ring_record_size(len);
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (end - tail > ring->size) {
+		fstrm__iothr_reserve_unlock(iothr, ioq);
+		fstrm__iothr_queue_stat_rejected(iothr, ioq, 1, len);
+		return fstrm_res_again;
+	}
+
+	ring->reserved = true;
+	ring->rsv_start = start;
+	ring->rsv_len = len;
+	*data = fstrm__iothr_ring_ptr(ring, start) + FSTRM__IOTHR_RING_HDR;
+
+	/* The lock, if any, is held until fstrm_iothr_commit(). */
+	return fstrm_res_success;
+}
+
+static fstrm_res
+fstrm__iothr_commit(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+		    size_t len)
+{
+	struct fstrm__iothr_ring *ring = ioq->ring;
+	struct fstrm__iothr_queue_entry entry;
+	unsigned space = 0, *pspace = fstrm__iothr_space(iothr, ioq, &space);
+	unsigned end;
+
+	if (unlikely(ring == NULL || !ring->reserved || len > ring->rsv_len))
+		return fstrm_res_invalid;
+
+	if (unlikely(len == 0 || iothr->shutting_down)) {
+		ring->reserved = false;
+		fstrm__iothr_reserve_unlock(iothr, ioq);
+		return len == 0 ? fstrm_res_success : fstrm_res_failure;
+	}
+
+	if (unlikely(iothr->opt.drop_policy == FSTRM_IOTHR_DROP_POLICY_SAMPLE) &&
+	    fstrm__iothr_sample_drop(iothr, ioq))
+	{
+		/* Discard the data frame by cancelling the reservation. */
+		ring->reserved = false;
+		fstrm__iothr_sample_discard(iothr, ioq, NULL, len, NULL, NULL);
+		fstrm__iothr_reserve_unlock(iothr, ioq);
+		return fstrm_res_success;
+	}
+
+	if (unlikely(iothr->opt.queued_bytes_max != 0) &&
+	    !fstrm__iothr_queue_charge(iothr, ioq, len))
+	{
+		fstrm__iothr_queue_stat_rejected_budget(iothr, ioq, 1, len);
+		return fstrm_res_again;
+	}
+
+	end = ring->rsv_start + (unsigned) fstrm__iothr_ring_record_size(len);
+	memcpy(fstrm__iothr_ring_ptr(ring, ring->rsv_start), &end, sizeof(end));
+
+	/* The data frame is released through the reserve buffer, see 'kind'. */
+	entry.data = fstrm__iothr_ring_ptr(ring, ring->rsv_start) +
+		FSTRM__IOTHR_RING_HDR;
+	entry.len_data = (uint32_t) len;
+	entry.kind = fstrm__iothr_entry_ring;
+	entry.iovcnt = 0;
+	if (unlikely(iothr->timestamps))
+		*fstrm__iothr_entry_enqueued(ioq, &entry) =
+			fstrm__iothr_now_us(iothr);
+
+	if (!iothr->queue_ops->insert(ioq->q, &entry, pspace)) {
+		fstrm__iothr_queue_entry_discard(&entry);
+		fstrm__iothr_uncharge(iothr, len);
+		fstrm__iothr_queue_stat_rejected(iothr, ioq, 1, len);
+		return fstrm_res_again;
+	}
+
+	ring->head = end;
+	ring->reserved = false;
+	fstrm__iothr_queue_stat_submitted(iothr, ioq, 1, len);
+	fstrm__iothr_reserve_unlock(iothr, ioq);
+	fstrm__iothr_maybe_wake(iothr, ioq, space);
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm_iothr_commit(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+		   size_t len)
+{
+	fstrm_res res;
+
+	fstrm__iothr_queue_enter(iothr, ioq);
+	res = fstrm__iothr_commit(iothr, ioq, len);
+	fstrm__iothr_queue_exit(iothr, ioq);
+	return res;
+}
+
+static void
+fstrm__iothr_close(struct fstrm_iothr *iothr)
+{
+	if (iothr->opened) {
+		iothr->opened = false;
+		fstrm_writer_close(iothr->writer);
+	}
+}
+
+/*
+ * Number of significant bits of 'x', which is the latency histogram bucket of
+ * 'x' microseconds, before capping.
+ */
+static inline unsigned
+fstrm__iothr_bit_width(uint64_t x)
+{
+#if defined(__GNUC__)
+	return x == 0 ? 0 : 64 - (unsigned) __builtin_clzll(x);
+#else
+	unsigned b = 0;
+
+	for (; x != 0; x >>= 1)
+		b++;
+	return b;
+#endif
+}
+
+/*
+ * Record the time the data frames in an output queue have waited since they
+ * were submitted in the latency histogram.
+ */
+static void
+fstrm__iothr_record_latency(struct fstrm_iothr *iothr,
+			    const struct fstrm__iothr_outq *outq)
+{
+	struct fstrm__iothr_latency *lat = &iothr->latency;
+	uint64_t now = fstrm__iothr_now_us(iothr);
+	uint64_t sum = 0, max;
+
+	max = atomic_load_explicit(&lat->max_us, memory_order_relaxed);
+	for (unsigned i = 0; i < outq->idx; i++) {
+		uint64_t enqueued = outq->enqueued[i];
+		uint64_t us = now > enqueued ? now - enqueued : 0;
+		unsigned b = fstrm__iothr_bit_width(us);
+
+		if (b > FSTRM_IOTHR_LATENCY_BUCKETS - 1)
+			b = FSTRM_IOTHR_LATENCY_BUCKETS - 1;
+		fstrm__iothr_stat_add(&lat->buckets[b], 1);
+		sum += us;
+		if (us > max)
+			max = us;
+	}
+	fstrm__iothr_stat_add(&lat->count, outq->idx);
+	fstrm__iothr_stat_add(&lat->sum_us, sum);
+	atomic_store_explicit(&lat->max_us, max, memory_order_relaxed);
+}
+
+/* Reasons for flushing the output queue, for the statistics. */
+typedef enum {
+	fstrm__iothr_flush_queue_full,
+	fstrm__iothr_flush_buffer_hint,
+	fstrm__iothr_flush_timeout,
+	fstrm__iothr_flush_idle,
+} fstrm__iothr_flush_reason;
+
+/* Payload bytes in an output queue, excluding the length prefixes. */
+static inline uint64_t
+fstrm__iothr_outq_bytes(const struct fstrm__iothr_outq *outq)
+{
+	return outq->nbytes - (uint64_t) outq->idx * sizeof(uint32_t);
+}
+
+/* Perform an output queue's deferred deallocations, and empty it. */
+static void
+fstrm__iothr_outq_reset(struct fstrm_iothr *iothr, struct fstrm__iothr_outq *outq)
+{
+	for (unsigned i = 0; i < outq->idx; i++)
+		fstrm__iothr_queue_entry_free_bytes(&outq->entries[i]);
+
+	/* Producers may be waiting for queued payload bytes to be released. */
+	if (unlikely(iothr->opt.queued_bytes_max != 0) && outq->idx > 0) {
+		fstrm__iothr_uncharge(iothr, fstrm__iothr_outq_bytes(outq));
+		fstrm__iothr_wake_producers(iothr);
+	}
+
+	outq->idx = 0;
+	outq->iovcnt = 0;
+	outq->nbytes = 0;
+}
+
+/* Append the data frames in an output queue to the spool. */
+static void
+fstrm__iothr_spool_output(struct fstrm_iothr *iothr,
+			  const struct fstrm__iothr_outq *outq)
+{
+	uint64_t nbytes = fstrm__iothr_outq_bytes(outq);
+	fstrm_res res;
+
+	res = fstrm__spool_append(iothr->spool, outq->iov, outq->frame_iovcnt,
+				  outq->idx, outq->nbytes);
+	if (res == fstrm_res_success) {
+		fstrm__iothr_stat_add(&iothr->stats.frames_spooled, outq->idx);
+		fstrm__iothr_stat_add(&iothr->stats.bytes_spooled, nbytes);
+	} else if (res == fstrm_res_again) {
+		fstrm__iothr_stat_add(&iothr->stats.frames_dropped_spool_full,
+				      outq->idx);
+		fstrm__iothr_stat_add(&iothr->stats.bytes_dropped_spool_full,
+				      nbytes);
+	} else {
+		fstrm__iothr_stat_add(&iothr->stats.frames_dropped_spool_error,
+				      outq->idx);
+		fstrm__iothr_stat_add(&iothr->stats.bytes_dropped_spool_error,
+				      nbytes);
+	}
+}
+
+/*
+ * Write the data frames in an output queue to 'dest', and empty it. Returns
+ * the result of writing to the writer; the caller closes it on failure.
+ */
+static fstrm_res
+fstrm__iothr_write_output(struct fstrm_iothr *iothr,
+			  struct fstrm__iothr_outq *outq,
+			  fstrm__iothr_output_dest dest)
+{
+	uint64_t nbytes = fstrm__iothr_outq_bytes(outq);
+	fstrm_res res = fstrm_res_success;
+
+	if (dest == fstrm__iothr_output_spool) {
+		fstrm__iothr_spool_output(iothr, outq);
+		fstrm__iothr_outq_reset(iothr, outq);
+		return res;
+	}
+
+	/*
+	 * Do the actual write. Unless some data frames are scattered across
+	 * several segments, there is one iovec per data frame.
+	 */
+	fstrm__iothr_stat_add(&iothr->stats.writev_calls, 1);
+	if (likely(outq->iovcnt == outq->idx)) {
+		res = fstrm_writer_writev(iothr->writer, outq->iov, outq->idx);
+	} else {
+		res = fstrm__writer_writev_frames(iothr->writer, outq->iov,
+						  outq->frame_iovcnt, outq->idx);
+	}
+	if (unlikely(outq->enqueued != NULL))
+		fstrm__iothr_record_latency(iothr, outq);
+	if (res == fstrm_res_success) {
+		fstrm__iothr_stat_add(&iothr->stats.frames_written, outq->idx);
+		fstrm__iothr_stat_add(&iothr->stats.bytes_written, nbytes);
+	} else {
+		fstrm__iothr_stat_add(&iothr->stats.frames_dropped_write_error,
+				      outq->idx);
+		fstrm__iothr_stat_add(&iothr->stats.bytes_dropped_write_error,
+				      nbytes);
+	}
+
+	fstrm__iothr_outq_reset(iothr, outq);
+	return res;
+}
+
+static void
+fstrm__iothr_thr_setup(void)
+{
+	sigset_t set;
+	int s;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	s = pthread_sigmask(SIG_BLOCK, &set, NULL);
+	assert(s == 0);
+}
+
+static void *
+fstrm__iothr_write_thr(void *arg)
+{
+	struct fstrm_iothr *iothr = (struct fstrm_iothr *)arg;
+
+	fstrm__iothr_thr_setup();
+
+	pthread_mutex_lock(&iothr->write_lock);
+	for (;;) {
+		struct fstrm__iothr_outq *outq;
+		fstrm__iothr_output_dest dest;
+		fstrm_res res;
+
+		while (iothr->write_pending == NULL && !iothr->write_stop)
+			pthread_cond_wait(&iothr->write_cv, &iothr->write_lock);
+		if (iothr->write_pending == NULL)
+			break;
+		outq = iothr->write_pending;
+		dest = iothr->write_dest;
+		pthread_mutex_unlock(&iothr->write_lock);
+
+		res = fstrm__iothr_write_output(iothr, outq, dest);
+
+		pthread_mutex_lock(&iothr->write_lock);
+		if (res != fstrm_res_success)
+			iothr->write_res = res;
+		iothr->write_pending = NULL;
+		pthread_cond_broadcast(&iothr->write_cv);
+	}
+	pthread_mutex_unlock(&iothr->write_lock);
+
+	return NULL;
+}
+
+/*
+ * With pipeline_writes, wait for the writer thread to finish writing the
+ * output queue handed to it, if any, and close the writer if that failed.
+ * The I/O thread must call this before it touches the writer or the spool.
+ */
+static void
+fstrm__iothr_write_wait(struct fstrm_iothr *iothr)
+{
+	fstrm_res res;
+
+	if (likely(!iothr->opt.pipeline_writes))
+		return;
+
+	pthread_mutex_lock(&iothr->write_lock);
+	while (iothr->write_pending != NULL)
+		pthread_cond_wait(&iothr->write_cv, &iothr->write_lock);
+	res = iothr->write_res;
+	iothr->write_res = fstrm_res_success;
+	pthread_mutex_unlock(&iothr->write_lock);
+
+	if (res != fstrm_res_success)
+		fstrm__iothr_close(iothr);
+}
+
+/*
+ * With direct_write, let producers write to the writer themselves while the
+ * I/O thread is idle. This is only done once everything submitted so far has
+ * been written out, and the writer is open.
+ */
+static void
+fstrm__iothr_direct_enable(struct fstrm_iothr *iothr)
+{
+	if (likely(!iothr->opt.direct_write) || iothr->direct_enabled ||
+	    iothr->outq->idx > 0)
+	{
+		return;
+	}
+
+	fstrm__iothr_write_wait(iothr);
+	if (!iothr->opened || iothr->shutting_down ||
+	    (iothr->spool != NULL && !fstrm__spool_empty(iothr->spool)))
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&iothr->direct_lock);
+	atomic_store_explicit(&iothr->direct_ok, true, memory_order_relaxed);
+	pthread_mutex_unlock(&iothr->direct_lock);
+	iothr->direct_enabled = true;
+}
+
+/*
+ * Take the writer back from the producers, waiting for a direct write in
+ * progress, and close it if a direct write failed.
+ */
+static void
+fstrm__iothr_direct_disable(struct fstrm_iothr *iothr)
+{
+	bool failed;
+
+	if (likely(!iothr->direct_enabled))
+		return;
+
+	pthread_mutex_lock(&iothr->direct_lock);
+	atomic_store_explicit(&iothr->direct_ok, false, memory_order_relaxed);
+	failed = iothr->direct_failed;
+	iothr->direct_failed = false;
+	pthread_mutex_unlock(&iothr->direct_lock);
+	iothr->direct_enabled = false;
+
+	if (failed)
+		fstrm__iothr_close(iothr);
+}
+
+static void
+fstrm__iothr_flush_output(struct fstrm_iothr *iothr,
+			  fstrm__iothr_flush_reason reason)
+{
+	struct fstrm__iothr_outq *outq = iothr->outq;
+	fstrm__iothr_output_dest dest;
+
+	if (outq->idx == 0)
+		return;
+
+	/*
+	 * Without a spool, hold on to the output queue until the attempt to
+	 * open the writer in progress finishes, rather than discard it.
+	 */
+	if (unlikely(iothr->opening) && iothr->spool == NULL)
+		return;
+	iothr->flush_deadline = 0;
+
+	fstrm__iothr_write_wait(iothr);
+
+	/*
+	 * While the writer is closed, or the spool still holds older data
+	 * frames, the output goes to the spool instead. With neither, it is
+	 * discarded; this only happens if the previous write failed.
+	 */
+	if (unlikely(iothr->spool != NULL) &&
+	    (!iothr->opened || !fstrm__spool_empty(iothr->spool)))
+	{
+		dest = fstrm__iothr_output_spool;
+		iothr->spool_pending = true;
+	} else if (likely(iothr->opened)) {
+		dest = fstrm__iothr_output_writer;
+
+		switch (reason) {
+		case fstrm__iothr_flush_queue_full:
+			fstrm__iothr_stat_add(&iothr->stats.flushes_queue_full, 1);
+			break;
+		case fstrm__iothr_flush_buffer_hint:
+			fstrm__iothr_stat_add(&iothr->stats.flushes_buffer_hint, 1);
+			break;
+		case fstrm__iothr_flush_timeout:
+			fstrm__iothr_stat_add(&iothr->stats.flushes_timeout, 1);
+			break;
+		case fstrm__iothr_flush_idle:
+			fstrm__iothr_stat_add(&iothr->stats.flushes_idle, 1);
+			break;
+		}
+	} else {
+		fstrm__iothr_stat_add(&iothr->stats.frames_dropped_closed,
+				      outq->idx);
+		fstrm__iothr_stat_add(&iothr->stats.bytes_dropped_closed,
+				      fstrm__iothr_outq_bytes(outq));
+		fstrm__iothr_outq_reset(iothr, outq);
+		return;
+	}
+
+	if (iothr->opt.pipeline_writes) {
+		/*
+		 * Hand the output queue to the writer thread, and carry on
+		 * filling the other one.
+		 */
+		pthread_mutex_lock(&iothr->write_lock);
+		iothr->write_pending = outq;
+		iothr->write_dest = dest;
+		pthread_cond_broadcast(&iothr->write_cv);
+		pthread_mutex_unlock(&iothr->write_lock);
+		iothr->outq = &iothr->outqs[outq == &iothr->outqs[0]];
+	} else if (fstrm__iothr_write_output(iothr, outq, dest) != fstrm_res_success) {
+		fstrm__iothr_close(iothr);
+	}
+}
+
+/* Whether the output queue has no room for a data frame of 'iovcnt' iovecs. */
+static inline bool
+fstrm__iothr_outq_full(struct fstrm_iothr *iothr, unsigned iovcnt)
+{
+	struct fstrm__iothr_outq *outq = iothr->outq;
+
+	return outq->idx >= iothr->opt.output_queue_size ||
+		outq->iovcnt + iovcnt > FSTRM__IOTHR_OUTQ_IOV_SIZE(iothr);
+}
+
+static void
+fstrm__iothr_maybe_flush_output(struct fstrm_iothr *iothr, size_t nbytes,
+				unsigned iovcnt)
+{
+	struct fstrm__iothr_outq *outq = iothr->outq;
+
+	assert(outq->idx <= iothr->opt.output_queue_size);
+	if (outq->idx > 0) {
+		/*
+		 * If the output queue is full, or there are more than
+		 * 'buffer_hint' bytes of data ready to be sent, flush the
+		 * output.
+		 */
+		if (fstrm__iothr_outq_full(iothr, iovcnt)) {
+			fstrm__iothr_flush_output(iothr, fstrm__iothr_flush_queue_full);
+		} else if (outq->nbytes + nbytes >= iothr->opt.buffer_hint) {
+			fstrm__iothr_flush_output(iothr, fstrm__iothr_flush_buffer_hint);
+		}
+	}
+}
+
+/*
+ * Flush the output queue if its oldest data frame has been waiting for
+ * flush_max_age microseconds.
+ */
+static void
+fstrm__iothr_maybe_flush_aged(struct fstrm_iothr *iothr)
+{
+	uint64_t now;
+
+	if (iothr->opt.flush_max_age == 0 || iothr->outq->idx == 0)
+		return;
+	now = fstrm__iothr_now_us(iothr);
+	if (now >= iothr->outq->oldest &&
+	    now - iothr->outq->oldest >= iothr->opt.flush_max_age)
+	{
+		fstrm__iothr_flush_output(iothr, fstrm__iothr_flush_timeout);
+	}
+}
+
+static void
+fstrm__iothr_process_queue_entry(struct fstrm_iothr *iothr,
+				 struct fstrm_iothr_queue *ioq,
+				 struct fstrm__iothr_queue_entry *entry)
+{
+	struct fstrm__iothr_outq_entry out;
+	unsigned iovcnt = entry->iovcnt > 0 ? entry->iovcnt : 1;
+
+	fstrm__iothr_queue_entry_resolve(ioq, entry, &out);
+
+	/*
+	 * While an attempt to open the writer is in progress, the output queue
+	 * buffers the data frames until it finishes, see
+	 * fstrm__iothr_flush_output(). Once it is full, they are discarded as
+	 * if the writer were closed.
+	 */
+	if (likely(iothr->opened || iothr->spool != NULL) ||
+	    (iothr->opening && !fstrm__iothr_outq_full(iothr, iovcnt)))
+	{
+		size_t nbytes = sizeof(uint32_t) + entry->len_data;
+		struct fstrm__iothr_outq *outq;
+
+		/* This may swap the output queues, with pipeline_writes. */
+		fstrm__iothr_maybe_flush_output(iothr, nbytes, iovcnt);
+		outq = iothr->outq;
+
+		/* Copy the entry to the array of outstanding queue entries. */
+		outq->entries[outq->idx] = out;
+		if (unlikely(iothr->timestamps)) {
+			uint64_t enqueued = *fstrm__iothr_entry_enqueued(ioq, entry);
+
+			if (outq->enqueued != NULL)
+				outq->enqueued[outq->idx] = enqueued;
+			if (outq->idx == 0 || enqueued < outq->oldest)
+				outq->oldest = enqueued;
+		}
+
+		/* Add the iovecs for the entry. */
+		if (likely(entry->iovcnt == 0)) {
+			outq->iov[outq->iovcnt].iov_base = out.data;
+			outq->iov[outq->iovcnt].iov_len = (size_t)entry->len_data;
+		} else {
+			memcpy(&outq->iov[outq->iovcnt], out.data,
+			       iovcnt * sizeof(struct iovec));
+		}
+		outq->frame_iovcnt[outq->idx] = iovcnt;
+		outq->iovcnt += iovcnt;
+
+		/* Increment the number of output queue entries. */
+		outq->idx++;
+
+		/* There are now nbytes more data waiting to be sent. */
+		outq->nbytes += nbytes;
+	} else {
+		/* Writer is closed, just discard the payload. */
+		fstrm__iothr_stat_add(&iothr->stats.frames_dropped_closed, 1);
+		fstrm__iothr_stat_add(&iothr->stats.bytes_dropped_closed,
+				      entry->len_data);
+		fstrm__iothr_uncharge(iothr, entry->len_data);
+		fstrm__iothr_queue_entry_free_bytes(&out);
+	}
+}
+
+/*
+ * Wake any producers waiting in fstrm_iothr_submit_wait(), after entries have
+ * been removed from the input queues, or queued payload bytes released.
+ */
+static void
+fstrm__iothr_wake_producers(struct fstrm_iothr *iothr)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (likely(atomic_load_explicit(&iothr->space_waiters,
+					memory_order_relaxed) == 0))
+	{
+		return;
+	}
+
+	pthread_mutex_lock(&iothr->space_lock);
+	atomic_fetch_add(&iothr->space_gen, 1);
+	pthread_cond_broadcast(&iothr->space_cv);
+	pthread_mutex_unlock(&iothr->space_lock);
+}
+
+/*
+ * With queued_bytes_max, whether at least half of it is in use. The output
+ * queue is then flushed as soon as the input queues are idle, rather than after
+ * flush_timeout, so that producers don't run out of queued payload bytes.
+ */
+static inline bool
+fstrm__iothr_budget_low(struct fstrm_iothr *iothr)
+{
+	return iothr->opt.queued_bytes_max != 0 &&
+		atomic_load_explicit(&iothr->queued_bytes, memory_order_relaxed) >=
+		iothr->opt.queued_bytes_max / 2;
+}
+
+/*
+ * Whether to leave the data frames in the input queues while the writer is
+ * closed, rather than discarding them. This is the case until the first
+ * attempt to open the writer finishes, so that the data frames submitted at
+ * startup are not lost to it. With FSTRM_IOTHR_DROP_POLICY_OLDEST, the most
+ * recent data frames are kept in the input queues until the writer has been
+ * reopened. Either way, data frames are spooled instead if possible.
+ */
+static inline bool
+fstrm__iothr_hold_input(struct fstrm_iothr *iothr)
+{
+	return !iothr->opened && iothr->spool == NULL &&
+		(iothr->first_open ||
+		 iothr->opt.drop_policy == FSTRM_IOTHR_DROP_POLICY_OLDEST);
+}
+
+/*
+ * With input_queue_max_bytes, resize an input queue after the I/O thread has
+ * removed 'n' entries from it: grow it if a producer asked for that, or shrink
+ * it back to input_queue_size entries once it has been empty for
+ * FSTRM__IOTHR_QUEUE_SHRINK_IDLE. Under FSTRM_IOTHR_QUEUE_MODEL_SPSC, the
+ * producer does both itself, see fstrm__iothr_queue_enter().
+ */
+static void
+fstrm__iothr_queue_maintain(struct fstrm_iothr *iothr,
+			    struct fstrm_iothr_queue *ioq, unsigned n)
+{
+	uint64_t now;
+
+	if (atomic_load_explicit(&ioq->grow, memory_order_relaxed)) {
+		if (ioq->size >= iothr->queue_size_max ||
+		    fstrm__iothr_queue_resize(iothr, ioq, ioq->size * 2))
+		{
+			atomic_store_explicit(&ioq->grow, false,
+					      memory_order_relaxed);
+			fstrm__iothr_wake_producers(iothr);
+		}
+		ioq->idle_since = 0;
+		return;
+	}
+
+	if (n != 0 || ioq->size == iothr->opt.input_queue_size) {
+		ioq->idle_since = 0;
+		return;
+	}
+
+	now = fstrm__iothr_now_us(iothr);
+	if (ioq->idle_since == 0) {
+		ioq->idle_since = now;
+	} else if (now - ioq->idle_since < FSTRM__IOTHR_QUEUE_SHRINK_IDLE) {
+		return;
+	} else if (iothr->opt.queue_model == FSTRM_IOTHR_QUEUE_MODEL_SPSC) {
+		/* Only the producer resizes its input queue, so ask it to. */
+		atomic_store_explicit(&ioq->shrink, true, memory_order_relaxed);
+		ioq->idle_since = 0;
+	} else if (fstrm__iothr_queue_resize(iothr, ioq,
+					     iothr->opt.input_queue_size))
+	{
+		ioq->idle_since = 0;
+	}
+}
+
+/*
+ * Update the depth high-water mark of an input queue from which 'n' entries
+ * were just removed, asking for at most 'max'. The depth of an input queue only
+ * grows until the I/O thread next drains it, so sampling it here catches the
+ * peaks without the producers having to look at the consumer's index.
+ */
+static inline void
+fstrm__iothr_queue_stat_depth(struct fstrm_iothr *iothr,
+			      struct fstrm_iothr_queue *ioq, unsigned n,
+			      unsigned max)
+{
+	uint64_t depth = n;
+
+	if (n == max)
+		depth += iothr->queue_ops->count(ioq->q);
+	if (depth > atomic_load_explicit(&ioq->stats.queue_depth_hwm,
+					 memory_order_relaxed))
+	{
+		atomic_store_explicit(&ioq->stats.queue_depth_hwm, depth,
+				      memory_order_relaxed);
+	}
+}
+
+static unsigned
+fstrm__iothr_process_queues(struct fstrm_iothr *iothr)
+{
+	unsigned total = 0;
+
+	if (unlikely(fstrm__iothr_hold_input(iothr)))
+		return 0;
+
+	/*
+	 * Remove input queue entries from each thread's circular queue, and
+	 * add them to our output queue. Each input queue is drained in a
+	 * single batch sized to fill the rest of the output queue, or all of
+	 * it if the output queue is already full and about to be flushed.
+	 */
+	for (unsigned i = 0; i < iothr->opt.num_input_queues; i++) {
+		struct fstrm_iothr_queue *ioq = &iothr->queues[i];
+		unsigned n, max = iothr->opt.output_queue_size - iothr->outq->idx;
+		if (max == 0)
+			max = iothr->opt.output_queue_size;
+
+		/* Skip the input queues which have not been handed out. */
+		if (!atomic_load_explicit(&ioq->claimed, memory_order_acquire) ||
+		    !fstrm__iothr_queue_try_enter(iothr, ioq))
+		{
+			continue;
+		}
+		n = iothr->queue_ops->remove_batch(ioq->q,
+						   iothr->batch_entries, max, NULL);
+		fstrm__iothr_queue_stat_depth(iothr, ioq, n, max);
+		if (unlikely(iothr->elastic))
+			fstrm__iothr_queue_maintain(iothr, ioq, n);
+		fstrm__iothr_queue_leave(iothr, ioq);
+		if (n == 0)
+			continue;
+		fstrm__iothr_wake_producers(iothr);
+		for (unsigned j = 0; j < n; j++)
+			fstrm__iothr_process_queue_entry(iothr, ioq,
+				fstrm__iothr_entry_at(ioq, iothr->batch_entries, j));
+		total += n;
+	}
+
+	/*
+	 * Data frames discarded because the writer is closed have released
+	 * their queued payload bytes.
+	 */
+	if (unlikely(iothr->opt.queued_bytes_max != 0) && total != 0)
+		fstrm__iothr_wake_producers(iothr);
+
+	return total;
+}
+
+/*
+ * Write a batch of data frames from the spool to the writer, once it has been
+ * reopened. Returns true if the spool may hold more data frames to write.
+ */
+static bool
+fstrm__iothr_drain_spool(struct fstrm_iothr *iothr)
+{
+	unsigned frames;
+	size_t bytes;
+	fstrm_res res;
+
+	if (likely(!iothr->spool_pending) || !iothr->opened)
+		return false;
+
+	/* A pipelined write may still be appending to the spool. */
+	fstrm__iothr_write_wait(iothr);
+	if (!iothr->opened)
+		return false;
+	if (fstrm__spool_empty(iothr->spool)) {
+		iothr->spool_pending = false;
+		return false;
+	}
+
+	fstrm__iothr_stat_add(&iothr->stats.writev_calls, 1);
+	res = fstrm__spool_drain(iothr->spool, iothr->writer, &frames, &bytes);
+	fstrm__iothr_stat_add(&iothr->stats.frames_written, frames);
+	fstrm__iothr_stat_add(&iothr->stats.bytes_written, bytes);
+	if (res != fstrm_res_success) {
+		/* The data frames stay in the spool until the next reopen. */
+		fstrm__iothr_close(iothr);
+		return false;
+	}
+	if (fstrm__spool_empty(iothr->spool)) {
+		iothr->spool_pending = false;
+		return false;
+	}
+	return true;
+}
+
+static void *
+fstrm__iothr_open_thr(void *arg)
+{
+	struct fstrm_iothr *iothr = (struct fstrm_iothr *)arg;
+
+	fstrm__iothr_thr_setup();
+	iothr->open_res = fstrm_writer_open(iothr->writer);
+
+	/*
+	 * Wake the I/O thread to collect the result, whether it is parked or
+	 * sleeping. See fstrm__iothr_open_done().
+	 */
+	atomic_store(&iothr->open_done, true);
+	fstrm__iothr_wake(iothr);
+	return NULL;
+}
+
+/* Whether an attempt to open the writer has finished, but not been collected. */
+static inline bool
+fstrm__iothr_open_done(struct fstrm_iothr *iothr)
+{
+	return iothr->opening && atomic_load(&iothr->open_done);
+}
+
+/*
+ * Record the result of an attempt to open the writer. On failure, schedule the
+ * next attempt after a jittered, exponentially increasing delay.
+ */
+static void
+fstrm__iothr_open_result(struct fstrm_iothr *iothr, fstrm_res res)
+{
+	uint64_t max, x;
+
+	iothr->first_open = false;
+	if (res == fstrm_res_success) {
+		iothr->opened = true;
+		iothr->reopen_delay = (uint64_t) iothr->opt.reopen_interval * 1000000;
+		return;
+	}
+	fstrm__iothr_stat_add(&iothr->stats.open_failures, 1);
+
+	/* Wait between half and all of the current interval. */
+	x = fstrm__iothr_splitmix64(iothr->reopen_seq++);
+	iothr->next_open = fstrm__iothr_now_us(iothr) + iothr->reopen_delay / 2 +
+		x % (iothr->reopen_delay / 2 + 1);
+
+	max = (uint64_t) iothr->opt.reopen_interval_max * 1000000;
+	iothr->reopen_delay *= 2;
+	if (iothr->reopen_delay > max)
+		iothr->reopen_delay = max;
+}
+
+/* Wait for an attempt to open the writer to finish, and collect its result. */
+static void
+fstrm__iothr_open_finish(struct fstrm_iothr *iothr)
+{
+	pthread_join(iothr->open_thr, NULL);
+	iothr->opening = false;
+	fstrm__iothr_open_result(iothr, iothr->open_res);
+}
+
+static void
+fstrm__iothr_maybe_open(struct fstrm_iothr *iothr)
+{
+	int res;
+
+	/* If we're already connected, there's nothing to do. */
+	if (likely(iothr->opened))
+		return;
+
+	/* Check if an attempt in progress has finished. */
+	if (iothr->opening) {
+		if (atomic_load(&iothr->open_done))
+			fstrm__iothr_open_finish(iothr);
+		return;
+	}
+
+	/* Check if the reopen interval has expired yet. */
+	if (fstrm__iothr_now_us(iothr) < iothr->next_open)
+		return;
+
+	/*
+	 * Attempt to open the transport. This may take up to the transport's
+	 * connect and handshake timeouts, so do it on another thread while the
+	 * I/O thread carries on draining the input queues. With external_drive,
+	 * the application's thread does the I/O work, and no threads of our
+	 * own are started for it, so open synchronously.
+	 */
+	fstrm__iothr_stat_add(&iothr->stats.open_attempts, 1);
+	if (iothr->opt.external_drive) {
+		fstrm__iothr_open_result(iothr, fstrm_writer_open(iothr->writer));
+		return;
+	}
+	atomic_store(&iothr->open_done, false);
+	iothr->opening = true;
+	res = pthread_create(&iothr->open_thr, NULL, fstrm__iothr_open_thr, iothr);
+	assert(res == 0);
+}
+
+/*
+ * Microseconds to wait for the writer to be reopened: until the next attempt,
+ * or for one reopen_interval if an attempt is in progress, since the open
+ * thread wakes the I/O thread when it finishes.
+ */
+static uint64_t
+fstrm__iothr_reopen_wait(struct fstrm_iothr *iothr)
+{
+	uint64_t now;
+
+	if (!iothr->opening) {
+		now = fstrm__iothr_now_us(iothr);
+		if (iothr->next_open > now)
+			return iothr->next_open - now;
+	}
+	return (uint64_t) iothr->opt.reopen_interval * 1000000;
+}
+
+static void
+fstrm__iothr_gettime_cond(struct fstrm_iothr *iothr, struct timespec *ts)
 {
-	if (entry->free_func != NULL)
-		entry->free_func(entry->data, entry->free_data);
+	fstrm__iothr_waker_gettime(&iothr->waker, ts);
 }
 
-static void
-fstrm__iothr_free_queues(struct fstrm_iothr *iothr)
+/*
+ * Returns true while the I/O thread should keep polling its empty input
+ * queues, and false once 'spin_duration' microseconds have elapsed since the
+ * input queues were first found empty (recorded in 'spin_start').
+ */
+static bool
+fstrm__iothr_spin(struct fstrm_iothr *iothr, struct timespec *spin_start)
 {
-	size_t i;
-	for (i = 0; i < iothr->opt.num_input_queues; i++) {
-		struct my_queue *queue;
-		struct fstrm__iothr_queue_entry entry;
+	struct timespec ts;
 
-		queue = iothr->queues[i].q;
-		while (iothr->queue_ops->remove(queue, &entry, NULL))
-			fstrm__iothr_queue_entry_free_bytes(&entry);
-		iothr->queue_ops->destroy(&queue);
+	if (iothr->opt.spin_duration == 0)
+		return false;
+
+	fstrm__iothr_gettime_cond(iothr, &ts);
+	if (spin_start->tv_sec == 0 && spin_start->tv_nsec == 0) {
+		*spin_start = ts;
+		return true;
 	}
-	my_free(iothr->queues);
+
+	my_timespec_sub(spin_start, &ts);
+	if (ts.tv_sec == 0 && ts.tv_nsec / 1000 < iothr->opt.spin_duration) {
+		cpu_relax();
+		return true;
+	}
+	return false;
 }
 
-void
-fstrm_iothr_destroy(struct fstrm_iothr **iothr)
+/*
+ * Sleep until a producer wakes the I/O thread, the I/O thread is shut down, or
+ * 'timeout' microseconds have elapsed. A 'timeout' of zero sleeps indefinitely.
+ * Returns true if the timeout expired. With direct_write, producers may write
+ * to the writer themselves meanwhile, see fstrm__iothr_direct_enable().
+ */
+static bool
+fstrm__iothr_park(struct fstrm_iothr *iothr, uint64_t timeout)
 {
-	if (*iothr != NULL) {
-		/*
-		 * Signal the I/O thread that a shutdown is in progress.
-		 * This waits for the I/O thread to finish.
-		 */
-		(*iothr)->shutting_down = true;
-		pthread_cond_signal(&(*iothr)->cv);
-		pthread_join((*iothr)->thr, NULL);
-		pthread_cond_destroy(&(*iothr)->cv);
-		pthread_mutex_destroy(&(*iothr)->cv_lock);
-		pthread_mutex_destroy(&(*iothr)->get_queue_lock);
+	struct timespec ts;
+	int res = 0;
 
-		/* Destroy the writer by calling its 'destroy' method. */
-		(void)fstrm_writer_destroy(&(*iothr)->writer);
+	atomic_store(&iothr->waker.parked, true);
 
-		/* Cleanup our allocations. */
-		fstrm__iothr_free_queues(*iothr);
-		my_free((*iothr)->outq_iov);
-		my_free((*iothr)->outq_entries);
-		my_free(*iothr);
+	/*
+	 * A producer may have submitted an entry after our last pass over the
+	 * input queues, but before it could observe 'parked'. Check again.
+	 * Likewise, an attempt to open the writer may just have finished.
+	 */
+	if (fstrm__iothr_open_done(iothr) ||
+	    fstrm__iothr_process_queues(iothr) != 0)
+	{
+		atomic_store(&iothr->waker.parked, false);
+		return false;
 	}
-}
+	fstrm__iothr_direct_enable(iothr);
 
-struct fstrm_iothr_queue *
-fstrm_iothr_get_input_queue(struct fstrm_iothr *iothr)
-{
-	struct fstrm_iothr_queue *q = NULL;
+	if (timeout != 0) {
+		const struct timespec delta = {
+			.tv_sec = timeout / 1000000,
+			.tv_nsec = (timeout % 1000000) * 1000,
+		};
+		fstrm__iothr_gettime_cond(iothr, &ts);
+		my_timespec_add(&delta, &ts);
+	}
 
-	pthread_mutex_lock(&iothr->get_queue_lock);
-	if (iothr->get_queue_idx < iothr->opt.num_input_queues) {
-		q = &iothr->queues[iothr->get_queue_idx];
-		iothr->get_queue_idx++;
+	pthread_mutex_lock(&iothr->waker.lock);
+	while (atomic_load(&iothr->waker.parked) && !iothr->shutting_down) {
+		if (timeout != 0) {
+			res = pthread_cond_timedwait(&iothr->waker.cv,
+						     &iothr->waker.lock, &ts);
+			if (res == ETIMEDOUT)
+				break;
+		} else {
+			pthread_cond_wait(&iothr->waker.cv, &iothr->waker.lock);
+		}
 	}
-	pthread_mutex_unlock(&iothr->get_queue_lock);
+	atomic_store(&iothr->waker.parked, false);
+	pthread_mutex_unlock(&iothr->waker.lock);
 
-	return q;
+	return res == ETIMEDOUT;
 }
 
-struct fstrm_iothr_queue *
-fstrm_iothr_get_input_queue_idx(struct fstrm_iothr *iothr, size_t idx)
+/*
+ * Sleep for 'timeout' microseconds, until the I/O thread is shut down, or until
+ * an attempt to open the writer finishes. Unlike fstrm__iothr_park(),
+ * producers do not wake the I/O thread.
+ */
+static void
+fstrm__iothr_sleep(struct fstrm_iothr *iothr, uint64_t timeout)
 {
-	struct fstrm_iothr_queue *q = NULL;
+	const struct timespec delta = {
+		.tv_sec = timeout / 1000000,
+		.tv_nsec = (timeout % 1000000) * 1000,
+	};
+	struct timespec ts;
 
-	if (idx < iothr->opt.num_input_queues)
-		q = &iothr->queues[idx];
+	fstrm__iothr_gettime_cond(iothr, &ts);
+	my_timespec_add(&delta, &ts);
 
-	return q;
+	pthread_mutex_lock(&iothr->waker.lock);
+	if (!iothr->shutting_down && !fstrm__iothr_open_done(iothr))
+		(void)pthread_cond_timedwait(&iothr->waker.cv, &iothr->waker.lock, &ts);
+	pthread_mutex_unlock(&iothr->waker.lock);
 }
 
-void
-fstrm_free_wrapper(void *data,
-		   void *free_data __attribute__((__unused__)))
+/* Write out everything still queued, and close the writer. */
+static void
+fstrm__iothr_shutdown(struct fstrm_iothr *iothr)
 {
-	free(data);
+	fstrm__iothr_direct_disable(iothr);
+
+	/* Give an attempt in progress a chance to finish. */
+	if (iothr->opening)
+		fstrm__iothr_open_finish(iothr);
+	while (fstrm__iothr_process_queues(iothr));
+	fstrm__iothr_flush_output(iothr, fstrm__iothr_flush_idle);
+	while (fstrm__iothr_drain_spool(iothr));
+	fstrm__iothr_write_wait(iothr);
+	fstrm__iothr_close(iothr);
 }
 
-fstrm_res
-fstrm_iothr_submit(struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
-		   void *data, size_t len,
-		   void (*free_func)(void *, void *), void *free_data)
+/*
+ * On the timed wait strategy, the number of microseconds the I/O thread may
+ * sleep with its input queues idle before checking back on them: flush_timeout
+ * seconds or, with flush_max_age, that many microseconds as long as it keeps
+ * finding data frames. Once it has not for a whole flush_max_age period, this
+ * sets 'idle' so that producers wake it instead.
+ */
+static uint64_t
+fstrm__iothr_timed_wait(struct fstrm_iothr *iothr)
 {
-	unsigned space = 0;
-	struct fstrm__iothr_queue_entry entry;
-
-	if (unlikely(iothr->shutting_down))
-		return fstrm_res_failure;
-
-	if (unlikely(len < 1 || len >= UINT32_MAX || data == NULL))
-		return fstrm_res_invalid;
-
-	entry.data = data;
-	entry.len_data = (uint32_t) len;
-	entry.free_func = free_func;
-	entry.free_data = free_data;
+	uint64_t timeout = (uint64_t) iothr->opt.flush_timeout * 1000000;
 
-	if (likely(len > 0) && iothr->queue_ops->insert(ioq->q, &entry, &space)) {
-		if (space == iothr->opt.queue_notify_threshold)
-			pthread_cond_signal(&iothr->cv);
-		return fstrm_res_success;
-	} else {
-		return fstrm_res_again;
+	if (iothr->opt.flush_max_age != 0) {
+		if (iothr->busy || iothr->outq->idx > 0)
+			timeout = iothr->opt.flush_max_age;
+		else
+			atomic_store(&iothr->idle, true);
+		iothr->busy = false;
 	}
+	return timeout;
 }
 
-static void
-fstrm__iothr_close(struct fstrm_iothr *iothr)
+static inline void
+fstrm__iothr_clear_idle(struct fstrm_iothr *iothr)
 {
-	if (iothr->opened) {
-		iothr->opened = false;
-		fstrm_writer_close(iothr->writer);
-	}
+	if (atomic_load_explicit(&iothr->idle, memory_order_relaxed))
+		atomic_store(&iothr->idle, false);
 }
 
-static void
-fstrm__iothr_flush_output(struct fstrm_iothr *iothr)
+static void *
+fstrm__iothr_thr(void *arg)
 {
-	fstrm_res res;
+	struct fstrm_iothr *iothr = (struct fstrm_iothr *)arg;
+	struct timespec spin_start = { 0, 0 };
 
-	/* Do the actual write. */
-	if (likely(iothr->opened && iothr->outq_idx > 0)) {
-		res = fstrm_writer_writev(iothr->writer, iothr->outq_iov,
-					  iothr->outq_idx);
-		if (res != fstrm_res_success)
-			fstrm__iothr_close(iothr);
-	}
+	fstrm__iothr_thr_setup();
+	fstrm__iothr_maybe_open(iothr);
 
-	/* Perform the deferred deallocations. */
-	for (unsigned i = 0; i < iothr->outq_idx; i++)
-		fstrm__iothr_queue_entry_free_bytes(&iothr->outq_entries[i]);
+	for (;;) {
+		unsigned count;
 
-	/* Zero counters and indices. */
-	iothr->outq_idx = 0;
-	iothr->outq_nbytes = 0;
-}
+		fstrm__iothr_direct_disable(iothr);
 
-static void
-fstrm__iothr_maybe_flush_output(struct fstrm_iothr *iothr, size_t nbytes)
-{
-	assert(iothr->outq_idx <= iothr->opt.output_queue_size);
-	if (iothr->outq_idx > 0) {
-		if (iothr->outq_idx >= iothr->opt.output_queue_size ||
-		    iothr->outq_nbytes + nbytes >= iothr->opt.buffer_hint)
-		{
-			/*
-			 * If the output queue is full, or there are more than
-			 * 'buffer_hint' bytes of data ready to be sent, flush
-			 * the output.
-			 */
-			fstrm__iothr_flush_output(iothr);
+		if (unlikely(iothr->shutting_down)) {
+			fstrm__iothr_shutdown(iothr);
+			break;
 		}
-	}
-}
 
-static void
-fstrm__iothr_process_queue_entry(struct fstrm_iothr *iothr,
-				 struct fstrm__iothr_queue_entry *entry)
-{
-	if (likely(iothr->opened)) {
-		size_t nbytes = sizeof(uint32_t) + entry->len_data;
+		fstrm__iothr_maybe_open(iothr);
 
-		fstrm__iothr_maybe_flush_output(iothr, nbytes);
+		/*
+		 * Catch up on the data frames spooled while the writer was
+		 * closed. New data frames keep being appended to the spool
+		 * until it is empty, so alternate with draining the input
+		 * queues, and don't sleep until the spool is empty.
+		 */
+		if (unlikely(fstrm__iothr_drain_spool(iothr))) {
+			(void)fstrm__iothr_process_queues(iothr);
+			continue;
+		}
 
-		/* Copy the entry to the array of outstanding queue entries. */
-		iothr->outq_entries[iothr->outq_idx] = *entry;
+		/*
+		 * If the input queues are not being drained, producers would
+		 * find them full and keep waking us. Sleep until the next
+		 * reopen attempt, or the one in progress finishes, without
+		 * advertising that we are parked.
+		 */
+		if (unlikely(fstrm__iothr_hold_input(iothr))) {
+			fstrm__iothr_sleep(iothr, fstrm__iothr_reopen_wait(iothr));
+			continue;
+		}
 
-		/* Add an iovec for the entry. */
-		iothr->outq_iov[iothr->outq_idx].iov_base = (void *)entry->data;
-		iothr->outq_iov[iothr->outq_idx].iov_len = (size_t)entry->len_data;
+		count = fstrm__iothr_process_queues(iothr);
+		if (count != 0) {
+			spin_start.tv_sec = spin_start.tv_nsec = 0;
+			iothr->busy = true;
+			fstrm__iothr_maybe_flush_aged(iothr);
+			continue;
+		}
 
-		/* Increment the number of output queue entries. */
-		iothr->outq_idx++;
+		/*
+		 * With flush_max_age, don't hold on to the output buffer once
+		 * the input queues have gone idle.
+		 */
+		if (iothr->opt.flush_max_age != 0)
+			fstrm__iothr_flush_output(iothr, fstrm__iothr_flush_idle);
 
-		/* There are now nbytes more data waiting to be sent. */
-		iothr->outq_nbytes += nbytes;
-	} else {
-		/* Writer is closed, just discard the payload. */
-		fstrm__iothr_queue_entry_free_bytes(entry);
+		if (iothr->opt.wait_strategy == FSTRM_IOTHR_WAIT_STRATEGY_SPIN_PARK) {
+			uint64_t timeout = 0;
+
+			if (fstrm__iothr_spin(iothr, &spin_start))
+				continue;
+			spin_start.tv_sec = spin_start.tv_nsec = 0;
+
+			/*
+			 * The input queues have gone idle, so there is nothing
+			 * to be gained by holding on to the output buffer.
+			 * Only set a timeout if the writer needs reopening, or
+			 * input queues which have grown are to be shrunk.
+			 */
+			if (!iothr->opened)
+				timeout = fstrm__iothr_reopen_wait(iothr);
+			else if (atomic_load(&iothr->num_grown) != 0)
+				timeout = FSTRM__IOTHR_QUEUE_SHRINK_IDLE;
+			fstrm__iothr_flush_output(iothr, fstrm__iothr_flush_idle);
+			(void)fstrm__iothr_park(iothr, timeout);
+		} else {
+			uint64_t timeout = fstrm__iothr_timed_wait(iothr);
+
+			if (!iothr->opened &&
+			    fstrm__iothr_reopen_wait(iothr) < timeout)
+			{
+				timeout = fstrm__iothr_reopen_wait(iothr);
+			}
+			if (fstrm__iothr_budget_low(iothr))
+				fstrm__iothr_flush_output(iothr, fstrm__iothr_flush_idle);
+			if (fstrm__iothr_park(iothr, timeout))
+				fstrm__iothr_flush_output(iothr, fstrm__iothr_flush_timeout);
+			fstrm__iothr_clear_idle(iothr);
+		}
 	}
+
+	return NULL;
 }
 
-static unsigned
-fstrm__iothr_process_queues(struct fstrm_iothr *iothr)
+/*
+ * Do one pass of the I/O work for an I/O thread object that has no thread of
+ * its own: reopen the writer if needed, drain the input queues, and flush the
+ * output queue once they are idle. Returns zero if there may be more work to
+ * do right away. Otherwise, returns the number of microseconds after which
+ * this must be called again, or UINT64_MAX if only once a producer wakes the
+ * thread doing the I/O work. Unlike the dedicated I/O thread, this does not
+ * spin.
+ */
+static uint64_t
+fstrm__iothr_run(struct fstrm_iothr *iothr)
 {
-	struct fstrm__iothr_queue_entry entry;
-	unsigned total = 0;
+	uint64_t now, timeout = UINT64_MAX;
+
+	fstrm__iothr_direct_disable(iothr);
+	fstrm__iothr_clear_idle(iothr);
+	fstrm__iothr_maybe_open(iothr);
+
+	/* See fstrm__iothr_thr(). */
+	if (unlikely(fstrm__iothr_drain_spool(iothr))) {
+		(void)fstrm__iothr_process_queues(iothr);
+		return 0;
+	}
+	if (unlikely(fstrm__iothr_hold_input(iothr)))
+		return fstrm__iothr_reopen_wait(iothr);
+
+	if (fstrm__iothr_process_queues(iothr) != 0) {
+		iothr->busy = true;
+		fstrm__iothr_maybe_flush_aged(iothr);
+		return 0;
+	}
 
 	/*
-	 * Remove input queue entries from each thread's circular queue, and
-	 * add them to our output queue.
+	 * The input queues are idle. On the timed wait strategy, producers
+	 * don't wake us until their queue is filling up, so check back every
+	 * flush_timeout seconds, and flush the output queue once it has been
+	 * idle that long. With flush_max_age, or if producers are running out
+	 * of queued payload bytes, flush it now, but still check back for the
+	 * data frames which did not wake us, see fstrm__iothr_timed_wait().
+	 * Otherwise, flush it now, and sleep until woken.
 	 */
-	for (unsigned i = 0; i < iothr->opt.num_input_queues; i++) {
-		if (iothr->queue_ops->remove(iothr->queues[i].q, &entry, NULL)) {
-			fstrm__iothr_process_queue_entry(iothr, &entry);
-			total++;
+	if (iothr->opt.wait_strategy == FSTRM_IOTHR_WAIT_STRATEGY_TIMED &&
+	    iothr->opt.flush_max_age == 0 && !fstrm__iothr_budget_low(iothr))
+	{
+		timeout = fstrm__iothr_timed_wait(iothr);
+		if (iothr->outq->idx > 0) {
+			now = fstrm__iothr_now_us(iothr);
+			if (iothr->flush_deadline == 0)
+				iothr->flush_deadline = now + timeout;
+			if (now >= iothr->flush_deadline)
+				fstrm__iothr_flush_output(iothr, fstrm__iothr_flush_timeout);
+			else
+				timeout = iothr->flush_deadline - now;
 		}
+	} else {
+		fstrm__iothr_flush_output(iothr, fstrm__iothr_flush_idle);
+		if (iothr->opt.wait_strategy == FSTRM_IOTHR_WAIT_STRATEGY_TIMED)
+			timeout = fstrm__iothr_timed_wait(iothr);
 	}
 
-	return total;
+	if (!iothr->opened && fstrm__iothr_reopen_wait(iothr) < timeout)
+		timeout = fstrm__iothr_reopen_wait(iothr);
+	if (atomic_load(&iothr->num_grown) != 0 &&
+	    timeout > FSTRM__IOTHR_QUEUE_SHRINK_IDLE)
+	{
+		timeout = FSTRM__IOTHR_QUEUE_SHRINK_IDLE;
+	}
+	return timeout;
 }
 
-static fstrm_res
-fstrm__iothr_open(struct fstrm_iothr *iothr)
+/*
+ * Shut down the I/O work of an attached I/O thread object which is being
+ * destroyed, and remove it from the reactor. Called by the reactor thread.
+ */
+static void
+fstrm__iothr_reactor_detach(struct fstrm_iothr_reactor *reactor,
+			    struct fstrm_iothr *iothr)
 {
-	fstrm_res res;
+	struct fstrm_iothr **p;
 
-	res = fstrm_writer_open(iothr->writer);
-	if (res == fstrm_res_success)
-		iothr->opened = true;
-	else
-		iothr->opened = false;
-	return res;
+	fstrm__iothr_shutdown(iothr);
+
+	pthread_mutex_lock(&reactor->waker.lock);
+	for (p = &reactor->iothrs; *p != iothr; p = &(*p)->reactor_next);
+	*p = iothr->reactor_next;
+	iothr->detached = true;
+	pthread_cond_broadcast(&reactor->detach_cv);
+	pthread_mutex_unlock(&reactor->waker.lock);
 }
 
+/*
+ * Sleep until a producer or fstrm_iothr_destroy() wakes the reactor thread, or
+ * 'timeout' microseconds have elapsed. See fstrm__iothr_park(). 'iothrs' is the
+ * list of attached I/O thread objects the reactor thread last ran.
+ */
 static void
-fstrm__iothr_maybe_open(struct fstrm_iothr *iothr)
+fstrm__iothr_reactor_park(struct fstrm_iothr_reactor *reactor,
+			  struct fstrm_iothr *iothrs, uint64_t timeout)
 {
-	/* If we're already connected, there's nothing to do. */
-	if (likely(iothr->opened))
-		return;
-
-	time_t since;
+	struct fstrm_iothr *iothr;
 	struct timespec ts;
 
-	/* Check if the reopen interval has expired yet. */
-#if HAVE_CLOCK_GETTIME
-	int rv = clock_gettime(iothr->clkid_gettime, &ts);
-	assert(rv == 0);
-#else
-	my_gettime(-1, &ts);
-#endif
-	since = ts.tv_sec - iothr->last_open_attempt;
-	if (since < (time_t) iothr->opt.reopen_interval)
-		return;
+	atomic_store(&reactor->waker.parked, true);
 
-	/* Attempt to open the transport. */
-	iothr->last_open_attempt = ts.tv_sec;
-	if (fstrm__iothr_open(iothr) != fstrm_res_success)
+	/*
+	 * An I/O thread object attached since then has not been run yet, and
+	 * its wakeup may have come before 'parked' was set, so don't park.
+	 * Attaching one after this wakes the reactor thread as usual.
+	 */
+	pthread_mutex_lock(&reactor->waker.lock);
+	iothr = reactor->iothrs;
+	pthread_mutex_unlock(&reactor->waker.lock);
+	if (iothr != iothrs) {
+		atomic_store(&reactor->waker.parked, false);
 		return;
-}
+	}
+	for (; iothr != NULL; iothr = iothr->reactor_next) {
+		if (iothr->shutting_down || fstrm__iothr_open_done(iothr) ||
+		    fstrm__iothr_process_queues(iothr) != 0)
+		{
+			atomic_store(&reactor->waker.parked, false);
+			return;
+		}
+		fstrm__iothr_direct_enable(iothr);
+	}
 
-static void
-fstrm__iothr_thr_setup(void)
-{
-	sigset_t set;
-	int s;
+	if (timeout != UINT64_MAX) {
+		const struct timespec delta = {
+			.tv_sec = timeout / 1000000,
+			.tv_nsec = (timeout % 1000000) * 1000,
+		};
+		fstrm__iothr_waker_gettime(&reactor->waker, &ts);
+		my_timespec_add(&delta, &ts);
+	}
 
-	sigemptyset(&set);
-	sigaddset(&set, SIGPIPE);
-	s = pthread_sigmask(SIG_BLOCK, &set, NULL);
-	assert(s == 0);
+	pthread_mutex_lock(&reactor->waker.lock);
+	while (atomic_load(&reactor->waker.parked) && !reactor->shutting_down) {
+		if (timeout != UINT64_MAX) {
+			if (pthread_cond_timedwait(&reactor->waker.cv,
+						   &reactor->waker.lock,
+						   &ts) == ETIMEDOUT)
+			{
+				break;
+			}
+		} else {
+			pthread_cond_wait(&reactor->waker.cv, &reactor->waker.lock);
+		}
+	}
+	atomic_store(&reactor->waker.parked, false);
+	pthread_mutex_unlock(&reactor->waker.lock);
 }
 
 static void *
-fstrm__iothr_thr(void *arg)
+fstrm__iothr_reactor_thr(void *arg)
 {
-	struct fstrm_iothr *iothr = (struct fstrm_iothr *)arg;
+	struct fstrm_iothr_reactor *reactor = (struct fstrm_iothr_reactor *)arg;
 
 	fstrm__iothr_thr_setup();
-	fstrm__iothr_maybe_open(iothr);
 
-	for (;;) {
-		int res;
-		unsigned count;
+	while (!reactor->shutting_down) {
+		struct fstrm_iothr *iothrs, *iothr, *next;
+		uint64_t timeout = UINT64_MAX;
 
-		if (unlikely(iothr->shutting_down)) {
-			while (fstrm__iothr_process_queues(iothr));
-			fstrm__iothr_flush_output(iothr);
-			fstrm__iothr_close(iothr);
-			break;
+		pthread_mutex_lock(&reactor->waker.lock);
+		iothrs = reactor->iothrs;
+		pthread_mutex_unlock(&reactor->waker.lock);
+
+		for (iothr = iothrs; iothr != NULL; iothr = next) {
+			uint64_t t;
+
+			next = iothr->reactor_next;
+			if (unlikely(iothr->shutting_down)) {
+				fstrm__iothr_reactor_detach(reactor, iothr);
+				continue;
+			}
+			t = fstrm__iothr_run(iothr);
+			if (t < timeout)
+				timeout = t;
 		}
 
-		fstrm__iothr_maybe_open(iothr);
+		if (timeout != 0)
+			fstrm__iothr_reactor_park(reactor, iothrs, timeout);
+	}
 
-		count = fstrm__iothr_process_queues(iothr);
-		if (count != 0)
-			continue;
+	return NULL;
+}
+
+struct fstrm_iothr_reactor *
+fstrm_iothr_reactor_init(void)
+{
+	struct fstrm_iothr_reactor *reactor;
+	int res;
+
+	reactor = my_calloc(1, sizeof(*reactor));
 
-		struct timespec ts;
 #if HAVE_CLOCK_GETTIME
-#if HAVE_PTHREAD_CONDATTR_SETCLOCK
-		int rv = clock_gettime(iothr->clkid_pthread, &ts);
-#else
-		int rv = clock_gettime(CLOCK_REALTIME, &ts);
-#endif
-		assert(rv == 0);
+	clockid_t clkid_gettime, clkid_pthread;
+
+	if (!fstrm__get_best_monotonic_clocks(&clkid_gettime, &clkid_pthread,
+					      NULL))
+	{
+		my_free(reactor);
+		return NULL;
+	}
+	fstrm__iothr_waker_init(&reactor->waker, clkid_pthread);
 #else
-		my_gettime(-1, &ts);
+	fstrm__iothr_waker_init(&reactor->waker);
 #endif
-		ts.tv_sec += iothr->opt.flush_timeout;
 
-		pthread_mutex_lock(&iothr->cv_lock);
-		res = pthread_cond_timedwait(&iothr->cv, &iothr->cv_lock, &ts);
-		pthread_mutex_unlock(&iothr->cv_lock);
+	res = pthread_cond_init(&reactor->detach_cv, NULL);
+	assert(res == 0);
+
+	res = pthread_create(&reactor->thr, NULL, fstrm__iothr_reactor_thr,
+			     reactor);
+	assert(res == 0);
+
+	return reactor;
+}
+
+void
+fstrm_iothr_reactor_destroy(struct fstrm_iothr_reactor **reactor)
+{
+	if (*reactor != NULL) {
+		pthread_mutex_lock(&(*reactor)->waker.lock);
+		assert((*reactor)->iothrs == NULL);
+		(*reactor)->shutting_down = true;
+		atomic_store(&(*reactor)->waker.parked, false);
+		pthread_cond_signal(&(*reactor)->waker.cv);
+		pthread_mutex_unlock(&(*reactor)->waker.lock);
+		pthread_join((*reactor)->thr, NULL);
 
-		if (res == ETIMEDOUT)
-			fstrm__iothr_flush_output(iothr);
+		fstrm__iothr_waker_destroy(&(*reactor)->waker);
+		pthread_cond_destroy(&(*reactor)->detach_cv);
+		my_free(*reactor);
 	}
+}
 
-	return NULL;
+int
+fstrm_iothr_get_fd(struct fstrm_iothr *iothr)
+{
+	return iothr->waker.fds[0];
+}
+
+fstrm_res
+fstrm_iothr_run_once(struct fstrm_iothr *iothr, int *timeout)
+{
+	uint8_t buf[64];
+	uint64_t t;
+
+	if (!iothr->opt.external_drive)
+		return fstrm_res_failure;
+
+	/* Consume the wakeups. */
+	while (read(iothr->waker.fds[0], buf, sizeof(buf)) > 0);
+	atomic_store(&iothr->waker.parked, false);
+
+	t = fstrm__iothr_run(iothr);
+	if (t != 0) {
+		/*
+		 * Advertise that we are about to sleep, and check the input
+		 * queues again. See fstrm__iothr_park().
+		 */
+		atomic_store(&iothr->waker.parked, true);
+		if (fstrm__iothr_open_done(iothr) ||
+		    fstrm__iothr_process_queues(iothr) != 0)
+		{
+			atomic_store(&iothr->waker.parked, false);
+			t = 0;
+		} else {
+			fstrm__iothr_direct_enable(iothr);
+		}
+	}
+
+	if (t == UINT64_MAX)
+		*timeout = -1;
+	else if (t / 1000 >= INT_MAX)
+		*timeout = INT_MAX;
+	else
+		*timeout = (int) ((t + 999) / 1000);
+	return fstrm_res_success;
 }
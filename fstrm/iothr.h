@@ -84,6 +84,10 @@ fstrm_iothr_options_destroy(struct fstrm_iothr_options **opt);
  * Set the `buffer_hint` parameter. This is the threshold number of bytes to
  * accumulate in the output buffer before forcing a buffer flush.
  *
+ * Large values are most useful together with a writer that coalesces small
+ * data frames, see fstrm_writer_options_set_coalesce_threshold(), and a
+ * correspondingly large `output_queue_size`.
+ *
  * \param opt
  *	`fstrm_iothr_options` object.
  * \param buffer_hint
@@ -104,7 +108,7 @@ fstrm_iothr_options_set_buffer_hint(
 #define FSTRM_IOTHR_BUFFER_HINT_DEFAULT			8192
 
 /** Maximum `buffer_hint` value. */
-#define FSTRM_IOTHR_BUFFER_HINT_MAX			65536
+#define FSTRM_IOTHR_BUFFER_HINT_MAX			16777216
 
 /**
  * Set the `flush_timeout` parameter. This is the number of seconds to allow
@@ -132,6 +136,47 @@ fstrm_iothr_options_set_flush_timeout(
 /** Maximum `flush_timeout` value. */
 #define FSTRM_IOTHR_FLUSH_TIMEOUT_MAX			600
 
+/**
+ * Set the `flush_max_age` parameter. This is the maximum number of
+ * microseconds after its submission a data frame may remain buffered before
+ * it is flushed, or 0 to disable the limit.
+ *
+ * When this parameter is set, the output buffer is also flushed as soon as
+ * the input queues are found empty, so that data frames are delivered
+ * promptly at low traffic, while at high traffic they continue to be
+ * coalesced into writes of up to `buffer_hint` bytes for at most
+ * `flush_max_age` microseconds. With #FSTRM_IOTHR_WAIT_STRATEGY_TIMED, the
+ * I/O thread also wakes up every `flush_max_age` microseconds, rather than
+ * every `flush_timeout` seconds, to collect data frames from the input queues
+ * while there are any. Once it has found none for that long, the next data
+ * frame submitted wakes it up.
+ *
+ * Data frames are timestamped on submission, as with the `track_latency`
+ * parameter. The ages are measured with the monotonic clock selected by the
+ * library, which may be a coarse clock ticking only every few milliseconds.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param flush_max_age
+ *	New `flush_max_age` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_iothr_options_set_flush_max_age(
+	struct fstrm_iothr_options *opt,
+	unsigned flush_max_age);
+
+/** Minimum `flush_max_age` value. */
+#define FSTRM_IOTHR_FLUSH_MAX_AGE_MIN			0
+
+/** Default `flush_max_age` value. */
+#define FSTRM_IOTHR_FLUSH_MAX_AGE_DEFAULT		0
+
+/** Maximum `flush_max_age` value. */
+#define FSTRM_IOTHR_FLUSH_MAX_AGE_MAX			600000000
+
 /**
  * Set the `input_queue_size` parameter. This is the number of queue entries to
  * allocate per each input queue. This option controls the number of outstanding
@@ -162,10 +207,82 @@ fstrm_iothr_options_set_input_queue_size(
 /** Maximum `input_queue_size` value. */
 #define FSTRM_IOTHR_INPUT_QUEUE_SIZE_MAX		16384
 
+/**
+ * Set the `input_queue_max_bytes` parameter. This is the number of bytes of
+ * queue entries each input queue may grow to. On 64-bit platforms, each queue
+ * entry takes 16 or 24 bytes, depending on the `track_latency` parameter,
+ * regardless of the size of the data frame it refers to.
+ *
+ * Input queues start out with **input_queue_size** entries. If this parameter
+ * allows it, an input queue found full by a producer is doubled in size, so
+ * that the data frame is accepted rather than rejected or dropped. With
+ * #FSTRM_IOTHR_DROP_POLICY_SAMPLE, this happens once sampling would start
+ * instead. Once a grown input queue has been idle for 10 seconds, it is shrunk
+ * back to **input_queue_size** entries; with #FSTRM_IOTHR_QUEUE_MODEL_SPSC,
+ * by the next submission to it.
+ *
+ * With #FSTRM_IOTHR_QUEUE_MODEL_MPSC, growing input queues costs each
+ * submission two more atomic operations, so the default is 0, which keeps the
+ * input queues at **input_queue_size** entries.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param input_queue_max_bytes
+ *	New `input_queue_max_bytes` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_iothr_options_set_input_queue_max_bytes(
+	struct fstrm_iothr_options *opt,
+	size_t input_queue_max_bytes);
+
+/** Default `input_queue_max_bytes` value. */
+#define FSTRM_IOTHR_INPUT_QUEUE_MAX_BYTES_DEFAULT	0
+
+/** Maximum `input_queue_max_bytes` value. */
+#define FSTRM_IOTHR_INPUT_QUEUE_MAX_BYTES_MAX		1073741824
+
+/**
+ * Set the `queued_bytes_max` parameter. This is the number of bytes of data
+ * frame payloads which may be queued across all of the input queues, from
+ * their submission until the `fstrm_iothr` object is done with them and
+ * invokes their deallocation callbacks.
+ *
+ * A data frame which would take the queued payload bytes over this limit is
+ * rejected with #fstrm_res_again, as if its input queue was full. With
+ * #FSTRM_IOTHR_DROP_POLICY_OLDEST, the oldest data frames in its input queue
+ * are discarded to make room for it instead, as far as they do. A data frame
+ * is always accepted while no other payload bytes are queued, so that one
+ * larger than this limit is not rejected forever.
+ *
+ * Unlike **input_queue_size**, this bounds the memory held by queued data
+ * frames regardless of their size. It is enforced with an atomic counter
+ * shared by all producers, which costs each submission two more atomic
+ * operations. The default is 0, which sets no limit and does not maintain the
+ * counter.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param queued_bytes_max
+ *	New `queued_bytes_max` value.
+ *
+ * \retval #fstrm_res_success
+ */
+fstrm_res
+fstrm_iothr_options_set_queued_bytes_max(
+	struct fstrm_iothr_options *opt,
+	size_t queued_bytes_max);
+
+/** Default `queued_bytes_max` value. */
+#define FSTRM_IOTHR_QUEUED_BYTES_MAX_DEFAULT		0
+
 /**
  * Set the `num_input_queues` parameter. This is the number of input queues to
  * create and must match the number of times that fstrm_iothr_get_input_queue()
- * is called on the corresponding `fstrm_iothr` object.
+ * is called on the corresponding `fstrm_iothr` object. The entries of an input
+ * queue are only allocated once it is first obtained.
  *
  * \param opt
  *	`fstrm_iothr_options` object.
@@ -192,6 +309,10 @@ fstrm_iothr_options_set_num_input_queues(
  * data frames that can be accumulated in the output queue before a buffer flush
  * must occur and thus affects performance and memory usage.
  *
+ * The data frames of a buffer flush are handed to the writer together, which
+ * writes them out in as many system calls as needed, so this parameter is not
+ * limited by the platform's `IOV_MAX`.
+ *
  * \param opt
  *	`fstrm_iothr_options` object.
  * \param output_queue_size
@@ -212,7 +333,7 @@ fstrm_iothr_options_set_output_queue_size(
 #define FSTRM_IOTHR_OUTPUT_QUEUE_SIZE_DEFAULT		64
 
 /** Maximum `output_queue_size` value. */
-#define FSTRM_IOTHR_OUTPUT_QUEUE_SIZE_MAX		IOV_MAX
+#define FSTRM_IOTHR_OUTPUT_QUEUE_SIZE_MAX		65536
 
 /**
  * Queue models.
@@ -256,6 +377,8 @@ fstrm_iothr_options_set_queue_model(
  * Set the `queue_notify_threshold` parameter. This controls the number of
  * outstanding queue entries to allow on an input queue before waking the I/O
  * thread, which will cause the outstanding queue entries to begin draining.
+ * This parameter is only used by the #FSTRM_IOTHR_WAIT_STRATEGY_TIMED wait
+ * strategy.
  *
  * \param opt
  *	`fstrm_iothr_options` object.
@@ -280,6 +403,19 @@ fstrm_iothr_options_set_queue_notify_threshold(
  * Set the `reopen_interval` parameter. This controls the number of seconds to
  * wait between attempts to reopen a closed `fstrm_writer` output stream.
  *
+ * The output stream is opened asynchronously. Until the first attempt
+ * finishes, the data frames wait in the input queues. After that, the I/O
+ * thread keeps draining the input queues while an attempt is in progress. Up
+ * to `output_queue_size` of the data frames drained meanwhile are held until
+ * the attempt finishes, and the rest are discarded as if the output stream
+ * were closed, unless a spool file is in use.
+ *
+ * After each failed attempt, the interval is doubled, up to
+ * `reopen_interval_max` seconds, and the actual wait is chosen at random
+ * between half and all of the interval, so that many writers reconnecting to
+ * the same receiver spread out their attempts. The interval is reset to
+ * `reopen_interval` once the output stream is open.
+ *
  * \param opt
  *	`fstrm_iothr_options` object.
  * \param reopen_interval
@@ -302,6 +438,416 @@ fstrm_iothr_options_set_reopen_interval(
 /** Maximum `reopen_interval` value. */
 #define FSTRM_IOTHR_REOPEN_INTERVAL_MAX			600
 
+/**
+ * Set the `reopen_interval_max` parameter. This is the number of seconds the
+ * interval between attempts to reopen the output stream backs off to. It is
+ * never less than `reopen_interval`.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param reopen_interval_max
+ *	New `reopen_interval_max` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_iothr_options_set_reopen_interval_max(
+	struct fstrm_iothr_options *opt,
+	unsigned reopen_interval_max);
+
+/** Minimum `reopen_interval_max` value. */
+#define FSTRM_IOTHR_REOPEN_INTERVAL_MAX_MIN		1
+
+/** Default `reopen_interval_max` value. */
+#define FSTRM_IOTHR_REOPEN_INTERVAL_MAX_DEFAULT		60
+
+/** Maximum `reopen_interval_max` value. */
+#define FSTRM_IOTHR_REOPEN_INTERVAL_MAX_MAX		3600
+
+/**
+ * Set the `spool_path` parameter. This is the path of a local file in which
+ * the I/O thread stores data frames while the output stream is not open,
+ * instead of discarding them. Once the output stream has been (re)opened, the
+ * data frames in the spool file are written to it in order, before any data
+ * frames submitted later.
+ *
+ * The spool file is created by fstrm_iothr_init(), which fails if the file
+ * cannot be opened. It is a Frame Streams file, and is removed by
+ * fstrm_iothr_destroy() unless it still holds data frames which could not be
+ * written to the output stream. In that case, the next `fstrm_iothr` object
+ * created with the same `spool_path` writes those data frames first. Any other
+ * existing file at `spool_path` is truncated.
+ *
+ * The default is NULL, which disables spooling.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param spool_path
+ *	Path of the spool file. The string is copied.
+ *
+ * \retval #fstrm_res_success
+ */
+fstrm_res
+fstrm_iothr_options_set_spool_path(
+	struct fstrm_iothr_options *opt,
+	const char *spool_path);
+
+/**
+ * Set the `spool_size` parameter. This is the maximum number of bytes of data
+ * frames held in the spool file. Data frames which do not fit are discarded.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param spool_size
+ *	New `spool_size` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_iothr_options_set_spool_size(
+	struct fstrm_iothr_options *opt,
+	size_t spool_size);
+
+/** Minimum `spool_size` value. */
+#define FSTRM_IOTHR_SPOOL_SIZE_MIN			1048576
+
+/** Default `spool_size` value. */
+#define FSTRM_IOTHR_SPOOL_SIZE_DEFAULT			268435456
+
+/**
+ * Wait strategies.
+ * \see fstrm_iothr_options_set_wait_strategy()
+ */
+typedef enum {
+	/**
+	 * Sleep on a condition variable. The I/O thread is woken when an input
+	 * queue reaches `queue_notify_threshold` outstanding entries, or every
+	 * `flush_timeout` seconds.
+	 */
+	FSTRM_IOTHR_WAIT_STRATEGY_TIMED,
+
+	/**
+	 * Poll the input queues for up to `spin_duration` microseconds, then
+	 * flush the output buffer and park until a data frame is submitted.
+	 */
+	FSTRM_IOTHR_WAIT_STRATEGY_SPIN_PARK,
+} fstrm_iothr_wait_strategy;
+
+/**
+ * Set the `wait_strategy` parameter. This controls how the I/O thread waits
+ * for new data frames when its input queues are empty.
+ *
+ * With #FSTRM_IOTHR_WAIT_STRATEGY_SPIN_PARK, producers only pay for a wakeup
+ * when the I/O thread is actually parked, and an idle I/O thread with an open
+ * output stream does not wake up periodically.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param wait_strategy
+ *	New `wait_strategy` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_iothr_options_set_wait_strategy(
+	struct fstrm_iothr_options *opt,
+	fstrm_iothr_wait_strategy wait_strategy);
+
+/** Default `wait_strategy` value. */
+#define FSTRM_IOTHR_WAIT_STRATEGY_DEFAULT		FSTRM_IOTHR_WAIT_STRATEGY_TIMED
+
+/**
+ * Set the `spin_duration` parameter. This is the number of microseconds the
+ * I/O thread polls its empty input queues before parking, when the wait
+ * strategy is #FSTRM_IOTHR_WAIT_STRATEGY_SPIN_PARK.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param spin_duration
+ *	New `spin_duration` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_iothr_options_set_spin_duration(
+	struct fstrm_iothr_options *opt,
+	unsigned spin_duration);
+
+/** Minimum `spin_duration` value. */
+#define FSTRM_IOTHR_SPIN_DURATION_MIN			0
+
+/** Default `spin_duration` value. */
+#define FSTRM_IOTHR_SPIN_DURATION_DEFAULT		50
+
+/** Maximum `spin_duration` value. */
+#define FSTRM_IOTHR_SPIN_DURATION_MAX			1000000
+
+/**
+ * Set the `track_latency` parameter. If non-zero, each data frame is
+ * timestamped when it is submitted, and the I/O thread records the time it
+ * spent waiting to be written into a histogram which can be retrieved with
+ * fstrm_iothr_get_latency().
+ *
+ * This makes each input queue entry 8 bytes larger and costs a read of the
+ * monotonic clock per submitted data frame (or per fstrm_iothr_submit_batch()
+ * call), so it is disabled by default.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param track_latency
+ *	New `track_latency` value.
+ *
+ * \retval #fstrm_res_success
+ */
+fstrm_res
+fstrm_iothr_options_set_track_latency(
+	struct fstrm_iothr_options *opt,
+	int track_latency);
+
+/** Default `track_latency` value. */
+#define FSTRM_IOTHR_TRACK_LATENCY_DEFAULT		0
+
+/**
+ * Set the `pipeline_writes` parameter. If non-zero, the output queue is double
+ * buffered: a separate writer thread writes one buffer of data frames to the
+ * writer while the I/O thread keeps draining the input queues into the other.
+ * This keeps the input queues from filling up while a write blocks, e.g. on a
+ * socket whose peer is slow to read, at the cost of a second thread and a
+ * second output buffer.
+ *
+ * With this option, the deallocation callbacks of written data frames are
+ * called on the writer thread rather than the I/O thread.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param pipeline_writes
+ *	New `pipeline_writes` value.
+ *
+ * \retval #fstrm_res_success
+ */
+fstrm_res
+fstrm_iothr_options_set_pipeline_writes(
+	struct fstrm_iothr_options *opt,
+	int pipeline_writes);
+
+/** Default `pipeline_writes` value. */
+#define FSTRM_IOTHR_PIPELINE_WRITES_DEFAULT		0
+
+/**
+ * Set the `reactor` parameter. If non-NULL, fstrm_iothr_init() does not start
+ * an I/O thread of its own. Instead, the I/O work is done by the thread of the
+ * given `fstrm_iothr_reactor` object, which may be shared by any number of
+ * `fstrm_iothr` objects. This reduces the number of threads, and of timer
+ * wakeups, in processes with many output streams.
+ *
+ * The reactor thread does not spin, so the `spin_duration` parameter is
+ * ignored. With #FSTRM_IOTHR_WAIT_STRATEGY_TIMED, the reactor thread still
+ * checks the input queues every `flush_timeout` seconds.
+ *
+ * The `fstrm_iothr_reactor` object must outlive every `fstrm_iothr` object
+ * using it.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param reactor
+ *	`fstrm_iothr_reactor` object, or NULL.
+ *
+ * \retval #fstrm_res_success
+ */
+fstrm_res
+fstrm_iothr_options_set_reactor(
+	struct fstrm_iothr_options *opt,
+	struct fstrm_iothr_reactor *reactor);
+
+/**
+ * Set the `external_drive` parameter. If non-zero, fstrm_iothr_init() does not
+ * start an I/O thread. Instead, the application does the I/O work by calling
+ * fstrm_iothr_run_once(), typically from its own event loop, whenever the file
+ * descriptor returned by fstrm_iothr_get_fd() becomes readable or the timeout
+ * returned by fstrm_iothr_run_once() expires. This may not be combined with
+ * the `reactor` parameter.
+ *
+ * fstrm_iothr_run_once() and fstrm_iothr_destroy() must not be called
+ * concurrently. fstrm_iothr_destroy() writes out the queued data frames on the
+ * calling thread. fstrm_iothr_run_once() blocks the calling thread while it
+ * opens the writer, and while it writes to it. To bound the former, the
+ * connect and handshake timeouts of a socket-based writer are each capped at
+ * #FSTRM_IOTHR_EXTERNAL_DRIVE_TIMEOUT_MAX milliseconds.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param external_drive
+ *	New `external_drive` value.
+ *
+ * \retval #fstrm_res_success
+ */
+fstrm_res
+fstrm_iothr_options_set_external_drive(
+	struct fstrm_iothr_options *opt,
+	int external_drive);
+
+/** Default `external_drive` value. */
+#define FSTRM_IOTHR_EXTERNAL_DRIVE_DEFAULT		0
+
+/**
+ * With the `external_drive` parameter, the maximum connect and handshake
+ * timeouts of a socket-based writer, in milliseconds.
+ */
+#define FSTRM_IOTHR_EXTERNAL_DRIVE_TIMEOUT_MAX		200
+
+/**
+ * Set the `direct_write` parameter. If non-zero, fstrm_iothr_submit() and
+ * fstrm_iothr_submitv() write the data frame to the output stream themselves,
+ * on the calling thread, when the I/O thread is idle: the output stream is
+ * open, and every data frame submitted before has been written out. This saves
+ * the hand-off to the I/O thread, and its wakeup, for low-rate streams where
+ * latency matters more than batching.
+ *
+ * A data frame is still queued as usual if its input queue is not empty, so
+ * that the data frames of each input queue are written in order, or if
+ * another thread is writing to the output stream at the time; the submitting
+ * thread never waits for the writer. With #FSTRM_IOTHR_WAIT_STRATEGY_TIMED
+ * and no `flush_max_age`, the I/O thread holds on to buffered data frames
+ * while idle, so direct writes only happen once they have been flushed.
+ *
+ * A directly written data frame is deallocated on the submitting thread, and
+ * is not included in the statistics returned by fstrm_iothr_get_latency(). If
+ * the write fails, the data frame is discarded, and the I/O thread closes the
+ * output stream and reopens it as usual.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param direct_write
+ *	New `direct_write` value.
+ *
+ * \retval #fstrm_res_success
+ */
+fstrm_res
+fstrm_iothr_options_set_direct_write(
+	struct fstrm_iothr_options *opt,
+	int direct_write);
+
+/** Default `direct_write` value. */
+#define FSTRM_IOTHR_DIRECT_WRITE_DEFAULT		0
+
+/**
+ * Drop policies.
+ * \see fstrm_iothr_options_set_drop_policy()
+ */
+typedef enum {
+	/**
+	 * Reject the data frame being submitted when the input queue is full,
+	 * by returning #fstrm_res_again. Data frames which reach the I/O
+	 * thread while the output stream is not open are discarded.
+	 */
+	FSTRM_IOTHR_DROP_POLICY_NEWEST,
+
+	/**
+	 * Discard the oldest data frame in the input queue to make room for the
+	 * one being submitted, like a flight recorder. While the output stream
+	 * is not open, the I/O thread leaves the input queues alone, so that
+	 * the most recent data frames are written once it is reopened.
+	 */
+	FSTRM_IOTHR_DROP_POLICY_OLDEST,
+
+	/**
+	 * Once an input queue is fuller than `drop_sample_threshold` percent,
+	 * discard submitted data frames at random, with a probability rising
+	 * linearly to 1 as the queue fills up. Otherwise like
+	 * #FSTRM_IOTHR_DROP_POLICY_NEWEST.
+	 */
+	FSTRM_IOTHR_DROP_POLICY_SAMPLE,
+} fstrm_iothr_drop_policy;
+
+/**
+ * Set the `drop_policy` parameter. This controls which data frames are
+ * discarded when the output stream cannot keep up with the producers.
+ *
+ * Data frames discarded by the #FSTRM_IOTHR_DROP_POLICY_OLDEST and
+ * #FSTRM_IOTHR_DROP_POLICY_SAMPLE policies are accepted by the submission
+ * functions, which return #fstrm_res_success, and their `free_func` is invoked
+ * from the submitting thread. They are counted in `struct fstrm_iothr_stats`.
+ *
+ * With #FSTRM_IOTHR_DROP_POLICY_OLDEST, the input queues always use the
+ * lock-free multiple producer queue implementation, since producers also
+ * remove entries from them, and fstrm_iothr_reserve() is not available.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param drop_policy
+ *	New `drop_policy` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_iothr_options_set_drop_policy(
+	struct fstrm_iothr_options *opt,
+	fstrm_iothr_drop_policy drop_policy);
+
+/** Default `drop_policy` value. */
+#define FSTRM_IOTHR_DROP_POLICY_DEFAULT			FSTRM_IOTHR_DROP_POLICY_NEWEST
+
+/**
+ * Set the `drop_sample_threshold` parameter. This is the input queue fill
+ * level, in percent, above which the #FSTRM_IOTHR_DROP_POLICY_SAMPLE policy
+ * starts discarding data frames.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param drop_sample_threshold
+ *	New `drop_sample_threshold` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_iothr_options_set_drop_sample_threshold(
+	struct fstrm_iothr_options *opt,
+	unsigned drop_sample_threshold);
+
+/** Minimum `drop_sample_threshold` value. */
+#define FSTRM_IOTHR_DROP_SAMPLE_THRESHOLD_MIN		0
+
+/** Default `drop_sample_threshold` value. */
+#define FSTRM_IOTHR_DROP_SAMPLE_THRESHOLD_DEFAULT	75
+
+/** Maximum `drop_sample_threshold` value. */
+#define FSTRM_IOTHR_DROP_SAMPLE_THRESHOLD_MAX		99
+
+/**
+ * Set the `reserve_buffer_size` parameter. This is the size in bytes of the
+ * buffer that each input queue allocates the first time fstrm_iothr_reserve()
+ * is called on it. It bounds the total size of the data frames that can be
+ * outstanding on that queue through fstrm_iothr_reserve(), and must be a power
+ * of 2.
+ *
+ * \param opt
+ *	`fstrm_iothr_options` object.
+ * \param reserve_buffer_size
+ *	New `reserve_buffer_size` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_iothr_options_set_reserve_buffer_size(
+	struct fstrm_iothr_options *opt,
+	unsigned reserve_buffer_size);
+
+/** Minimum `reserve_buffer_size` value. */
+#define FSTRM_IOTHR_RESERVE_BUFFER_SIZE_MIN		4096
+
+/** Default `reserve_buffer_size` value. */
+#define FSTRM_IOTHR_RESERVE_BUFFER_SIZE_DEFAULT		262144
+
+/** Maximum `reserve_buffer_size` value. */
+#define FSTRM_IOTHR_RESERVE_BUFFER_SIZE_MAX		268435456
+
 /**
  * Initialize an `fstrm_iothr` object. This creates a background I/O thread
  * which asynchronously writes data frames submitted by other threads which call
@@ -329,12 +875,83 @@ fstrm_iothr_init(
  * flush or discard any queued data frames and deallocates any resources used
  * internally. This function blocks until the I/O thread has terminated.
  *
+ * Producers sleeping in fstrm_iothr_submit_wait() return #fstrm_res_failure,
+ * and this function waits for them to do so. Otherwise, no other function
+ * may be called on the `fstrm_iothr` object, or its queues, once this
+ * function has been called.
+ *
  * \param iothr
  *	Pointer to `fstrm_iothr` object.
  */
 void
 fstrm_iothr_destroy(struct fstrm_iothr **iothr);
 
+/**
+ * Initialize an `fstrm_iothr_reactor` object. This starts a reactor thread,
+ * which does the I/O work of the `fstrm_iothr` objects initialized with it as
+ * their `reactor` parameter, see fstrm_iothr_options_set_reactor().
+ *
+ * \return
+ *	`fstrm_iothr_reactor` object.
+ * \retval
+ *	NULL on failure.
+ */
+struct fstrm_iothr_reactor *
+fstrm_iothr_reactor_init(void);
+
+/**
+ * Destroy an `fstrm_iothr_reactor` object, stopping the reactor thread. Every
+ * `fstrm_iothr` object using the reactor must have been destroyed first.
+ *
+ * \param reactor
+ *	Pointer to `fstrm_iothr_reactor` object.
+ */
+void
+fstrm_iothr_reactor_destroy(struct fstrm_iothr_reactor **reactor);
+
+/**
+ * Return the file descriptor of an `fstrm_iothr` object with the
+ * `external_drive` parameter, which becomes readable when fstrm_iothr_run_once()
+ * should be called. The caller must not read from or close it.
+ *
+ * \param iothr
+ *	`fstrm_iothr` object.
+ *
+ * \return
+ *	File descriptor, or -1 without the `external_drive` parameter.
+ */
+int
+fstrm_iothr_get_fd(struct fstrm_iothr *iothr);
+
+/**
+ * Do a bounded step of the I/O work of an `fstrm_iothr` object with the
+ * `external_drive` parameter: open the writer if needed, move the queued data
+ * frames to the output buffer, and write it out once it is full or the input
+ * queues are idle.
+ *
+ * This blocks the calling thread while the writer is being opened, for up to
+ * the transport's connect and handshake timeouts, see
+ * #FSTRM_IOTHR_EXTERNAL_DRIVE_TIMEOUT_MAX. Writes block it too, unless they
+ * are handed to a writer thread, see fstrm_iothr_options_set_pipeline_writes().
+ * The file descriptor returned by fstrm_iothr_get_fd() does not reflect
+ * whether the output stream is writable.
+ *
+ * \param iothr
+ *	`fstrm_iothr` object.
+ * \param[out] timeout
+ *	The number of milliseconds after which fstrm_iothr_run_once() must be
+ *	called again even if the file descriptor returned by
+ *	fstrm_iothr_get_fd() has not become readable: 0 if there is more work
+ *	to do right away, and -1 if there is no deadline. This is suitable for
+ *	passing to poll().
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ *	The `external_drive` parameter was not set.
+ */
+fstrm_res
+fstrm_iothr_run_once(struct fstrm_iothr *iothr, int *timeout);
+
 /**
  * Obtain an `fstrm_iothr_queue` object for submitting data frames to the
  * `fstrm_iothr` object. `fstrm_iothr_queue` objects are child objects of their
@@ -348,7 +965,8 @@ fstrm_iothr_destroy(struct fstrm_iothr **iothr);
  *
  * `fstrm_iothr` objects allocate a fixed total number of `fstrm_iothr_queue`
  * objects during the call to fstrm_iothr_init(). To adjust this parameter, use
- * fstrm_iothr_options_set_num_input_queues().
+ * fstrm_iothr_options_set_num_input_queues(). The entries of each input queue
+ * are allocated when it is first obtained.
  *
  * This function will fail if it is called more than **num_input_queues** times.
  * By default, only one input queue is initialized per `fstrm_iothr` object.
@@ -371,6 +989,40 @@ fstrm_iothr_destroy(struct fstrm_iothr **iothr);
 struct fstrm_iothr_queue *
 fstrm_iothr_get_input_queue(struct fstrm_iothr *iothr);
 
+/**
+ * Obtain an `fstrm_iothr_queue` object like fstrm_iothr_get_input_queue(), and
+ * register the deallocation callback that data frames submitted to it will
+ * normally use.
+ *
+ * Input queue entries usually carry the `free_func` and `free_data` arguments
+ * to fstrm_iothr_submit() and the related functions. The entries of an input
+ * queue with a registered callback leave them out, which halves their size, so
+ * that twice as many fit in the same memory. Data frames submitted with any
+ * other `free_func` and `free_data` are still accepted, at the cost of an
+ * extra memory allocation each. Data frames committed with
+ * fstrm_iothr_commit() do not need one.
+ *
+ * The callback is registered for the lifetime of the input queue.
+ * fstrm_iothr_get_input_queue_idx() fails on an input queue obtained from this
+ * function.
+ *
+ * \param iothr
+ *	`fstrm_iothr` object.
+ * \param free_func
+ *	Deallocation callback, as for fstrm_iothr_submit(). May be NULL.
+ * \param free_data
+ *	Parameter passed to `free_func`.
+ *
+ * \return
+ *	`fstrm_iothr_queue` object.
+ * \retval
+ *	NULL on failure.
+ */
+struct fstrm_iothr_queue *
+fstrm_iothr_get_input_queue_free(struct fstrm_iothr *iothr,
+				 void (*free_func)(void *, void *),
+				 void *free_data);
+
 /**
  * Obtain an `fstrm_iothr_queue` object for submitting data frames to the
  * `fstrm_iothr` object. This function is like fstrm_iothr_get_input_queue()
@@ -443,6 +1095,245 @@ fstrm_iothr_submit(
 	void *data, size_t len,
 	void (*free_func)(void *buf, void *free_data), void *free_data);
 
+/**
+ * Submit a data frame to the background I/O thread, waiting for space in the
+ * input queue if it is full. This function is like fstrm_iothr_submit(),
+ * except that instead of returning #fstrm_res_again immediately, the calling
+ * thread sleeps until the I/O thread has drained entries from the input queue,
+ * or until `timeout` milliseconds have elapsed.
+ *
+ * The I/O thread only has to wake producers when some are actually waiting, so
+ * this function does not slow down fstrm_iothr_submit() callers.
+ *
+ * \param iothr
+ *	`fstrm_iothr` object.
+ * \param ioq
+ *	`fstrm_iothr_queue` object.
+ * \param data
+ *	Data frame bytes.
+ * \param len
+ *	Number of bytes in `data`.
+ * \param free_func
+ *	Callback function to deallocate the data frame, see
+ *	fstrm_iothr_submit().
+ * \param free_data
+ *	Parameter to pass to `free_func`.
+ * \param timeout
+ *	Maximum number of milliseconds to wait. Zero does not wait at all, and a
+ *	negative value waits indefinitely.
+ *
+ * \retval #fstrm_res_success
+ *	The data frame was successfully queued.
+ * \retval #fstrm_res_again
+ *	The queue was still full when `timeout` expired.
+ * \retval #fstrm_res_invalid
+ *	The data frame is empty, or too large.
+ * \retval #fstrm_res_failure
+ *	Permanent failure, e.g. the `fstrm_iothr` object is being destroyed.
+ */
+fstrm_res
+fstrm_iothr_submit_wait(
+	struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+	void *data, size_t len,
+	void (*free_func)(void *buf, void *free_data), void *free_data,
+	int timeout);
+
+/**
+ * Retrieve the occupancy of an input queue, so that producers can shed or
+ * sample load before the queue fills up. This is cheap enough to be called
+ * before every submission, but with concurrent producers and the I/O thread
+ * at work, the result is only an estimate.
+ *
+ * \param iothr
+ *	`fstrm_iothr` object.
+ * \param ioq
+ *	`fstrm_iothr_queue` object.
+ * \param[out] depth
+ *	Number of data frames waiting in the input queue.
+ * \param[out] capacity
+ *	Number of data frames the input queue can hold. May be NULL.
+ */
+void
+fstrm_iothr_get_queue_occupancy(
+	struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+	unsigned *depth, unsigned *capacity);
+
+/**
+ * Submit a data frame whose payload is scattered across several buffers to the
+ * background I/O thread. This function is like fstrm_iothr_submit(), except
+ * that the payload is the concatenation of the `iovcnt` buffers described by
+ * `iov`, which are written to the output stream as a single data frame without
+ * being copied.
+ *
+ * The `iov` array itself and all of the buffers it describes must remain valid
+ * until `free_func` is invoked, which is passed `iov` as its `buf` parameter.
+ *
+ * \param iothr
+ *	`fstrm_iothr` object.
+ * \param ioq
+ *	`fstrm_iothr_queue` object.
+ * \param iov
+ *	Array of `struct iovec` objects describing the data frame's segments.
+ * \param iovcnt
+ *	Number of `struct iovec` objects in `iov`, at most
+ *	#FSTRM_IOTHR_SUBMITV_IOVCNT_MAX.
+ * \param free_func
+ *	Callback function to deallocate the data frame. The `buf` parameter
+ *	passed to this callback is `iov`.
+ * \param free_data
+ *	Parameter to pass to `free_func`.
+ *
+ * \retval #fstrm_res_success
+ *	The data frame was successfully queued.
+ * \retval #fstrm_res_again
+ *	The queue is full.
+ * \retval #fstrm_res_invalid
+ *	The data frame is empty, too large, or has too many segments.
+ * \retval #fstrm_res_failure
+ *	Permanent failure.
+ */
+fstrm_res
+fstrm_iothr_submitv(
+	struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+	const struct iovec *iov, int iovcnt,
+	void (*free_func)(void *buf, void *free_data), void *free_data);
+
+/** Maximum number of segments in a data frame passed to fstrm_iothr_submitv(). */
+#define FSTRM_IOTHR_SUBMITV_IOVCNT_MAX			16
+
+/**
+ * A data frame to be submitted with fstrm_iothr_submit_batch(). The fields
+ * have the same meaning as the corresponding parameters of
+ * fstrm_iothr_submit().
+ */
+struct fstrm_iothr_frame {
+	/** Data frame bytes. */
+	void	*data;
+
+	/** Number of bytes in `data`. */
+	size_t	len;
+
+	/** Callback function to deallocate the data frame. May be NULL. */
+	void	(*free_func)(void *buf, void *free_data);
+
+	/** Parameter to pass to `free_func`. */
+	void	*free_data;
+};
+
+/**
+ * Submit an array of data frames to the background I/O thread. This function
+ * is like fstrm_iothr_submit(), except that the frames are enqueued in array
+ * order onto the input queue with far fewer synchronization operations, and
+ * the I/O thread is woken at most once.
+ *
+ * If the input queue does not have space for all of the frames, the leading
+ * frames which fit are enqueued and #fstrm_res_again is returned. The number
+ * of frames enqueued is returned in `n_submitted`; responsibility for
+ * deallocating those frames passes to the `fstrm` library, while the caller
+ * retains responsibility for the rest.
+ *
+ * All frames are validated before any are enqueued. If any frame is invalid,
+ * no frames are enqueued and #fstrm_res_invalid is returned.
+ *
+ * \param iothr
+ *	`fstrm_iothr` object.
+ * \param ioq
+ *	`fstrm_iothr_queue` object.
+ * \param frames
+ *	Array of data frames.
+ * \param n_frames
+ *	Number of data frames in `frames`.
+ * \param[out] n_submitted
+ *	If non-NULL, the number of leading frames of `frames` which were
+ *	enqueued.
+ *
+ * \retval #fstrm_res_success
+ *	All of the data frames were successfully queued.
+ * \retval #fstrm_res_again
+ *	The queue is full. Only `n_submitted` data frames were queued.
+ * \retval #fstrm_res_invalid
+ *	A data frame was invalid. No data frames were queued.
+ * \retval #fstrm_res_failure
+ *	Permanent failure. No data frames were queued.
+ */
+fstrm_res
+fstrm_iothr_submit_batch(
+	struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+	const struct fstrm_iothr_frame *frames, size_t n_frames,
+	size_t *n_submitted);
+
+/**
+ * Reserve space for a data frame in the input queue's own buffer. The caller
+ * serializes the data frame directly into the returned memory and then passes
+ * it to the I/O thread with fstrm_iothr_commit(). Unlike fstrm_iothr_submit(),
+ * this requires no allocation by the caller and no deallocation callback; the
+ * space is reclaimed by the I/O thread once the data frame has been written.
+ *
+ * Only one reservation may be outstanding on an input queue at a time. On an
+ * #FSTRM_IOTHR_QUEUE_MODEL_MPSC queue, the reservation holds a lock on the
+ * input queue's buffer until it is committed or cancelled, so other threads
+ * calling fstrm_iothr_reserve() on the same queue will block.
+ *
+ * The buffer is allocated on the first call, and its size is set with
+ * fstrm_iothr_options_set_reserve_buffer_size().
+ *
+ * \param iothr
+ *	`fstrm_iothr` object.
+ * \param ioq
+ *	`fstrm_iothr_queue` object.
+ * \param len
+ *	Maximum number of bytes in the data frame.
+ * \param[out] data
+ *	Where to store a pointer to `len` bytes of reserved memory.
+ *
+ * \retval #fstrm_res_success
+ *	The space was reserved.
+ * \retval #fstrm_res_again
+ *	The buffer does not currently have `len` bytes free.
+ * \retval #fstrm_res_invalid
+ *	`len` is zero, or too large to ever fit in the buffer.
+ * \retval #fstrm_res_failure
+ *	Permanent failure, or the `drop_policy` is
+ *	#FSTRM_IOTHR_DROP_POLICY_OLDEST.
+ */
+fstrm_res
+fstrm_iothr_reserve(
+	struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+	size_t len, void **data);
+
+/**
+ * Submit the data frame in the space obtained from the last call to
+ * fstrm_iothr_reserve() on the input queue to the background I/O thread.
+ *
+ * `len` may be smaller than the length that was reserved, in which case the
+ * remainder of the reservation is returned to the buffer. If `len` is zero,
+ * the reservation is cancelled and nothing is submitted.
+ *
+ * If the input queue is full, #fstrm_res_again is returned and the
+ * reservation, including its contents, remains valid. The caller should either
+ * retry the commit or cancel the reservation.
+ *
+ * \param iothr
+ *	`fstrm_iothr` object.
+ * \param ioq
+ *	`fstrm_iothr_queue` object.
+ * \param len
+ *	Number of bytes in the data frame, or zero to cancel the reservation.
+ *
+ * \retval #fstrm_res_success
+ *	The data frame was successfully queued, or the reservation was
+ *	cancelled.
+ * \retval #fstrm_res_again
+ *	The queue is full.
+ * \retval #fstrm_res_invalid
+ *	There is no outstanding reservation, or `len` is larger than the
+ *	reservation.
+ */
+fstrm_res
+fstrm_iothr_commit(
+	struct fstrm_iothr *iothr, struct fstrm_iothr_queue *ioq,
+	size_t len);
+
 /**
  * Wrapper function for the system's `free()`, suitable for use as the
  * `free_func` callback for fstrm_iothr_submit().
@@ -455,6 +1346,263 @@ fstrm_iothr_submit(
 void
 fstrm_free_wrapper(void *data, void *free_data);
 
+/**
+ * Statistics for an `fstrm_iothr` object, obtained with
+ * fstrm_iothr_get_stats(). Counters are cumulative since fstrm_iothr_init().
+ * Byte counts are data frame payload bytes, excluding the length prefixes.
+ *
+ * New fields are only ever added at the end of this structure. Its size is
+ * passed to fstrm_iothr_get_stats(), so that programs built against an older
+ * version of this header keep working with a newer library, and vice versa.
+ */
+struct fstrm_iothr_stats {
+	/** Data frames accepted onto the input queues. */
+	uint64_t	frames_submitted;
+	/** Bytes accepted onto the input queues. */
+	uint64_t	bytes_submitted;
+
+	/**
+	 * Data frames not accepted because an input queue (or, for
+	 * fstrm_iothr_reserve(), its buffer) was full. Together with
+	 * `frames_rejected_budget`, this is the number of times a submission
+	 * function returned #fstrm_res_again.
+	 */
+	uint64_t	frames_rejected_full;
+	/** Bytes not accepted because an input queue was full. */
+	uint64_t	bytes_rejected_full;
+
+	/**
+	 * Data frames not accepted because `queued_bytes_max` bytes were
+	 * already queued.
+	 */
+	uint64_t	frames_rejected_budget;
+	/** Bytes not accepted because `queued_bytes_max` bytes were queued. */
+	uint64_t	bytes_rejected_budget;
+
+	/**
+	 * Data frames discarded from a full input queue by the
+	 * #FSTRM_IOTHR_DROP_POLICY_OLDEST policy.
+	 */
+	uint64_t	frames_dropped_oldest;
+	/** Bytes discarded by the #FSTRM_IOTHR_DROP_POLICY_OLDEST policy. */
+	uint64_t	bytes_dropped_oldest;
+
+	/**
+	 * Data frames discarded on submission by the
+	 * #FSTRM_IOTHR_DROP_POLICY_SAMPLE policy.
+	 */
+	uint64_t	frames_dropped_sampled;
+	/** Bytes discarded by the #FSTRM_IOTHR_DROP_POLICY_SAMPLE policy. */
+	uint64_t	bytes_dropped_sampled;
+
+	/** Data frames written to the output stream. */
+	uint64_t	frames_written;
+	/** Bytes written to the output stream. */
+	uint64_t	bytes_written;
+	/**
+	 * Data frames written by the submitting thread, with `direct_write`.
+	 * These are included in `frames_written`.
+	 */
+	uint64_t	frames_written_direct;
+
+	/** Data frames discarded because the output stream was not open. */
+	uint64_t	frames_dropped_closed;
+	/** Bytes discarded because the output stream was not open. */
+	uint64_t	bytes_dropped_closed;
+
+	/** Data frames discarded because writing them failed. */
+	uint64_t	frames_dropped_write_error;
+	/** Bytes discarded because writing them failed. */
+	uint64_t	bytes_dropped_write_error;
+
+	/**
+	 * Data frames stored in the spool file while the output stream was not
+	 * open. These are included in `frames_written` once they have been
+	 * written from the spool file to the output stream.
+	 */
+	uint64_t	frames_spooled;
+	/** Bytes stored in the spool file. */
+	uint64_t	bytes_spooled;
+
+	/** Data frames discarded because the spool file was full. */
+	uint64_t	frames_dropped_spool_full;
+	/** Bytes discarded because the spool file was full. */
+	uint64_t	bytes_dropped_spool_full;
+
+	/** Number of writes issued to the output stream. */
+	uint64_t	writev_calls;
+
+	/** Output buffer flushes because the output queue was full. */
+	uint64_t	flushes_queue_full;
+	/** Output buffer flushes because `buffer_hint` bytes were buffered. */
+	uint64_t	flushes_buffer_hint;
+	/**
+	 * Output buffer flushes because `flush_timeout` expired, or data had
+	 * been buffered for `flush_max_age`.
+	 */
+	uint64_t	flushes_timeout;
+	/**
+	 * Output buffer flushes because the input queues were idle
+	 * (#FSTRM_IOTHR_WAIT_STRATEGY_SPIN_PARK), or the I/O thread was shutting
+	 * down.
+	 */
+	uint64_t	flushes_idle;
+
+	/** Attempts to open the output stream, including the first. */
+	uint64_t	open_attempts;
+	/** Failed attempts to open the output stream. */
+	uint64_t	open_failures;
+
+	/**
+	 * Highest number of entries found by the I/O thread in any single
+	 * input queue when draining it.
+	 */
+	uint64_t	queue_depth_hwm;
+
+	/**
+	 * Payload bytes of the data frames currently queued, with
+	 * `queued_bytes_max`. Zero otherwise.
+	 */
+	uint64_t	bytes_queued;
+	/** Highest value observed of `bytes_queued`. */
+	uint64_t	bytes_queued_hwm;
+
+	/** Data frames discarded because writing them to the spool file failed. */
+	uint64_t	frames_dropped_spool_error;
+	/** Bytes discarded because writing them to the spool file failed. */
+	uint64_t	bytes_dropped_spool_error;
+};
+
+/**
+ * Statistics for a single input queue, obtained with
+ * fstrm_iothr_get_queue_stats(). The fields have the same meaning as the
+ * corresponding fields of `struct fstrm_iothr_stats`, and new fields are
+ * likewise only ever added at the end.
+ */
+struct fstrm_iothr_queue_stats {
+	/** Data frames accepted onto the input queue. */
+	uint64_t	frames_submitted;
+	/** Bytes accepted onto the input queue. */
+	uint64_t	bytes_submitted;
+	/** Data frames not accepted because the input queue was full. */
+	uint64_t	frames_rejected_full;
+	/** Bytes not accepted because the input queue was full. */
+	uint64_t	bytes_rejected_full;
+	/** Data frames not accepted because `queued_bytes_max` was reached. */
+	uint64_t	frames_rejected_budget;
+	/** Bytes not accepted because `queued_bytes_max` was reached. */
+	uint64_t	bytes_rejected_budget;
+	/** Data frames discarded by the #FSTRM_IOTHR_DROP_POLICY_OLDEST policy. */
+	uint64_t	frames_dropped_oldest;
+	/** Bytes discarded by the #FSTRM_IOTHR_DROP_POLICY_OLDEST policy. */
+	uint64_t	bytes_dropped_oldest;
+	/** Data frames discarded by the #FSTRM_IOTHR_DROP_POLICY_SAMPLE policy. */
+	uint64_t	frames_dropped_sampled;
+	/** Bytes discarded by the #FSTRM_IOTHR_DROP_POLICY_SAMPLE policy. */
+	uint64_t	bytes_dropped_sampled;
+	/**
+	 * Highest number of entries found by the I/O thread in the input
+	 * queue when draining it.
+	 */
+	uint64_t	queue_depth_hwm;
+};
+
+/**
+ * Retrieve statistics for an `fstrm_iothr` object, summed over all of its
+ * input queues.
+ *
+ * This function may be called from any thread at any time. The counters are
+ * maintained without locks, so a snapshot is not atomic with respect to
+ * concurrent submissions and writes: each counter is individually accurate,
+ * but related counters may be momentarily out of step.
+ *
+ * \param iothr
+ *	`fstrm_iothr` object.
+ * \param[out] stats
+ *	Where to store the statistics.
+ * \param size
+ *	`sizeof(struct fstrm_iothr_stats)`, as compiled into the caller. At
+ *	most this many bytes of `stats` are written.
+ *
+ * \return
+ *	The number of bytes of `stats` filled in. This is less than `size` if
+ *	the library predates some of the fields known to the caller, which are
+ *	then set to zero.
+ */
+size_t
+fstrm_iothr_get_stats(struct fstrm_iothr *iothr, struct fstrm_iothr_stats *stats,
+		      size_t size);
+
+/**
+ * Retrieve statistics for a single input queue of an `fstrm_iothr` object. See
+ * fstrm_iothr_get_stats().
+ *
+ * \param iothr
+ *	`fstrm_iothr` object.
+ * \param ioq
+ *	`fstrm_iothr_queue` object.
+ * \param[out] stats
+ *	Where to store the statistics.
+ * \param size
+ *	`sizeof(struct fstrm_iothr_queue_stats)`, as compiled into the caller.
+ *
+ * \return
+ *	The number of bytes of `stats` filled in, as for fstrm_iothr_get_stats().
+ */
+size_t
+fstrm_iothr_get_queue_stats(struct fstrm_iothr *iothr,
+			    struct fstrm_iothr_queue *ioq,
+			    struct fstrm_iothr_queue_stats *stats, size_t size);
+
+/** Number of buckets in `struct fstrm_iothr_latency`. */
+#define FSTRM_IOTHR_LATENCY_BUCKETS			32
+
+/**
+ * Histogram of the time data frames spent between being submitted to an
+ * `fstrm_iothr` and being handed to the writer, obtained with
+ * fstrm_iothr_get_latency().
+ *
+ * The buckets are logarithmic: `buckets[0]` counts data frames which waited
+ * less than 1 microsecond, and `buckets[i]` for `i` > 0 those which waited at
+ * least 2^(i-1) and less than 2^i microseconds. The last bucket also counts
+ * all longer waits.
+ *
+ * The resolution is that of the monotonic clock selected by the library,
+ * which may be a coarse clock ticking only every few milliseconds.
+ */
+struct fstrm_iothr_latency {
+	/** Number of data frames recorded. */
+	uint64_t	count;
+	/** Sum of the recorded latencies, in microseconds. */
+	uint64_t	sum_us;
+	/** Largest recorded latency, in microseconds. */
+	uint64_t	max_us;
+	/** Number of data frames recorded in each bucket. */
+	uint64_t	buckets[FSTRM_IOTHR_LATENCY_BUCKETS];
+};
+
+/**
+ * Retrieve the submit-to-write latency histogram of an `fstrm_iothr` object.
+ * Latencies are recorded for every data frame handed to the writer, whether
+ * or not the write succeeded. Data frames discarded while the writer was
+ * closed are not recorded.
+ *
+ * Like fstrm_iothr_get_stats(), this function may be called from any thread
+ * at any time, and the snapshot is not atomic.
+ *
+ * \param iothr
+ *	`fstrm_iothr` object.
+ * \param[out] latency
+ *	Where to store the histogram.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ *	The `track_latency` option was not enabled.
+ */
+fstrm_res
+fstrm_iothr_get_latency(struct fstrm_iothr *iothr,
+			struct fstrm_iothr_latency *latency);
+
 /**@}*/
 
 #endif /* FSTRM_IOTHR_H */
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2026 by Farsight Security, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "fstrm-private.h"
+
+struct fstrm_iothr_pool_queue {
+	/* Shard used by fstrm_iothr_pool_submit(). */
+	size_t				home;
+
+	/* Input queue of each shard. */
+	struct fstrm_iothr_queue	**queues;
+
+	/* Next handle obtained from the pool, for fstrm_iothr_pool_destroy(). */
+	struct fstrm_iothr_pool_queue	*next;
+};
+
+struct fstrm_iothr_pool {
+	/* Allocated array of I/O threads, size 'num_shards'. */
+	struct fstrm_iothr		**iothrs;
+	size_t				num_shards;
+
+	/*
+	 * Handles obtained by fstrm_iothr_pool_get_input_queue(), most recent
+	 * first. The n'th handle uses each shard's n'th input queue.
+	 */
+	pthread_mutex_t			get_queue_lock;
+	struct fstrm_iothr_pool_queue	*pqs;
+	size_t				num_pqs;
+};
+
+struct fstrm_iothr_pool *
+fstrm_iothr_pool_init(size_t num_shards,
+		      const struct fstrm_iothr_options *opt,
+		      fstrm_iothr_pool_writer_func writer_func,
+		      void *writer_data)
+{
+	struct fstrm_iothr_pool *pool;
+	int res;
+
+	if (num_shards < FSTRM_IOTHR_POOL_NUM_SHARDS_MIN ||
+	    num_shards > FSTRM_IOTHR_POOL_NUM_SHARDS_MAX ||
+	    writer_func == NULL)
+	{
+		return NULL;
+	}
+
+	pool = my_calloc(1, sizeof(*pool));
+	res = pthread_mutex_init(&pool->get_queue_lock, NULL);
+	assert(res == 0);
+
+	pool->iothrs = my_calloc(num_shards, sizeof(struct fstrm_iothr *));
+	pool->num_shards = num_shards;
+	for (size_t i = 0; i < num_shards; i++) {
+		struct fstrm_writer *w;
+		char suffix[32];
+
+		w = writer_func(writer_data, i);
+		if (w == NULL)
+			goto fail;
+
+		/* Give each shard its own spool file. */
+		snprintf(suffix, sizeof(suffix), ".%zu", i);
+		pool->iothrs[i] = fstrm__iothr_init(opt, &w, suffix);
+		if (pool->iothrs[i] == NULL) {
+			(void)fstrm_writer_destroy(&w);
+			goto fail;
+		}
+	}
+
+	return pool;
+fail:
+	fstrm_iothr_pool_destroy(&pool);
+	return NULL;
+}
+
+void
+fstrm_iothr_pool_destroy(struct fstrm_iothr_pool **pool)
+{
+	if (*pool != NULL) {
+		struct fstrm_iothr_pool_queue *pq, *next;
+
+		for (size_t i = 0; i < (*pool)->num_shards; i++)
+			fstrm_iothr_destroy(&(*pool)->iothrs[i]);
+		my_free((*pool)->iothrs);
+
+		for (pq = (*pool)->pqs; pq != NULL; pq = next) {
+			next = pq->next;
+			my_free(pq->queues);
+			my_free(pq);
+		}
+		pthread_mutex_destroy(&(*pool)->get_queue_lock);
+		my_free(*pool);
+	}
+}
+
+size_t
+fstrm_iothr_pool_get_num_shards(const struct fstrm_iothr_pool *pool)
+{
+	return pool->num_shards;
+}
+
+struct fstrm_iothr *
+fstrm_iothr_pool_get_iothr(struct fstrm_iothr_pool *pool, size_t shard)
+{
+	if (shard >= pool->num_shards)
+		return NULL;
+	return pool->iothrs[shard];
+}
+
+struct fstrm_iothr_pool_queue *
+fstrm_iothr_pool_get_input_queue(struct fstrm_iothr_pool *pool)
+{
+	struct fstrm_iothr_pool_queue *pq = NULL;
+
+	pthread_mutex_lock(&pool->get_queue_lock);
+
+	/* Every shard has the same number of input queues. */
+	if (fstrm_iothr_get_input_queue_idx(pool->iothrs[0], pool->num_pqs) == NULL)
+		goto out;
+
+	pq = my_calloc(1, sizeof(*pq));
+	pq->home = pool->num_pqs % pool->num_shards;
+	pq->queues = my_calloc(pool->num_shards, sizeof(struct fstrm_iothr_queue *));
+	for (size_t i = 0; i < pool->num_shards; i++) {
+		pq->queues[i] = fstrm_iothr_get_input_queue_idx(pool->iothrs[i],
+								pool->num_pqs);
+		assert(pq->queues[i] != NULL);
+	}
+
+	pq->next = pool->pqs;
+	pool->pqs = pq;
+	pool->num_pqs++;
+out:
+	pthread_mutex_unlock(&pool->get_queue_lock);
+	return pq;
+}
+
+fstrm_res
+fstrm_iothr_pool_submit(struct fstrm_iothr_pool *pool,
+			struct fstrm_iothr_pool_queue *pq,
+			void *data, size_t len,
+			void (*free_func)(void *, void *), void *free_data)
+{
+	return fstrm_iothr_submit(pool->iothrs[pq->home], pq->queues[pq->home],
+				  data, len, free_func, free_data);
+}
+
+/* 64-bit FNV-1a hash. */
+static inline uint64_t
+fstrm__iothr_pool_hash(const void *key, size_t len_key)
+{
+	const uint8_t *p = key;
+	uint64_t h = UINT64_C(0xcbf29ce484222325);
+
+	for (size_t i = 0; i < len_key; i++) {
+		h ^= p[i];
+		h *= UINT64_C(0x100000001b3);
+	}
+	return h;
+}
+
+fstrm_res
+fstrm_iothr_pool_submit_key(struct fstrm_iothr_pool *pool,
+			    struct fstrm_iothr_pool_queue *pq,
+			    const void *key, size_t len_key,
+			    void *data, size_t len,
+			    void (*free_func)(void *, void *), void *free_data)
+{
+	size_t shard = 0;
+
+	if (pool->num_shards > 1)
+		shard = fstrm__iothr_pool_hash(key, len_key) % pool->num_shards;
+	return fstrm_iothr_submit(pool->iothrs[shard], pq->queues[shard],
+				  data, len, free_func, free_data);
+}
@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2026 by Farsight Security, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef FSTRM_IOTHR_POOL_H
+#define FSTRM_IOTHR_POOL_H
+
+/**
+ * \defgroup fstrm_iothr_pool fstrm_iothr_pool
+ *
+ * The `fstrm_iothr_pool` interface spreads data frames over several
+ * \ref fstrm_iothr I/O threads, or shards, each with its own `fstrm_writer`.
+ * A single I/O thread, and a single output stream, can only go so fast; a pool
+ * of them scales the output across cores and connections.
+ *
+ * The shards are all configured with the same `fstrm_iothr_options`. Their
+ * writers are created by a caller-supplied callback, which is called once for
+ * each shard during fstrm_iothr_pool_init(). If the options specify a spool
+ * file, each shard's spool file is named after it, with a suffix of `.`
+ * followed by the shard number.
+ *
+ * Producers obtain an `fstrm_iothr_pool_queue` handle with
+ * fstrm_iothr_pool_get_input_queue(), which holds one input queue in every
+ * shard. Handles are assigned home shards round-robin, and
+ * fstrm_iothr_pool_submit() submits data frames to the handle's home shard.
+ * fstrm_iothr_pool_submit_key() instead picks the shard by hashing a key, so
+ * that data frames submitted through a handle with the same key are written
+ * to the same output stream, in order.
+ *
+ * Since each handle takes an input queue from every shard, a pool provides as
+ * many handles as the **num_input_queues** option.
+ *
+ * @{
+ */
+
+/**
+ * Callback which creates the writer for a shard of an `fstrm_iothr_pool`.
+ *
+ * \param data
+ *	The `writer_data` parameter passed to fstrm_iothr_pool_init().
+ * \param shard
+ *	The shard number, from 0 to `num_shards` - 1.
+ *
+ * \return
+ *	`fstrm_writer` object, owned by the shard's `fstrm_iothr`.
+ * \retval
+ *	NULL on failure.
+ */
+typedef struct fstrm_writer *
+(*fstrm_iothr_pool_writer_func)(void *data, size_t shard);
+
+/** Minimum `num_shards` value. */
+#define FSTRM_IOTHR_POOL_NUM_SHARDS_MIN			1
+
+/** Maximum `num_shards` value. */
+#define FSTRM_IOTHR_POOL_NUM_SHARDS_MAX			256
+
+/**
+ * Initialize an `fstrm_iothr_pool` object. This creates `num_shards`
+ * `fstrm_iothr` objects, each with a writer created by `writer_func`.
+ *
+ * \param num_shards
+ *	Number of shards, between #FSTRM_IOTHR_POOL_NUM_SHARDS_MIN and
+ *	#FSTRM_IOTHR_POOL_NUM_SHARDS_MAX.
+ * \param opt
+ *	`fstrm_iothr_options` object for every shard. May be NULL, in which
+ *	case the default options will be used.
+ * \param writer_func
+ *	Callback which creates each shard's writer.
+ * \param writer_data
+ *	Parameter to pass to `writer_func`.
+ *
+ * \return
+ *	`fstrm_iothr_pool` object.
+ * \retval
+ *	NULL on failure.
+ */
+struct fstrm_iothr_pool *
+fstrm_iothr_pool_init(
+	size_t num_shards,
+	const struct fstrm_iothr_options *opt,
+	fstrm_iothr_pool_writer_func writer_func,
+	void *writer_data);
+
+/**
+ * Destroy an `fstrm_iothr_pool` object, destroying each shard's `fstrm_iothr`
+ * as with fstrm_iothr_destroy(). The `fstrm_iothr_pool_queue` handles are
+ * destroyed as well.
+ *
+ * \param pool
+ *	Pointer to `fstrm_iothr_pool` object.
+ */
+void
+fstrm_iothr_pool_destroy(struct fstrm_iothr_pool **pool);
+
+/**
+ * Return the number of shards of an `fstrm_iothr_pool`.
+ *
+ * \param pool
+ *	`fstrm_iothr_pool` object.
+ */
+size_t
+fstrm_iothr_pool_get_num_shards(const struct fstrm_iothr_pool *pool);
+
+/**
+ * Return the `fstrm_iothr` object of a shard, e.g. to retrieve its statistics
+ * with fstrm_iothr_get_stats(). The `fstrm_iothr` object remains owned by the
+ * pool.
+ *
+ * \param pool
+ *	`fstrm_iothr_pool` object.
+ * \param shard
+ *	Shard number.
+ *
+ * \return
+ *	`fstrm_iothr` object.
+ * \retval
+ *	NULL if `shard` is out of range.
+ */
+struct fstrm_iothr *
+fstrm_iothr_pool_get_iothr(struct fstrm_iothr_pool *pool, size_t shard);
+
+/**
+ * Obtain an `fstrm_iothr_pool_queue` handle for submitting data frames to the
+ * pool. As with fstrm_iothr_get_input_queue(), each worker thread should have
+ * a dedicated handle, and this function may be called concurrently.
+ *
+ * \param pool
+ *	`fstrm_iothr_pool` object.
+ *
+ * \return
+ *	`fstrm_iothr_pool_queue` object.
+ * \retval
+ *	NULL if all **num_input_queues** handles have been obtained.
+ */
+struct fstrm_iothr_pool_queue *
+fstrm_iothr_pool_get_input_queue(struct fstrm_iothr_pool *pool);
+
+/**
+ * Submit a data frame to the home shard of an `fstrm_iothr_pool_queue` handle.
+ * See fstrm_iothr_submit() for the handling of the data frame.
+ *
+ * \param pool
+ *	`fstrm_iothr_pool` object.
+ * \param pq
+ *	`fstrm_iothr_pool_queue` object.
+ * \param data
+ *	Data frame bytes.
+ * \param len
+ *	Number of bytes in `data`.
+ * \param free_func
+ *	Callback function to deallocate the data frame.
+ * \param free_data
+ *	Parameter to pass to `free_func`.
+ *
+ * \retval #fstrm_res_success
+ *	The data frame was successfully queued.
+ * \retval #fstrm_res_again
+ *	The queue is full.
+ * \retval #fstrm_res_failure
+ *	Permanent failure.
+ */
+fstrm_res
+fstrm_iothr_pool_submit(
+	struct fstrm_iothr_pool *pool, struct fstrm_iothr_pool_queue *pq,
+	void *data, size_t len,
+	void (*free_func)(void *buf, void *free_data), void *free_data);
+
+/**
+ * Submit a data frame to the shard selected by hashing `key`. Data frames
+ * submitted through the same handle with equal keys are written by the same
+ * shard, in the order they were submitted. See fstrm_iothr_submit() for the
+ * handling of the data frame.
+ *
+ * \param pool
+ *	`fstrm_iothr_pool` object.
+ * \param pq
+ *	`fstrm_iothr_pool_queue` object.
+ * \param key
+ *	Key bytes, for example a client address.
+ * \param len_key
+ *	Number of bytes in `key`.
+ * \param data
+ *	Data frame bytes.
+ * \param len
+ *	Number of bytes in `data`.
+ * \param free_func
+ *	Callback function to deallocate the data frame.
+ * \param free_data
+ *	Parameter to pass to `free_func`.
+ *
+ * \retval #fstrm_res_success
+ *	The data frame was successfully queued.
+ * \retval #fstrm_res_again
+ *	The queue is full.
+ * \retval #fstrm_res_failure
+ *	Permanent failure.
+ */
+fstrm_res
+fstrm_iothr_pool_submit_key(
+	struct fstrm_iothr_pool *pool, struct fstrm_iothr_pool_queue *pq,
+	const void *key, size_t len_key,
+	void *data, size_t len,
+	void (*free_func)(void *buf, void *free_data), void *free_data);
+
+/**@}*/
+
+#endif /* FSTRM_IOTHR_POOL_H */
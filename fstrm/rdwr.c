@@ -150,6 +150,13 @@ fstrm_rdwr_set_write(struct fstrm_rdwr *rdwr,
 	rdwr->ops.write = fn;
 }
 
+void
+fstrm__rdwr_set_limit_timeouts(struct fstrm_rdwr *rdwr,
+			       fstrm__rdwr_limit_timeouts_func fn)
+{
+	rdwr->ops.limit_timeouts = fn;
+}
+
 fstrm_res
 fstrm__rdwr_read_control_frame(struct fstrm_rdwr *rdwr,
 			       struct fstrm_control *control,
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2026 by Farsight Security, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "fstrm-private.h"
+
+static fstrm_res
+fstrm__socket_connect_nonblocking(int fd, const struct sockaddr *sa,
+				  socklen_t sa_len, unsigned connect_timeout)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	socklen_t len_err = sizeof(int);
+	int err = 0;
+	int flags, n;
+
+	flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return fstrm_res_failure;
+
+	if (connect(fd, sa, sa_len) < 0) {
+		if (errno != EINPROGRESS)
+			return fstrm_res_failure;
+
+		/* Wait for the connection to complete, or fail. */
+		do {
+			n = poll(&pfd, 1, (int) connect_timeout);
+		} while (n == -1 && errno == EINTR);
+		if (n != 1)
+			return fstrm_res_failure;
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len_err) != 0 ||
+		    err != 0)
+		{
+			return fstrm_res_failure;
+		}
+	}
+
+	/* The rest of the I/O on the socket is blocking. */
+	if (fcntl(fd, F_SETFL, flags) == -1)
+		return fstrm_res_failure;
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm__socket_connect(int fd, const struct sockaddr *sa, socklen_t sa_len,
+		      unsigned connect_timeout, unsigned handshake_timeout)
+{
+	if (connect_timeout != 0) {
+		if (fstrm__socket_connect_nonblocking(fd, sa, sa_len,
+						      connect_timeout) != fstrm_res_success)
+		{
+			return fstrm_res_failure;
+		}
+	} else {
+		if (connect(fd, sa, sa_len) < 0)
+			return fstrm_res_failure;
+	}
+
+	/*
+	 * A writer only reads from the socket while waiting for the ACCEPT and
+	 * FINISH control frames, so a receive timeout bounds the handshakes.
+	 */
+	if (handshake_timeout != 0) {
+		const struct timeval tv = {
+			.tv_sec = handshake_timeout / 1000,
+			.tv_usec = (handshake_timeout % 1000) * 1000,
+		};
+		if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0)
+			return fstrm_res_failure;
+	}
+	return fstrm_res_success;
+}
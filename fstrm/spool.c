@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2026 by Farsight Security, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fstrm-private.h"
+
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
+
+/* Number of bytes read from the spool file at a time. */
+#define FSTRM__SPOOL_READ_SIZE		(256 * 1024)
+
+/* Maximum number of data frames passed to the writer at a time. */
+#define FSTRM__SPOOL_DRAIN_FRAMES	128
+
+/*
+ * The spool file is an uni-directional Frame Streams file: an escaped START
+ * control frame, followed by length-prefixed data frames. Data frames are
+ * appended at 'write_off' and drained from 'read_off'. Both offsets are reset
+ * to just past the START frame whenever the spool becomes empty, which keeps
+ * the file from growing beyond the data frames actually held.
+ *
+ * A spool file left behind by fstrm__spool_destroy() is picked up again by
+ * fstrm__spool_init(), so that its data frames are drained first.
+ */
+struct fstrm__spool {
+	int			fd;
+	char			*path;
+	size_t			max_size;
+
+	/* Size of the START control frame at the beginning of the file. */
+	off_t			hdr_len;
+
+	off_t			read_off;
+	off_t			write_off;
+
+	/*
+	 * Read buffer used by fstrm__spool_drain(). The bytes from 'buf_pos' to
+	 * 'buf_len' are the data frames at 'read_off'.
+	 */
+	uint8_t			*buf;
+	size_t			buf_size;
+	size_t			buf_pos;
+	size_t			buf_len;
+
+	struct iovec		iov[FSTRM__SPOOL_DRAIN_FRAMES];
+};
+
+static fstrm_res
+fstrm__spool_pwritev(int fd, struct iovec *iov, int iovcnt, off_t off)
+{
+	while (iovcnt > 0) {
+		ssize_t written;
+
+		if (lseek(fd, off, SEEK_SET) == (off_t) -1)
+			return fstrm_res_failure;
+		written = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+		if (written == -1) {
+			if (errno == EINTR)
+				continue;
+			return fstrm_res_failure;
+		}
+		off += written;
+
+		/* Skip past the segments written, and adjust a partial one. */
+		while (iovcnt > 0 && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (uint8_t *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return fstrm_res_success;
+}
+
+/*
+ * Find the end of the complete data frames in the spool file 'fd' of 'size'
+ * bytes, starting at 'off'. Whatever follows them, such as a data frame cut
+ * short, is not part of the spool.
+ */
+static off_t
+fstrm__spool_scan(int fd, off_t off, off_t size)
+{
+	uint8_t buf[4096];
+	off_t buf_off = 0;
+	size_t buf_len = 0;
+
+	while (size - off >= (off_t) sizeof(uint32_t)) {
+		uint32_t be32, len_frame;
+
+		if (off < buf_off ||
+		    off + (off_t) sizeof(be32) > buf_off + (off_t) buf_len)
+		{
+			ssize_t n = pread(fd, buf, sizeof(buf), off);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n < (ssize_t) sizeof(be32))
+				break;
+			buf_off = off;
+			buf_len = (size_t) n;
+		}
+		memcpy(&be32, buf + (off - buf_off), sizeof(be32));
+		len_frame = ntohl(be32);
+
+		/* Stop at a control frame, or a truncated data frame. */
+		if (len_frame == 0 ||
+		    (off_t) len_frame > size - off - (off_t) sizeof(be32))
+		{
+			break;
+		}
+		off += (off_t) sizeof(be32) + len_frame;
+	}
+	return off;
+}
+
+/*
+ * Resume the spool file 'fd' left behind by an earlier fstrm__spool_destroy(),
+ * if it starts with the START frame 'hdr'. Returns the offset just past its
+ * data frames, or zero if it has to be started afresh.
+ */
+static off_t
+fstrm__spool_resume(int fd, const uint8_t *hdr, size_t len_hdr)
+{
+	uint8_t buf[FSTRM_CONTROL_FRAME_LENGTH_MAX + 2 * sizeof(uint32_t)];
+	struct stat st;
+	ssize_t n;
+
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) len_hdr)
+		return 0;
+	do {
+		n = pread(fd, buf, len_hdr, 0);
+	} while (n == -1 && errno == EINTR);
+	if (n != (ssize_t) len_hdr || memcmp(buf, hdr, len_hdr) != 0)
+		return 0;
+	return fstrm__spool_scan(fd, (off_t) len_hdr, st.st_size);
+}
+
+struct fstrm__spool *
+fstrm__spool_init(const char *path, size_t max_size)
+{
+	struct fstrm__spool *spool;
+	struct fstrm_control *c;
+	uint8_t hdr[FSTRM_CONTROL_FRAME_LENGTH_MAX + 2 * sizeof(uint32_t)];
+	size_t len_hdr = sizeof(hdr);
+	struct iovec iov;
+	off_t end = 0;
+	fstrm_res res;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return NULL;
+
+	c = fstrm_control_init();
+	res = fstrm_control_set_type(c, FSTRM_CONTROL_START);
+	if (res == fstrm_res_success)
+		res = fstrm_control_encode(c, hdr, &len_hdr,
+					   FSTRM_CONTROL_FLAG_WITH_HEADER);
+	fstrm_control_destroy(&c);
+
+	/* Keep the data frames of an existing spool file, if any. */
+	if (res == fstrm_res_success)
+		end = fstrm__spool_resume(fd, hdr, len_hdr);
+	if (res == fstrm_res_success && ftruncate(fd, end) != 0)
+		res = fstrm_res_failure;
+	if (res == fstrm_res_success && end == 0) {
+		iov.iov_base = hdr;
+		iov.iov_len = len_hdr;
+		res = fstrm__spool_pwritev(fd, &iov, 1, 0);
+		end = (off_t) len_hdr;
+	}
+	if (res != fstrm_res_success) {
+		close(fd);
+		(void)unlink(path);
+		return NULL;
+	}
+
+	spool = my_calloc(1, sizeof(*spool));
+	spool->fd = fd;
+	spool->path = my_strdup(path);
+	spool->max_size = max_size;
+	spool->hdr_len = (off_t) len_hdr;
+	spool->read_off = spool->hdr_len;
+	spool->write_off = end;
+	spool->buf_size = FSTRM__SPOOL_READ_SIZE;
+	spool->buf = my_malloc(spool->buf_size);
+	return spool;
+}
+
+/*
+ * Move the data frames which have not been drained yet to the beginning of the
+ * spool file, so that it only holds undelivered data frames. The read buffer
+ * still holds the same bytes at 'read_off' afterwards.
+ */
+static fstrm_res
+fstrm__spool_compact(struct fstrm__spool *spool)
+{
+	uint8_t buf[4096];
+	off_t src = spool->read_off;
+	off_t dst = spool->hdr_len;
+
+	while (src < spool->write_off) {
+		size_t len = sizeof(buf);
+		struct iovec iov;
+		ssize_t n;
+
+		if ((off_t) len > spool->write_off - src)
+			len = (size_t) (spool->write_off - src);
+		n = pread(spool->fd, buf, len, src);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			goto fail;
+		iov.iov_base = buf;
+		iov.iov_len = (size_t) n;
+		if (fstrm__spool_pwritev(spool->fd, &iov, 1, dst) != fstrm_res_success)
+			goto fail;
+		src += n;
+		dst += n;
+	}
+	spool->read_off = spool->hdr_len;
+	spool->write_off = dst;
+	return fstrm_res_success;
+
+fail:
+	/*
+	 * If the data frames were moved into a region overlapping them, they
+	 * may have been partially overwritten, so they have to be discarded.
+	 * Otherwise, they are still intact where they were.
+	 */
+	if (spool->write_off - spool->read_off > spool->read_off - spool->hdr_len) {
+		spool->read_off = spool->hdr_len;
+		spool->write_off = spool->hdr_len;
+		spool->buf_pos = 0;
+		spool->buf_len = 0;
+	}
+	return fstrm_res_failure;
+}
+
+void
+fstrm__spool_destroy(struct fstrm__spool **spool)
+{
+	if (*spool != NULL) {
+		/*
+		 * Data frames which could not be drained are left behind in
+		 * the spool file, for the next fstrm__spool_init() with the
+		 * same path, or to be replayed by other means. If they cannot
+		 * be moved to the beginning, the file is no longer valid.
+		 */
+		if (!fstrm__spool_empty(*spool) &&
+		    (*spool)->read_off > (*spool)->hdr_len &&
+		    fstrm__spool_compact(*spool) != fstrm_res_success)
+		{
+			(*spool)->read_off = (*spool)->write_off;
+		}
+		if (fstrm__spool_empty(*spool))
+			(void)unlink((*spool)->path);
+		else
+			(void)ftruncate((*spool)->fd, (*spool)->write_off);
+		close((*spool)->fd);
+		my_free((*spool)->path);
+		my_free((*spool)->buf);
+		my_free(*spool);
+	}
+}
+
+bool
+fstrm__spool_empty(const struct fstrm__spool *spool)
+{
+	return spool->read_off == spool->write_off;
+}
+
+/*
+ * Write 'iovcnt' segments at '*off', and advance '*off' past them.
+ */
+static fstrm_res
+fstrm__spool_write(struct fstrm__spool *spool, struct iovec *iov, int iovcnt,
+		   off_t *off)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if (fstrm__spool_pwritev(spool->fd, iov, iovcnt, *off) != fstrm_res_success)
+		return fstrm_res_failure;
+	*off += (off_t) len;
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm__spool_append(struct fstrm__spool *spool, const struct iovec *iov,
+		    const unsigned *frame_iovcnt, int nframes, size_t nbytes)
+{
+	struct iovec iovecs[2 * FSTRM__SPOOL_DRAIN_FRAMES];
+	uint32_t be32_lens[FSTRM__SPOOL_DRAIN_FRAMES];
+	off_t off = spool->write_off;
+	int iov_idx = 0, len_idx = 0;
+
+	if ((size_t) (spool->write_off - spool->read_off) + nbytes > spool->max_size)
+		return fstrm_res_again;
+
+	/*
+	 * While the spool is being drained, the data frames already written
+	 * out still take up the beginning of the file. Reclaim that space
+	 * rather than growing the file beyond 'max_size'.
+	 */
+	if ((size_t) (spool->write_off - spool->hdr_len) + nbytes > spool->max_size) {
+		if (fstrm__spool_compact(spool) != fstrm_res_success)
+			return fstrm_res_failure;
+		off = spool->write_off;
+	}
+
+	for (int i = 0; i < nframes; i++) {
+		uint32_t len = 0;
+
+		assert(1 + frame_iovcnt[i] <= FSTRM__SPOOL_DRAIN_FRAMES);
+
+		/* Write out what we have if this frame does not fit. */
+		if (len_idx == FSTRM__SPOOL_DRAIN_FRAMES ||
+		    iov_idx + 1 + (int) frame_iovcnt[i] > 2 * FSTRM__SPOOL_DRAIN_FRAMES)
+		{
+			if (fstrm__spool_write(spool, iovecs, iov_idx, &off) != fstrm_res_success)
+				return fstrm_res_failure;
+			iov_idx = 0;
+			len_idx = 0;
+		}
+
+		for (unsigned j = 0; j < frame_iovcnt[i]; j++)
+			len += iov[j].iov_len;
+
+		/* Frame length. */
+		be32_lens[len_idx] = htonl(len);
+		iovecs[iov_idx].iov_base = &be32_lens[len_idx];
+		iovecs[iov_idx].iov_len = sizeof(uint32_t);
+		iov_idx++;
+		len_idx++;
+
+		/* Frame data segments. */
+		memcpy(&iovecs[iov_idx], iov, frame_iovcnt[i] * sizeof(struct iovec));
+		iov_idx += frame_iovcnt[i];
+		iov += frame_iovcnt[i];
+	}
+	if (iov_idx > 0 &&
+	    fstrm__spool_write(spool, iovecs, iov_idx, &off) != fstrm_res_success)
+	{
+		return fstrm_res_failure;
+	}
+
+	/* Only publish the data frames once all of them have been written. */
+	spool->write_off = off;
+	return fstrm_res_success;
+}
+
+/*
+ * Refill the read buffer from the spool file, keeping the data frames at the
+ * beginning of the buffer which have not been written yet. The buffer is
+ * grown if needed to hold at least one complete data frame.
+ */
+static fstrm_res
+fstrm__spool_fill(struct fstrm__spool *spool)
+{
+	size_t have = spool->buf_len - spool->buf_pos;
+
+	memmove(spool->buf, spool->buf + spool->buf_pos, have);
+	spool->buf_pos = 0;
+	spool->buf_len = have;
+
+	for (;;) {
+		off_t off = spool->read_off + (off_t) spool->buf_len;
+		size_t left = (size_t) (spool->write_off - off);
+		const uint8_t *p = spool->buf;
+		size_t len = spool->buf_len;
+		uint32_t len_frame;
+
+		if (left > spool->buf_size - spool->buf_len)
+			left = spool->buf_size - spool->buf_len;
+		while (left > 0) {
+			ssize_t n = pread(spool->fd, spool->buf + spool->buf_len,
+					  left, off);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return fstrm_res_failure;
+			spool->buf_len += (size_t) n;
+			off += n;
+			left -= (size_t) n;
+		}
+
+		/* Done if the first data frame is complete. */
+		len = spool->buf_len;
+		if (!fs_load_be32(&p, &len, &len_frame))
+			return fstrm_res_failure;
+		if (len_frame <= len)
+			return fstrm_res_success;
+		if (off == spool->write_off)
+			return fstrm_res_failure;
+
+		spool->buf_size = sizeof(uint32_t) + len_frame;
+		spool->buf = my_realloc(spool->buf, spool->buf_size);
+	}
+}
+
+fstrm_res
+fstrm__spool_drain(struct fstrm__spool *spool, struct fstrm_writer *w,
+		   unsigned *frames, size_t *bytes)
+{
+	size_t pos = spool->buf_pos;
+	size_t nbytes = 0;
+	int n = 0;
+
+	*frames = 0;
+	*bytes = 0;
+
+	if (fstrm__spool_empty(spool))
+		return fstrm_res_success;
+
+	/* Parse up to FSTRM__SPOOL_DRAIN_FRAMES complete data frames. */
+	while (n < FSTRM__SPOOL_DRAIN_FRAMES) {
+		const uint8_t *p = spool->buf + pos;
+		size_t len = spool->buf_len - pos;
+		uint32_t len_frame;
+
+		if (!fs_load_be32(&p, &len, &len_frame) || len < len_frame) {
+			if (n > 0)
+				break;
+			if (fstrm__spool_fill(spool) != fstrm_res_success)
+				return fstrm_res_failure;
+			pos = spool->buf_pos;
+			continue;
+		}
+		spool->iov[n].iov_base = (void *) p;
+		spool->iov[n].iov_len = len_frame;
+		pos += sizeof(uint32_t) + len_frame;
+		nbytes += len_frame;
+		n++;
+	}
+
+	if (fstrm_writer_writev(w, spool->iov, n) != fstrm_res_success)
+		return fstrm_res_failure;
+	spool->read_off += (off_t) (pos - spool->buf_pos);
+	spool->buf_pos = pos;
+	*frames = (unsigned) n;
+	*bytes = nbytes;
+
+	/* Reclaim the disk space once everything has been drained. */
+	if (fstrm__spool_empty(spool)) {
+		spool->read_off = spool->hdr_len;
+		spool->write_off = spool->hdr_len;
+		spool->buf_pos = 0;
+		spool->buf_len = 0;
+		(void)ftruncate(spool->fd, spool->hdr_len);
+	}
+	return fstrm_res_success;
+}
@@ -34,6 +34,8 @@
 struct fstrm_tcp_writer_options {
 	char			*socket_address;
 	char			*socket_port;
+	unsigned		connect_timeout;
+	unsigned		handshake_timeout;
 };
 
 struct fstrm__tcp_writer {
@@ -41,12 +43,18 @@ struct fstrm__tcp_writer {
 	int			fd;
 	struct sockaddr_storage	ss;
 	socklen_t		ss_len;
+	unsigned		connect_timeout;
+	unsigned		handshake_timeout;
 };
 
 struct fstrm_tcp_writer_options *
 fstrm_tcp_writer_options_init(void)
 {
-	return my_calloc(1, sizeof(struct fstrm_tcp_writer_options));
+	struct fstrm_tcp_writer_options *twopt;
+	twopt = my_calloc(1, sizeof(*twopt));
+	twopt->connect_timeout = FSTRM_TCP_WRITER_CONNECT_TIMEOUT_DEFAULT;
+	twopt->handshake_timeout = FSTRM_TCP_WRITER_HANDSHAKE_TIMEOUT_DEFAULT;
+	return twopt;
 }
 
 void
@@ -79,6 +87,22 @@ fstrm_tcp_writer_options_set_socket_port(
 		twopt->socket_port = my_strdup(socket_port);
 }
 
+void
+fstrm_tcp_writer_options_set_connect_timeout(
+	struct fstrm_tcp_writer_options *twopt,
+	unsigned connect_timeout)
+{
+	twopt->connect_timeout = connect_timeout;
+}
+
+void
+fstrm_tcp_writer_options_set_handshake_timeout(
+	struct fstrm_tcp_writer_options *twopt,
+	unsigned handshake_timeout)
+{
+	twopt->handshake_timeout = handshake_timeout;
+}
+
 static fstrm_res
 fstrm__tcp_writer_op_open(void *obj)
 {
@@ -130,7 +154,10 @@ fstrm__tcp_writer_op_open(void *obj)
 #endif
 
 	/* Connect the TCP socket. */
-	if (connect(w->fd, (struct sockaddr *) &w->ss, w->ss_len) < 0) {
+	if (fstrm__socket_connect(w->fd, (struct sockaddr *) &w->ss, w->ss_len,
+				  w->connect_timeout,
+				  w->handshake_timeout) != fstrm_res_success)
+	{
 		close(w->fd);
 		return fstrm_res_failure;
 	}
@@ -203,6 +230,14 @@ fstrm__tcp_writer_op_write(void *obj, const struct iovec *iov, int iovcnt)
 	}
 }
 
+static void
+fstrm__tcp_writer_op_limit_timeouts(void *obj, unsigned timeout_max)
+{
+	struct fstrm__tcp_writer *w = obj;
+	fstrm__socket_limit_timeout(&w->connect_timeout, timeout_max);
+	fstrm__socket_limit_timeout(&w->handshake_timeout, timeout_max);
+}
+
 static fstrm_res
 fstrm__tcp_writer_op_destroy(void *obj)
 {
@@ -274,6 +309,8 @@ fstrm_tcp_writer_init(const struct fstrm_tcp_writer_options *twopt,
 		my_free(tw);
 		return NULL;
 	}
+	tw->connect_timeout = twopt->connect_timeout;
+	tw->handshake_timeout = twopt->handshake_timeout;
 
 	rdwr = fstrm_rdwr_init(tw);
 	fstrm_rdwr_set_destroy(rdwr, fstrm__tcp_writer_op_destroy);
@@ -281,5 +318,7 @@ fstrm_tcp_writer_init(const struct fstrm_tcp_writer_options *twopt,
 	fstrm_rdwr_set_close(rdwr, fstrm__tcp_writer_op_close);
 	fstrm_rdwr_set_read(rdwr, fstrm__tcp_writer_op_read);
 	fstrm_rdwr_set_write(rdwr, fstrm__tcp_writer_op_write);
+	fstrm__rdwr_set_limit_timeouts(rdwr,
+		fstrm__tcp_writer_op_limit_timeouts);
 	return fstrm_writer_init(wopt, &rdwr);
 }
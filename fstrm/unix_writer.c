@@ -32,18 +32,26 @@
 
 struct fstrm_unix_writer_options {
 	char			*socket_path;
+	unsigned		connect_timeout;
+	unsigned		handshake_timeout;
 };
 
 struct fstrm__unix_writer {
 	bool			connected;
 	int			fd;
 	struct sockaddr_un	sa;
+	unsigned		connect_timeout;
+	unsigned		handshake_timeout;
 };
 
 struct fstrm_unix_writer_options *
 fstrm_unix_writer_options_init(void)
 {
-	return my_calloc(1, sizeof(struct fstrm_unix_writer_options));
+	struct fstrm_unix_writer_options *uwopt;
+	uwopt = my_calloc(1, sizeof(*uwopt));
+	uwopt->connect_timeout = FSTRM_UNIX_WRITER_CONNECT_TIMEOUT_DEFAULT;
+	uwopt->handshake_timeout = FSTRM_UNIX_WRITER_HANDSHAKE_TIMEOUT_DEFAULT;
+	return uwopt;
 }
 
 void
@@ -65,6 +73,22 @@ fstrm_unix_writer_options_set_socket_path(
 		uwopt->socket_path = my_strdup(socket_path);
 }
 
+void
+fstrm_unix_writer_options_set_connect_timeout(
+	struct fstrm_unix_writer_options *uwopt,
+	unsigned connect_timeout)
+{
+	uwopt->connect_timeout = connect_timeout;
+}
+
+void
+fstrm_unix_writer_options_set_handshake_timeout(
+	struct fstrm_unix_writer_options *uwopt,
+	unsigned handshake_timeout)
+{
+	uwopt->handshake_timeout = handshake_timeout;
+}
+
 static fstrm_res
 fstrm__unix_writer_op_open(void *obj)
 {
@@ -116,7 +140,10 @@ fstrm__unix_writer_op_open(void *obj)
 #endif
 
 	/* Connect the AF_UNIX socket. */
-	if (connect(w->fd, (struct sockaddr *) &w->sa, sizeof(w->sa)) < 0) {
+	if (fstrm__socket_connect(w->fd, (struct sockaddr *) &w->sa, sizeof(w->sa),
+				  w->connect_timeout,
+				  w->handshake_timeout) != fstrm_res_success)
+	{
 		close(w->fd);
 		return fstrm_res_failure;
 	}
@@ -189,6 +216,14 @@ fstrm__unix_writer_op_write(void *obj, const struct iovec *iov, int iovcnt)
 	}
 }
 
+static void
+fstrm__unix_writer_op_limit_timeouts(void *obj, unsigned timeout_max)
+{
+	struct fstrm__unix_writer *w = obj;
+	fstrm__socket_limit_timeout(&w->connect_timeout, timeout_max);
+	fstrm__socket_limit_timeout(&w->handshake_timeout, timeout_max);
+}
+
 static fstrm_res
 fstrm__unix_writer_op_destroy(void *obj)
 {
@@ -213,6 +248,8 @@ fstrm_unix_writer_init(const struct fstrm_unix_writer_options *uwopt,
 	uw = my_calloc(1, sizeof(*uw));
 	uw->sa.sun_family = AF_UNIX;
 	strncpy(uw->sa.sun_path, uwopt->socket_path, sizeof(uw->sa.sun_path) - 1);
+	uw->connect_timeout = uwopt->connect_timeout;
+	uw->handshake_timeout = uwopt->handshake_timeout;
 
 	rdwr = fstrm_rdwr_init(uw);
 	fstrm_rdwr_set_destroy(rdwr, fstrm__unix_writer_op_destroy);
@@ -220,5 +257,7 @@ fstrm_unix_writer_init(const struct fstrm_unix_writer_options *uwopt,
 	fstrm_rdwr_set_close(rdwr, fstrm__unix_writer_op_close);
 	fstrm_rdwr_set_read(rdwr, fstrm__unix_writer_op_read);
 	fstrm_rdwr_set_write(rdwr, fstrm__unix_writer_op_write);
+	fstrm__rdwr_set_limit_timeouts(rdwr,
+		fstrm__unix_writer_op_limit_timeouts);
 	return fstrm_writer_init(wopt, &rdwr);
 }
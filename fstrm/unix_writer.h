@@ -68,6 +68,43 @@ fstrm_unix_writer_options_set_socket_path(
 	struct fstrm_unix_writer_options *uwopt,
 	const char *socket_path);
 
+/**
+ * Set the `connect_timeout` option. This is the number of milliseconds the
+ * writer waits for a connection to the `AF_UNIX` socket to be established. Zero
+ * waits for as long as the operating system does.
+ *
+ * \param uwopt
+ *	`fstrm_unix_writer_options` object.
+ * \param connect_timeout
+ *	New `connect_timeout` value.
+ */
+void
+fstrm_unix_writer_options_set_connect_timeout(
+	struct fstrm_unix_writer_options *uwopt,
+	unsigned connect_timeout);
+
+/** Default `connect_timeout` value. */
+#define FSTRM_UNIX_WRITER_CONNECT_TIMEOUT_DEFAULT		5000
+
+/**
+ * Set the `handshake_timeout` option. This is the number of milliseconds the
+ * writer waits for each control frame from the receiver, during the
+ * READY/ACCEPT handshake when opening and the STOP/FINISH handshake when
+ * closing. Zero waits indefinitely.
+ *
+ * \param uwopt
+ *	`fstrm_unix_writer_options` object.
+ * \param handshake_timeout
+ *	New `handshake_timeout` value.
+ */
+void
+fstrm_unix_writer_options_set_handshake_timeout(
+	struct fstrm_unix_writer_options *uwopt,
+	unsigned handshake_timeout);
+
+/** Default `handshake_timeout` value. */
+#define FSTRM_UNIX_WRITER_HANDSHAKE_TIMEOUT_DEFAULT		5000
+
 /**
  * Initialize the `fstrm_writer` object. Note that the `AF_UNIX` socket will not
  * actually be opened until a subsequent call to fstrm_writer_open().
@@ -35,6 +35,23 @@ typedef enum {
 
 struct fstrm_writer_options {
 	fs_bufvec		*content_types;
+	size_t			coalesce_threshold;
+	size_t			coalesce_buffer_size;
+	int			thread_safe;
+};
+
+/*
+ * A call to write data frames, published by the calling thread for whichever
+ * thread holds the writer's lock to carry out. Lives on the caller's stack,
+ * which does not return before 'done' is set.
+ */
+struct fstrm__writer_req {
+	const struct iovec		*iov;
+	const unsigned			*frame_iovcnt;
+	int				nframes;
+	fstrm_res			res;
+	bool				done;
+	struct fstrm__writer_req	*next;
 };
 
 struct fstrm_writer {
@@ -46,14 +63,44 @@ struct fstrm_writer {
 	struct fstrm_control	*control_start;
 	struct fstrm_control	*control_finish;
 
+	/*
+	 * Data frames being assembled for the next fstrm_rdwr_write() call:
+	 * 'iov_idx' elements of 'iovecs', and 'len_idx' length prefixes in
+	 * 'be32_lens'. With coalescing enabled, the length prefixes and the
+	 * small data frames are instead copied to the first 'stage_len' bytes
+	 * of 'stage'.
+	 */
 	struct iovec		*iovecs;
 	uint32_t		*be32_lens;
+	int			iov_idx;
+	int			len_idx;
+
+	uint8_t			*stage;
+	size_t			stage_size;
+	size_t			stage_len;
+	size_t			coalesce_threshold;
+
+	/*
+	 * With thread_safe, 'lock' serializes the use of the writer. Writing
+	 * threads push their requests onto 'pending', and then take 'lock';
+	 * the thread that gets it writes out all pending requests at once, so
+	 * that the others typically find theirs already done.
+	 */
+	bool			thread_safe;
+	pthread_mutex_t		lock;
+	_Atomic(struct fstrm__writer_req *) pending;
 };
 
 struct fstrm_writer_options *
 fstrm_writer_options_init(void)
 {
-	return my_calloc(1, sizeof(struct fstrm_writer_options));
+	struct fstrm_writer_options *wopt;
+
+	wopt = my_calloc(1, sizeof(*wopt));
+	wopt->coalesce_threshold = FSTRM_WRITER_COALESCE_THRESHOLD_DEFAULT;
+	wopt->coalesce_buffer_size = FSTRM_WRITER_COALESCE_BUFFER_SIZE_DEFAULT;
+	wopt->thread_safe = FSTRM_WRITER_THREAD_SAFE_DEFAULT;
+	return wopt;
 }
 
 void
@@ -90,6 +137,38 @@ fstrm_writer_options_add_content_type(
 	return fstrm_res_success;
 }
 
+fstrm_res
+fstrm_writer_options_set_coalesce_threshold(
+	struct fstrm_writer_options *wopt,
+	size_t coalesce_threshold)
+{
+	if (coalesce_threshold > FSTRM_WRITER_COALESCE_THRESHOLD_MAX)
+		return fstrm_res_failure;
+	wopt->coalesce_threshold = coalesce_threshold;
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm_writer_options_set_thread_safe(
+	struct fstrm_writer_options *wopt,
+	int thread_safe)
+{
+	wopt->thread_safe = thread_safe ? 1 : 0;
+	return fstrm_res_success;
+}
+
+fstrm_res
+fstrm_writer_options_set_coalesce_buffer_size(
+	struct fstrm_writer_options *wopt,
+	size_t coalesce_buffer_size)
+{
+	if (coalesce_buffer_size < FSTRM_WRITER_COALESCE_BUFFER_SIZE_MIN ||
+	    coalesce_buffer_size > FSTRM_WRITER_COALESCE_BUFFER_SIZE_MAX)
+		return fstrm_res_failure;
+	wopt->coalesce_buffer_size = coalesce_buffer_size;
+	return fstrm_res_success;
+}
+
 struct fstrm_writer *
 fstrm_writer_init(const struct fstrm_writer_options *wopt,
 		  struct fstrm_rdwr **rdwr)
@@ -118,6 +197,17 @@ fstrm_writer_init(const struct fstrm_writer_options *wopt,
 
 	w->iovecs = my_calloc(FSTRM__WRITER_IOVEC_SIZE, sizeof(struct iovec));
 	w->be32_lens = my_calloc(FSTRM__WRITER_IOVEC_SIZE / 2, sizeof(uint32_t));
+	if (wopt != NULL && wopt->coalesce_threshold > 0) {
+		w->coalesce_threshold = wopt->coalesce_threshold;
+		w->stage_size = wopt->coalesce_buffer_size;
+		w->stage = my_malloc(w->stage_size);
+	}
+	if (wopt != NULL && wopt->thread_safe) {
+		int rc = pthread_mutex_init(&w->lock, NULL);
+		assert(rc == 0);
+		w->thread_safe = true;
+	}
+	atomic_init(&w->pending, NULL);
 
 	w->state = fstrm_writer_state_opening;
 	return w;
@@ -143,6 +233,9 @@ fstrm_writer_destroy(struct fstrm_writer **w)
 		fs_bufvec_destroy(&(*w)->content_types);
 		my_free((*w)->iovecs);
 		my_free((*w)->be32_lens);
+		my_free((*w)->stage);
+		if ((*w)->thread_safe)
+			pthread_mutex_destroy(&(*w)->lock);
 		my_free(*w);
 	}
 	return res;
@@ -260,8 +353,22 @@ fstrm__writer_open_unidirectional(struct fstrm_writer *w)
 	return fstrm_res_success;
 }
 
-fstrm_res
-fstrm_writer_open(struct fstrm_writer *w)
+static inline void
+fstrm__writer_lock(struct fstrm_writer *w)
+{
+	if (unlikely(w->thread_safe))
+		pthread_mutex_lock(&w->lock);
+}
+
+static inline void
+fstrm__writer_unlock(struct fstrm_writer *w)
+{
+	if (unlikely(w->thread_safe))
+		pthread_mutex_unlock(&w->lock);
+}
+
+static fstrm_res
+fstrm__writer_open(struct fstrm_writer *w)
 {
 	fstrm_res res;
 
@@ -275,26 +382,38 @@ fstrm_writer_open(struct fstrm_writer *w)
 	if (w->rdwr->ops.read != NULL) {
 		/* Bi-directional transport. */
 		res = fstrm__writer_open_bidirectional(w);
-		if (res != fstrm_res_success)
-			return res;
 	} else {
 		/* Uni-directional transport. */
 		res = fstrm__writer_open_unidirectional(w);
-		if (res != fstrm_res_success)
-			return res;
+	}
+	if (res != fstrm_res_success) {
+		/* Start the next attempt with a fresh connection. */
+		(void)fstrm_rdwr_close(w->rdwr);
+		return res;
 	}
 
 	w->state = fstrm_writer_state_opened;
 	return fstrm_res_success;
 }
 
+fstrm_res
+fstrm_writer_open(struct fstrm_writer *w)
+{
+	fstrm_res res;
+
+	fstrm__writer_lock(w);
+	res = fstrm__writer_open(w);
+	fstrm__writer_unlock(w);
+	return res;
+}
+
 static fstrm_res
 fstrm__writer_maybe_open(struct fstrm_writer *w)
 {
 	fstrm_res res;
 
 	if (unlikely(w->state == fstrm_writer_state_opening)) {
-		res = fstrm_writer_open(w);
+		res = fstrm__writer_open(w);
 		if (res != fstrm_res_success)
 			return res;
 	}
@@ -302,8 +421,8 @@ fstrm__writer_maybe_open(struct fstrm_writer *w)
 	return fstrm_res_success;
 }
 
-fstrm_res
-fstrm_writer_close(struct fstrm_writer *w)
+static fstrm_res
+fstrm__writer_close(struct fstrm_writer *w)
 {
 	fstrm_res res;
 
@@ -333,51 +452,211 @@ fstrm_writer_close(struct fstrm_writer *w)
 	return res;
 }
 
+fstrm_res
+fstrm_writer_close(struct fstrm_writer *w)
+{
+	fstrm_res res;
+
+	fstrm__writer_lock(w);
+	res = fstrm__writer_close(w);
+	fstrm__writer_unlock(w);
+	return res;
+}
+
+/*
+ * Write out the data frames assembled so far. Some platforms have a
+ * ridiculously low IOV_MAX, literally the lowest value even allowed by POSIX,
+ * which is lower than FSTRM__WRITER_IOVEC_SIZE, so split the write as needed.
+ */
 static fstrm_res
-fstrm__writer_write_iov(struct fstrm_writer *w, const struct iovec *iov, int iovcnt)
+fstrm__writer_flush_frames(struct fstrm_writer *w)
 {
-	for (int i = 0, iov_idx = 0; i < iovcnt; i++) {
-		/* Frame length. */
-		w->be32_lens[i] = htonl(iov[i].iov_len);
-		w->iovecs[iov_idx].iov_len = sizeof(uint32_t);
-		w->iovecs[iov_idx].iov_base = (void *) &w->be32_lens[i];
-		iov_idx += 1;
-
-		/* Frame data. */
-		memcpy(&w->iovecs[iov_idx], &iov[i], sizeof(struct iovec));
-		iov_idx += 1;
+	fstrm_res res = fstrm_res_success;
+
+	for (int i = 0; i < w->iov_idx && res == fstrm_res_success; i += IOV_MAX) {
+		int iovcnt = w->iov_idx - i;
+		if (iovcnt > IOV_MAX)
+			iovcnt = IOV_MAX;
+		res = fstrm_rdwr_write(w->rdwr, &w->iovecs[i], iovcnt);
 	}
+	w->iov_idx = 0;
+	w->len_idx = 0;
+	w->stage_len = 0;
+	return res;
+}
 
-	return fstrm_rdwr_write(w->rdwr, w->iovecs, 2 * iovcnt);
+/*
+ * Copy bytes to the staging buffer, extending the last iovec if it ends where
+ * the copy begins.
+ */
+static void
+fstrm__writer_stage(struct fstrm_writer *w, const void *data, size_t len)
+{
+	uint8_t *dst = w->stage + w->stage_len;
+	struct iovec *last = w->iov_idx > 0 ? &w->iovecs[w->iov_idx - 1] : NULL;
+
+	memcpy(dst, data, len);
+	w->stage_len += len;
+	if (last != NULL && (uint8_t *) last->iov_base + last->iov_len == dst) {
+		last->iov_len += len;
+	} else {
+		w->iovecs[w->iov_idx].iov_base = (void *) dst;
+		w->iovecs[w->iov_idx].iov_len = len;
+		w->iov_idx += 1;
+	}
 }
 
+/*
+ * Add a data frame of 'len' bytes, made up of 'iovcnt' segments, to the data
+ * frames being assembled, writing them out first if it does not fit.
+ */
 static fstrm_res
-fstrm__writer_write_iov_stupid(struct fstrm_writer *w,
-			       const struct iovec *iov, int iovcnt)
+fstrm__writer_add_frame(struct fstrm_writer *w, const struct iovec *iov,
+			unsigned iovcnt, uint32_t len)
 {
-	fstrm_res res;
+	bool coalesce = len <= w->coalesce_threshold;
+	uint32_t be32_len = htonl(len);
 
-	int iov_max = FSTRM__WRITER_IOVEC_SIZE / 2;
-	if (iov_max > IOV_MAX)
-		iov_max = IOV_MAX;
-	assert(iov_max > 0);
+	assert(1 + iovcnt <= FSTRM__WRITER_IOVEC_SIZE);
 
-	while (iovcnt > 0) {
-		int iovcnt_to_write = iov_max;
-		if (iovcnt_to_write > iovcnt)
-			iovcnt_to_write = iovcnt;
-
-		res = fstrm__writer_write_iov(w, iov, iovcnt_to_write);
+	/* Write out what we have if this frame does not fit. */
+	if (w->iov_idx + 1 + (int) iovcnt > FSTRM__WRITER_IOVEC_SIZE ||
+	    (w->stage != NULL &&
+	     w->stage_len + sizeof(be32_len) + (coalesce ? len : 0) > w->stage_size))
+	{
+		fstrm_res res = fstrm__writer_flush_frames(w);
 		if (res != fstrm_res_success)
 			return res;
+	}
 
-		iov += iovcnt_to_write;
-		iovcnt -= iovcnt_to_write;
+	if (w->stage != NULL) {
+		/* Frame length. */
+		fstrm__writer_stage(w, &be32_len, sizeof(be32_len));
+
+		/* Frame data, if small enough to copy. */
+		if (coalesce) {
+			for (unsigned j = 0; j < iovcnt; j++) {
+				if (iov[j].iov_len > 0)
+					fstrm__writer_stage(w, iov[j].iov_base, iov[j].iov_len);
+			}
+			return fstrm_res_success;
+		}
+	} else {
+		/* Frame length. */
+		w->be32_lens[w->len_idx] = be32_len;
+		w->iovecs[w->iov_idx].iov_len = sizeof(uint32_t);
+		w->iovecs[w->iov_idx].iov_base = (void *) &w->be32_lens[w->len_idx];
+		w->iov_idx += 1;
+		w->len_idx += 1;
 	}
 
+	/* Frame data segments. */
+	memcpy(&w->iovecs[w->iov_idx], iov, iovcnt * sizeof(struct iovec));
+	w->iov_idx += iovcnt;
 	return fstrm_res_success;
 }
 
+/* Write out the data frames of a list of requests. */
+static fstrm_res
+fstrm__writer_write_reqs(struct fstrm_writer *w,
+			 const struct fstrm__writer_req *req)
+{
+	fstrm_res res;
+
+	res = fstrm__writer_maybe_open(w);
+	if (res != fstrm_res_success)
+		return res;
+	if (unlikely(w->state != fstrm_writer_state_opened))
+		return fstrm_res_failure;
+
+	for (; req != NULL; req = req->next) {
+		const struct iovec *iov = req->iov;
+
+		for (int i = 0; i < req->nframes; i++) {
+			unsigned iovcnt = 1;
+			uint32_t len = 0;
+
+			if (req->frame_iovcnt != NULL)
+				iovcnt = req->frame_iovcnt[i];
+			for (unsigned j = 0; j < iovcnt; j++)
+				len += iov[j].iov_len;
+
+			res = fstrm__writer_add_frame(w, iov, iovcnt, len);
+			if (res != fstrm_res_success)
+				return res;
+			iov += iovcnt;
+		}
+	}
+
+	return fstrm__writer_flush_frames(w);
+}
+
+/*
+ * With thread_safe, write out every pending request, including the caller's,
+ * in as few writes as possible. Called with the writer's lock held. A failure
+ * is reported to all of the requests, since it is not known how much of the
+ * output made it.
+ */
+static void
+fstrm__writer_combine(struct fstrm_writer *w)
+{
+	struct fstrm__writer_req *req, *next, *reqs = NULL;
+	fstrm_res res;
+
+	/* Take the pending requests, and put them back in the order made. */
+	req = atomic_exchange(&w->pending, NULL);
+	for (; req != NULL; req = next) {
+		next = req->next;
+		req->next = reqs;
+		reqs = req;
+	}
+
+	res = fstrm__writer_write_reqs(w, reqs);
+
+	/* Each requesting thread may return as soon as its request is done. */
+	for (req = reqs; req != NULL; req = next) {
+		next = req->next;
+		req->res = res;
+		req->done = true;
+	}
+}
+
+static fstrm_res
+fstrm__writer_submit(struct fstrm_writer *w, struct fstrm__writer_req *req)
+{
+	if (likely(!w->thread_safe))
+		return fstrm__writer_write_reqs(w, req);
+
+	req->next = atomic_load(&w->pending);
+	while (!atomic_compare_exchange_weak(&w->pending, &req->next, req));
+
+	pthread_mutex_lock(&w->lock);
+	if (!req->done)
+		fstrm__writer_combine(w);
+	pthread_mutex_unlock(&w->lock);
+	return req->res;
+}
+
+fstrm_res
+fstrm__writer_writev_frames(struct fstrm_writer *w, const struct iovec *iov,
+			    const unsigned *frame_iovcnt, int nframes)
+{
+	struct fstrm__writer_req req = {
+		.iov = iov,
+		.frame_iovcnt = frame_iovcnt,
+		.nframes = nframes,
+	};
+
+	return fstrm__writer_submit(w, &req);
+}
+
+void
+fstrm__writer_limit_timeouts(struct fstrm_writer *w, unsigned timeout_max)
+{
+	if (w->rdwr->ops.limit_timeouts != NULL)
+		w->rdwr->ops.limit_timeouts(w->rdwr->obj, timeout_max);
+}
+
 fstrm_res
 fstrm_writer_write(struct fstrm_writer *w, const void *data, size_t len_data)
 {
@@ -391,23 +670,15 @@ fstrm_writer_write(struct fstrm_writer *w, const void *data, size_t len_data)
 fstrm_res
 fstrm_writer_writev(struct fstrm_writer *w, const struct iovec *iov, int iovcnt)
 {
-	fstrm_res res;
+	struct fstrm__writer_req req = {
+		.iov = iov,
+		.nframes = iovcnt,
+	};
 
 	if (unlikely(iovcnt < 1))
 		return fstrm_res_success;
 
-	res = fstrm__writer_maybe_open(w);
-	if (res != fstrm_res_success)
-		return res;
-
-	if (likely(w->state == fstrm_writer_state_opened)) {
-		if (likely((2 * iovcnt) <= FSTRM__WRITER_IOVEC_SIZE))
-			return fstrm__writer_write_iov(w, iov, iovcnt);
-		else
-			return fstrm__writer_write_iov_stupid(w, iov, iovcnt);
-	}
-
-	return fstrm_res_failure;
+	return fstrm__writer_submit(w, &req);
 }
 
 fstrm_res
@@ -417,7 +688,9 @@ fstrm_writer_get_control(struct fstrm_writer *w,
 {
 	fstrm_res res;
 
+	fstrm__writer_lock(w);
 	res = fstrm__writer_maybe_open(w);
+	fstrm__writer_unlock(w);
 	if (res != fstrm_res_success)
 		return res;
 
@@ -96,6 +96,90 @@ fstrm_writer_options_add_content_type(
 	const void *content_type,
 	size_t len_content_type);
 
+/**
+ * Set the `coalesce_threshold` option. Data frames whose payloads are at most
+ * this many bytes are copied, together with their length prefixes, into a
+ * contiguous staging buffer, so that runs of small data frames are written
+ * with a single iovec rather than two iovecs per frame. Larger data frames
+ * are still written without copying. Zero disables coalescing.
+ *
+ * \param wopt
+ *	`fstrm_writer_options` object.
+ * \param coalesce_threshold
+ *	New `coalesce_threshold` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_writer_options_set_coalesce_threshold(
+	struct fstrm_writer_options *wopt,
+	size_t coalesce_threshold);
+
+/** Default `coalesce_threshold` value. */
+#define FSTRM_WRITER_COALESCE_THRESHOLD_DEFAULT		0
+
+/** Maximum `coalesce_threshold` value. */
+#define FSTRM_WRITER_COALESCE_THRESHOLD_MAX		65536
+
+/**
+ * Set the `coalesce_buffer_size` option. This is the size in bytes of the
+ * staging buffer used when `coalesce_threshold` is non-zero, and thus the
+ * largest number of bytes of coalesced data frames written at a time.
+ *
+ * \param wopt
+ *	`fstrm_writer_options` object.
+ * \param coalesce_buffer_size
+ *	New `coalesce_buffer_size` value.
+ *
+ * \retval #fstrm_res_success
+ * \retval #fstrm_res_failure
+ */
+fstrm_res
+fstrm_writer_options_set_coalesce_buffer_size(
+	struct fstrm_writer_options *wopt,
+	size_t coalesce_buffer_size);
+
+/** Minimum `coalesce_buffer_size` value. */
+#define FSTRM_WRITER_COALESCE_BUFFER_SIZE_MIN		131072
+
+/** Default `coalesce_buffer_size` value. */
+#define FSTRM_WRITER_COALESCE_BUFFER_SIZE_DEFAULT	1048576
+
+/** Maximum `coalesce_buffer_size` value. */
+#define FSTRM_WRITER_COALESCE_BUFFER_SIZE_MAX		67108864
+
+/**
+ * Set the `thread_safe` option. If non-zero, fstrm_writer_write(),
+ * fstrm_writer_writev(), fstrm_writer_open(), fstrm_writer_close() and
+ * fstrm_writer_get_control() may be called concurrently from several threads.
+ * fstrm_writer_destroy() must still not be called concurrently with any of
+ * them.
+ *
+ * Concurrent writes are combined: each writing thread publishes its data
+ * frames, and whichever thread gets hold of the writer writes out the data
+ * frames of all threads waiting at that point together, typically with a
+ * single write to the underlying `fstrm_rdwr` object. The data frames of each
+ * call are written contiguously, and each call returns once its data frames
+ * have been written. If a combined write fails, all of the calls involved
+ * return #fstrm_res_failure. This batches the output of busy threads without a
+ * dedicated I/O thread, see \ref fstrm_iothr for the asynchronous alternative.
+ *
+ * \param wopt
+ *	`fstrm_writer_options` object.
+ * \param thread_safe
+ *	New `thread_safe` value.
+ *
+ * \retval #fstrm_res_success
+ */
+fstrm_res
+fstrm_writer_options_set_thread_safe(
+	struct fstrm_writer_options *wopt,
+	int thread_safe);
+
+/** Default `thread_safe` value. */
+#define FSTRM_WRITER_THREAD_SAFE_DEFAULT		0
+
 /**
  * Initialize a new `fstrm_writer` object based on an underlying `fstrm_rdwr`
  * object and an `fstrm_writer_options` object.
@@ -2,6 +2,7 @@
 #define MY_ALLOC_H
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -21,6 +22,17 @@ my_malloc(size_t size)
 	return (ptr);
 }
 
+static inline void *
+my_calloc_aligned(size_t alignment, size_t nmemb, size_t size)
+{
+	void *ptr = NULL;
+	assert(size == 0 || nmemb <= SIZE_MAX / size);
+	int rc = posix_memalign(&ptr, alignment, nmemb * size);
+	assert(rc == 0 && ptr != NULL);
+	memset(ptr, 0, nmemb * size);
+	return (ptr);
+}
+
 static inline void *
 my_realloc(void *ptr, size_t size)
 {
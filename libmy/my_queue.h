@@ -66,8 +66,8 @@ my_queue_impl_type(void);
  *
  * \param[in] q Queue object.
  * \param[in] elem Element object.
- * \param[out] space If non-NULL, pointer to store the number of remaining
- *	spaces in the queue.
+ * \param[in,out] space If non-NULL, pointer to store the number of remaining
+ *	spaces in the queue. See my_queue_insert_batch().
  * \return true if the element was inserted into the queue,
  *	false if the queue is full.
  */
@@ -87,12 +87,61 @@ my_queue_insert(struct my_queue *q, void *elem, unsigned *space);
 bool
 my_queue_remove(struct my_queue *q, void *elem, unsigned *count);
 
+/**
+ * Insert up to 'n' elements into the queue, with the synchronization cost of a
+ * single my_queue_insert() call. Elements are inserted in array order; if
+ * there is not enough space for all of them, only the leading elements which
+ * fit are inserted.
+ *
+ * \param[in] q Queue object.
+ * \param[in] elems Array of 'n' element objects.
+ * \param[in] n Number of elements in 'elems'.
+ * \param[in,out] space If non-NULL, pointer to store the number of remaining
+ *	spaces in the queue. On input, it holds a threshold at or below which
+ *	the caller needs the exact number. Above it, implementations which
+ *	cache the consumer's position may store a lower bound instead, rather
+ *	than synchronizing with the consumer.
+ * \return Number of elements inserted into the queue, 0 if the queue is full.
+ */
+unsigned
+my_queue_insert_batch(struct my_queue *q, const void *elems, unsigned n,
+		      unsigned *space);
+
+/**
+ * Remove up to 'max' elements from the queue, with the synchronization cost of
+ * a single my_queue_remove() call.
+ *
+ * \param[in] q Queue object.
+ * \param[out] elems Array of at least 'max' elements where the removed
+ *	element objects will be copied, oldest first.
+ * \param[in] max Maximum number of elements to remove.
+ * \param[out] count If non-NULL, pointer to store the count of elements
+ *	remaining in the queue.
+ * \return Number of elements removed from the queue, 0 if the queue is empty.
+ */
+unsigned
+my_queue_remove_batch(struct my_queue *q, void *elems, unsigned max,
+		      unsigned *count);
+
+/**
+ * Count the elements in the queue. This may be called from any thread, but
+ * with concurrent producers or consumers the result is only an estimate.
+ *
+ * \param[in] q Queue object.
+ * \return Number of elements in the queue.
+ */
+unsigned
+my_queue_count(struct my_queue *q);
+
 struct my_queue_ops {
 	struct my_queue *(*init)(unsigned, unsigned);
 	void (*destroy)(struct my_queue **);
 	const char *(*impl_type)(void);
 	bool (*insert)(struct my_queue *, void *, unsigned *);
 	bool (*remove)(struct my_queue *, void *, unsigned *);
+	unsigned (*insert_batch)(struct my_queue *, const void *, unsigned, unsigned *);
+	unsigned (*remove_batch)(struct my_queue *, void *, unsigned, unsigned *);
+	unsigned (*count)(struct my_queue *);
 };
 
 #endif /* MY_QUEUE_H */
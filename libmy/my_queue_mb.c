@@ -51,6 +51,15 @@ my_queue_mb_insert(struct my_queue *, void *, unsigned *);
 bool
 my_queue_mb_remove(struct my_queue *, void *, unsigned *);
 
+unsigned
+my_queue_mb_insert_batch(struct my_queue *, const void *, unsigned, unsigned *);
+
+unsigned
+my_queue_mb_remove_batch(struct my_queue *, void *, unsigned, unsigned *);
+
+unsigned
+my_queue_mb_count(struct my_queue *);
+
 struct my_queue {
 	uint8_t		*data;
 	unsigned	num_elems;
@@ -139,6 +148,67 @@ my_queue_mb_remove(struct my_queue *q, void *item, unsigned *pcount)
 	return (res);
 }
 
+unsigned
+my_queue_mb_insert_batch(struct my_queue *q, const void *items, unsigned n,
+			 unsigned *pspace)
+{
+	unsigned head = q->head;
+	unsigned tail = MY_ACCESS_ONCE(q->tail);
+	unsigned space = q_space(head, tail, q->num_elems);
+	if (n > space)
+		n = space;
+	if (n >= 1) {
+		unsigned first = q->num_elems - head;
+		if (first > n)
+			first = n;
+		memcpy(&q->data[head * q->sizeof_elem], items,
+		       first * q->sizeof_elem);
+		memcpy(&q->data[0], (const uint8_t *) items + first * q->sizeof_elem,
+		       (n - first) * q->sizeof_elem);
+		smp_wmb();
+		q->head = (head + n) & (q->num_elems - 1);
+		smp_wmb();
+		space -= n;
+	}
+	if (pspace != NULL)
+		*pspace = space;
+	return (n);
+}
+
+unsigned
+my_queue_mb_remove_batch(struct my_queue *q, void *items, unsigned max,
+			 unsigned *pcount)
+{
+	unsigned head = MY_ACCESS_ONCE(q->head);
+	unsigned tail = q->tail;
+	unsigned count = q_count(head, tail, q->num_elems);
+	unsigned n = count < max ? count : max;
+	if (n >= 1) {
+		unsigned first = q->num_elems - tail;
+		if (first > n)
+			first = n;
+		smp_rmb();
+		memcpy(items, &q->data[tail * q->sizeof_elem],
+		       first * q->sizeof_elem);
+		memcpy((uint8_t *) items + first * q->sizeof_elem, &q->data[0],
+		       (n - first) * q->sizeof_elem);
+		smp_mb();
+		q->tail = (tail + n) & (q->num_elems - 1);
+		count -= n;
+	}
+	if (pcount != NULL)
+		*pcount = count;
+	return (n);
+}
+
+unsigned
+my_queue_mb_count(struct my_queue *q)
+{
+	unsigned head = MY_ACCESS_ONCE(q->head);
+	unsigned tail = MY_ACCESS_ONCE(q->tail);
+	return (q_count(head, tail, q->num_elems));
+}
+
 const struct my_queue_ops my_queue_mb_ops = {
 	.init =
 		my_queue_mb_init,
@@ -150,6 +220,12 @@ const struct my_queue_ops my_queue_mb_ops = {
 		my_queue_mb_insert,
 	.remove =
 		my_queue_mb_remove,
+	.insert_batch =
+		my_queue_mb_insert_batch,
+	.remove_batch =
+		my_queue_mb_remove_batch,
+	.count =
+		my_queue_mb_count,
 };
 
 #endif /* MY_HAVE_MEMORY_BARRIERS */
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2026 by Farsight Security, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Bounded lock-free queue with per-slot sequence numbers, after Dmitry
+ * Vyukov's bounded MPMC queue.
+ *
+ * Each slot carries a sequence number which tells producers and consumers
+ * whether the slot is free for the lap of the ring they are working on
+ * (seq == pos), or holds an element published for it (seq == pos + 1).
+ * Producers claim a run of free slots by advancing 'enqueue_pos' with a
+ * compare-and-swap, copy their elements in, and then publish each slot by
+ * storing its sequence number. Consumers claim published slots the same way
+ * through 'dequeue_pos' and hand them back to the next lap of producers.
+ *
+ * The queue is safe for any number of producers and consumers, and unlike the
+ * other implementations it holds exactly 'num_elems' elements.
+ */
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "my_alloc.h"
+
+#include "my_queue.h"
+
+#if defined(__GNUC__)
+# define _aligned __attribute__((aligned(64)))
+#else
+# define _aligned
+#endif
+
+struct my_queue *
+my_queue_mpmc_init(unsigned, unsigned);
+
+void
+my_queue_mpmc_destroy(struct my_queue **);
+
+const char *
+my_queue_mpmc_impl_type(void);
+
+bool
+my_queue_mpmc_insert(struct my_queue *, void *, unsigned *);
+
+bool
+my_queue_mpmc_remove(struct my_queue *, void *, unsigned *);
+
+unsigned
+my_queue_mpmc_insert_batch(struct my_queue *, const void *, unsigned, unsigned *);
+
+unsigned
+my_queue_mpmc_remove_batch(struct my_queue *, void *, unsigned, unsigned *);
+
+unsigned
+my_queue_mpmc_count(struct my_queue *);
+
+/*
+ * A slot is the sequence number followed by the element, padded so that the
+ * element is 8-byte aligned.
+ */
+#define SLOT_HDR	8
+
+struct my_queue {
+	atomic_uint	enqueue_pos _aligned;
+	atomic_uint	dequeue_pos _aligned;
+	uint8_t		*slots _aligned;
+	unsigned	num_elems;
+	unsigned	sizeof_elem;
+	unsigned	sizeof_slot;
+};
+
+static inline atomic_uint *
+q_seq(struct my_queue *q, unsigned pos)
+{
+	return (atomic_uint *) &q->slots[(pos & (q->num_elems - 1)) * q->sizeof_slot];
+}
+
+static inline uint8_t *
+q_elem(struct my_queue *q, unsigned pos)
+{
+	return &q->slots[(pos & (q->num_elems - 1)) * q->sizeof_slot + SLOT_HDR];
+}
+
+struct my_queue *
+my_queue_mpmc_init(unsigned num_elems, unsigned sizeof_elem)
+{
+	struct my_queue *q;
+	if (num_elems < 2 || ((num_elems - 1) & num_elems) != 0)
+		return (NULL);
+	q = my_calloc_aligned(64, 1, sizeof(*q));
+	q->num_elems = num_elems;
+	q->sizeof_elem = sizeof_elem;
+	q->sizeof_slot = SLOT_HDR + ((sizeof_elem + 7) & ~7U);
+	q->slots = my_calloc_aligned(64, q->num_elems, q->sizeof_slot);
+	for (unsigned i = 0; i < num_elems; i++)
+		atomic_init(q_seq(q, i), i);
+	atomic_init(&q->enqueue_pos, 0);
+	atomic_init(&q->dequeue_pos, 0);
+	return (q);
+}
+
+void
+my_queue_mpmc_destroy(struct my_queue **q)
+{
+	if (*q) {
+		free((*q)->slots);
+		free(*q);
+		*q = NULL;
+	}
+}
+
+const char *
+my_queue_mpmc_impl_type(void)
+{
+	return ("lock-free sequenced slots");
+}
+
+static inline unsigned
+q_count(struct my_queue *q)
+{
+	unsigned head = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+	unsigned count = head - tail;
+	/* The two loads are not a snapshot, so clamp the estimate. */
+	if ((int) count < 0)
+		return (0);
+	if (count > q->num_elems)
+		return (q->num_elems);
+	return (count);
+}
+
+/*
+ * Claim up to 'max' consecutive slots whose sequence numbers are 'pos + off'
+ * relative to the cursor 'cursor'. Returns the number of slots claimed and
+ * their first position in 'ppos'.
+ */
+static inline unsigned
+q_claim(struct my_queue *q, atomic_uint *cursor, unsigned off, unsigned max,
+	unsigned *ppos)
+{
+	unsigned pos = atomic_load_explicit(cursor, memory_order_relaxed);
+	for (;;) {
+		unsigned n = 0;
+		while (n < max) {
+			unsigned seq = atomic_load_explicit(q_seq(q, pos + n),
+							    memory_order_acquire);
+			int dif = (int) (seq - (pos + n + off));
+			if (dif == 0) {
+				n++;
+				continue;
+			}
+			if (dif > 0 && n == 0)
+				goto reload;
+			break;
+		}
+		if (n == 0)
+			return (0);
+		if (atomic_compare_exchange_weak_explicit(cursor, &pos, pos + n,
+							  memory_order_relaxed,
+							  memory_order_relaxed))
+		{
+			*ppos = pos;
+			return (n);
+		}
+		continue;
+reload:
+		/* Another thread claimed the slot at 'pos' first. */
+		pos = atomic_load_explicit(cursor, memory_order_relaxed);
+	}
+}
+
+bool
+my_queue_mpmc_insert(struct my_queue *q, void *item, unsigned *pspace)
+{
+	return (my_queue_mpmc_insert_batch(q, item, 1, pspace) == 1);
+}
+
+bool
+my_queue_mpmc_remove(struct my_queue *q, void *item, unsigned *pcount)
+{
+	return (my_queue_mpmc_remove_batch(q, item, 1, pcount) == 1);
+}
+
+unsigned
+my_queue_mpmc_insert_batch(struct my_queue *q, const void *items, unsigned n,
+			   unsigned *pspace)
+{
+	unsigned pos = 0;
+	n = q_claim(q, &q->enqueue_pos, 0, n, &pos);
+	for (unsigned i = 0; i < n; i++) {
+		memcpy(q_elem(q, pos + i),
+		       (const uint8_t *) items + i * q->sizeof_elem,
+		       q->sizeof_elem);
+		atomic_store_explicit(q_seq(q, pos + i), pos + i + 1,
+				      memory_order_release);
+	}
+	if (pspace != NULL)
+		*pspace = q->num_elems - q_count(q);
+	return (n);
+}
+
+unsigned
+my_queue_mpmc_remove_batch(struct my_queue *q, void *items, unsigned max,
+			   unsigned *pcount)
+{
+	unsigned pos = 0;
+	unsigned n = q_claim(q, &q->dequeue_pos, 1, max, &pos);
+	for (unsigned i = 0; i < n; i++) {
+		memcpy((uint8_t *) items + i * q->sizeof_elem,
+		       q_elem(q, pos + i),
+		       q->sizeof_elem);
+		atomic_store_explicit(q_seq(q, pos + i), pos + i + q->num_elems,
+				      memory_order_release);
+	}
+	if (pcount != NULL)
+		*pcount = q_count(q);
+	return (n);
+}
+
+unsigned
+my_queue_mpmc_count(struct my_queue *q)
+{
+	return (q_count(q));
+}
+
+const struct my_queue_ops my_queue_mpmc_ops = {
+	.init =
+		my_queue_mpmc_init,
+	.destroy =
+		my_queue_mpmc_destroy,
+	.impl_type =
+		my_queue_mpmc_impl_type,
+	.insert =
+		my_queue_mpmc_insert,
+	.remove =
+		my_queue_mpmc_remove,
+	.insert_batch =
+		my_queue_mpmc_insert_batch,
+	.remove_batch =
+		my_queue_mpmc_remove_batch,
+	.count =
+		my_queue_mpmc_count,
+};
@@ -62,6 +62,15 @@ my_queue_mutex_insert(struct my_queue *, void *, unsigned *);
 bool
 my_queue_mutex_remove(struct my_queue *, void *, unsigned *);
 
+unsigned
+my_queue_mutex_insert_batch(struct my_queue *, const void *, unsigned, unsigned *);
+
+unsigned
+my_queue_mutex_remove_batch(struct my_queue *, void *, unsigned, unsigned *);
+
+unsigned
+my_queue_mutex_count(struct my_queue *);
+
 struct my_queue *
 my_queue_mutex_init(unsigned num_elems, unsigned sizeof_elem)
 {
@@ -160,6 +169,68 @@ my_queue_mutex_remove(struct my_queue *q, void *item, unsigned *pcount)
 	return (res);
 }
 
+unsigned
+my_queue_mutex_insert_batch(struct my_queue *q, const void *items, unsigned n,
+			    unsigned *pspace)
+{
+	q_lock(q);
+	unsigned head = q->head;
+	unsigned tail = q->tail;
+	unsigned space = q_space(head, tail, q->num_elems);
+	if (n > space)
+		n = space;
+	if (n >= 1) {
+		unsigned first = q->num_elems - head;
+		if (first > n)
+			first = n;
+		memcpy(&q->data[head * q->sizeof_elem], items,
+		       first * q->sizeof_elem);
+		memcpy(&q->data[0], (const uint8_t *) items + first * q->sizeof_elem,
+		       (n - first) * q->sizeof_elem);
+		q->head = (head + n) & (q->num_elems - 1);
+		space -= n;
+	}
+	q_unlock(q);
+	if (pspace)
+		*pspace = space;
+	return (n);
+}
+
+unsigned
+my_queue_mutex_remove_batch(struct my_queue *q, void *items, unsigned max,
+			    unsigned *pcount)
+{
+	q_lock(q);
+	unsigned head = q->head;
+	unsigned tail = q->tail;
+	unsigned count = q_count(head, tail, q->num_elems);
+	unsigned n = count < max ? count : max;
+	if (n >= 1) {
+		unsigned first = q->num_elems - tail;
+		if (first > n)
+			first = n;
+		memcpy(items, &q->data[tail * q->sizeof_elem],
+		       first * q->sizeof_elem);
+		memcpy((uint8_t *) items + first * q->sizeof_elem, &q->data[0],
+		       (n - first) * q->sizeof_elem);
+		q->tail = (tail + n) & (q->num_elems - 1);
+		count -= n;
+	}
+	q_unlock(q);
+	if (pcount)
+		*pcount = count;
+	return (n);
+}
+
+unsigned
+my_queue_mutex_count(struct my_queue *q)
+{
+	q_lock(q);
+	unsigned count = q_count(q->head, q->tail, q->num_elems);
+	q_unlock(q);
+	return (count);
+}
+
 const struct my_queue_ops my_queue_mutex_ops = {
 	.init =
 		my_queue_mutex_init,
@@ -171,4 +242,10 @@ const struct my_queue_ops my_queue_mutex_ops = {
 		my_queue_mutex_insert,
 	.remove =
 		my_queue_mutex_remove,
+	.insert_batch =
+		my_queue_mutex_insert_batch,
+	.remove_batch =
+		my_queue_mutex_remove_batch,
+	.count =
+		my_queue_mutex_count,
 };
@@ -0,0 +1,241 @@
+/*
+ * Copyright (c) 2026 by Farsight Security, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Single producer, single consumer ring buffer using C11 atomics.
+ *
+ * The producer owns 'head' and the consumer owns 'tail', and each index lives
+ * on its own cache line together with the owning side's cached copy of the
+ * other side's index. A side only reloads the other side's index when its
+ * cached copy shows too few free slots (producer) or elements (consumer) for
+ * the request, when the caller asks for the remaining count, or when the
+ * caller asks for the remaining space and the cached copy shows it at or below
+ * the caller's threshold. In the steady state, the two cache lines are only
+ * transferred once per batch rather than once per element.
+ *
+ * Indices run freely and are reduced modulo 'num_elems' when accessing the
+ * ring, so all 'num_elems' slots are usable. Publication of elements and
+ * slots uses release stores paired with acquire loads.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "my_alloc.h"
+
+#include "my_queue.h"
+
+#if defined(__GNUC__)
+# define _aligned __attribute__((aligned(64)))
+#else
+# define _aligned
+#endif
+
+struct my_queue *
+my_queue_spsc_init(unsigned, unsigned);
+
+void
+my_queue_spsc_destroy(struct my_queue **);
+
+const char *
+my_queue_spsc_impl_type(void);
+
+bool
+my_queue_spsc_insert(struct my_queue *, void *, unsigned *);
+
+bool
+my_queue_spsc_remove(struct my_queue *, void *, unsigned *);
+
+unsigned
+my_queue_spsc_insert_batch(struct my_queue *, const void *, unsigned, unsigned *);
+
+unsigned
+my_queue_spsc_remove_batch(struct my_queue *, void *, unsigned, unsigned *);
+
+unsigned
+my_queue_spsc_count(struct my_queue *);
+
+struct my_queue {
+	/* Producer. */
+	atomic_uint	head _aligned;
+	unsigned	tail_cache;
+
+	/* Consumer. */
+	atomic_uint	tail _aligned;
+	unsigned	head_cache;
+
+	/* Read-only after initialization. */
+	uint8_t		*data _aligned;
+	unsigned	num_elems;
+	unsigned	sizeof_elem;
+};
+
+struct my_queue *
+my_queue_spsc_init(unsigned num_elems, unsigned sizeof_elem)
+{
+	struct my_queue *q;
+	if (num_elems < 2 || ((num_elems - 1) & num_elems) != 0)
+		return (NULL);
+	q = my_calloc_aligned(64, 1, sizeof(*q));
+	q->num_elems = num_elems;
+	q->sizeof_elem = sizeof_elem;
+	q->data = my_calloc_aligned(64, q->num_elems, q->sizeof_elem);
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return (q);
+}
+
+void
+my_queue_spsc_destroy(struct my_queue **q)
+{
+	if (*q) {
+		free((*q)->data);
+		free(*q);
+		*q = NULL;
+	}
+}
+
+const char *
+my_queue_spsc_impl_type(void)
+{
+	return ("C11 atomics, cached indices");
+}
+
+/*
+ * Copy 'n' elements between 'items' and the ring starting at index 'idx',
+ * wrapping around the end of the ring if needed.
+ */
+static inline void
+q_copy_in(struct my_queue *q, unsigned idx, const void *items, unsigned n)
+{
+	unsigned off = idx & (q->num_elems - 1);
+	unsigned first = q->num_elems - off;
+	if (first > n)
+		first = n;
+	memcpy(&q->data[off * q->sizeof_elem], items, first * q->sizeof_elem);
+	memcpy(&q->data[0], (const uint8_t *) items + first * q->sizeof_elem,
+	       (n - first) * q->sizeof_elem);
+}
+
+static inline void
+q_copy_out(struct my_queue *q, unsigned idx, void *items, unsigned n)
+{
+	unsigned off = idx & (q->num_elems - 1);
+	unsigned first = q->num_elems - off;
+	if (first > n)
+		first = n;
+	memcpy(items, &q->data[off * q->sizeof_elem], first * q->sizeof_elem);
+	memcpy((uint8_t *) items + first * q->sizeof_elem, &q->data[0],
+	       (n - first) * q->sizeof_elem);
+}
+
+bool
+my_queue_spsc_insert(struct my_queue *q, void *item, unsigned *pspace)
+{
+	return (my_queue_spsc_insert_batch(q, item, 1, pspace) == 1);
+}
+
+bool
+my_queue_spsc_remove(struct my_queue *q, void *item, unsigned *pcount)
+{
+	return (my_queue_spsc_remove_batch(q, item, 1, pcount) == 1);
+}
+
+unsigned
+my_queue_spsc_insert_batch(struct my_queue *q, const void *items, unsigned n,
+			   unsigned *pspace)
+{
+	unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	unsigned space = q->num_elems - (head - q->tail_cache);
+	if (space < n || (pspace != NULL && space - n <= *pspace)) {
+		q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+		space = q->num_elems - (head - q->tail_cache);
+	}
+	if (n > space)
+		n = space;
+	if (n >= 1) {
+		q_copy_in(q, head, items, n);
+		atomic_store_explicit(&q->head, head + n, memory_order_release);
+		space -= n;
+	}
+	if (pspace != NULL)
+		*pspace = space;
+	return (n);
+}
+
+unsigned
+my_queue_spsc_remove_batch(struct my_queue *q, void *items, unsigned max,
+			   unsigned *pcount)
+{
+	unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	unsigned count = q->head_cache - tail;
+	if (count < max || pcount != NULL) {
+		q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+		count = q->head_cache - tail;
+	}
+	unsigned n = count < max ? count : max;
+	if (n >= 1) {
+		q_copy_out(q, tail, items, n);
+		atomic_store_explicit(&q->tail, tail + n, memory_order_release);
+		count -= n;
+	}
+	if (pcount != NULL)
+		*pcount = count;
+	return (n);
+}
+
+unsigned
+my_queue_spsc_count(struct my_queue *q)
+{
+	unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	unsigned count = head - tail;
+	/* The two loads are not a snapshot, so clamp the estimate. */
+	if ((int) count < 0)
+		return (0);
+	if (count > q->num_elems)
+		return (q->num_elems);
+	return (count);
+}
+
+const struct my_queue_ops my_queue_spsc_ops = {
+	.init =
+		my_queue_spsc_init,
+	.destroy =
+		my_queue_spsc_destroy,
+	.impl_type =
+		my_queue_spsc_impl_type,
+	.insert =
+		my_queue_spsc_insert,
+	.remove =
+		my_queue_spsc_remove,
+	.insert_batch =
+		my_queue_spsc_insert_batch,
+	.remove_batch =
+		my_queue_spsc_remove_batch,
+	.count =
+		my_queue_spsc_count,
+};
@@ -15,4 +15,10 @@ for QUEUE_MODEL in SPSC MPSC; do
     done
 done
 
+for QUEUE_MODEL in SPSC MPSC; do
+    for NUM_THREADS in 1 4; do
+        $DIRNAME/$TNAME "$FILENAME" $QUEUE_MODEL $NUM_THREADS 100000 SPIN_PARK
+    done
+done
+
 rm -f "$FILENAME"
@@ -7,6 +7,8 @@ if [ -z "$DIRNAME" ]; then
     DIRNAME="$(dirname $(readlink -f $0))"
 fi
 
+$DIRNAME/$TNAME $SOCKADDR
+
 for QUEUE_MODEL in SPSC MPSC; do
     for NUM_THREADS in 1 4 16; do
         for NUM_MESSAGES in 1 1000 100000; do
@@ -197,14 +197,16 @@ main(int argc, char **argv)
 	unsigned num_messages;
 	unsigned num_threads;
 	fstrm_iothr_queue_model queue_model;
+	fstrm_iothr_wait_strategy wait_strategy = FSTRM_IOTHR_WAIT_STRATEGY_TIMED;
 
-	if (argc != 5) {
-		fprintf(stderr, "Usage: %s <FILE> <QUEUE MODEL> <NUM THREADS> <NUM MESSAGES>\n", argv[0]);
+	if (argc != 5 && argc != 6) {
+		fprintf(stderr, "Usage: %s <FILE> <QUEUE MODEL> <NUM THREADS> <NUM MESSAGES> [<WAIT STRATEGY>]\n", argv[0]);
 		fprintf(stderr, "\n");
 		fprintf(stderr, "FILE is a filesystem path.\n");
 		fprintf(stderr, "QUEUE MODEL is the string 'SPSC' or 'MPSC'.\n");
 		fprintf(stderr, "NUM THREADS is an integer.\n");
 		fprintf(stderr, "NUM MESSAGES is an integer.\n");
+		fprintf(stderr, "WAIT STRATEGY is the string 'TIMED' (default) or 'SPIN_PARK'.\n");
 		return EXIT_FAILURE;
 	}
 	file_path = argv[1];
@@ -229,6 +231,17 @@ main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
+	if (argc == 6) {
+		if (strcasecmp(argv[5], "TIMED") == 0) {
+			wait_strategy = FSTRM_IOTHR_WAIT_STRATEGY_TIMED;
+		} else if (strcasecmp(argv[5], "SPIN_PARK") == 0) {
+			wait_strategy = FSTRM_IOTHR_WAIT_STRATEGY_SPIN_PARK;
+		} else {
+			fprintf(stderr, "%s: Error: invalid wait strategy\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
 	printf("testing fstrm_iothr with file= %s "
 	       "queue_model= %s "
 	       "num_threads= %u "
@@ -253,6 +266,7 @@ main(int argc, char **argv)
 		assert(0); /* not reached */
 	}
 	fstrm_iothr_options_set_queue_model(iothr_opt, queue_model);
+	fstrm_iothr_options_set_wait_strategy(iothr_opt, wait_strategy);
 
 	struct fstrm_iothr *iothr = fstrm_iothr_init(iothr_opt, &w);
 	assert(iothr != NULL);
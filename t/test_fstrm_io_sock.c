@@ -29,6 +29,7 @@
 #include <sys/un.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <pthread.h>
 #include <poll.h>
@@ -404,6 +405,169 @@ get_tcp_server_socket(const char *socket_address, uint16_t *socket_port)
 	return sfd;
 }
 
+static struct fstrm_writer *
+get_writer(bool is_unix, const char *socket_param, const char *socket_port,
+	   unsigned connect_timeout, unsigned handshake_timeout)
+{
+	struct fstrm_writer *w;
+
+	if (is_unix) {
+		struct fstrm_unix_writer_options *uwopt;
+		uwopt = fstrm_unix_writer_options_init();
+		fstrm_unix_writer_options_set_socket_path(uwopt, socket_param);
+		fstrm_unix_writer_options_set_connect_timeout(uwopt, connect_timeout);
+		fstrm_unix_writer_options_set_handshake_timeout(uwopt, handshake_timeout);
+		w = fstrm_unix_writer_init(uwopt, NULL);
+		fstrm_unix_writer_options_destroy(&uwopt);
+	} else {
+		struct fstrm_tcp_writer_options *twopt;
+		twopt = fstrm_tcp_writer_options_init();
+		fstrm_tcp_writer_options_set_socket_address(twopt, socket_param);
+		fstrm_tcp_writer_options_set_socket_port(twopt, socket_port);
+		fstrm_tcp_writer_options_set_connect_timeout(twopt, connect_timeout);
+		fstrm_tcp_writer_options_set_handshake_timeout(twopt, handshake_timeout);
+		w = fstrm_tcp_writer_init(twopt, NULL);
+		fstrm_tcp_writer_options_destroy(&twopt);
+	}
+	assert(w != NULL);
+	return w;
+}
+
+/*
+ * Returns the number of seconds fstrm_writer_open() took to fail, or a negative
+ * number if it succeeded.
+ */
+static double
+time_failed_open(struct fstrm_writer *w)
+{
+	struct timespec ts_a, ts_b;
+	fstrm_res res;
+
+#if HAVE_CLOCK_GETTIME
+	const clockid_t clock = CLOCK_MONOTONIC;
+#else
+	const int clock = -1;
+#endif
+	my_gettime(clock, &ts_a);
+	res = fstrm_writer_open(w);
+	my_gettime(clock, &ts_b);
+	if (res == fstrm_res_success)
+		return -1.0;
+	my_timespec_sub(&ts_a, &ts_b);
+	return my_timespec_to_double(&ts_b);
+}
+
+static int
+get_server_socket(bool is_unix, const char *socket_param, char *socket_port,
+		  size_t len_socket_port)
+{
+	uint16_t port;
+	int sfd;
+
+	if (is_unix)
+		return get_unix_server_socket(socket_param);
+	sfd = get_tcp_server_socket(socket_param, &port);
+	snprintf(socket_port, len_socket_port, "%u", port);
+	return sfd;
+}
+
+/*
+ * Check that a writer gives up on a server socket which never accepts
+ * connections. The kernel queues the first connection, but the ACCEPT frame
+ * never arrives, so the writer must fail after 'handshake_timeout'. Once the
+ * listen backlog is full, connecting must fail within 'connect_timeout'.
+ * With the `external_drive` parameter, fstrm_iothr_run_once() must not block
+ * for the default timeouts.
+ */
+static int
+test_timeouts(bool is_unix, const char *socket_param)
+{
+	const unsigned timeout = 200, long_timeout = 5000;
+	char s_socket_port[16] = {0};
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr *iothr;
+	struct fstrm_writer *w;
+	struct timespec ts_a, ts_b;
+	int server_fd, fds[8];
+	double elapsed;
+	int next;
+
+#if HAVE_CLOCK_GETTIME
+	const clockid_t clock = CLOCK_MONOTONIC;
+#else
+	const int clock = -1;
+#endif
+
+	server_fd = get_server_socket(is_unix, socket_param, s_socket_port,
+				      sizeof(s_socket_port));
+	w = get_writer(is_unix, socket_param, s_socket_port,
+		       long_timeout, long_timeout);
+	iothr_opt = fstrm_iothr_options_init();
+	fstrm_iothr_options_set_external_drive(iothr_opt, 1);
+	iothr = fstrm_iothr_init(iothr_opt, &w);
+	assert(iothr != NULL);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	my_gettime(clock, &ts_a);
+	fstrm_iothr_run_once(iothr, &next);
+	my_gettime(clock, &ts_b);
+	my_timespec_sub(&ts_a, &ts_b);
+	elapsed = my_timespec_to_double(&ts_b);
+	fstrm_iothr_destroy(&iothr);
+	close(server_fd);
+	printf("fstrm_iothr_run_once() returned after %.3f seconds\n", elapsed);
+	if (elapsed > 1.0 + FSTRM_IOTHR_EXTERNAL_DRIVE_TIMEOUT_MAX / 1000.0) {
+		fprintf(stderr, "%s: fstrm_iothr_run_once() blocked\n", __func__);
+		return EXIT_FAILURE;
+	}
+
+	server_fd = get_server_socket(is_unix, socket_param, s_socket_port,
+				      sizeof(s_socket_port));
+	w = get_writer(is_unix, socket_param, s_socket_port, timeout, timeout);
+	elapsed = time_failed_open(w);
+	printf("handshake with a silent server failed after %.3f seconds\n",
+	       elapsed);
+	if (elapsed < 0.9 * timeout / 1000 || elapsed > 1.0 + timeout / 1000.0) {
+		fprintf(stderr, "%s: handshake_timeout of %u ms not honored\n",
+			__func__, timeout);
+		return EXIT_FAILURE;
+	}
+
+	/* Fill up the listen backlog. */
+	for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+		struct sockaddr_storage ss;
+		socklen_t ss_len = sizeof(ss);
+
+		if (getsockname(server_fd, (struct sockaddr *) &ss, &ss_len) == -1) {
+			perror("getsockname");
+			abort();
+		}
+		fds[i] = socket(ss.ss_family, SOCK_STREAM, 0);
+		if (fds[i] == -1 ||
+		    fcntl(fds[i], F_SETFL, O_NONBLOCK) == -1)
+		{
+			perror("socket");
+			abort();
+		}
+		(void)connect(fds[i], (struct sockaddr *) &ss, ss_len);
+	}
+	poll(NULL, 0, 100);
+
+	elapsed = time_failed_open(w);
+	printf("connecting to a full backlog failed after %.3f seconds\n",
+	       elapsed);
+	if (elapsed < 0 || elapsed > 1.0 + timeout / 1000.0) {
+		fprintf(stderr, "%s: connect_timeout of %u ms not honored\n",
+			__func__, timeout);
+		return EXIT_FAILURE;
+	}
+
+	fstrm_writer_destroy(&w);
+	for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+		close(fds[i]);
+	close(server_fd);
+	return EXIT_SUCCESS;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -421,8 +585,15 @@ main(int argc, char **argv)
 	fstrm_iothr_queue_model queue_model;
 	bool is_unix;
 
+	if (argc == 3 && (strcasecmp(argv[1], "unix") == 0 ||
+			  strcasecmp(argv[1], "tcp") == 0))
+	{
+		alarm(300);
+		return test_timeouts(strcasecmp(argv[1], "unix") == 0, argv[2]);
+	}
 	if (argc != 6) {
 		fprintf(stderr, "Usage: %s <SOCKET TYPE> <SOCKET PARAM> <QUEUE MODEL> <NUM THREADS> <NUM MESSAGES>\n", argv[0]);
+		fprintf(stderr, "       %s <SOCKET TYPE> <SOCKET PARAM>\n", argv[0]);
 		fprintf(stderr, "\n");
 		fprintf(stderr, "SOCKET TYPE is 'tcp' or 'unix'.");
 		fprintf(stderr, "For SOCKET TYPE 'unix', SOCKET PARAMS should be a filesystem path.");
@@ -430,6 +601,7 @@ main(int argc, char **argv)
 		fprintf(stderr, "QUEUE MODEL is the string 'SPSC' or 'MPSC'.\n");
 		fprintf(stderr, "NUM THREADS is an integer.\n");
 		fprintf(stderr, "NUM MESSAGES is an integer.\n");
+		fprintf(stderr, "Without them, test the connect and handshake timeouts.\n");
 		fprintf(stderr, "\n");
 		return EXIT_FAILURE;
 	}
@@ -490,22 +662,14 @@ main(int argc, char **argv)
 	struct fstrm_writer *w = NULL;
 
 	if (is_unix) {
-		struct fstrm_unix_writer_options *uwopt;
-		uwopt = fstrm_unix_writer_options_init();
-		fstrm_unix_writer_options_set_socket_path(uwopt, unix_socket_path);
-		w = fstrm_unix_writer_init(uwopt, NULL);
-		assert(w != NULL);
-		fstrm_unix_writer_options_destroy(&uwopt);
+		w = get_writer(true, unix_socket_path, NULL,
+			       FSTRM_UNIX_WRITER_CONNECT_TIMEOUT_DEFAULT,
+			       FSTRM_UNIX_WRITER_HANDSHAKE_TIMEOUT_DEFAULT);
 	} else {
-		struct fstrm_tcp_writer_options *twopt;
-		twopt = fstrm_tcp_writer_options_init();
-		fstrm_tcp_writer_options_set_socket_address(twopt, tcp_socket_address);
-		fstrm_tcp_writer_options_set_socket_port(twopt, s_tcp_socket_port);
-		w = fstrm_tcp_writer_init(twopt, NULL);
-		assert(w != NULL);
-		fstrm_tcp_writer_options_destroy(&twopt);
+		w = get_writer(false, tcp_socket_address, s_tcp_socket_port,
+			       FSTRM_TCP_WRITER_CONNECT_TIMEOUT_DEFAULT,
+			       FSTRM_TCP_WRITER_HANDSHAKE_TIMEOUT_DEFAULT);
 	}
-	assert(w != NULL);
 
 	struct fstrm_iothr_options *iothr_opt;
 	iothr_opt = fstrm_iothr_options_init();
@@ -0,0 +1,2591 @@
+/*
+ * Copyright (c) 2026 by Farsight Security, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/**
+ * test_iothr_submit: exercises the fstrm_iothr submission interfaces.
+ *
+ * Each test instantiates a dummy writer implementation which captures the
+ * byte stream generated by the library, submits a known sequence of data
+ * frames, and verifies that the same sequence of data frames was written.
+ */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstrm.h>
+
+#include "libmy/my_alloc.h"
+#include "libmy/my_time.h"
+#include "libmy/ubuf.h"
+
+static const unsigned num_frames = 10000;
+
+struct capture {
+	ubuf			*u;
+	unsigned		num_writes;
+	unsigned		num_iovecs;
+	bool			destroyed;
+};
+
+static fstrm_res
+capture_destroy(void *obj)
+{
+	/* The capture outlives the writer, see capture_free(). */
+	struct capture *c = obj;
+	c->destroyed = true;
+	return fstrm_res_success;
+}
+
+static void
+capture_free(struct capture **c)
+{
+	assert((*c)->destroyed);
+	ubuf_destroy(&(*c)->u);
+	my_free(*c);
+}
+
+/* While set, opening a capture writer blocks, so the I/O thread is stalled. */
+static atomic_bool capture_hold_open;
+
+/* While set, opening a capture writer fails. */
+static atomic_bool capture_fail_open;
+
+/* Number of attempts to open a capture writer, and when the first ones began. */
+static atomic_uint capture_opens;
+static double capture_open_times[16];
+
+static double
+now_seconds(void)
+{
+	struct timespec ts;
+
+#if HAVE_CLOCK_GETTIME
+	my_gettime(CLOCK_MONOTONIC, &ts);
+#else
+	my_gettime(-1, &ts);
+#endif
+	return my_timespec_to_double(&ts);
+}
+
+static fstrm_res
+capture_open(__attribute__((unused)) void *obj)
+{
+	unsigned i = atomic_load(&capture_opens);
+
+	if (i < sizeof(capture_open_times) / sizeof(capture_open_times[0]))
+		capture_open_times[i] = now_seconds();
+	atomic_store(&capture_opens, i + 1);
+
+	while (atomic_load(&capture_hold_open))
+		poll(NULL, 0, 1);
+	if (atomic_load(&capture_fail_open))
+		return fstrm_res_failure;
+	return fstrm_res_success;
+}
+
+static fstrm_res
+capture_close(__attribute__((unused)) void *obj)
+{
+	return fstrm_res_success;
+}
+
+/* While set, each write to a capture writer takes a millisecond. */
+static atomic_bool capture_slow_write;
+
+/* While set, writes to a capture writer fail. */
+static atomic_bool capture_fail_write;
+
+static fstrm_res
+capture_write(void *obj, const struct iovec *iov, int iovcnt)
+{
+	struct capture *c = obj;
+	if (atomic_load(&capture_fail_write))
+		return fstrm_res_failure;
+	if (atomic_load(&capture_slow_write))
+		poll(NULL, 0, 1);
+	for (int i = 0; i < iovcnt; i++)
+		ubuf_append(c->u, iov[i].iov_base, iov[i].iov_len);
+	c->num_writes++;
+	c->num_iovecs += (unsigned) iovcnt;
+	return fstrm_res_success;
+}
+
+/*
+ * Create a writer which captures into 'c', with options 'wopt' (which may be
+ * NULL). 'c' must be released with capture_free() after the writer has been
+ * destroyed.
+ */
+static struct fstrm_writer *
+capture_writer_init(const struct fstrm_writer_options *wopt,
+		    struct capture **c)
+{
+	struct fstrm_rdwr *rdwr;
+	struct fstrm_writer *w;
+
+	*c = my_calloc(1, sizeof(**c));
+	(*c)->u = ubuf_init(4096);
+
+	rdwr = fstrm_rdwr_init(*c);
+	fstrm_rdwr_set_destroy(rdwr, capture_destroy);
+	fstrm_rdwr_set_open(rdwr, capture_open);
+	fstrm_rdwr_set_close(rdwr, capture_close);
+	fstrm_rdwr_set_write(rdwr, capture_write);
+
+	w = fstrm_writer_init(wopt, &rdwr);
+	assert(w != NULL);
+	return w;
+}
+
+/*
+ * Create an fstrm_iothr whose writer captures into 'c'. 'c' must be released
+ * with capture_free() after the fstrm_iothr has been destroyed.
+ */
+static struct fstrm_iothr *
+capture_iothr_init(const struct fstrm_iothr_options *iothr_opt,
+		   struct capture **c)
+{
+	struct fstrm_writer *w = capture_writer_init(NULL, c);
+	struct fstrm_iothr *iothr;
+
+	iothr = fstrm_iothr_init(iothr_opt, &w);
+	assert(iothr != NULL);
+	return iothr;
+}
+
+static char *
+make_frame(unsigned i, size_t *len)
+{
+	char buf[64];
+	*len = (size_t) snprintf(buf, sizeof(buf), "frame #%u%.*s",
+				 i, (int) (i % 7), "-------");
+	return my_strdup(buf);
+}
+
+/*
+ * Return the next data frame of a captured byte stream in 'frame' and
+ * 'len_frame', skipping control frames. Returns false at the end of the
+ * stream.
+ */
+static bool
+capture_next_frame(const uint8_t **p, size_t *len,
+		   const uint8_t **frame, size_t *len_frame)
+{
+	while (*len > 0) {
+		uint32_t be32;
+
+		assert(*len >= sizeof(be32));
+		memcpy(&be32, *p, sizeof(be32));
+		*p += sizeof(be32);
+		*len -= sizeof(be32);
+
+		if (be32 == 0) {
+			/* Skip the control frame. */
+			assert(*len >= sizeof(be32));
+			memcpy(&be32, *p, sizeof(be32));
+			*p += sizeof(be32);
+			*len -= sizeof(be32);
+			assert(*len >= ntohl(be32));
+			*p += ntohl(be32);
+			*len -= ntohl(be32);
+			continue;
+		}
+
+		*len_frame = ntohl(be32);
+		assert(*len >= *len_frame);
+		*frame = *p;
+		*p += *len_frame;
+		*len -= *len_frame;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Parse the captured byte stream and check that it consists of exactly the
+ * data frames produced by make_frame(0) .. make_frame(n - 1), in order.
+ */
+static int
+check_capture(struct capture *c, unsigned n)
+{
+	const uint8_t *p = ubuf_data(c->u);
+	size_t len = ubuf_size(c->u);
+	const uint8_t *frame;
+	size_t len_frame;
+	unsigned i = 0;
+
+	while (capture_next_frame(&p, &len, &frame, &len_frame)) {
+		size_t len_expected;
+		char *expected = make_frame(i, &len_expected);
+		if (len_frame != len_expected ||
+		    memcmp(frame, expected, len_frame) != 0)
+		{
+			fprintf(stderr, "%s: data frame %u mismatch\n", __func__, i);
+			free(expected);
+			return EXIT_FAILURE;
+		}
+		free(expected);
+		i++;
+	}
+
+	if (i != n) {
+		fprintf(stderr, "%s: got %u data frames, expected %u\n",
+			__func__, i, n);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "%s: got %u data frames in %u writes\n",
+		__func__, i, c->num_writes);
+	return EXIT_SUCCESS;
+}
+
+static int
+test_submit_batch(void)
+{
+	const size_t batch_size = 7;
+	struct fstrm_iothr_frame frames[batch_size];
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	fstrm_res res;
+	int ret;
+
+	iothr_opt = fstrm_iothr_options_init();
+	fstrm_iothr_options_set_input_queue_size(iothr_opt, 16);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	/* An invalid frame rejects the whole batch. */
+	frames[0].data = make_frame(0, &frames[0].len);
+	frames[0].free_func = fstrm_free_wrapper;
+	frames[0].free_data = NULL;
+	frames[1] = frames[0];
+	frames[1].len = 0;
+	size_t n_submitted = 1;
+	res = fstrm_iothr_submit_batch(iothr, ioq, frames, 2, &n_submitted);
+	assert(res == fstrm_res_invalid);
+	assert(n_submitted == 0);
+	free(frames[0].data);
+
+	for (unsigned i = 0; i < num_frames; ) {
+		size_t n = batch_size;
+		if (n > num_frames - i)
+			n = num_frames - i;
+		for (size_t j = 0; j < n; j++) {
+			frames[j].data = make_frame(i + j, &frames[j].len);
+			frames[j].free_func = fstrm_free_wrapper;
+			frames[j].free_data = NULL;
+		}
+
+		/* Resubmit whatever did not fit until the whole batch is in. */
+		size_t off = 0;
+		for (;;) {
+			res = fstrm_iothr_submit_batch(iothr, ioq, &frames[off],
+						       n - off, &n_submitted);
+			off += n_submitted;
+			if (res == fstrm_res_success)
+				break;
+			assert(res == fstrm_res_again);
+			poll(NULL, 0, 1);
+		}
+		assert(off == n);
+		i += n;
+	}
+
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, num_frames);
+	capture_free(&c);
+	return ret;
+}
+
+/*
+ * On the timed wait strategy, producers only wake the I/O thread once their
+ * input queue holds more than queue_notify_threshold entries, and leave the
+ * rest for it to pick up after flush_timeout. Check that it is woken each time
+ * the input queue fills up past the threshold, over enough rounds to wrap the
+ * input queue several times, and not before.
+ */
+static int
+test_notify_threshold(void)
+{
+	const unsigned threshold = FSTRM_IOTHR_QUEUE_NOTIFY_THRESHOLD_DEFAULT;
+	const unsigned per_round = threshold + 8, num_rounds = 50;
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	unsigned depth, before, i = 0;
+	fstrm_res res;
+	int ret;
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_flush_timeout(iothr_opt,
+		FSTRM_IOTHR_FLUSH_TIMEOUT_MAX);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_input_queue_size(iothr_opt, 6);
+	assert(res == fstrm_res_failure);
+	res = fstrm_iothr_options_set_input_queue_size(iothr_opt, 128);
+	assert(res == fstrm_res_success);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	for (unsigned round = 0; round < num_rounds; round++) {
+		unsigned waited = 0;
+
+		for (unsigned j = 0; j < per_round; j++, i++) {
+			size_t len;
+			char *frame = make_frame(i, &len);
+
+			res = fstrm_iothr_submit(iothr, ioq, frame, len,
+						 fstrm_free_wrapper, NULL);
+			assert(res == fstrm_res_success);
+		}
+		for (;;) {
+			fstrm_iothr_get_queue_occupancy(iothr, ioq, &depth, NULL);
+			if (depth <= threshold || waited > 1000)
+				break;
+			poll(NULL, 0, 1);
+			waited++;
+		}
+		if (depth > threshold) {
+			fprintf(stderr, "%s: round %u was not drained\n",
+				__func__, round);
+			fstrm_iothr_destroy(&iothr);
+			capture_free(&c);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Up to the threshold, the I/O thread is left to sleep. */
+	poll(NULL, 0, 100);
+	fstrm_iothr_get_queue_occupancy(iothr, ioq, &before, NULL);
+	for (unsigned j = before; j < threshold; j++, i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		res = fstrm_iothr_submit(iothr, ioq, frame, len,
+					 fstrm_free_wrapper, NULL);
+		assert(res == fstrm_res_success);
+	}
+	poll(NULL, 0, 100);
+	fstrm_iothr_get_queue_occupancy(iothr, ioq, &depth, NULL);
+
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, i);
+	capture_free(&c);
+	if (depth != threshold) {
+		fprintf(stderr, "%s: %u data frames queued, expected %u\n",
+			__func__, depth, threshold);
+		return EXIT_FAILURE;
+	}
+	return ret;
+}
+
+/*
+ * Submit data frames through the input queue's reserve buffer. With
+ * 'registered', the input queue has a registered deallocation callback, and
+ * every other data frame is submitted with it instead.
+ */
+static int
+test_reserve_commit(fstrm_iothr_queue_model queue_model, bool registered)
+{
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	fstrm_res res;
+	void *data;
+	int ret;
+
+	/* Use a small buffer so that it wraps around and fills up. */
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_queue_model(iothr_opt, queue_model);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_reserve_buffer_size(iothr_opt, 4096);
+	assert(res == fstrm_res_success);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+
+	if (registered)
+		ioq = fstrm_iothr_get_input_queue_free(iothr, fstrm_free_wrapper,
+						       NULL);
+	else
+		ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	/* Invalid reservations and commits. */
+	res = fstrm_iothr_commit(iothr, ioq, 1);
+	assert(res == fstrm_res_invalid);
+	res = fstrm_iothr_reserve(iothr, ioq, 0, &data);
+	assert(res == fstrm_res_invalid);
+	res = fstrm_iothr_reserve(iothr, ioq, 4096, &data);
+	assert(res == fstrm_res_invalid);
+
+	/* A cancelled reservation submits nothing. */
+	res = fstrm_iothr_reserve(iothr, ioq, 64, &data);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_commit(iothr, ioq, 65);
+	assert(res == fstrm_res_invalid);
+	res = fstrm_iothr_commit(iothr, ioq, 0);
+	assert(res == fstrm_res_success);
+
+	for (unsigned i = 0; i < num_frames; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		if (registered && i % 2 == 1) {
+			while ((res = fstrm_iothr_submit(iothr, ioq, frame, len,
+							 fstrm_free_wrapper,
+							 NULL)) ==
+			       fstrm_res_again)
+			{
+				poll(NULL, 0, 1);
+			}
+			assert(res == fstrm_res_success);
+			continue;
+		}
+
+		/* Reserve more than needed, and commit the actual length. */
+		while ((res = fstrm_iothr_reserve(iothr, ioq, 64, &data)) ==
+		       fstrm_res_again)
+		{
+			poll(NULL, 0, 1);
+		}
+		assert(res == fstrm_res_success);
+		memcpy(data, frame, len);
+		free(frame);
+
+		while ((res = fstrm_iothr_commit(iothr, ioq, len)) ==
+		       fstrm_res_again)
+		{
+			poll(NULL, 0, 1);
+		}
+		assert(res == fstrm_res_success);
+	}
+
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, num_frames);
+	capture_free(&c);
+	return ret;
+}
+
+static int
+test_bufpool(void)
+{
+	struct fstrm_bufpool_options *bpopt;
+	struct fstrm_bufpool *bp;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	fstrm_res res;
+	void *buf, *buf2;
+	int ret;
+
+	bpopt = fstrm_bufpool_options_init();
+	res = fstrm_bufpool_options_set_max_buf_size(bpopt, 1000);
+	assert(res == fstrm_res_success);
+	res = fstrm_bufpool_options_set_num_cached_bufs(bpopt, 100);
+	assert(res == fstrm_res_failure);
+	bp = fstrm_bufpool_init(bpopt);
+	fstrm_bufpool_options_destroy(&bpopt);
+
+	/* A returned buffer is handed out again for the same size class. */
+	buf = fstrm_bufpool_alloc(bp, 100);
+	fstrm_bufpool_free_wrapper(buf, bp);
+	buf2 = fstrm_bufpool_alloc(bp, 128);
+	assert(buf2 == buf);
+	fstrm_bufpool_free_wrapper(buf2, bp);
+
+	/* Buffers larger than the largest size class are not cached. */
+	buf = fstrm_bufpool_alloc(bp, 4096);
+	memset(buf, 0, 4096);
+	fstrm_bufpool_free_wrapper(buf, bp);
+
+	iothr = capture_iothr_init(NULL, &c);
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	for (unsigned i = 0; i < num_frames; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		buf = fstrm_bufpool_alloc(bp, len);
+		memcpy(buf, frame, len);
+		free(frame);
+
+		while ((res = fstrm_iothr_submit(iothr, ioq, buf, len,
+						 fstrm_bufpool_free_wrapper, bp)) ==
+		       fstrm_res_again)
+		{
+			poll(NULL, 0, 1);
+		}
+		assert(res == fstrm_res_success);
+	}
+
+	fstrm_iothr_destroy(&iothr);
+	fstrm_bufpool_destroy(&bp);
+	ret = check_capture(c, num_frames);
+	capture_free(&c);
+	return ret;
+}
+
+/* A data frame split into a header segment and a payload segment. */
+struct split_frame {
+	struct iovec	iov[3];
+	char		*buf;
+};
+
+static void
+free_split_frame(void *buf, __attribute__((unused)) void *free_data)
+{
+	/* 'buf' is the iovec array, the first member of the split_frame. */
+	struct split_frame *sf = buf;
+	free(sf->buf);
+	free(sf);
+}
+
+static int
+test_submitv(void)
+{
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	fstrm_res res;
+	int ret;
+
+	iothr = capture_iothr_init(NULL, &c);
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	struct iovec iov_bad[1] = {{ .iov_base = NULL, .iov_len = 0 }};
+	res = fstrm_iothr_submitv(iothr, ioq, iov_bad, 1, NULL, NULL);
+	assert(res == fstrm_res_invalid);
+	res = fstrm_iothr_submitv(iothr, ioq, iov_bad,
+				  FSTRM_IOTHR_SUBMITV_IOVCNT_MAX + 1, NULL, NULL);
+	assert(res == fstrm_res_invalid);
+
+	for (unsigned i = 0; i < num_frames; i++) {
+		struct split_frame *sf;
+		size_t len, len_hdr = 6;
+
+		/* Mix in contiguous frames. */
+		if (i % 3 == 0) {
+			char *frame = make_frame(i, &len);
+			while ((res = fstrm_iothr_submit(iothr, ioq, frame, len,
+							 fstrm_free_wrapper, NULL)) ==
+			       fstrm_res_again)
+			{
+				poll(NULL, 0, 1);
+			}
+			assert(res == fstrm_res_success);
+			continue;
+		}
+
+		/* Header, an empty segment, and the rest of the frame. */
+		sf = my_calloc(1, sizeof(*sf));
+		sf->buf = make_frame(i, &len);
+		sf->iov[0].iov_base = sf->buf;
+		sf->iov[0].iov_len = len_hdr;
+		sf->iov[1].iov_base = NULL;
+		sf->iov[1].iov_len = 0;
+		sf->iov[2].iov_base = sf->buf + len_hdr;
+		sf->iov[2].iov_len = len - len_hdr;
+
+		while ((res = fstrm_iothr_submitv(iothr, ioq, sf->iov, 3,
+						  free_split_frame, NULL)) ==
+		       fstrm_res_again)
+		{
+			poll(NULL, 0, 1);
+		}
+		assert(res == fstrm_res_success);
+	}
+
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, num_frames);
+	capture_free(&c);
+	return ret;
+}
+
+struct free_counter {
+	unsigned	count;
+};
+
+static void
+free_counted(void *data, void *free_data)
+{
+	struct free_counter *fc = free_data;
+	fc->count++;
+	free(data);
+}
+
+/*
+ * Submit data frames with many distinct deallocation callbacks. With
+ * 'registered', the first one is registered with the input queue, and the
+ * submission times are tracked too.
+ */
+static int
+test_free_funcs(bool registered)
+{
+	struct free_counter counters[20] = {{ 0 }};
+	const unsigned num_counters = sizeof(counters) / sizeof(counters[0]);
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_latency lat;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	fstrm_res res;
+	int ret;
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_track_latency(iothr_opt, registered);
+	assert(res == fstrm_res_success);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	if (registered) {
+		ioq = fstrm_iothr_get_input_queue_free(iothr, free_counted,
+						       &counters[0]);
+		assert(ioq != NULL);
+		assert(fstrm_iothr_get_input_queue_idx(iothr, 0) == NULL);
+	} else {
+		ioq = fstrm_iothr_get_input_queue(iothr);
+		assert(ioq != NULL);
+	}
+
+	for (unsigned i = 0; i < num_frames; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		while ((res = fstrm_iothr_submit(iothr, ioq, frame, len,
+						 free_counted,
+						 &counters[i % num_counters])) ==
+		       fstrm_res_again)
+		{
+			poll(NULL, 0, 1);
+		}
+		assert(res == fstrm_res_success);
+	}
+
+	if (registered) {
+		/* Wait for the I/O thread to write out everything. */
+		for (unsigned i = 0; i < 10000; i++) {
+			res = fstrm_iothr_get_latency(iothr, &lat);
+			assert(res == fstrm_res_success);
+			if (lat.count == num_frames)
+				break;
+			poll(NULL, 0, 1);
+		}
+		if (lat.count != num_frames) {
+			fprintf(stderr, "%s: %u data frames timed, expected %u\n",
+				__func__, (unsigned) lat.count, num_frames);
+			return EXIT_FAILURE;
+		}
+	}
+
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, num_frames);
+	capture_free(&c);
+
+	for (unsigned i = 0; i < num_counters; i++) {
+		unsigned expected = num_frames / num_counters +
+			(i < num_frames % num_counters ? 1 : 0);
+		if (counters[i].count != expected) {
+			fprintf(stderr, "%s: callback %u called %u times, expected %u\n",
+				__func__, i, counters[i].count, expected);
+			return EXIT_FAILURE;
+		}
+	}
+	return ret;
+}
+
+static int
+test_stats(void)
+{
+	struct fstrm_iothr_queue_stats qs;
+	struct fstrm_iothr_stats st, st_short;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	uint64_t bytes = 0, rejected = 0;
+	size_t len_short;
+	fstrm_res res;
+	int ret;
+
+	iothr = capture_iothr_init(NULL, &c);
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	for (unsigned i = 0; i < num_frames; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		while ((res = fstrm_iothr_submit(iothr, ioq, frame, len,
+						 fstrm_free_wrapper, NULL)) ==
+		       fstrm_res_again)
+		{
+			rejected++;
+			poll(NULL, 0, 1);
+		}
+		assert(res == fstrm_res_success);
+		bytes += len;
+	}
+
+	/* Wait for the I/O thread to write out everything. */
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.frames_written == num_frames)
+			break;
+		poll(NULL, 0, 1);
+	}
+
+	fstrm_iothr_get_queue_stats(iothr, ioq, &qs, sizeof(qs));
+
+	/* A caller built with a shorter structure only gets its fields. */
+	memset(&st_short, 0xff, sizeof(st_short));
+	len_short = fstrm_iothr_get_stats(iothr, &st_short,
+		offsetof(struct fstrm_iothr_stats, bytes_submitted));
+	if (len_short != sizeof(st_short.frames_submitted) ||
+	    st_short.frames_submitted != num_frames ||
+	    st_short.bytes_submitted != UINT64_MAX)
+	{
+		fprintf(stderr, "%s: short statistics overrun\n", __func__);
+		return EXIT_FAILURE;
+	}
+
+	/* Latency tracking is disabled by default. */
+	struct fstrm_iothr_latency lat;
+	res = fstrm_iothr_get_latency(iothr, &lat);
+	assert(res == fstrm_res_failure);
+
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, num_frames);
+	capture_free(&c);
+
+	if (st.frames_submitted != num_frames ||
+	    st.bytes_submitted != bytes ||
+	    st.frames_rejected_full != rejected ||
+	    st.frames_written != num_frames ||
+	    st.bytes_written != bytes ||
+	    st.frames_dropped_closed != 0 ||
+	    st.frames_dropped_write_error != 0 ||
+	    st.open_attempts != 1 ||
+	    st.open_failures != 0 ||
+	    st.writev_calls == 0 ||
+	    st.queue_depth_hwm == 0)
+	{
+		fprintf(stderr, "%s: unexpected iothr statistics\n", __func__);
+		return EXIT_FAILURE;
+	}
+	if (qs.frames_submitted != st.frames_submitted ||
+	    qs.bytes_submitted != st.bytes_submitted ||
+	    qs.frames_rejected_full != st.frames_rejected_full ||
+	    qs.queue_depth_hwm != st.queue_depth_hwm)
+	{
+		fprintf(stderr, "%s: unexpected queue statistics\n", __func__);
+		return EXIT_FAILURE;
+	}
+	return ret;
+}
+
+static int
+test_latency(void)
+{
+	const size_t batch_size = 3;
+	struct fstrm_iothr_frame frames[batch_size];
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_latency lat;
+	struct fstrm_iothr_stats st;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	uint64_t sum = 0;
+	fstrm_res res;
+	int ret;
+
+	iothr_opt = fstrm_iothr_options_init();
+	fstrm_iothr_options_set_track_latency(iothr_opt, 1);
+	fstrm_iothr_options_set_queue_model(iothr_opt, FSTRM_IOTHR_QUEUE_MODEL_MPSC);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	/* Alternate single submissions and batches, which stamp differently. */
+	for (unsigned i = 0; i < num_frames; ) {
+		size_t n = (i % 2 == 0) ? 1 : batch_size;
+		size_t off = 0, n_submitted;
+
+		if (n > num_frames - i)
+			n = num_frames - i;
+		for (size_t j = 0; j < n; j++) {
+			frames[j].data = make_frame(i + j, &frames[j].len);
+			frames[j].free_func = fstrm_free_wrapper;
+			frames[j].free_data = NULL;
+		}
+		for (;;) {
+			res = fstrm_iothr_submit_batch(iothr, ioq, &frames[off],
+						       n - off, &n_submitted);
+			off += n_submitted;
+			if (res == fstrm_res_success)
+				break;
+			assert(res == fstrm_res_again);
+			poll(NULL, 0, 1);
+		}
+		i += n;
+	}
+
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.frames_written == num_frames)
+			break;
+		poll(NULL, 0, 1);
+	}
+
+	res = fstrm_iothr_get_latency(iothr, &lat);
+	assert(res == fstrm_res_success);
+
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, num_frames);
+	capture_free(&c);
+
+	for (unsigned i = 0; i < FSTRM_IOTHR_LATENCY_BUCKETS; i++)
+		sum += lat.buckets[i];
+	if (lat.count != num_frames || sum != lat.count ||
+	    lat.max_us * lat.count < lat.sum_us)
+	{
+		fprintf(stderr, "%s: unexpected latency histogram\n", __func__);
+		return EXIT_FAILURE;
+	}
+	return ret;
+}
+
+static int
+test_flush_max_age(void)
+{
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_stats st;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	fstrm_res res;
+	int ret;
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_flush_max_age(iothr_opt,
+		FSTRM_IOTHR_FLUSH_MAX_AGE_MAX + 1);
+	assert(res == fstrm_res_failure);
+	res = fstrm_iothr_options_set_flush_max_age(iothr_opt, 5000);
+	assert(res == fstrm_res_success);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	/*
+	 * A single data frame is below the queue notification threshold, so
+	 * without flush_max_age it would wait for the 1 second flush_timeout.
+	 * Every other data frame, let the I/O thread go idle first, so that it
+	 * is no longer checking back every flush_max_age.
+	 */
+	for (unsigned i = 0; i < 10; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+		unsigned waited = 0;
+
+		if (i % 2 == 1)
+			poll(NULL, 0, 20);
+		res = fstrm_iothr_submit(iothr, ioq, frame, len,
+					 fstrm_free_wrapper, NULL);
+		assert(res == fstrm_res_success);
+		for (;;) {
+			fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+			if (st.frames_written == i + 1)
+				break;
+			poll(NULL, 0, 1);
+			waited++;
+		}
+		if (waited > 500) {
+			fprintf(stderr, "%s: data frame %u took %u ms to be written\n",
+				__func__, i, waited);
+			fstrm_iothr_destroy(&iothr);
+			capture_free(&c);
+			return EXIT_FAILURE;
+		}
+	}
+
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, 10);
+	capture_free(&c);
+	return ret;
+}
+
+static int
+test_submit_wait(void)
+{
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	unsigned depth, capacity;
+	fstrm_res res;
+	int ret;
+
+	iothr_opt = fstrm_iothr_options_init();
+	fstrm_iothr_options_set_input_queue_size(iothr_opt, 16);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	fstrm_iothr_get_queue_occupancy(iothr, ioq, &depth, &capacity);
+	assert(depth == 0);
+	assert(capacity == 16);
+
+	/* Never returns fstrm_res_again without a timeout. */
+	for (unsigned i = 0; i < num_frames; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		res = fstrm_iothr_submit_wait(iothr, ioq, frame, len,
+					      fstrm_free_wrapper, NULL,
+					      (i % 2 == 0) ? -1 : 1000);
+		assert(res == fstrm_res_success);
+
+		fstrm_iothr_get_queue_occupancy(iothr, ioq, &depth, NULL);
+		assert(depth <= capacity);
+	}
+
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, num_frames);
+	capture_free(&c);
+	return ret;
+}
+
+struct destroy_waiter {
+	struct fstrm_iothr		*iothr;
+	struct fstrm_iothr_queue	*ioq;
+	fstrm_res			res;
+};
+
+static void *
+destroy_waiter_thr(void *arg)
+{
+	struct destroy_waiter *w = arg;
+	size_t len;
+	char *frame = make_frame(0, &len);
+
+	w->res = fstrm_iothr_submit_wait(w->iothr, w->ioq, frame, len,
+					 fstrm_free_wrapper, NULL, -1);
+	if (w->res != fstrm_res_success)
+		free(frame);
+
+	/* Let fstrm_iothr_destroy() finish. */
+	atomic_store(&capture_hold_open, false);
+	return NULL;
+}
+
+/*
+ * fstrm_iothr_destroy() makes a producer sleeping in fstrm_iothr_submit_wait()
+ * give up, and waits for it to return before tearing down the object.
+ */
+static int
+test_submit_wait_destroy(void)
+{
+	const unsigned queue_size = 16;
+	struct fstrm_iothr_options *iothr_opt;
+	struct destroy_waiter w;
+	struct capture *c;
+	pthread_t thr;
+	fstrm_res res;
+	int ret;
+
+	iothr_opt = fstrm_iothr_options_init();
+	fstrm_iothr_options_set_input_queue_size(iothr_opt, queue_size);
+
+	/* Stall the I/O thread so that the input queue fills up. */
+	atomic_store(&capture_hold_open, true);
+	w.iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	w.ioq = fstrm_iothr_get_input_queue(w.iothr);
+	assert(w.ioq != NULL);
+
+	for (unsigned i = 0; i < queue_size; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		res = fstrm_iothr_submit(w.iothr, w.ioq, frame, len,
+					 fstrm_free_wrapper, NULL);
+		assert(res == fstrm_res_success);
+	}
+
+	int r = pthread_create(&thr, NULL, destroy_waiter_thr, &w);
+	assert(r == 0);
+	poll(NULL, 0, 100);
+
+	fstrm_iothr_destroy(&w.iothr);
+	pthread_join(thr, NULL);
+
+	ret = check_capture(c, queue_size);
+	capture_free(&c);
+	if (w.res != fstrm_res_failure) {
+		fprintf(stderr, "%s: fstrm_iothr_submit_wait() returned %d\n",
+			__func__, (int) w.res);
+		return EXIT_FAILURE;
+	}
+	return ret;
+}
+
+static int
+test_drop_policy(fstrm_iothr_drop_policy drop_policy)
+{
+	const unsigned queue_size = 16, n = 200;
+	struct fstrm_iothr_options *iothr_opt;
+	struct free_counter fc = { 0 };
+	struct fstrm_iothr_stats st;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	fstrm_res res;
+	void *rsv;
+
+	iothr_opt = fstrm_iothr_options_init();
+	fstrm_iothr_options_set_input_queue_size(iothr_opt, queue_size);
+	res = fstrm_iothr_options_set_drop_policy(iothr_opt, drop_policy);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_drop_sample_threshold(iothr_opt, 50);
+	assert(res == fstrm_res_success);
+
+	/* Stall the I/O thread so that the input queue fills up. */
+	atomic_store(&capture_hold_open, true);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	res = fstrm_iothr_reserve(iothr, ioq, 16, &rsv);
+	if (drop_policy == FSTRM_IOTHR_DROP_POLICY_OLDEST) {
+		assert(res == fstrm_res_failure);
+	} else {
+		assert(res == fstrm_res_success);
+		res = fstrm_iothr_commit(iothr, ioq, 0);
+		assert(res == fstrm_res_success);
+	}
+
+	/* Once the input queue is full, every data frame is accepted and dropped. */
+	for (unsigned i = 0; i < n; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		res = fstrm_iothr_submit(iothr, ioq, frame, len, free_counted, &fc);
+		assert(res == fstrm_res_success);
+	}
+
+	/* Data frames discarded by sampling never enter the input queue. */
+	fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+	if (st.frames_submitted !=
+	    (drop_policy == FSTRM_IOTHR_DROP_POLICY_OLDEST ? n : queue_size) ||
+	    st.frames_rejected_full != 0 ||
+	    fc.count != n - queue_size)
+	{
+		fprintf(stderr, "%s: %u data frames submitted, %u freed\n",
+			__func__, (unsigned) st.frames_submitted, fc.count);
+		return EXIT_FAILURE;
+	}
+	if (drop_policy == FSTRM_IOTHR_DROP_POLICY_OLDEST &&
+	    st.frames_dropped_oldest != n - queue_size)
+	{
+		fprintf(stderr, "%s: frames_dropped_oldest=%u\n", __func__,
+			(unsigned) st.frames_dropped_oldest);
+		return EXIT_FAILURE;
+	}
+	if (drop_policy == FSTRM_IOTHR_DROP_POLICY_SAMPLE &&
+	    st.frames_dropped_sampled != n - queue_size)
+	{
+		fprintf(stderr, "%s: frames_dropped_sampled=%u\n", __func__,
+			(unsigned) st.frames_dropped_sampled);
+		return EXIT_FAILURE;
+	}
+
+	/* The data frames left in the input queue are written once it opens. */
+	atomic_store(&capture_hold_open, false);
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.frames_written == queue_size)
+			break;
+		poll(NULL, 0, 1);
+	}
+
+	fstrm_iothr_destroy(&iothr);
+	capture_free(&c);
+
+	if (st.frames_written != queue_size || fc.count != n) {
+		fprintf(stderr, "%s: %u data frames written, %u freed\n",
+			__func__, (unsigned) st.frames_written, fc.count);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+ * While the writer is being reopened, the I/O thread keeps draining the input
+ * queue. It holds on to as many data frames as fit in the output queue, and
+ * discards the rest.
+ */
+static int
+test_reopen_drain(void)
+{
+	const unsigned queue_size = 16, outq_size = 32, n = 200;
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_stats st;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	fstrm_res res;
+	int ret;
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_input_queue_size(iothr_opt, queue_size);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_output_queue_size(iothr_opt, outq_size);
+	assert(res == fstrm_res_success);
+	fstrm_iothr_options_set_reopen_interval(iothr_opt, 1);
+
+	/* Fail the first attempt, and stall the next one. */
+	atomic_store(&capture_fail_open, true);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.open_failures == 1)
+			break;
+		poll(NULL, 0, 1);
+	}
+	atomic_store(&capture_hold_open, true);
+	atomic_store(&capture_fail_open, false);
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.open_attempts == 2)
+			break;
+		poll(NULL, 0, 1);
+	}
+	if (st.open_attempts != 2) {
+		fprintf(stderr, "%s: writer was not reopened\n", __func__);
+		atomic_store(&capture_hold_open, false);
+		fstrm_iothr_destroy(&iothr);
+		capture_free(&c);
+		return EXIT_FAILURE;
+	}
+
+	/* Producers don't have to wait for the attempt to finish. */
+	for (unsigned i = 0; i < n; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		res = fstrm_iothr_submit_wait(iothr, ioq, frame, len,
+					      fstrm_free_wrapper, NULL, 1000);
+		if (res != fstrm_res_success) {
+			fprintf(stderr, "%s: data frame %u was rejected\n",
+				__func__, i);
+			free(frame);
+			atomic_store(&capture_hold_open, false);
+			fstrm_iothr_destroy(&iothr);
+			capture_free(&c);
+			return EXIT_FAILURE;
+		}
+	}
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.frames_dropped_closed == n - outq_size)
+			break;
+		poll(NULL, 0, 1);
+	}
+
+	/* The data frames held back are written once the writer opens. */
+	atomic_store(&capture_hold_open, false);
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.frames_written == outq_size)
+			break;
+		poll(NULL, 0, 1);
+	}
+	fstrm_iothr_destroy(&iothr);
+
+	if (st.frames_dropped_closed != n - outq_size ||
+	    st.frames_written != outq_size)
+	{
+		fprintf(stderr, "%s: %u data frames dropped, %u written\n",
+			__func__, (unsigned) st.frames_dropped_closed,
+			(unsigned) st.frames_written);
+		capture_free(&c);
+		return EXIT_FAILURE;
+	}
+	ret = check_capture(c, outq_size);
+	capture_free(&c);
+	return ret;
+}
+
+/* Wait for the open_failures statistic to reach 'n'. */
+static bool
+wait_open_failures(struct fstrm_iothr *iothr, unsigned n)
+{
+	struct fstrm_iothr_stats st;
+
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.open_failures >= n)
+			return true;
+		poll(NULL, 0, 1);
+	}
+	return false;
+}
+
+/*
+ * After each failed attempt to open the writer, the reopen interval doubles up
+ * to reopen_interval_max, and the next attempt is made after between half and
+ * all of it. The interval is reset once the writer has been opened.
+ */
+static int
+test_reopen_backoff(void)
+{
+	/*
+	 * The attempts whose delay after the previous one is checked, counted
+	 * from 0, and the reopen interval in seconds. The fourth attempt
+	 * succeeds, so the sixth one is back to the initial interval.
+	 */
+	static const struct {
+		unsigned	attempt;
+		double		interval;
+	} checks[] = { { 1, 1.0 }, { 2, 2.0 }, { 3, 2.0 }, { 5, 1.0 } };
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	fstrm_res res;
+	size_t len;
+	char *frame;
+	int ret = EXIT_SUCCESS;
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_reopen_interval(iothr_opt, 1);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_reopen_interval_max(iothr_opt, 2);
+	assert(res == fstrm_res_success);
+
+	/* Fail the first three attempts. */
+	atomic_store(&capture_opens, 0);
+	atomic_store(&capture_fail_open, true);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+	if (!wait_open_failures(iothr, 3))
+		ret = EXIT_FAILURE;
+	atomic_store(&capture_fail_open, false);
+
+	/* Once opened, fail a write, and the attempt to reopen after it. */
+	frame = make_frame(0, &len);
+	res = fstrm_iothr_submit_wait(iothr, ioq, frame, len,
+				      fstrm_free_wrapper, NULL, -1);
+	assert(res == fstrm_res_success);
+	while (ret == EXIT_SUCCESS && atomic_load(&capture_opens) < 4)
+		poll(NULL, 0, 1);
+	atomic_store(&capture_fail_open, true);
+	atomic_store(&capture_fail_write, true);
+	frame = make_frame(1, &len);
+	res = fstrm_iothr_submit_wait(iothr, ioq, frame, len,
+				      fstrm_free_wrapper, NULL, -1);
+	assert(res == fstrm_res_success);
+	if (ret == EXIT_SUCCESS && !wait_open_failures(iothr, 4))
+		ret = EXIT_FAILURE;
+	atomic_store(&capture_fail_open, false);
+	atomic_store(&capture_fail_write, false);
+	while (ret == EXIT_SUCCESS && atomic_load(&capture_opens) < 6)
+		poll(NULL, 0, 1);
+
+	fstrm_iothr_destroy(&iothr);
+	capture_free(&c);
+	if (ret != EXIT_SUCCESS) {
+		fprintf(stderr, "%s: writer was not reopened\n", __func__);
+		return ret;
+	}
+
+	for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+		unsigned a = checks[i].attempt;
+		double delay = capture_open_times[a] - capture_open_times[a - 1];
+
+		fprintf(stderr, "%s: attempt %u followed after %.3f seconds\n",
+			__func__, a + 1, delay);
+		if (delay < checks[i].interval / 2 - 0.02 ||
+		    delay > checks[i].interval + 0.1)
+		{
+			fprintf(stderr, "%s: expected between %.1f and %.1f\n",
+				__func__, checks[i].interval / 2,
+				checks[i].interval);
+			ret = EXIT_FAILURE;
+		}
+	}
+	return ret;
+}
+
+static int
+test_pipeline_writes(void)
+{
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_latency lat;
+	struct fstrm_iothr_stats st;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	fstrm_res res;
+	int ret;
+
+	/*
+	 * Write slowly, so that the I/O thread fills one output queue while
+	 * the writer thread is writing the other. This only checks that the
+	 * data frames are all written, in order, and timed; whether the writes
+	 * actually overlapped with filling the other output queue is not
+	 * checked.
+	 */
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_pipeline_writes(iothr_opt, 1);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_track_latency(iothr_opt, 1);
+	assert(res == fstrm_res_success);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+	atomic_store(&capture_slow_write, true);
+
+	for (unsigned i = 0; i < num_frames; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		while ((res = fstrm_iothr_submit(iothr, ioq, frame, len,
+						 fstrm_free_wrapper, NULL)) ==
+		       fstrm_res_again)
+		{
+			poll(NULL, 0, 1);
+		}
+		assert(res == fstrm_res_success);
+	}
+
+	/* Wait for the writer thread to write out everything. */
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.frames_written == num_frames)
+			break;
+		poll(NULL, 0, 1);
+	}
+	res = fstrm_iothr_get_latency(iothr, &lat);
+	assert(res == fstrm_res_success);
+
+	fstrm_iothr_destroy(&iothr);
+	atomic_store(&capture_slow_write, false);
+	ret = check_capture(c, num_frames);
+	capture_free(&c);
+
+	if (st.frames_written != num_frames || lat.count != num_frames) {
+		fprintf(stderr, "%s: %u data frames written, %u timed, "
+			"expected %u\n", __func__, (unsigned) st.frames_written,
+			(unsigned) lat.count, num_frames);
+		return EXIT_FAILURE;
+	}
+	return ret;
+}
+
+struct external_producer {
+	struct fstrm_iothr	*iothr;
+	struct fstrm_iothr_queue *ioq;
+	atomic_bool		done;
+};
+
+static void *
+external_producer_thr(void *arg)
+{
+	struct external_producer *p = arg;
+
+	/* This relies on fstrm_iothr_run_once() to make room. */
+	for (unsigned i = 0; i < num_frames; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+		fstrm_res res;
+
+		res = fstrm_iothr_submit_wait(p->iothr, p->ioq, frame, len,
+					      fstrm_free_wrapper, NULL, -1);
+		assert(res == fstrm_res_success);
+	}
+	atomic_store(&p->done, true);
+	return NULL;
+}
+
+static int
+test_external_drive(void)
+{
+	struct fstrm_iothr_options *iothr_opt;
+	struct external_producer p;
+	struct fstrm_iothr_stats st;
+	struct capture *c;
+	pthread_t thr;
+	unsigned polls = 0;
+	fstrm_res res;
+	int timeout, ret;
+
+	/* Without external_drive, there is nothing to drive. */
+	p.iothr = capture_iothr_init(NULL, &c);
+	assert(fstrm_iothr_get_fd(p.iothr) == -1);
+	assert(fstrm_iothr_run_once(p.iothr, &timeout) == fstrm_res_failure);
+	fstrm_iothr_destroy(&p.iothr);
+	capture_free(&c);
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_external_drive(iothr_opt, 1);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_input_queue_size(iothr_opt, 128);
+	assert(res == fstrm_res_success);
+	p.iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	p.ioq = fstrm_iothr_get_input_queue(p.iothr);
+	assert(p.ioq != NULL);
+	atomic_init(&p.done, false);
+
+	int r = pthread_create(&thr, NULL, external_producer_thr, &p);
+	assert(r == 0);
+
+	/* A minimal event loop. */
+	for (;;) {
+		struct pollfd pfd = {
+			.fd = fstrm_iothr_get_fd(p.iothr),
+			.events = POLLIN,
+		};
+
+		res = fstrm_iothr_run_once(p.iothr, &timeout);
+		assert(res == fstrm_res_success);
+		fstrm_iothr_get_stats(p.iothr, &st, sizeof(st));
+		if (atomic_load(&p.done) && st.frames_written == num_frames)
+			break;
+		if (timeout != 0) {
+			(void)poll(&pfd, 1, timeout);
+			polls++;
+		}
+	}
+	pthread_join(thr, NULL);
+
+	fstrm_iothr_destroy(&p.iothr);
+	ret = check_capture(c, num_frames);
+	capture_free(&c);
+	fprintf(stderr, "%s: slept in poll() %u times\n", __func__, polls);
+	return ret;
+}
+
+/*
+ * With external_drive, the timed wait strategy and flush_max_age, a trickle of
+ * data frames is written within flush_max_age, although producers don't wake
+ * the event loop below the queue notification threshold. Once it has gone
+ * idle, the next data frame does wake it up.
+ */
+static int
+test_external_drive_timed(void)
+{
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_stats st;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	struct pollfd pfd;
+	fstrm_res res;
+	int timeout, ret;
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_external_drive(iothr_opt, 1);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_wait_strategy(iothr_opt,
+		FSTRM_IOTHR_WAIT_STRATEGY_TIMED);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_flush_max_age(iothr_opt, 5000);
+	assert(res == fstrm_res_success);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+	pfd.fd = fstrm_iothr_get_fd(iothr);
+	pfd.events = POLLIN;
+
+	for (unsigned i = 0; i < 10; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+		unsigned waited = 0;
+
+		res = fstrm_iothr_submit(iothr, ioq, frame, len,
+					 fstrm_free_wrapper, NULL);
+		assert(res == fstrm_res_success);
+		if (i > 0 && poll(&pfd, 1, 0) != 1) {
+			fprintf(stderr, "%s: data frame %u did not wake the "
+				"event loop\n", __func__, i);
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+
+		for (;;) {
+			res = fstrm_iothr_run_once(iothr, &timeout);
+			assert(res == fstrm_res_success);
+			fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+			if (st.frames_written == i + 1)
+				break;
+			if (timeout < 0 || waited > 500) {
+				fprintf(stderr, "%s: data frame %u not written, "
+					"timeout %d\n", __func__, i, timeout);
+				ret = EXIT_FAILURE;
+				goto out;
+			}
+			if (poll(&pfd, 1, timeout) == 0)
+				waited += (unsigned) timeout;
+		}
+
+		/* Let the event loop go idle. */
+		for (unsigned j = 0; j < 1000; j++) {
+			res = fstrm_iothr_run_once(iothr, &timeout);
+			assert(res == fstrm_res_success);
+			if (timeout < 0 || timeout > 5)
+				break;
+			(void)poll(&pfd, 1, timeout);
+		}
+		if (timeout < 0) {
+			fprintf(stderr, "%s: idle event loop would sleep "
+				"indefinitely\n", __func__);
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+	}
+	ret = EXIT_SUCCESS;
+
+out:
+	fstrm_iothr_destroy(&iothr);
+	if (ret == EXIT_SUCCESS)
+		ret = check_capture(c, 10);
+	capture_free(&c);
+	return ret;
+}
+
+static int
+test_reactor(void)
+{
+	enum { num_iothrs = 3 };
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_reactor *reactor;
+	struct fstrm_iothr *iothrs[num_iothrs];
+	struct fstrm_iothr_queue *ioqs[num_iothrs];
+	struct capture *captures[num_iothrs];
+	fstrm_res res;
+	int ret = EXIT_SUCCESS;
+
+	reactor = fstrm_iothr_reactor_init();
+	assert(reactor != NULL);
+
+	/*
+	 * Attach I/O thread objects with each wait strategy, and one with
+	 * pipeline_writes.
+	 */
+	for (unsigned k = 0; k < num_iothrs; k++) {
+		iothr_opt = fstrm_iothr_options_init();
+		res = fstrm_iothr_options_set_reactor(iothr_opt, reactor);
+		assert(res == fstrm_res_success);
+		if (k == 1) {
+			res = fstrm_iothr_options_set_wait_strategy(iothr_opt,
+				FSTRM_IOTHR_WAIT_STRATEGY_TIMED);
+			assert(res == fstrm_res_success);
+			res = fstrm_iothr_options_set_flush_timeout(iothr_opt, 1);
+			assert(res == fstrm_res_success);
+		} else if (k == 2) {
+			res = fstrm_iothr_options_set_pipeline_writes(iothr_opt, 1);
+			assert(res == fstrm_res_success);
+		}
+		iothrs[k] = capture_iothr_init(iothr_opt, &captures[k]);
+		fstrm_iothr_options_destroy(&iothr_opt);
+		ioqs[k] = fstrm_iothr_get_input_queue(iothrs[k]);
+		assert(ioqs[k] != NULL);
+	}
+
+	for (unsigned i = 0; i < num_frames; i++) {
+		for (unsigned k = 0; k < num_iothrs; k++) {
+			size_t len;
+			char *frame = make_frame(i, &len);
+
+			while ((res = fstrm_iothr_submit(iothrs[k], ioqs[k],
+					frame, len, fstrm_free_wrapper, NULL)) ==
+			       fstrm_res_again)
+			{
+				poll(NULL, 0, 1);
+			}
+			assert(res == fstrm_res_success);
+		}
+	}
+
+	/*
+	 * Destroying an I/O thread object writes out what it still holds,
+	 * while the reactor carries on serving the others.
+	 */
+	for (unsigned k = 0; k < num_iothrs; k++) {
+		fstrm_iothr_destroy(&iothrs[k]);
+		if (check_capture(captures[k], num_frames) != EXIT_SUCCESS)
+			ret = EXIT_FAILURE;
+		capture_free(&captures[k]);
+	}
+	fstrm_iothr_reactor_destroy(&reactor);
+	return ret;
+}
+
+static struct fstrm_writer *
+pool_writer(void *data, size_t shard)
+{
+	struct capture **captures = data;
+	return capture_writer_init(NULL, &captures[shard]);
+}
+
+static int
+test_iothr_pool(void)
+{
+	enum { num_shards = 4, num_keys = 16 };
+	struct capture *captures[num_shards];
+	struct fstrm_iothr_pool_queue *pq;
+	struct fstrm_iothr_pool *pool;
+	unsigned key_shard[num_keys], key_next[num_keys];
+	unsigned total = 0, shards_used = 0;
+	fstrm_res res;
+
+	pool = fstrm_iothr_pool_init(num_shards, NULL, pool_writer, captures);
+	assert(pool != NULL);
+	assert(fstrm_iothr_pool_get_num_shards(pool) == num_shards);
+	assert(fstrm_iothr_pool_get_iothr(pool, num_shards) == NULL);
+
+	/* There is one input queue per shard by default, so one handle. */
+	pq = fstrm_iothr_pool_get_input_queue(pool);
+	assert(pq != NULL);
+	assert(fstrm_iothr_pool_get_input_queue(pool) == NULL);
+
+	for (unsigned i = 0; i < num_frames; i++) {
+		uint32_t key = i % num_keys;
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		while ((res = fstrm_iothr_pool_submit_key(pool, pq, &key,
+				sizeof(key), frame, len, fstrm_free_wrapper,
+				NULL)) == fstrm_res_again)
+		{
+			poll(NULL, 0, 1);
+		}
+		assert(res == fstrm_res_success);
+	}
+	fstrm_iothr_pool_destroy(&pool);
+
+	/*
+	 * Each key's data frames must all have been written by the same shard,
+	 * in order.
+	 */
+	for (unsigned k = 0; k < num_keys; k++) {
+		key_shard[k] = num_shards;
+		key_next[k] = k;
+	}
+	for (unsigned shard = 0; shard < num_shards; shard++) {
+		const uint8_t *p = ubuf_data(captures[shard]->u);
+		size_t len = ubuf_size(captures[shard]->u);
+		const uint8_t *frame;
+		size_t len_frame;
+		unsigned n = 0;
+
+		while (capture_next_frame(&p, &len, &frame, &len_frame)) {
+			unsigned i, k;
+
+			assert(len_frame > 7 && memcmp(frame, "frame #", 7) == 0);
+			i = (unsigned) strtoul((const char *) frame + 7, NULL, 10);
+			k = i % num_keys;
+			if (key_shard[k] == num_shards)
+				key_shard[k] = shard;
+			if (key_shard[k] != shard || i != key_next[k]) {
+				fprintf(stderr, "%s: data frame %u out of place "
+					"in shard %u\n", __func__, i, shard);
+				return EXIT_FAILURE;
+			}
+			key_next[k] += num_keys;
+			n++;
+		}
+		total += n;
+		if (n > 0)
+			shards_used++;
+		capture_free(&captures[shard]);
+	}
+
+	if (total != num_frames || shards_used < 2) {
+		fprintf(stderr, "%s: got %u data frames from %u shards\n",
+			__func__, total, shards_used);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "%s: got %u data frames from %u shards\n",
+		__func__, total, shards_used);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * With 'block_open', opening the writer blocks instead of failing until the
+ * data frames have been spooled.
+ */
+static int
+test_spool(bool block_open)
+{
+	const unsigned n = 1000;
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_stats st;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	const char *dirname;
+	char path[4096];
+	fstrm_res res;
+	int ret;
+
+	dirname = getenv("DIRNAME");
+	if (dirname == NULL)
+		dirname = ".";
+	snprintf(path, sizeof(path), "%s/test_iothr_submit.spool", dirname);
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_spool_path(iothr_opt, path);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_spool_size(iothr_opt, 0);
+	assert(res == fstrm_res_failure);
+	fstrm_iothr_options_set_reopen_interval(iothr_opt, 1);
+	fstrm_iothr_options_set_wait_strategy(iothr_opt,
+		FSTRM_IOTHR_WAIT_STRATEGY_SPIN_PARK);
+
+	/* The data frames submitted while the writer can't be opened are spooled. */
+	if (block_open)
+		atomic_store(&capture_hold_open, true);
+	else
+		atomic_store(&capture_fail_open, true);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	assert(access(path, F_OK) == 0);
+
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	for (unsigned i = 0; i < n; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		res = fstrm_iothr_submit_wait(iothr, ioq, frame, len,
+					      fstrm_free_wrapper, NULL, -1);
+		assert(res == fstrm_res_success);
+	}
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.frames_spooled == n)
+			break;
+		poll(NULL, 0, 1);
+	}
+	if (st.frames_spooled != n || st.frames_dropped_closed != 0 ||
+	    st.frames_written != 0)
+	{
+		fprintf(stderr, "%s: %u data frames spooled, %u written\n",
+			__func__, (unsigned) st.frames_spooled,
+			(unsigned) st.frames_written);
+		return EXIT_FAILURE;
+	}
+
+	/*
+	 * Once the writer opens, the spool is written before the data frames
+	 * submitted since.
+	 */
+	atomic_store(&capture_hold_open, false);
+	atomic_store(&capture_fail_open, false);
+	for (unsigned i = n; i < 2 * n; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		res = fstrm_iothr_submit_wait(iothr, ioq, frame, len,
+					      fstrm_free_wrapper, NULL, -1);
+		assert(res == fstrm_res_success);
+	}
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.frames_written == 2 * n)
+			break;
+		poll(NULL, 0, 1);
+	}
+
+	fstrm_iothr_destroy(&iothr);
+
+	/* The spool file is removed once it has been drained. */
+	if (access(path, F_OK) == 0) {
+		fprintf(stderr, "%s: %s was not removed\n", __func__, path);
+		(void)unlink(path);
+		return EXIT_FAILURE;
+	}
+
+	ret = check_capture(c, 2 * n);
+	capture_free(&c);
+	return ret;
+}
+
+/*
+ * A spool file left behind by fstrm_iothr_destroy() is written out by the next
+ * fstrm_iothr object created with the same spool_path.
+ */
+static int
+test_spool_resume(void)
+{
+	const unsigned n = 1000;
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_stats st;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	const char *dirname;
+	char path[4096];
+	fstrm_res res;
+	int ret;
+
+	dirname = getenv("DIRNAME");
+	if (dirname == NULL)
+		dirname = ".";
+	snprintf(path, sizeof(path), "%s/test_iothr_submit.spool", dirname);
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_spool_path(iothr_opt, path);
+	assert(res == fstrm_res_success);
+
+	/* The writer never opens, so the data frames stay in the spool. */
+	atomic_store(&capture_fail_open, true);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+	for (unsigned i = 0; i < n; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		res = fstrm_iothr_submit_wait(iothr, ioq, frame, len,
+					      fstrm_free_wrapper, NULL, -1);
+		assert(res == fstrm_res_success);
+	}
+	fstrm_iothr_destroy(&iothr);
+	capture_free(&c);
+	atomic_store(&capture_fail_open, false);
+	if (access(path, F_OK) != 0) {
+		fprintf(stderr, "%s: %s was removed\n", __func__, path);
+		fstrm_iothr_options_destroy(&iothr_opt);
+		return EXIT_FAILURE;
+	}
+
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.frames_written == n)
+			break;
+		poll(NULL, 0, 1);
+	}
+	fstrm_iothr_destroy(&iothr);
+
+	if (access(path, F_OK) == 0) {
+		fprintf(stderr, "%s: %s was not removed\n", __func__, path);
+		(void)unlink(path);
+		return EXIT_FAILURE;
+	}
+
+	ret = check_capture(c, n);
+	capture_free(&c);
+	return ret;
+}
+
+/*
+ * A failed fstrm_iothr_init() returns NULL and leaves the writer with the
+ * caller.
+ */
+static int
+test_init_failure(void)
+{
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_reactor *reactor;
+	struct fstrm_iothr *iothr;
+	struct fstrm_writer *w;
+	struct capture *c;
+	fstrm_res res;
+
+	/* The spool file can't be created. */
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_spool_path(iothr_opt,
+		"/nonexistent/test_iothr_submit.spool");
+	assert(res == fstrm_res_success);
+	w = capture_writer_init(NULL, &c);
+	iothr = fstrm_iothr_init(iothr_opt, &w);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	if (iothr != NULL || w == NULL) {
+		fprintf(stderr, "%s: bad spool_path was accepted\n", __func__);
+		return EXIT_FAILURE;
+	}
+	fstrm_writer_destroy(&w);
+	capture_free(&c);
+
+	/* An externally driven fstrm_iothr can't be attached to a reactor. */
+	reactor = fstrm_iothr_reactor_init();
+	assert(reactor != NULL);
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_external_drive(iothr_opt, 1);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_reactor(iothr_opt, reactor);
+	assert(res == fstrm_res_success);
+	w = capture_writer_init(NULL, &c);
+	iothr = fstrm_iothr_init(iothr_opt, &w);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	fstrm_iothr_reactor_destroy(&reactor);
+	if (iothr != NULL || w == NULL) {
+		fprintf(stderr, "%s: external_drive with a reactor was accepted\n",
+			__func__);
+		return EXIT_FAILURE;
+	}
+	fstrm_writer_destroy(&w);
+	capture_free(&c);
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * A writer with coalesce_threshold copies small data frames into its staging
+ * buffer, so that a run of them goes out as a single iovec.
+ */
+static int
+test_coalesce(void)
+{
+	struct fstrm_writer_options *wopt;
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct fstrm_writer *w;
+	struct capture *c;
+	fstrm_res res;
+	int ret;
+
+	wopt = fstrm_writer_options_init();
+	res = fstrm_writer_options_set_coalesce_threshold(wopt,
+		FSTRM_WRITER_COALESCE_THRESHOLD_MAX + 1);
+	assert(res == fstrm_res_failure);
+	res = fstrm_writer_options_set_coalesce_buffer_size(wopt,
+		FSTRM_WRITER_COALESCE_BUFFER_SIZE_MIN - 1);
+	assert(res == fstrm_res_failure);
+
+	/*
+	 * Copy the data frames of up to 14 bytes, i.e. "frame #0" through
+	 * "frame #99" and some of their longer variants, and a small enough
+	 * staging buffer that it fills up several times per flush.
+	 */
+	res = fstrm_writer_options_set_coalesce_threshold(wopt, 14);
+	assert(res == fstrm_res_success);
+	res = fstrm_writer_options_set_coalesce_buffer_size(wopt,
+		FSTRM_WRITER_COALESCE_BUFFER_SIZE_MIN);
+	assert(res == fstrm_res_success);
+
+	w = capture_writer_init(wopt, &c);
+	fstrm_writer_options_destroy(&wopt);
+
+	/* Batches well beyond IOV_MAX data frames. */
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_output_queue_size(iothr_opt, 16384);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_buffer_hint(iothr_opt, 1 << 20);
+	assert(res == fstrm_res_success);
+	iothr = fstrm_iothr_init(iothr_opt, &w);
+	assert(iothr != NULL);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	for (unsigned i = 0; i < num_frames; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		while ((res = fstrm_iothr_submit(iothr, ioq, frame, len,
+						 fstrm_free_wrapper, NULL)) ==
+		       fstrm_res_again)
+		{
+			poll(NULL, 0, 1);
+		}
+		assert(res == fstrm_res_success);
+	}
+
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, num_frames);
+
+	/* Without coalescing, each data frame takes two iovecs. */
+	if (ret == EXIT_SUCCESS &&
+	    (c->num_writes >= num_frames || c->num_iovecs >= num_frames))
+	{
+		fprintf(stderr, "%s: %u data frames took %u iovecs in %u writes\n",
+			__func__, num_frames, c->num_iovecs, c->num_writes);
+		ret = EXIT_FAILURE;
+	}
+	capture_free(&c);
+	return ret;
+}
+
+static int
+test_direct_write(void)
+{
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_stats st;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	fstrm_res res;
+	int ret;
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_wait_strategy(iothr_opt,
+		FSTRM_IOTHR_WAIT_STRATEGY_SPIN_PARK);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_direct_write(iothr_opt, 1);
+	assert(res == fstrm_res_success);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	/*
+	 * The first half of the data frames mostly go through the input queue,
+	 * while the I/O thread is busy. Once it has gone idle, a single
+	 * producer writes every data frame directly.
+	 */
+	for (unsigned i = 0; i < num_frames; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		if (i == num_frames / 2) {
+			for (unsigned j = 0; j < 10000; j++) {
+				fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+				if (st.frames_written == i)
+					break;
+				poll(NULL, 0, 1);
+			}
+			poll(NULL, 0, 1);
+		}
+
+		while ((res = fstrm_iothr_submit(iothr, ioq, frame, len,
+						 fstrm_free_wrapper, NULL)) ==
+		       fstrm_res_again)
+		{
+			poll(NULL, 0, 1);
+		}
+		assert(res == fstrm_res_success);
+	}
+
+	fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, num_frames);
+	capture_free(&c);
+
+	if (st.frames_written_direct < num_frames / 2) {
+		fprintf(stderr, "%s: only %u data frames written directly\n",
+			__func__, (unsigned) st.frames_written_direct);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "%s: %u data frames written directly\n", __func__,
+		(unsigned) st.frames_written_direct);
+	return ret;
+}
+
+#define NUM_DIRECT_THREADS	4
+#define NUM_DIRECT_FRAMES	2000
+
+struct direct_thr_arg {
+	struct fstrm_iothr		*iothr;
+	struct fstrm_iothr_queue	*ioq;
+	unsigned			id;
+};
+
+static void *
+direct_thr(void *arg)
+{
+	struct direct_thr_arg *a = arg;
+
+	for (unsigned i = 0; i < NUM_DIRECT_FRAMES; i++) {
+		char buf[64];
+		fstrm_res res;
+
+		snprintf(buf, sizeof(buf), "thread %u #%u", a->id, i);
+		while ((res = fstrm_iothr_submit(a->iothr, a->ioq,
+						 my_strdup(buf), strlen(buf),
+						 fstrm_free_wrapper, NULL)) ==
+		       fstrm_res_again)
+		{
+			poll(NULL, 0, 1);
+		}
+		assert(res == fstrm_res_success);
+
+		/* Let the I/O thread go idle now and then. */
+		if (i % 100 == 99)
+			poll(NULL, 0, 1);
+	}
+	return NULL;
+}
+
+/*
+ * With direct_write, several producers each submit to their own input queue,
+ * so that their data frames are written directly or go through the input
+ * queue depending on what the I/O thread and the other producers are doing.
+ * The data frames of each input queue must still come out in order.
+ */
+static int
+test_direct_write_order(fstrm_iothr_wait_strategy wait_strategy)
+{
+	struct direct_thr_arg args[NUM_DIRECT_THREADS];
+	pthread_t thrs[NUM_DIRECT_THREADS];
+	unsigned next[NUM_DIRECT_THREADS] = { 0 };
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_stats st;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	const uint8_t *p, *frame;
+	size_t len, len_frame;
+	unsigned n = 0;
+	fstrm_res res;
+	int ret = EXIT_SUCCESS;
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_num_input_queues(iothr_opt,
+						       NUM_DIRECT_THREADS);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_wait_strategy(iothr_opt, wait_strategy);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_flush_max_age(iothr_opt, 1000);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_direct_write(iothr_opt, 1);
+	assert(res == fstrm_res_success);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+
+	for (unsigned i = 0; i < NUM_DIRECT_THREADS; i++) {
+		args[i].iothr = iothr;
+		args[i].ioq = fstrm_iothr_get_input_queue(iothr);
+		assert(args[i].ioq != NULL);
+		args[i].id = i;
+		pthread_create(&thrs[i], NULL, direct_thr, &args[i]);
+	}
+	for (unsigned i = 0; i < NUM_DIRECT_THREADS; i++)
+		pthread_join(thrs[i], NULL);
+	fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+	fstrm_iothr_destroy(&iothr);
+
+	p = ubuf_data(c->u);
+	len = ubuf_size(c->u);
+	while (capture_next_frame(&p, &len, &frame, &len_frame)) {
+		char buf[64];
+		unsigned id, i;
+
+		assert(len_frame < sizeof(buf));
+		memcpy(buf, frame, len_frame);
+		buf[len_frame] = '\0';
+		if (sscanf(buf, "thread %u #%u", &id, &i) != 2 ||
+		    id >= NUM_DIRECT_THREADS || i != next[id])
+		{
+			fprintf(stderr, "%s: unexpected data frame %s\n",
+				__func__, buf);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		next[id]++;
+		n++;
+	}
+	capture_free(&c);
+	if (ret == EXIT_SUCCESS && n != NUM_DIRECT_THREADS * NUM_DIRECT_FRAMES) {
+		fprintf(stderr, "%s: got %u data frames, expected %u\n",
+			__func__, n, NUM_DIRECT_THREADS * NUM_DIRECT_FRAMES);
+		ret = EXIT_FAILURE;
+	}
+	if (ret == EXIT_SUCCESS && st.frames_written_direct == 0) {
+		fprintf(stderr, "%s: no data frames were written directly\n",
+			__func__);
+		ret = EXIT_FAILURE;
+	}
+	fprintf(stderr, "%s: %u of %u data frames written directly\n", __func__,
+		(unsigned) st.frames_written_direct, n);
+	return ret;
+}
+#define NUM_WRITER_THREADS	4
+#define NUM_WRITER_FRAMES	250
+
+struct writer_thr_arg {
+	struct fstrm_writer	*w;
+	unsigned		id;
+};
+
+static void *
+writer_thr(void *arg)
+{
+	struct writer_thr_arg *a = arg;
+
+	for (unsigned i = 0; i < NUM_WRITER_FRAMES; i++) {
+		char buf[64];
+		size_t len;
+		fstrm_res res;
+
+		len = (size_t) snprintf(buf, sizeof(buf), "thread %u #%u", a->id, i);
+		res = fstrm_writer_write(a->w, buf, len);
+		assert(res == fstrm_res_success);
+	}
+	return NULL;
+}
+
+static int
+test_writer_thread_safe(void)
+{
+	struct writer_thr_arg args[NUM_WRITER_THREADS];
+	pthread_t thrs[NUM_WRITER_THREADS];
+	unsigned next[NUM_WRITER_THREADS] = { 0 };
+	struct fstrm_writer_options *wopt;
+	struct fstrm_writer *w;
+	struct capture *c;
+	const uint8_t *p, *frame;
+	size_t len, len_frame;
+	unsigned n = 0;
+	fstrm_res res;
+	int ret = EXIT_SUCCESS;
+
+	wopt = fstrm_writer_options_init();
+	res = fstrm_writer_options_set_thread_safe(wopt, 1);
+	assert(res == fstrm_res_success);
+	w = capture_writer_init(wopt, &c);
+	fstrm_writer_options_destroy(&wopt);
+
+	/* Write slowly, so that the threads' data frames pile up. */
+	atomic_store(&capture_slow_write, true);
+
+	for (unsigned i = 0; i < NUM_WRITER_THREADS; i++) {
+		args[i].w = w;
+		args[i].id = i;
+		pthread_create(&thrs[i], NULL, writer_thr, &args[i]);
+	}
+	for (unsigned i = 0; i < NUM_WRITER_THREADS; i++)
+		pthread_join(thrs[i], NULL);
+	fstrm_writer_destroy(&w);
+	atomic_store(&capture_slow_write, false);
+
+	/* The data frames of each thread are interleaved, but in order. */
+	p = ubuf_data(c->u);
+	len = ubuf_size(c->u);
+	while (capture_next_frame(&p, &len, &frame, &len_frame)) {
+		char buf[64];
+		unsigned id, i;
+
+		assert(len_frame < sizeof(buf));
+		memcpy(buf, frame, len_frame);
+		buf[len_frame] = '\0';
+		if (sscanf(buf, "thread %u #%u", &id, &i) != 2 ||
+		    id >= NUM_WRITER_THREADS || i != next[id])
+		{
+			fprintf(stderr, "%s: unexpected data frame %s\n",
+				__func__, buf);
+			ret = EXIT_FAILURE;
+			break;
+		}
+		next[id]++;
+		n++;
+	}
+	if (ret == EXIT_SUCCESS && n != NUM_WRITER_THREADS * NUM_WRITER_FRAMES) {
+		fprintf(stderr, "%s: got %u data frames, expected %u\n",
+			__func__, n, NUM_WRITER_THREADS * NUM_WRITER_FRAMES);
+		ret = EXIT_FAILURE;
+	}
+	if (ret == EXIT_SUCCESS && c->num_writes >= n) {
+		fprintf(stderr, "%s: no data frames were combined\n", __func__);
+		ret = EXIT_FAILURE;
+	}
+	fprintf(stderr, "%s: got %u data frames in %u writes\n",
+		__func__, n, c->num_writes);
+	capture_free(&c);
+	return ret;
+}
+
+/*
+ * Fill up an input queue with input_queue_max_bytes while the I/O thread is
+ * stalled, so that the producer has to grow it.
+ */
+static int
+test_elastic_queues(fstrm_iothr_queue_model queue_model)
+{
+	const unsigned queue_size = 16;
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_stats st;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	unsigned depth, capacity, n = 0;
+	fstrm_res res;
+	int ret;
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_num_input_queues(iothr_opt, 256);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_input_queue_size(iothr_opt, queue_size);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_input_queue_max_bytes(iothr_opt, 4096);
+	assert(res == fstrm_res_success);
+	res = fstrm_iothr_options_set_queue_model(iothr_opt, queue_model);
+	assert(res == fstrm_res_success);
+
+	/* Stall the I/O thread so that the input queue fills up. */
+	atomic_store(&capture_hold_open, true);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+
+	ioq = fstrm_iothr_get_input_queue_idx(iothr, 255);
+	assert(ioq != NULL);
+	fstrm_iothr_get_queue_occupancy(iothr, ioq, &depth, &capacity);
+	if (depth != 0 || capacity != queue_size) {
+		fprintf(stderr, "%s: initial depth=%u capacity=%u\n",
+			__func__, depth, capacity);
+		return EXIT_FAILURE;
+	}
+
+	/* The input queue grows instead of rejecting data frames, up to a limit. */
+	for (;;) {
+		size_t len;
+		char *frame = make_frame(n, &len);
+
+		res = fstrm_iothr_submit(iothr, ioq, frame, len,
+					 fstrm_free_wrapper, NULL);
+		if (res != fstrm_res_success) {
+			assert(res == fstrm_res_again);
+			free(frame);
+			break;
+		}
+		n++;
+		assert(n < 10000);
+	}
+	fstrm_iothr_get_queue_occupancy(iothr, ioq, &depth, &capacity);
+	if (n <= queue_size || depth != n || capacity < n) {
+		fprintf(stderr, "%s: %u data frames queued, depth=%u capacity=%u\n",
+			__func__, n, depth, capacity);
+		return EXIT_FAILURE;
+	}
+
+	/* The data frames are written in order once the writer opens. */
+	atomic_store(&capture_hold_open, false);
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.frames_written == n)
+			break;
+		poll(NULL, 0, 1);
+	}
+
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, n);
+	capture_free(&c);
+	fprintf(stderr, "%s: input queue grew from %u to %u entries\n",
+		__func__, queue_size, capacity);
+	return ret;
+}
+
+static int
+test_queued_bytes_max(void)
+{
+	const unsigned budget = 1000;
+	struct fstrm_iothr_options *iothr_opt;
+	struct fstrm_iothr_stats st;
+	struct fstrm_iothr_queue *ioq;
+	struct fstrm_iothr *iothr;
+	struct capture *c;
+	uint64_t queued = 0;
+	unsigned n = 0;
+	fstrm_res res;
+	int ret;
+
+	iothr_opt = fstrm_iothr_options_init();
+	res = fstrm_iothr_options_set_queued_bytes_max(iothr_opt, budget);
+	assert(res == fstrm_res_success);
+
+	/* Stall the I/O thread so that the queued payload bytes add up. */
+	atomic_store(&capture_hold_open, true);
+	iothr = capture_iothr_init(iothr_opt, &c);
+	fstrm_iothr_options_destroy(&iothr_opt);
+	ioq = fstrm_iothr_get_input_queue(iothr);
+	assert(ioq != NULL);
+
+	/* Data frames are rejected well before the input queue is full. */
+	for (;;) {
+		size_t len;
+		char *frame = make_frame(n, &len);
+
+		res = fstrm_iothr_submit(iothr, ioq, frame, len,
+					 fstrm_free_wrapper, NULL);
+		if (res != fstrm_res_success) {
+			assert(res == fstrm_res_again);
+			free(frame);
+			break;
+		}
+		queued += len;
+		n++;
+	}
+	fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+	if (st.bytes_queued != queued || queued > budget ||
+	    st.bytes_queued_hwm != queued ||
+	    st.frames_rejected_budget != 1 || st.frames_rejected_full != 0)
+	{
+		fprintf(stderr, "%s: %u data frames, %u bytes queued, stats %u/%u, "
+			"rejected %u/%u\n", __func__, n, (unsigned) queued,
+			(unsigned) st.bytes_queued, (unsigned) st.bytes_queued_hwm,
+			(unsigned) st.frames_rejected_budget,
+			(unsigned) st.frames_rejected_full);
+		return EXIT_FAILURE;
+	}
+
+	/* Once they have been written, the payload bytes are released. */
+	atomic_store(&capture_hold_open, false);
+	for (unsigned i = 0; i < 10000; i++) {
+		fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+		if (st.bytes_queued == 0)
+			break;
+		poll(NULL, 0, 1);
+	}
+	if (st.bytes_queued != 0 || st.frames_written != n) {
+		fprintf(stderr, "%s: %u bytes still queued\n", __func__,
+			(unsigned) st.bytes_queued);
+		return EXIT_FAILURE;
+	}
+
+	/* Producers waiting for payload bytes to be released are woken. */
+	for (unsigned i = n; i < num_frames; i++) {
+		size_t len;
+		char *frame = make_frame(i, &len);
+
+		res = fstrm_iothr_submit_wait(iothr, ioq, frame, len,
+					      fstrm_free_wrapper, NULL, -1);
+		assert(res == fstrm_res_success);
+	}
+
+	fstrm_iothr_get_stats(iothr, &st, sizeof(st));
+	fstrm_iothr_destroy(&iothr);
+	ret = check_capture(c, num_frames);
+	capture_free(&c);
+	if (st.bytes_queued_hwm > budget) {
+		fprintf(stderr, "%s: bytes_queued_hwm=%u\n", __func__,
+			(unsigned) st.bytes_queued_hwm);
+		return EXIT_FAILURE;
+	}
+	return ret;
+}
+
+int
+main(void)
+{
+	if (test_submit_batch() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_notify_threshold() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_reserve_commit(FSTRM_IOTHR_QUEUE_MODEL_SPSC, false) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_reserve_commit(FSTRM_IOTHR_QUEUE_MODEL_MPSC, false) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_reserve_commit(FSTRM_IOTHR_QUEUE_MODEL_SPSC, true) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_bufpool() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_free_funcs(false) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_free_funcs(true) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_submitv() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_stats() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_latency() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_flush_max_age() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_submit_wait() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_submit_wait_destroy() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_drop_policy(FSTRM_IOTHR_DROP_POLICY_OLDEST) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_drop_policy(FSTRM_IOTHR_DROP_POLICY_SAMPLE) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_reopen_drain() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_reopen_backoff() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_pipeline_writes() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_coalesce() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_direct_write() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_direct_write_order(FSTRM_IOTHR_WAIT_STRATEGY_SPIN_PARK) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_direct_write_order(FSTRM_IOTHR_WAIT_STRATEGY_TIMED) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_writer_thread_safe() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_elastic_queues(FSTRM_IOTHR_QUEUE_MODEL_SPSC) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_elastic_queues(FSTRM_IOTHR_QUEUE_MODEL_MPSC) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_queued_bytes_max() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_external_drive() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_external_drive_timed() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_reactor() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_iothr_pool() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_spool(false) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_spool(true) != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_spool_resume() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	if (test_init_failure() != EXIT_SUCCESS)
+		return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
@@ -41,8 +41,12 @@
 extern const struct my_queue_ops my_queue_mb_ops;
 #endif
 
+extern const struct my_queue_ops my_queue_mpmc_ops;
+
 extern const struct my_queue_ops my_queue_mutex_ops;
 
+extern const struct my_queue_ops my_queue_spsc_ops;
+
 const struct my_queue_ops *queue_ops;
 
 struct producer_stats {
@@ -76,6 +80,22 @@ static struct my_queue *q;
 
 static int size;
 
+/*
+ * Number of elements the producer inserts and the consumer removes per call,
+ * 1 for my_queue_insert() and my_queue_remove().
+ */
+static unsigned batch;
+
+#define MAX_BATCH	64
+
+/*
+ * Number of producer threads. Only multi-producer queue implementations may
+ * be run with more than one.
+ */
+static unsigned num_producers;
+
+#define MAX_PRODUCERS	4
+
 static inline void
 maybe_wait_producer(int64_t i)
 {
@@ -116,13 +136,30 @@ thr_producer(__attribute__((unused)) void *arg)
 			if (shut_down)
 				goto out;
 
-			res = queue_ops->insert(q, &i, &space);
-			s->count_insert_calls++;
-			if (res) {
-				s->count_producer++;
-				s->checksum_producer += i;
-			} else {
-				s->count_producer_full++;
+			if (batch > 1 && i % batch == 1) {
+				int64_t items[MAX_BATCH];
+				unsigned n;
+
+				for (unsigned j = 0; j < batch; j++)
+					items[j] = i + j;
+				n = queue_ops->insert_batch(q, items, batch, &space);
+				s->count_insert_calls++;
+				for (unsigned j = 0; j < n; j++) {
+					s->count_producer++;
+					s->checksum_producer += items[j];
+				}
+				if (n == 0)
+					s->count_producer_full++;
+				i += batch - 1;
+			} else if (batch <= 1) {
+				res = queue_ops->insert(q, &i, &space);
+				s->count_insert_calls++;
+				if (res) {
+					s->count_producer++;
+					s->checksum_producer += i;
+				} else {
+					s->count_producer_full++;
+				}
 			}
 			maybe_wait_producer(i);
 		}
@@ -139,25 +176,29 @@ out:
 static void *
 thr_consumer(__attribute__((unused)) void *arg)
 {
-	bool res;
+	unsigned n;
 	unsigned count = 0;
+	int64_t items[MAX_BATCH];
 
 	struct consumer_stats *s;
 	s = my_calloc(1, sizeof(*s));
 
 	for (unsigned loops = 1; ; loops++) {
 		for (int64_t i = 1; i <= 1000000; i++) {
-			res = queue_ops->remove(q, &i, &count);
+			if (batch > 1)
+				n = queue_ops->remove_batch(q, items, batch, &count);
+			else
+				n = queue_ops->remove(q, &items[0], &count) ? 1 : 0;
 			s->count_remove_calls++;
-			if (res) {
-				if (i == 0) {
+			if (n == 0)
+				s->count_consumer_empty++;
+			for (unsigned j = 0; j < n; j++) {
+				if (items[j] == 0) {
 					fprintf(stderr, "%s: received shutdown message\n", __func__);
 					goto out;
 				}
-				s->checksum_consumer += i;
+				s->checksum_consumer += items[j];
 				s->count_consumer++;
-			} else {
-				s->count_consumer_empty++;
 			}
 			maybe_wait_consumer(i);
 		}
@@ -228,6 +269,7 @@ run_test(void)
 	int res;
 	struct timespec ts_a, ts_b;
 	struct producer_stats *ps;
+	struct producer_stats ps_sum = { 0 };
 	struct consumer_stats *cs;
 	struct timespec ts = { .tv_sec = seconds, .tv_nsec = 0 };
 
@@ -238,9 +280,11 @@ run_test(void)
 	}
 	fprintf(stderr, "queue implementation type: %s\n", queue_ops->impl_type());
 	fprintf(stderr, "queue size: %d entries\n", size);
+	fprintf(stderr, "batch size: %u entries\n", batch);
+	fprintf(stderr, "producer threads: %u\n", num_producers);
 	fprintf(stderr, "running for %d seconds\n", seconds);
 
-	pthread_t thr_p;
+	pthread_t thr_p[MAX_PRODUCERS];
 	pthread_t thr_c;
 
 #if HAVE_CLOCK_GETTIME
@@ -250,22 +294,36 @@ run_test(void)
 #endif
 	my_gettime(clock, &ts_a);
 
-	pthread_create(&thr_p, NULL, thr_producer, NULL);
+	for (unsigned i = 0; i < num_producers; i++)
+		pthread_create(&thr_p[i], NULL, thr_producer, NULL);
 	pthread_create(&thr_c, NULL, thr_consumer, NULL);
 
 	my_nanosleep(&ts);
 	shut_down = true;
 
-	pthread_join(thr_p, (void **) &ps);
+	for (unsigned i = 0; i < num_producers; i++) {
+		pthread_join(thr_p[i], (void **) &ps);
+		ps_sum.count_producer_full += ps->count_producer_full;
+		ps_sum.count_producer += ps->count_producer;
+		ps_sum.checksum_producer += ps->checksum_producer;
+		ps_sum.count_insert_calls += ps->count_insert_calls;
+		free(ps);
+	}
 	send_shutdown_message(q);
 	pthread_join(thr_c, (void **) &cs);
 
 	my_gettime(clock, &ts_b);
 
-	res = check_stats(ps, cs);
-	print_stats(&ts_a, &ts_b, ps, cs);
+	res = check_stats(&ps_sum, cs);
+	print_stats(&ts_a, &ts_b, &ps_sum, cs);
+
+	/* The shutdown message was the last element in the queue. */
+	if (queue_ops->count(q) != 0) {
+		fprintf(stderr, "FATAL ERROR: queue count != 0 (%u) after draining\n",
+			queue_ops->count(q));
+		res = EXIT_FAILURE;
+	}
 
-	free(ps);
 	free(cs);
 
 	queue_ops->destroy(&q);
@@ -299,20 +357,42 @@ main(int argc, char **argv)
 	}
 	size = atoi(argv[2]);
 	seconds = atoi(argv[3]);
+	num_producers = 1;
 
+	const struct my_queue_ops *all_ops[] = {
 #ifdef MY_HAVE_MEMORY_BARRIERS
-	queue_ops = &my_queue_mb_ops;
-	res = run_test();
-	if (res != EXIT_SUCCESS)
-		return res;
+		&my_queue_mb_ops,
 #endif
+		&my_queue_spsc_ops,
+		&my_queue_mpmc_ops,
+		&my_queue_mutex_ops,
+	};
+	const struct my_queue_ops *mp_ops[] = {
+		&my_queue_mpmc_ops,
+		&my_queue_mutex_ops,
+	};
+
+	for (batch = 1; batch <= MAX_BATCH; batch += MAX_BATCH - 1) {
+		for (size_t i = 0; i < sizeof(all_ops) / sizeof(all_ops[0]); i++) {
+			shut_down = false;
+			queue_ops = all_ops[i];
+			res = run_test();
+			if (res != EXIT_SUCCESS)
+				return res;
+		}
+	}
 
-	shut_down = false;
+	num_producers = MAX_PRODUCERS;
 
-	queue_ops = &my_queue_mutex_ops;
-	res = run_test();
-	if (res != EXIT_SUCCESS)
-		return res;
+	for (batch = 1; batch <= MAX_BATCH; batch += MAX_BATCH - 1) {
+		for (size_t i = 0; i < sizeof(mp_ops) / sizeof(mp_ops[0]); i++) {
+			shut_down = false;
+			queue_ops = mp_ops[i];
+			res = run_test();
+			if (res != EXIT_SUCCESS)
+				return res;
+		}
+	}
 
 	return EXIT_SUCCESS;
 }